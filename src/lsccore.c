@@ -15,16 +15,23 @@ sizeof(char *) == sizeof(long) == sizeof(lua_Integer) == 8
 201223 - added (long) casts to allow x86:
 sizeof(char *) == sizeof(long) == 4 ;  sizeof(lua_Integer) == 8
 
+261018 - newbuffer() returns a buffer object collected by the Lua GC
+(see src/slbuf.c) instead of the raw address of a malloc'd block.
+Memory functions accept buffers or raw addresses.
+
 */
 
 
-#define VERSION "lsc-0.3"
+#define VERSION "lsc-0.4"
 
 
 #include "lua.h"
 #include "lauxlib.h"
 
+#include "slbuf.h"	// buffer objects (see src/slbuf.c)
+
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>	// errno
@@ -38,14 +45,25 @@ sizeof(char *) == sizeof(long) == 4 ;  sizeof(lua_Integer) == 8
 #define RET_ERRNO return (lua_pushnil(L), lua_pushinteger(L, errno), 2)
 
 
+static long checkarg(lua_State *L, int idx) {
+	// syscall argument: an integer or a buffer (passed as the 
+	// buffer address)
+	slbuf *b = slbuf_test(L, idx);
+	if (b) return (long) b->ptr;
+	return (long) luaL_optinteger(L, idx, 0);
+}
+
 static int ll_syscall(lua_State *L) {
+	// lua API: syscall(number, p1, ... p6) => r | nil, errno
+	// parameters p1..p6 are integers or buffers (passed as the
+	// address of the buffer first byte)
 	long number = (long) luaL_checkinteger(L, 1);
-	long p1 = luaL_optinteger(L, 2, 0);
-	long p2 = luaL_optinteger(L, 3, 0);
-	long p3 = luaL_optinteger(L, 4, 0);
-	long p4 = luaL_optinteger(L, 5, 0);
-	long p5 = luaL_optinteger(L, 6, 0);
-	long p6 = luaL_optinteger(L, 7, 0);
+	long p1 = checkarg(L, 2);
+	long p2 = checkarg(L, 3);
+	long p3 = checkarg(L, 4);
+	long p4 = checkarg(L, 5);
+	long p5 = checkarg(L, 6);
+	long p6 = checkarg(L, 7);
 	long r = syscall(number, p1, p2, p3, p4, p5, p6);
 	if (r == -1) RET_ERRNO;  // return nil, errno
 	lua_pushinteger(L, r);
@@ -54,34 +72,50 @@ static int ll_syscall(lua_State *L) {
 
 //----------------------------------------------------------------------
 // memory / buffer minimal API
+// 
+// buffers are slbuf objects (see src/slbuf.c): they are collected 
+// by the Lua GC, and all accesses through a buffer are bounds-checked.
+// buffers also have methods for typed get/put at an index and slicing 
+// (b:getuint(), b:putuint(), b:view(), etc.)
+//
+// the functions below accept either a buffer or a raw address 
+// (an integer, eg. returned by a syscall, or by environ()). 
+// raw addresses are of course not checked... 
 // ...one big step towards the perfect footgun... :-)
 
-// FIXME: how to use a userdata automatically GC'd by Lua for buffer?
+static char *checkptr(lua_State *L, int idx, size_t need, int write) {
+	// return the address at stack index idx (a buffer or an integer)
+	// if it is a buffer, ensure it has at least 'need' bytes (and
+	// that it is writable if 'write')
+	slbuf *b = slbuf_test(L, idx);
+	if (b == NULL) return (char *) (long) luaL_checkinteger(L, idx);
+	if (need > b->len) luaL_error(L, "out of range");
+	if (write) slbuf_checkwrite(L, b);
+	return b->ptr;
+}
 
 static int ll_newbuffer(lua_State *L) {
-	// lua API: newbuffer(size) => addr
-	// return the address of a block of allocated memory
-	size_t size = (long) luaL_checkinteger(L, 1);
-	char *mb = (char *) malloc(size);
-	if (mb == NULL) LERR("buffer: allocation failed");
-	memset(mb, 0, size); // ?? is it needed or already done by lua?
-	lua_pushinteger(L, (lua_Integer) (long)mb);
+	// lua API: newbuffer(size) => buffer
+	// return a new buffer (initialized with null bytes)
+	lua_Integer size = luaL_checkinteger(L, 1);
+	if (size < 0) LERR("buffer: invalid size");
+	slbuf_new(L, size);
 	return 1;
 }
 
 static int ll_freebuffer(lua_State *L) {
-	// lua API: freebuffer(addr)
-	// free a buffer allocated with newbuffer()
-	char *p = (char *) (long) luaL_checkinteger(L, 1);
-	free(p);
+	// lua API: freebuffer(buffer)
+	// buffers are collected by the GC. this function is kept only
+	// for compatibility. It does nothing.
+	slbuf_check(L, 1);
 	RET_TRUE;
 }
 
 static int ll_zero(lua_State *L) {
 	// lua API: zero(addr, size)
 	// write `size` null bytes at address `addr`
-	char *p = (char *) (long) luaL_checkinteger(L, 1);
 	size_t n =  (long) luaL_checkinteger(L, 2);
+	char *p = checkptr(L, 1, n, 1);
 	memset(p, 0, n);
 	RET_TRUE;
 }
@@ -89,13 +123,15 @@ static int ll_zero(lua_State *L) {
 static int ll_getstr(lua_State *L) {
 	// lua API: getstr(addr [, size]) => string
 	// if size=-1 (default), string is null-terminated
-	char *p = (char *) (long) luaL_checkinteger(L, 1);
 	long size = (long) luaL_optinteger(L, 2, -1);
+	char *p = checkptr(L, 1, size < 0 ? 0 : size, 0);
+	slbuf *b = slbuf_test(L, 1);
 	if (size < 0) {
-		lua_pushstring (L, p);
-	} else {
-		lua_pushlstring (L, p, size);
+		// in a buffer, do not read beyond the end
+		if (b) size = strnlen(p, b->len);
+		else size = strlen(p);
 	}
+	lua_pushlstring (L, p, size);
 	return 1;
 }
 
@@ -104,10 +140,11 @@ static int ll_putbin(lua_State *L) {
 	// copy binary string `str` at address `addr`
 	// return addr
 	size_t len;
-	char *ptr = (char *) (long) luaL_checkinteger(L, 1);
 	const char *str = luaL_checklstring(L, 2, &len);
+	char *ptr = checkptr(L, 1, len, 1);
 	memcpy(ptr, str, len);
-	RET_INT( (lua_Integer) (long)ptr );
+	lua_settop(L, 1);
+	return 1;
 }
 
 static int ll_putstr(lua_State *L) {
@@ -115,19 +152,20 @@ static int ll_putstr(lua_State *L) {
 	// same as putbin, but append a null terminator ('\0') 
 	// at the end of the written string.
 	size_t len;
-	char *ptr = (char *) (long) luaL_checkinteger(L, 1);
 	const char *str = luaL_checklstring(L, 2, &len);
+	char *ptr = checkptr(L, 1, len + 1, 1);
 	memcpy(ptr, str, len);
 	ptr[len] = '\0';
-	RET_INT( (lua_Integer) (long)ptr );
+	lua_settop(L, 1);
+	return 1;
 }
 
 static int ll_getuint(lua_State *L) {
 	// lua API: getuint(addr, isize) => i
 	// get unsigned integer i at address addr
 	// isize is i size in bytes. can be 1, 2, 4 or 8
-	char *p = (char *) (long) luaL_checkinteger(L, 1);
 	int sz = (long) luaL_checkinteger(L, 2);
+	char *p = checkptr(L, 1, sz, 0);
 	long i;
 	switch (sz) {
 		case 1: i = *((uint8_t *) p); break;
@@ -143,9 +181,10 @@ static int ll_putuint(lua_State *L) {
 	// lua API: putuint(addr, i, isize)
 	// put integer i at address addr.
 	// isize is i size in bytes. can be 1, 2, 4 or 8
-	char *p = (char *) (long) luaL_checkinteger(L, 1);
+	// return addr
 	long i = (long) luaL_checkinteger(L, 2);
 	int sz = (long) luaL_checkinteger(L, 3);
+	char *p = checkptr(L, 1, sz, 1);
 	switch (sz) {
 		case 1: *((uint8_t *) p) = i & 0xff; break;
 		case 2: *((uint16_t *) p) = i & 0xffff; break;
@@ -153,7 +192,8 @@ static int ll_putuint(lua_State *L) {
 		case 8: *((uint64_t *) p) = i; break;
 		default: LERR("lsc.putint: invalid parameter"); break;
 	}
-	RET_INT( (lua_Integer) (long)p );
+	lua_settop(L, 1);
+	return 1;
 }
 
 // access to  global variables: errno, environ
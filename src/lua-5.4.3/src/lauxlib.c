@@ -773,8 +773,9 @@ static int skipcomment (LoadF *lf, int *cp) {
 }
 
 
-LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
-                                             const char *mode) {
+/// slua: standard file loader (was luaL_loadfilex)
+LUALIB_API int luaL_loadfilesrc (lua_State *L, const char *filename,
+                                               const char *mode) {
   LoadF lf;
   int status, readstatus;
   int c;
@@ -809,6 +810,20 @@ LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
 }
 
 
+/// slua: the file loader can be replaced (eg. by a bytecode cache)
+static luaL_Loadfile loadfile = luaL_loadfilesrc;
+
+LUALIB_API void luaL_setloadfile (luaL_Loadfile f) {
+  loadfile = (f != NULL) ? f : luaL_loadfilesrc;
+}
+
+
+LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
+                                             const char *mode) {
+  return loadfile(L, filename, mode);
+}
+
+
 typedef struct LoadS {
   const char *s;
   size_t size;
@@ -1085,7 +1100,13 @@ static void warnfon (void *ud, const char *message, int tocont) {
 
 
 LUALIB_API lua_State *luaL_newstate (void) {
-  lua_State *L = lua_newstate(l_alloc, NULL);
+  return luaL_newstatex(l_alloc, NULL);
+}
+
+
+/// slua: same as luaL_newstate, with a custom allocator
+LUALIB_API lua_State *luaL_newstatex (lua_Alloc f, void *ud) {
+  lua_State *L = lua_newstate(f, ud);
   if (l_likely(L)) {
     lua_atpanic(L, &panic);
     lua_setwarnf(L, warnfoff, L);  /* default is warnings off */
@@ -94,11 +94,21 @@ LUALIB_API int (luaL_loadfilex) (lua_State *L, const char *filename,
 
 #define luaL_loadfile(L,f)	luaL_loadfilex(L,f,NULL)
 
+/// slua: replace the file loader used by luaL_loadfilex (NULL restores
+/// the standard loader, luaL_loadfilesrc). See slcache.h
+typedef int (*luaL_Loadfile) (lua_State *L, const char *filename,
+                                            const char *mode);
+LUALIB_API void (luaL_setloadfile) (luaL_Loadfile f);
+LUALIB_API int (luaL_loadfilesrc) (lua_State *L, const char *filename,
+                                                 const char *mode);
+
 LUALIB_API int (luaL_loadbufferx) (lua_State *L, const char *buff, size_t sz,
                                    const char *name, const char *mode);
 LUALIB_API int (luaL_loadstring) (lua_State *L, const char *s);
 
 LUALIB_API lua_State *(luaL_newstate) (void);
+/// slua: luaL_newstate with a custom allocator
+LUALIB_API lua_State *(luaL_newstatex) (lua_Alloc f, void *ud);
 
 LUALIB_API lua_Integer (luaL_len) (lua_State *L, int idx);
 
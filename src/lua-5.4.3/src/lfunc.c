@@ -260,6 +260,9 @@ Proto *luaF_newproto (lua_State *L) {
   f->linedefined = 0;
   f->lastlinedefined = 0;
   f->source = NULL;
+#if defined(SLUA_VMSTATS)
+  f->vmstats = NULL;
+#endif
   return f;
 }
 
@@ -559,6 +559,9 @@ typedef struct Proto {
   LocVar *locvars;  /* information about local variables (debug information) */
   TString  *source;  /* used for debug information */
   GCObject *gclist;
+#if defined(SLUA_VMSTATS)  /// slua: instruction counters (slvmstats.h)
+  struct SlvmStats *vmstats;
+#endif
 } Proto;
 
 /* }================================================================== */
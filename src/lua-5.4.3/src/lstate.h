@@ -196,6 +196,9 @@ typedef struct CallInfo {
   } u2;
   short nresults;  /* expected number of results from this function */
   unsigned short callstatus;
+#if defined(SLUA_VMSTATS)  /// slua: call start time (slvmstats.h)
+  unsigned long long vmt0;
+#endif
 } CallInfo;
 
 
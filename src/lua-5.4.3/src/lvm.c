@@ -30,6 +30,11 @@
 #include "ltm.h"
 #include "lvm.h"
 
+/// slua: instrumentation build (opcode and function counters)
+#if defined(SLUA_VMSTATS)
+#include "slvmstats.h"
+#endif
+
 
 /*
 ** By default, use jump tables in the main interpreter loop on gcc
@@ -288,6 +293,9 @@ void luaV_finishget (lua_State *L, const TValue *t, TValue *key, StkId val,
                       const TValue *slot) {
   int loop;  /* counter to avoid infinite loops */
   const TValue *tm;  /* metamethod */
+#if defined(SLUA_VMSTATS)
+  slvm_finishget++;
+#endif
   for (loop = 0; loop < MAXTAGLOOP; loop++) {
     if (slot == NULL) {  /* 't' is not a table? */
       lua_assert(!ttistable(t));
@@ -305,6 +313,9 @@ void luaV_finishget (lua_State *L, const TValue *t, TValue *key, StkId val,
       }
       /* else will try the metamethod */
     }
+#if defined(SLUA_VMSTATS)
+    slvm_indextm++;
+#endif
     if (ttisfunction(tm)) {  /* is metamethod a function? */
       luaT_callTMres(L, tm, t, key, val);  /* call it */
       return;
@@ -330,6 +341,9 @@ void luaV_finishget (lua_State *L, const TValue *t, TValue *key, StkId val,
 void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
                      TValue *val, const TValue *slot) {
   int loop;  /* counter to avoid infinite loops */
+#if defined(SLUA_VMSTATS)
+  slvm_finishset++;
+#endif
   for (loop = 0; loop < MAXTAGLOOP; loop++) {
     const TValue *tm;  /* '__newindex' metamethod */
     if (slot != NULL) {  /* is 't' a table? */
@@ -350,6 +364,9 @@ void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
         luaG_typeerror(L, t, "index");
     }
     /* try the metamethod */
+#if defined(SLUA_VMSTATS)
+    slvm_newindextm++;
+#endif
     if (ttisfunction(tm)) {
       luaT_callTM(L, tm, t, key, val);
       return;
@@ -1118,9 +1135,17 @@ void luaV_finishOp (lua_State *L) {
     updatebase(ci);  /* correct stack */ \
   } \
   i = *(pc++); \
+  vmcount(i); \
   ra = RA(i); /* WARNING: any stack reallocation invalidates 'ra' */ \
 }
 
+/// slua: count the instruction (global and per instruction counters)
+#if defined(SLUA_VMSTATS)
+#define vmcount(i)	slvm_count(vmst, cl->p, pc, i)
+#else
+#define vmcount(i)	((void)0)
+#endif
+
 #define vmdispatch(o)	switch(o)
 #define vmcase(l)	case l:
 #define vmbreak		break
@@ -1132,6 +1157,9 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
   StkId base;
   const Instruction *pc;
   int trap;
+#if defined(SLUA_VMSTATS)
+  SlvmStats *vmst;  /* counters of the running function */
+#endif
 #if LUA_USE_JUMPTABLE
 #include "ljumptab.h"
 #endif
@@ -1141,6 +1169,11 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
   cl = clLvalue(s2v(ci->func));
   k = cl->p->k;
   pc = ci->u.l.savedpc;
+#if defined(SLUA_VMSTATS)
+  vmst = slvm_stats(cl->p);
+  if (pc == cl->p->code)  /* first instruction (not resuming)? */
+    slvm_call(vmst, ci);
+#endif
   if (l_unlikely(trap)) {
     if (pc == cl->p->code) {  /* first instruction (not resuming)? */
       if (cl->p->is_vararg)
@@ -1660,6 +1693,9 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
           goto ret;  /* caller returns after the tail call */
         }
         ci->func -= delta;  /* restore 'func' (if vararg) */
+#if defined(SLUA_VMSTATS)
+        slvm_return(vmst, ci);  /* the frame is reused by the callee */
+#endif
         luaD_pretailcall(L, ci, ra, b);  /* prepare call frame */
         goto startfunc;  /* execute the callee */
       }
@@ -1719,6 +1755,9 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
           }
         }
        ret:  /* return from a Lua function */
+#if defined(SLUA_VMSTATS)
+        slvm_return(vmst, ci);
+#endif
         if (ci->callstatus & CIST_FRESH)
           return;  /* end this frame */
         else {
@@ -26,6 +26,7 @@ This is for Lua 5.3+ only, built with default 64-bit integers
 #include <fcntl.h>	// open
 #include <sys/ioctl.h>	// ioctl
 #include <poll.h>	// poll
+#include <sys/epoll.h>	// epoll_create1 epoll_ctl epoll_wait
 #include <time.h>	// nanosleep
 #include <utime.h>	// utime
 
@@ -36,11 +37,14 @@ This is for Lua 5.3+ only, built with default 64-bit integers
 #include <sys/wait.h>	// waitpid 
 #include <sys/mount.h>	// mount umount
 #include <sys/mman.h>	// mmap and friends
+#include <sys/syscall.h>	// SYS_* (for io_uring)
+#include <stdint.h>
 
 
 #include "lua.h"
 #include "lauxlib.h"
 
+#include "slbuf.h"	// buffer objects (see src/slbuf.c)
 
 
 #define LERR(msg) return luaL_error(L, msg)
@@ -84,7 +88,7 @@ static int int_or_errno(lua_State *L, int n) {
 // default backlog for listen()
 #define BACKLOG 32
 
-// buffer size for recv, recvfrom, read
+// default read size for recv, recvfrom, read
 #define BUFSIZE 4096
 
 // default timeout: 10 seconds  (poll, ...)
@@ -257,16 +261,36 @@ static int ll_fcntl(lua_State *L) {
 static int ll_read(lua_State *L) { 
 	// lua api:  read(fd [, cnt]) => str
 	// attempt to read cnt bytes 
-	// cnt must be less or equal to BUFSIZE (4,096) bytes (ie. 4kb)
-	// cnt defaults to BUFSIZE
+	// cnt defaults to BUFSIZE (4,096 bytes). cnt can be any size:
+	// bytes are read directly in the Lua buffer used to build 
+	// the result string.
 	// return read bytes as a string or nil, errno
-	char buf[BUFSIZE];
+	luaL_Buffer b;
 	int fd = luaL_checkinteger(L, 1);
-	int cnt = luaL_optinteger(L, 2, BUFSIZE);
-	if (cnt > BUFSIZE) LERR("cnt too large");
-	int n = read(fd, buf, cnt);
+	lua_Integer cnt = luaL_optinteger(L, 2, BUFSIZE);
+	if (cnt < 0) LERR("invalid cnt");
+	char *p = luaL_buffinitsize(L, &b, cnt);
+	ssize_t n = read(fd, p, cnt);
 	if (n == -1) return nil_errno(L);
-	RET_STRN(buf, n);
+	luaL_pushresultsize(&b, n);
+	return 1;
+}
+
+static int ll_readbuf(lua_State *L) { 
+	// lua api:  readbuf(fd, buf [, idx, cnt]) => n
+	// attempt to read cnt bytes in buffer buf, at index idx.
+	// idx defaults to 1, cnt defaults to #buf - idx + 1
+	// (the buffer can be reused for many reads - no string
+	// is created)
+	// return the number of bytes read or nil, errno
+	size_t cnt;
+	int fd = luaL_checkinteger(L, 1);
+	slbuf *b = slbuf_check(L, 2);
+	char *p = slbuf_range(L, b, 3, &cnt);
+	slbuf_checkwrite(L, b);
+	ssize_t n = read(fd, p, cnt);
+	if (n == -1) return nil_errno(L);
+	RET_INT(n);
 }
 
 static int ll_write(lua_State *L) {
@@ -274,17 +298,30 @@ static int ll_write(lua_State *L) {
 	// attempt to write count bytes in string str starting at 
 	// index 'idx'. count defaults to (#str-idx+1), idx defaults to 1, 
 	// so write(fd, str) attempts to write all bytes in str.
+	// str can also be a buffer.
 	// return number of bytes actually written, or nil, errno
 	int fd = luaL_checkinteger(L, 1);
 	size_t len, idx, count;
-	const char *str = luaL_checklstring(L, 2, &len);	
+	const char *str = slbuf_checkdata(L, 2, &len);	
 	idx = luaL_optinteger(L, 3, 1);
-	count = len + idx - 1;
-	count = luaL_optinteger(L, 4, count);
-	if ((idx < 1) || (idx + count - 1 > len)) LERR("out of range");
+	if (idx < 1 || idx > len + 1) LERR("out of range");
+	count = luaL_optinteger(L, 4, len - idx + 1);
+	if (count > len - idx + 1) LERR("out of range");
 	return int_or_errno(L, write(fd, str + idx - 1, count));
 }
 
+static int ll_newbuffer(lua_State *L) {
+	// lua api: newbuffer(size) => buf
+	// return a new buffer of size bytes (initialized with null bytes)
+	// buffers can be used with readbuf() and recvbuf(), and in place
+	// of a string with write(), send() and sendto()
+	// buf:get(i, j) returns bytes i to j as a string
+	lua_Integer size = luaL_checkinteger(L, 1);
+	if (size < 0) LERR("invalid size");
+	slbuf_new(L, size);
+	return 1;
+}
+
 static int ll_dup2(lua_State *L) {
 	// lua api: dup2(oldfd [, newfd]) => newfd | nil, errno
 	// if newfd is not provided, return dup(oldfd)
@@ -343,6 +380,111 @@ static int ll_ftruncate(lua_State *L) {
 	return int_or_errno(L, ftruncate(fd, len));
 }
 
+//----------------------------------------------------------------------
+// memory mappings
+//
+// a mapping is a buffer (see slbuf.h) which is unmapped when it is
+// collected or by munmap(). buf:get(), getuint(), getint(), find()
+// and view() work directly in the mapped memory, and a mapping can
+// be passed in place of a string to write() or send().
+// A PROT_READ-only mapping is a read-only buffer.
+// munmap() fails with EBUSY while views of the mapping or other objects
+// using its memory (eg. slshm rings, uring operations not reaped, 
+// luazen async jobs) are alive.
+//
+// some constants: PROT_READ=1, PROT_WRITE=2, MAP_SHARED=1,
+// MAP_PRIVATE=2, MS_ASYNC=1, MS_SYNC=4, MADV_SEQUENTIAL=2,
+// MADV_WILLNEED=3, MADV_DONTNEED=4
+
+static void mmap_release(slbuf *b) {
+	munmap(b->ptr, b->len);
+}
+
+static int ll_mmap(lua_State *L) {
+	// lua api: mmap(fd, size [, prot [, flags [, offset]]])
+	//	=> buf | nil, errno
+	// if fd is -1, create an anonymous mapping. If size is nil or 0,
+	// map the file from offset to the end of the file.
+	// prot defaults to PROT_READ, flags to MAP_SHARED, offset to 0
+	int fd = luaL_checkinteger(L, 1);
+	lua_Integer size = luaL_optinteger(L, 2, 0);
+	int prot = luaL_optinteger(L, 3, PROT_READ);
+	int flags = luaL_optinteger(L, 4, MAP_SHARED);
+	off_t offset = luaL_optinteger(L, 5, 0);
+	struct stat st;
+	char *p = NULL;
+	slbuf *b;
+	if (size < 0 || offset < 0) LERR("invalid size or offset");
+	if (fd < 0) flags |= MAP_ANONYMOUS;
+	else if (size == 0) {
+		if (fstat(fd, &st) == -1) return nil_errno(L);
+		if (st.st_size > offset) size = st.st_size - offset;
+	}
+	if (size > 0) {
+		p = mmap(NULL, size, prot, flags, fd, offset);
+		if (p == MAP_FAILED) return nil_errno(L);
+	}
+	b = slbuf_wrap(L, p, size, (p ? mmap_release : NULL), 0);
+	b->readonly = !(prot & PROT_WRITE);
+	return 1;
+}
+
+static slbuf *checkmapping(lua_State *L, int idx) {
+	slbuf *b = slbuf_check(L, idx);
+	if (b->release != mmap_release && b->len != 0)
+		luaL_error(L, "not a mapping");
+	return b;
+}
+
+static int ll_munmap(lua_State *L) {
+	// lua api: munmap(buf) => true | nil, errno
+	// unmap the mapping now. buf becomes an empty buffer.
+	// return nil, EBUSY if the mapping is in use (see above)
+	slbuf *b = checkmapping(L, 1);
+	if (b->nrefs > 0) {
+		errno = EBUSY;
+		return nil_errno(L);
+	}
+	if (b->release) b->release(b);
+	b->release = NULL;
+	b->len = 0;
+	RET_TRUE;
+}
+
+static char *pagerange(lua_State *L, slbuf *b, int argi, size_t *cnt) {
+	// check the range (idx, cnt) at argi, argi+1 in mapping b and
+	// extend it down to the start of its first page
+	char *p = slbuf_range(L, b, argi, cnt);
+	size_t off = (size_t)(p - b->ptr) % sysconf(_SC_PAGESIZE);
+	*cnt += off;
+	return p - off;
+}
+
+static int ll_msync(lua_State *L) {
+	// lua api: msync(buf [, idx, cnt [, flags]]) => true | nil, errno
+	// write back the modified pages of a shared file mapping.
+	// the range defaults to the whole mapping, flags to MS_SYNC
+	size_t cnt;
+	slbuf *b = checkmapping(L, 1);
+	char *p = pagerange(L, b, 2, &cnt);
+	int flags = luaL_optinteger(L, 4, MS_SYNC);
+	if (cnt == 0) RET_TRUE;
+	if (msync(p, cnt, flags) == -1) return nil_errno(L);
+	RET_TRUE;
+}
+
+static int ll_madvise(lua_State *L) {
+	// lua api: madvise(buf, advice [, idx, cnt]) => true | nil, errno
+	// the range defaults to the whole mapping
+	size_t cnt;
+	slbuf *b = checkmapping(L, 1);
+	int advice = luaL_checkinteger(L, 2);
+	char *p = pagerange(L, b, 3, &cnt);
+	if (cnt == 0) RET_TRUE;
+	if (madvise(p, cnt, advice) == -1) return nil_errno(L);
+	RET_TRUE;
+}
+
 
 
 //----------------------------------------------------------------------
@@ -633,6 +775,671 @@ static int ll_pollin(lua_State *L) {
 	return int_or_errno(L, poll(&pfd, (nfds_t) 1, timeout));
 }
 
+//----------------------------------------------------------------------
+// epoll
+
+// max number of events returned by one epoll_wait() call
+#define EPOLL_MAXEVENTS 1024
+
+static int ll_epoll_create(lua_State *L) {
+	// lua api: epoll_create([flags]) => epfd | nil, errno
+	// flags defaults to 0 (or EPOLL_CLOEXEC = 0x80000)
+	int flags = luaL_optinteger(L, 1, 0);
+	return int_or_errno(L, epoll_create1(flags));
+}
+
+static int ll_epoll_ctl(lua_State *L) {
+	// lua api: epoll_ctl(epfd, op, fd [, events]) => 0 | nil, errno
+	// op: EPOLL_CTL_ADD=1, EPOLL_CTL_DEL=2, EPOLL_CTL_MOD=3
+	// events: an OR of EPOLL* values, eg. EPOLLIN=1, EPOLLOUT=4,
+	// EPOLLET=1<<31 for edge-triggered mode. defaults to EPOLLIN.
+	struct epoll_event ev;
+	int epfd = luaL_checkinteger(L, 1);
+	int op = luaL_checkinteger(L, 2);
+	int fd = luaL_checkinteger(L, 3);
+	ev.events = (uint32_t) luaL_optinteger(L, 4, EPOLLIN);
+	ev.data.u64 = 0;
+	ev.data.fd = fd;
+	return int_or_errno(L, epoll_ctl(epfd, op, fd, &ev));
+}
+
+static int epoll_wait_list(lua_State *L, int epfd, int tidx, 
+		int maxevents, int timeout) {
+	// wait for events and store them in the table at stack index
+	// tidx as integers (fd << 32 | events). return the number of
+	// ready events or -1 (and errno is set)
+	struct epoll_event eva[EPOLL_MAXEVENTS];
+	int i, n;
+	if (maxevents < 1 || maxevents > EPOLL_MAXEVENTS) 
+		maxevents = EPOLL_MAXEVENTS;
+	n = epoll_wait(epfd, eva, maxevents, timeout);
+	for (i = 0; i < n; i++) {
+		lua_pushinteger(L, 
+			((int64_t)eva[i].data.fd << 32) | eva[i].events);
+		lua_rawseti(L, tidx, i+1);
+	}
+	return n;
+}
+
+static int ll_epoll_wait(lua_State *L) {
+	// lua api: epoll_wait(epfd, evlist [, maxevents, timeout]) 
+	//	=> n | nil, errno
+	// wait for events on epfd. ready events are stored in table 
+	// evlist at indices 1 to n, as integers (fd << 32 | events)
+	// entries after index n are not modified, so evlist can be 
+	// reused across calls without creating garbage.
+	// maxevents defaults to (and cannot exceed) 1024
+	// timeout:  timeout in millisecs (-1 for infinite timeout)
+	int epfd = luaL_checkinteger(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	int maxevents = luaL_optinteger(L, 3, EPOLL_MAXEVENTS);
+	int timeout = luaL_optinteger(L, 4, DEFAULT_TIMEOUT);
+	return int_or_errno(L, 
+		epoll_wait_list(L, epfd, 2, maxevents, timeout));
+}
+
+// evloop: a minimal dispatcher on top of epoll. a coroutine is 
+// registered for each watched fd. when the fd is ready, the coroutine
+// is resumed with (fd, events). if it yields an integer, it is used
+// as the new events mask for the fd. when it returns, the fd is
+// removed from the loop.
+// the coroutines are stored in the evloop user value (a table 
+// indexed by fd).
+
+#define EVLOOP_MT "lualinux.evloop"
+
+typedef struct { int epfd; } evloop;
+
+static evloop *checkevloop(lua_State *L) {
+	evloop *ev = luaL_checkudata(L, 1, EVLOOP_MT);
+	if (ev->epfd == -1) luaL_error(L, "evloop is closed");
+	return ev;
+}
+
+static int evloop_ctl(lua_State *L, int op) {
+	// lua api: ev:add(fd, events, co) / ev:mod(fd, events [, co])
+	// => true | nil, errno
+	evloop *ev = checkevloop(L);
+	int fd = luaL_checkinteger(L, 2);
+	struct epoll_event eve;
+	eve.events = (uint32_t) luaL_checkinteger(L, 3);
+	eve.data.u64 = 0;
+	eve.data.fd = fd;
+	if (op == EPOLL_CTL_ADD || !lua_isnoneornil(L, 4))
+		luaL_checktype(L, 4, LUA_TTHREAD);
+	if (epoll_ctl(ev->epfd, op, fd, &eve) == -1) return nil_errno(L);
+	if (!lua_isnoneornil(L, 4)) {
+		lua_getiuservalue(L, 1, 1);
+		lua_pushvalue(L, 4);
+		lua_rawseti(L, -2, fd);
+	}
+	RET_TRUE;
+}
+
+static int ll_evloop_add(lua_State *L) { 
+	return evloop_ctl(L, EPOLL_CTL_ADD); 
+}
+
+static int ll_evloop_mod(lua_State *L) { 
+	return evloop_ctl(L, EPOLL_CTL_MOD); 
+}
+
+static int ll_evloop_del(lua_State *L) {
+	// lua api: ev:del(fd) => true | nil, errno
+	evloop *ev = checkevloop(L);
+	int fd = luaL_checkinteger(L, 2);
+	lua_getiuservalue(L, 1, 1);
+	lua_pushnil(L);
+	lua_rawseti(L, -2, fd);
+	if (epoll_ctl(ev->epfd, EPOLL_CTL_DEL, fd, NULL) == -1) 
+		return nil_errno(L);
+	RET_TRUE;
+}
+
+static int ll_evloop_wait(lua_State *L) {
+	// lua api: ev:wait([timeout, maxevents]) => n | nil, errno
+	// wait for events and resume the coroutines of the ready fds.
+	// return the number of ready fds (0 on timeout)
+	// if a coroutine raises an error, the fd is removed from the 
+	// loop and the error is propagated.
+	evloop *ev = checkevloop(L);
+	int timeout = luaL_optinteger(L, 2, DEFAULT_TIMEOUT);
+	int maxevents = luaL_optinteger(L, 3, EPOLL_MAXEVENTS);
+	int i, n, fd, status, nres;
+	lua_settop(L, 1);
+	lua_getiuservalue(L, 1, 1);	// coroutine table at index 2
+	lua_getiuservalue(L, 1, 2);	// event list at index 3
+	n = epoll_wait_list(L, ev->epfd, 3, maxevents, timeout);
+	if (n == -1) return nil_errno(L);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, 3, i);
+		int64_t fev = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		fd = fev >> 32;
+		if (lua_rawgeti(L, 2, fd) != LUA_TTHREAD) {
+			// fd removed by a previous coroutine in this batch
+			lua_pop(L, 1);
+			continue;
+		}
+		lua_State *co = lua_tothread(L, -1);
+		lua_pushinteger(co, fd);
+		lua_pushinteger(co, fev & 0xffffffff);
+		status = lua_resume(co, L, 2, &nres);
+		if (status == LUA_YIELD) {
+			if (nres > 0 && lua_isinteger(co, -nres)) {
+				struct epoll_event eve;
+				eve.events = lua_tointeger(co, -nres);
+				eve.data.u64 = 0;
+				eve.data.fd = fd;
+				epoll_ctl(ev->epfd, EPOLL_CTL_MOD, fd, &eve);
+			}
+			lua_pop(co, nres);
+		} else {
+			// coroutine is done (or failed): remove the fd
+			epoll_ctl(ev->epfd, EPOLL_CTL_DEL, fd, NULL);
+			lua_pushnil(L);
+			lua_rawseti(L, 2, fd);
+			if (status != LUA_OK) {
+				lua_xmove(co, L, 1);  // error object
+				return lua_error(L);
+			}
+			lua_pop(co, nres);
+		}
+		lua_pop(L, 1);	// the coroutine
+	}
+	RET_INT(n);
+}
+
+static int ll_evloop_fd(lua_State *L) {
+	// lua api: ev:fd() => epfd
+	evloop *ev = checkevloop(L);
+	RET_INT(ev->epfd);
+}
+
+static int ll_evloop_close(lua_State *L) {
+	// lua api: ev:close()
+	// (also called when the evloop is collected)
+	evloop *ev = luaL_checkudata(L, 1, EVLOOP_MT);
+	if (ev->epfd != -1) close(ev->epfd);
+	ev->epfd = -1;
+	return 0;
+}
+
+static const struct luaL_Reg evloop_methods[] = {
+	{"add", ll_evloop_add},
+	{"mod", ll_evloop_mod},
+	{"del", ll_evloop_del},
+	{"wait", ll_evloop_wait},
+	{"fd", ll_evloop_fd},
+	{"close", ll_evloop_close},
+	{"__gc", ll_evloop_close},
+	{NULL, NULL},
+};
+
+static int ll_evloop(lua_State *L) {
+	// lua api: evloop() => ev | nil, errno
+	// create a new epoll-based event loop
+	evloop *ev = lua_newuserdatauv(L, sizeof(evloop), 2);
+	ev->epfd = -1;
+	if (luaL_newmetatable(L, EVLOOP_MT)) {
+		luaL_setfuncs(L, evloop_methods, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	lua_newtable(L);
+	lua_setiuservalue(L, -2, 1);	// coroutines, indexed by fd
+	lua_newtable(L);
+	lua_setiuservalue(L, -2, 2);	// reusable event list
+	ev->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (ev->epfd == -1) return nil_errno(L);
+	return 1;
+}
+
+//----------------------------------------------------------------------
+// io_uring
+//
+// io_uring is used with raw syscalls (no liburing, and no dependency 
+// on the kernel headers, which are usually not available with musl).
+// The kernel ABI structures are declared below.
+// On kernels without io_uring, uring() returns nil, errno (ENOSYS), 
+// and the application can fall back to the regular I/O functions.
+// read and write require Linux 5.6+, accept 5.5+
+
+#ifndef SYS_io_uring_setup
+#define SYS_io_uring_setup 425
+#define SYS_io_uring_enter 426
+#endif
+
+#define IORING_OFF_SQ_RING	0ULL
+#define IORING_OFF_CQ_RING	0x8000000ULL
+#define IORING_OFF_SQES		0x10000000ULL
+#define IORING_FEAT_SINGLE_MMAP	(1U << 0)
+#define IORING_ENTER_GETEVENTS	(1U << 0)
+
+#define IORING_OP_FSYNC		3
+#define IORING_OP_ACCEPT	13
+#define IORING_OP_ASYNC_CANCEL	14
+#define IORING_OP_READ		22
+#define IORING_OP_WRITE		23
+
+struct uring_sqring_offsets {
+	uint32_t head, tail, ring_mask, ring_entries, flags, dropped;
+	uint32_t array, resv1;
+	uint64_t resv2;
+};
+
+struct uring_cqring_offsets {
+	uint32_t head, tail, ring_mask, ring_entries, overflow, cqes;
+	uint32_t flags, resv1;
+	uint64_t resv2;
+};
+
+struct uring_params {
+	uint32_t sq_entries, cq_entries, flags, sq_thread_cpu;
+	uint32_t sq_thread_idle, features, wq_fd, resv[3];
+	struct uring_sqring_offsets sq_off;
+	struct uring_cqring_offsets cq_off;
+};
+
+struct uring_sqe {	// submission queue entry (64 bytes)
+	uint8_t opcode, flags;
+	uint16_t ioprio;
+	int32_t fd;
+	uint64_t off;
+	uint64_t addr;
+	uint32_t len;
+	uint32_t op_flags;	// rw_flags, fsync_flags, accept_flags
+	uint64_t user_data;
+	uint64_t pad[3];
+};
+
+struct uring_cqe {	// completion queue entry (16 bytes)
+	uint64_t user_data;
+	int32_t res;
+	uint32_t flags;
+};
+
+#define URING_MT "lualinux.uring"
+
+typedef struct {
+	int fd;
+	unsigned pending;	// sqes queued since the last submit
+	unsigned inflight;	// operations queued and not yet reaped
+	uint64_t seq;		// last sequence number (sqe user_data)
+	void *sqring, *cqring;	// mapped rings
+	size_t sqring_sz, cqring_sz;
+	struct uring_sqe *sqes;
+	size_t sqes_sz;
+	// pointers in the mapped rings
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct uring_cqe *cqes;
+} uring;
+
+static void uring_unmap(uring *u) {
+	if (u->sqes) munmap(u->sqes, u->sqes_sz);
+	if (u->cqring && u->cqring != u->sqring) 
+		munmap(u->cqring, u->cqring_sz);
+	if (u->sqring) munmap(u->sqring, u->sqring_sz);
+	if (u->fd != -1) close(u->fd);
+	u->sqes = NULL; u->sqring = u->cqring = NULL; u->fd = -1;
+}
+
+static int uring_enter(uring *u, unsigned min_complete) {
+	// submit the pending sqes. return the number of submitted sqes
+	// or -1 (errno is set)
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	int n = syscall(SYS_io_uring_enter, u->fd, u->pending, 
+			min_complete, flags, NULL, 0);
+	if (n >= 0) u->pending -= n;
+	return n;
+}
+
+static struct uring_sqe *uring_trysqe(uring *u) {
+	// return a free sqe, or NULL if the submission queue is full.
+	// if it is full, submit the pending entries first
+	unsigned tail = *u->sq_tail;
+	unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head >= *u->sq_entries) {
+		if (uring_enter(u, 0) == -1) return NULL;
+		head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head >= *u->sq_entries) return NULL;
+	}
+	struct uring_sqe *sqe = &u->sqes[tail & *u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static void uring_publish(uring *u) {
+	// make the sqe returned by uring_trysqe() visible to the kernel
+	unsigned tail = *u->sq_tail;
+	unsigned idx = tail & *u->sq_mask;
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->pending++;
+}
+
+static void uring_consume(uring *u) {
+	// discard the available completions (used by uring_drain)
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		if (u->cqes[head & *u->cq_mask].user_data != 0) 
+			u->inflight--;
+		head++;
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void uring_drain(lua_State *L, uring *u) {
+	// cancel the operations in flight and wait for their completion,
+	// so that the kernel no longer uses the pinned buffers.
+	// the ring is at stack index 1. cancel requests have user_data 0
+	struct uring_sqe *sqe;
+	if (u->inflight == 0) return;
+	lua_getiuservalue(L, 1, 1);	// udata by sequence number
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		lua_pop(L, 1);
+		while ((sqe = uring_trysqe(u)) == NULL) {
+			if (uring_enter(u, 1) == -1 && errno != EINTR) 
+				goto wait;
+			uring_consume(u);
+		}
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = lua_tointeger(L, -1);
+		uring_publish(u);
+	}
+wait:
+	lua_settop(L, 1);
+	uring_consume(u);
+	while (u->inflight > 0) {
+		if (uring_enter(u, 1) == -1 && errno != EINTR) break;
+		uring_consume(u);
+	}
+}
+
+static uring *checkuring(lua_State *L) {
+	uring *u = luaL_checkudata(L, 1, URING_MT);
+	if (u->fd == -1) luaL_error(L, "uring is closed");
+	return u;
+}
+
+static struct uring_sqe *uring_getsqe(lua_State *L, uring *u) {
+	// return a free sqe, or raise an error
+	struct uring_sqe *sqe;
+	errno = 0;
+	sqe = uring_trysqe(u);
+	if (sqe == NULL && errno != 0 && errno != EBUSY)
+		luaL_error(L, "uring submit error: %d", errno);
+	if (sqe == NULL) luaL_error(L, "uring submission queue full");
+	return sqe;
+}
+
+static void uring_queue(lua_State *L, uring *u, struct uring_sqe *sqe,
+		int pin) {
+	// publish sqe. The kernel user_data is a sequence number, and 
+	// the udata (argument 2) is kept in a table by sequence number, 
+	// so several operations can use the same udata. if pin is not
+	// 0, the value at this stack index (the buffer or string used 
+	// by the operation) is kept alive until the completion is reaped
+	sqe->user_data = ++u->seq;
+	lua_getiuservalue(L, 1, 1);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, u->seq);
+	lua_pop(L, 1);
+	if (pin) {
+		// a buffer cannot be unmapped until the completion is 
+		// reaped (see ll_munmap)
+		slbuf *b = slbuf_test(L, pin);
+		if (b) b->nrefs++;
+		lua_getiuservalue(L, 1, 2);
+		lua_pushvalue(L, pin);
+		lua_rawseti(L, -2, u->seq);
+		lua_pop(L, 1);
+	}
+	uring_publish(u);
+	u->inflight++;
+}
+
+static int ll_uring_read(lua_State *L) {
+	// lua api: u:read(udata, fd, buf [, idx, cnt, offset]) => u
+	// queue a read of cnt bytes in buffer buf at index idx 
+	// (idx, cnt as in readbuf()). offset is the file offset 
+	// (defaults to -1: the current file position)
+	// udata is an integer returned with the completion.
+	size_t cnt;
+	uring *u = checkuring(L);
+	luaL_checkinteger(L, 2);	// udata
+	int fd = luaL_checkinteger(L, 3);
+	slbuf *b = slbuf_check(L, 4);
+	char *p = slbuf_range(L, b, 5, &cnt);
+	slbuf_checkwrite(L, b);
+	if (cnt > UINT32_MAX) LERR("count too large");
+	struct uring_sqe *sqe = uring_getsqe(L, u);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)p;
+	sqe->len = cnt;
+	sqe->off = luaL_optinteger(L, 7, -1);
+	uring_queue(L, u, sqe, 4);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int ll_uring_write(lua_State *L) {
+	// lua api: u:write(udata, fd, str [, idx, count, offset]) => u
+	// queue a write of count bytes of str (a string or a buffer), 
+	// starting at index idx (idx, count as in write()). offset is 
+	// the file offset (defaults to -1: the current file position)
+	size_t len, idx, count;
+	uring *u = checkuring(L);
+	luaL_checkinteger(L, 2);	// udata
+	int fd = luaL_checkinteger(L, 3);
+	const char *str = slbuf_checkdata(L, 4, &len);
+	idx = luaL_optinteger(L, 5, 1);
+	if (idx < 1 || idx > len + 1) LERR("out of range");
+	count = luaL_optinteger(L, 6, len - idx + 1);
+	if (count > len - idx + 1) LERR("out of range");
+	if (count > UINT32_MAX) LERR("count too large");
+	struct uring_sqe *sqe = uring_getsqe(L, u);
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)(str + idx - 1);
+	sqe->len = count;
+	sqe->off = luaL_optinteger(L, 7, -1);
+	uring_queue(L, u, sqe, 4);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int ll_uring_accept(lua_State *L) {
+	// lua api: u:accept(udata, fd [, flags]) => u
+	// queue an accept (accept4 flags, default to 0). the completion
+	// result is the client fd (the client address is not returned:
+	// use getpeername() if needed)
+	uring *u = checkuring(L);
+	luaL_checkinteger(L, 2);	// udata
+	struct uring_sqe *sqe = uring_getsqe(L, u);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = luaL_checkinteger(L, 3);
+	sqe->op_flags = luaL_optinteger(L, 4, 0);
+	uring_queue(L, u, sqe, 0);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int ll_uring_fsync(lua_State *L) {
+	// lua api: u:fsync(udata, fd [, flags]) => u
+	// queue an fsync. flags=1 (IORING_FSYNC_DATASYNC) for fdatasync
+	uring *u = checkuring(L);
+	luaL_checkinteger(L, 2);	// udata
+	struct uring_sqe *sqe = uring_getsqe(L, u);
+	sqe->opcode = IORING_OP_FSYNC;
+	sqe->fd = luaL_checkinteger(L, 3);
+	sqe->op_flags = luaL_optinteger(L, 4, 0);
+	uring_queue(L, u, sqe, 0);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int ll_uring_submit(lua_State *L) {
+	// lua api: u:submit([waitnr]) => n | nil, errno
+	// submit all the queued operations with one syscall, and
+	// wait for at least waitnr completions (defaults to 0)
+	// return the number of submitted operations
+	uring *u = checkuring(L);
+	unsigned waitnr = luaL_optinteger(L, 2, 0);
+	if (u->pending == 0 && waitnr == 0) RET_INT(0);
+	return int_or_errno(L, uring_enter(u, waitnr));
+}
+
+static int ll_uring_reap(lua_State *L) {
+	// lua api: u:reap(tbl [, max]) => n
+	// collect up to max available completions (all by default).
+	// for each completion i (1 to n), the udata and the result
+	// are stored in tbl at indices 2i-1 and 2i. the result is the
+	// syscall return value, or -errno in case of error.
+	// the table can be reused (entries after 2n are not modified)
+	uring *u = checkuring(L);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_Integer max = luaL_optinteger(L, 3, LUA_MAXINTEGER);
+	lua_getiuservalue(L, 1, 1);	// udata by sequence number
+	lua_getiuservalue(L, 1, 2);	// pinned objects
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	lua_Integer n = 0;
+	while (head != tail && n < max) {
+		struct uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+		lua_Integer seq = cqe->user_data;
+		n++;
+		lua_rawgeti(L, -2, seq);
+		lua_rawseti(L, 2, 2*n - 1);
+		lua_pushinteger(L, cqe->res);
+		lua_rawseti(L, 2, 2*n);
+		lua_pushnil(L);
+		lua_rawseti(L, -3, seq);
+		if (lua_rawgeti(L, -1, seq) != LUA_TNIL) {	// unpin
+			slbuf *b = slbuf_test(L, -1);
+			if (b) b->nrefs--;
+			lua_pushnil(L);
+			lua_rawseti(L, -3, seq);
+		}
+		lua_pop(L, 1);
+		u->inflight--;
+		head++;
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	RET_INT(n);
+}
+
+static int ll_uring_close(lua_State *L) {
+	// lua api: u:close()
+	// (also called when the ring is collected)
+	// the operations in flight are canceled first
+	uring *u = luaL_checkudata(L, 1, URING_MT);
+	slbuf *b;
+	lua_settop(L, 1);
+	if (u->fd != -1) uring_drain(L, u);
+	uring_unmap(u);
+	// release the buffers of the canceled operations
+	lua_getiuservalue(L, 1, 2);
+	lua_pushnil(L);
+	while (lua_next(L, 2)) {
+		if ((b = slbuf_test(L, -1)) != NULL) b->nrefs--;
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	lua_newtable(L);
+	lua_setiuservalue(L, 1, 1);
+	lua_newtable(L);
+	lua_setiuservalue(L, 1, 2);
+	return 0;
+}
+
+static const struct luaL_Reg uring_methods[] = {
+	{"read", ll_uring_read},
+	{"write", ll_uring_write},
+	{"accept", ll_uring_accept},
+	{"fsync", ll_uring_fsync},
+	{"submit", ll_uring_submit},
+	{"reap", ll_uring_reap},
+	{"close", ll_uring_close},
+	{"__gc", ll_uring_close},
+	{NULL, NULL},
+};
+
+static int ll_uring(lua_State *L) {
+	// lua api: uring([entries]) => u | nil, errno
+	// create an io_uring instance. entries is the submission queue
+	// size (defaults to 256). operations are queued with the u:read,
+	// u:write, u:accept and u:fsync methods, submitted with one 
+	// syscall with u:submit(), and completions are collected with
+	// u:reap(). the buffers and strings used by the operations are
+	// kept alive until their completion is reaped. u:close() cancels
+	// the operations in flight and waits for their completion.
+	// return nil, errno if io_uring is not available (ENOSYS=38,
+	// or EPERM=1 if disabled by the system administrator)
+	unsigned entries = luaL_optinteger(L, 1, 256);
+	struct uring_params p;
+	uring *u = lua_newuserdatauv(L, sizeof(uring), 2);
+	memset(u, 0, sizeof(uring));
+	u->fd = -1;
+	if (luaL_newmetatable(L, URING_MT)) {
+		luaL_setfuncs(L, uring_methods, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	lua_newtable(L);
+	lua_setiuservalue(L, -2, 1);	// udata by sequence number
+	lua_newtable(L);
+	lua_setiuservalue(L, -2, 2);	// objects pinned by sequence number
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(SYS_io_uring_setup, entries, &p);
+	if (u->fd == -1) return nil_errno(L);
+	u->sqring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cqring_sz = p.cq_off.cqes + 
+		p.cq_entries * sizeof(struct uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cqring_sz > u->sqring_sz) u->sqring_sz = u->cqring_sz;
+	}
+	u->sqring = mmap(NULL, u->sqring_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sqring == MAP_FAILED) goto err;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cqring = u->sqring;
+	} else {
+		u->cqring = mmap(NULL, u->cqring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cqring == MAP_FAILED) goto err;
+	}
+	u->sqes_sz = p.sq_entries * sizeof(struct uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) goto err;
+	char *sq = u->sqring, *cq = u->cqring;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_entries = (unsigned *)(sq + p.sq_off.ring_entries);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct uring_cqe *)(cq + p.cq_off.cqes);
+	return 1;
+err:
+	lua_pushnil(L);
+	lua_pushinteger(L, errno);
+	if (u->sqes == MAP_FAILED) u->sqes = NULL;
+	if (u->cqring == MAP_FAILED) u->cqring = NULL;
+	if (u->sqring == MAP_FAILED) u->sqring = NULL;
+	uring_unmap(u);
+	return 2;
+}
+
 //----------------------------------------------------------------------
 // socket functions
 
@@ -719,43 +1526,66 @@ static int ll_connect(lua_State *L) {
 }
 
 static int ll_recvfrom(lua_State *L) {
-	// lua api: recvfrom(fd [, flags]) => str, sockaddr
-	// receive up to BUFSIZE bytes (4,096 bytes)
+	// lua api: recvfrom(fd [, flags, cnt]) => str, sockaddr
+	// receive up to cnt bytes. cnt defaults to BUFSIZE (4,096 bytes)
 	// return received bytes and sender sockaddr as strings or nil, errno
 	// flags is an OR of all the MSG_* flags defined in sys/socket.h
 	// flags defaults to 0.
+	luaL_Buffer b;
 	int fd = luaL_checkinteger(L, 1);
-	char buf[BUFSIZE];
 	int flags = luaL_optinteger(L, 2, 0);
+	lua_Integer cnt = luaL_optinteger(L, 3, BUFSIZE);
+	if (cnt < 0) LERR("invalid cnt");
 	char addrbuf[136];
 	socklen_t addrbuflen = 136;
-	int n = recvfrom(fd, buf, BUFSIZE, flags, 
+	char *p = luaL_buffinitsize(L, &b, cnt);
+	ssize_t n = recvfrom(fd, p, cnt, flags, 
 		(struct sockaddr *) addrbuf, &addrbuflen);
 	if (n == -1) return nil_errno(L);
-	lua_pushlstring(L, buf, n);
+	luaL_pushresultsize(&b, n);
 	lua_pushlstring(L, addrbuf, addrbuflen);
 	return 2;
 }
 
 static int ll_recv(lua_State *L) {
-	// lua api: recv(fd [, flags]) => str
-	// receive up to BUFSIZE bytes (4,096 bytes)
+	// lua api: recv(fd [, flags, cnt]) => str
+	// receive up to cnt bytes. cnt defaults to BUFSIZE (4,096 bytes)
 	// return received bytes as a string or nil, errno
 	// flags is an OR of all the MSG_* flags defined in sys/socket.h
 	// flags defaults to 0.
+	luaL_Buffer b;
 	int fd = luaL_checkinteger(L, 1);
-	char buf[BUFSIZE];
 	int flags = luaL_optinteger(L, 2, 0);
-	int n = recv(fd, buf, BUFSIZE, flags);
+	lua_Integer cnt = luaL_optinteger(L, 3, BUFSIZE);
+	if (cnt < 0) LERR("invalid cnt");
+	char *p = luaL_buffinitsize(L, &b, cnt);
+	ssize_t n = recv(fd, p, cnt, flags);
 	if (n == -1) return nil_errno(L);
-	lua_pushlstring(L, buf, n);
+	luaL_pushresultsize(&b, n);
 	return 1; 
 }
 
+static int ll_recvbuf(lua_State *L) {
+	// lua api: recvbuf(fd, buf [, flags, idx, cnt]) => n
+	// receive up to cnt bytes in buffer buf at index idx.
+	// idx defaults to 1, cnt defaults to #buf - idx + 1
+	// flags defaults to 0.
+	// return the number of bytes received or nil, errno
+	size_t cnt;
+	int fd = luaL_checkinteger(L, 1);
+	slbuf *b = slbuf_check(L, 2);
+	int flags = luaL_optinteger(L, 3, 0);
+	char *p = slbuf_range(L, b, 4, &cnt);
+	slbuf_checkwrite(L, b);
+	ssize_t n = recv(fd, p, cnt, flags);
+	if (n == -1) return nil_errno(L);
+	RET_INT(n);
+}
+
 static int ll_sendto(lua_State *L) {
 	// lua api: sendto(fd, str, flags, sockaddr [, idx, count])
 	// attempt to send count bytes in string str starting at index idx, 
-	// to address sockaddr.
+	// to address sockaddr. str can also be a buffer.
 	// idx nd count are optional. they default to 1 and the number
 	// of remaining bytes in string.
 	// flags is an OR of all the MSG_* flags defined in sys/socket.h
@@ -764,21 +1594,22 @@ static int ll_sendto(lua_State *L) {
 	int n;
 	struct sockaddr *sa;
 	int fd = luaL_checkinteger(L, 1);
-	const char *str = luaL_checklstring(L, 2, &len);	
+	const char *str = slbuf_checkdata(L, 2, &len);	
 	int flags = luaL_checkinteger(L, 3);
 	sa = (struct sockaddr *)luaL_checklstring(L, 4, &salen);
 	idx = luaL_optinteger(L, 5, 1);
-	count = len + idx - 1;
-	count = luaL_optinteger(L, 6, count);
-	if ((idx < 1) || (idx + count - 1 > len)) LERR("out of range");
-	return int_or_errno(L, sendto(fd, str, len, flags, sa, salen));
+	if (idx < 1 || idx > len + 1) LERR("out of range");
+	count = luaL_optinteger(L, 6, len - idx + 1);
+	if (count > len - idx + 1) LERR("out of range");
+	return int_or_errno(L, 
+		sendto(fd, str + idx - 1, count, flags, sa, salen));
 }
 
 static int ll_send(lua_State *L) {
 	// lua api: sendto(fd, str, flags [, idx, count])
 	// attempt to send count bytes in string str starting at index idx, 
 	// (assume the socket is connected. equivalent to write(), 
-	// but with flags)
+	// but with flags). str can also be a buffer.
 	// idx and count are optional. they default to 1 and the number
 	// of remaining bytes in string.
 	// flags is an OR of all the MSG_* flags defined in sys/socket.h
@@ -786,13 +1617,13 @@ static int ll_send(lua_State *L) {
 	size_t len, idx, count;
 	int n;
 	int fd = luaL_checkinteger(L, 1);
-	const char *str = luaL_checklstring(L, 2, &len);	
+	const char *str = slbuf_checkdata(L, 2, &len);	
 	int flags = luaL_checkinteger(L, 3);
 	idx = luaL_optinteger(L, 4, 1);
-	count = len + idx - 1;
-	count = luaL_optinteger(L, 5, count);
-	if ((idx < 1) || (idx + count - 1 > len)) LERR("out of range");
-	return int_or_errno(L, send(fd, str, len, flags));
+	if (idx < 1 || idx > len + 1) LERR("out of range");
+	count = luaL_optinteger(L, 5, len - idx + 1);
+	if (count > len - idx + 1) LERR("out of range");
+	return int_or_errno(L, send(fd, str + idx - 1, count, flags));
 }
 
 static int ll_getsockname(lua_State *L) {
@@ -886,7 +1717,15 @@ static int ll_getnameinfo(lua_State *L) {
 // lua library declaration
 //
 
+//------------------------------------------------------------
+// syscall statistics (declarations - see below)
+
+static int ll_stats(lua_State *L);
+static int ll_stats_enable(lua_State *L);
+
+//------------------------------------------------------------
 // lualinux function table
+
 static const struct luaL_Reg lualinuxlib[] = {
 	//
 	//
@@ -913,12 +1752,18 @@ static const struct luaL_Reg lualinuxlib[] = {
 	{"fcntl", ll_fcntl},
 	{"fsync", ll_fsync},
 	{"read", ll_read},
+	{"readbuf", ll_readbuf},
 	{"write", ll_write},
 	{"dup2", ll_dup2},
 	{"pipe2", ll_pipe2},
 	{"fileno", ll_fileno},
 	{"fdopen", ll_fdopen},
 	{"ftruncate", ll_ftruncate},
+	{"newbuffer", ll_newbuffer},
+	{"mmap", ll_mmap},
+	{"munmap", ll_munmap},
+	{"msync", ll_msync},
+	{"madvise", ll_madvise},
 	//
 	{"opendir", ll_opendir},
 	{"readdir", ll_readdir},
@@ -940,6 +1785,11 @@ static const struct luaL_Reg lualinuxlib[] = {
 	{"ioctl_int", ll_ioctl_int},
 	{"poll", ll_poll},
 	{"pollin", ll_pollin},
+	{"epoll_create", ll_epoll_create},
+	{"epoll_ctl", ll_epoll_ctl},
+	{"epoll_wait", ll_epoll_wait},
+	{"evloop", ll_evloop},
+	{"uring", ll_uring},
 	//
 	{"socket", ll_socket},
 	{"setsockopt", ll_setsockopt},
@@ -950,6 +1800,7 @@ static const struct luaL_Reg lualinuxlib[] = {
 	{"connect", ll_connect},
 	{"recvfrom", ll_recvfrom},
 	{"recv", ll_recv},
+	{"recvbuf", ll_recvbuf},
 	{"sendto", ll_sendto},
 	{"send", ll_send},
 	{"getsockname", ll_getsockname},
@@ -957,9 +1808,177 @@ static const struct luaL_Reg lualinuxlib[] = {
 	{"getaddrinfo", ll_getaddrinfo},
 	{"getnameinfo", ll_getnameinfo},
 	//
+	{"stats", ll_stats},
+	{"stats_enable", ll_stats_enable},
+	//
 	{NULL, NULL},
 };
 
+//------------------------------------------------------------
+// syscall statistics
+//
+// When statistics are enabled, the functions in the lualinux table
+// are replaced with wrappers which record for each function:
+// the number of calls, the number of errors (the function returns 
+// nil, errno, or raises an error), the number of bytes read or 
+// written (I/O functions only), and a histogram of the call 
+// durations (log2 scale, in nanoseconds).
+// Durations are measured with clock_gettime(CLOCK_MONOTONIC) which
+// does not enter the kernel (vDSO), so the overhead is low.
+//
+// The wrappers are installed in the lualinux table: a function 
+// stored elsewhere before the statistics are enabled (eg. in a local
+// variable) is not instrumented. The statistics can be enabled when
+// the library is loaded with the environment variable 
+// LUALINUX_STATS=1. The counters are global (for all the states, 
+// which may run in different threads), updated with atomic adds.
+// The methods of the evloop and uring objects are not instrumented.
+
+#define NFUNCS (sizeof(lualinuxlib) / sizeof(luaL_Reg) - 1)
+#define NBUCKETS 40	// 2^39 ns = about 9 minutes
+
+typedef struct llstat {
+	uint64_t calls, errors, bytes;
+	uint64_t time;		// total duration (nanoseconds)
+	uint64_t hist[NBUCKETS];
+} llstat;
+
+static llstat llstats[NFUNCS];
+static int stats_enabled;
+
+// I/O functions: they return the data read (a string) or the 
+// number of bytes read or written
+static const char *const iofuncs[] = {
+	"read", "recv", "recvfrom", 
+	"readbuf", "write", "recvbuf", "send", "sendto", NULL,
+};
+
+static char isiofunc[NFUNCS];	// set by stats_enable()
+
+static int isio(const char *name) {
+	int i;
+	for (i = 0; iofuncs[i]; i++)
+		if (strcmp(name, iofuncs[i]) == 0) return 1;
+	return 0;
+}
+
+#define ADD(x, n) __atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+
+static uint64_t nsnow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int stats_call(lua_State *L, int i) {
+	// call lualinux function i (in protected mode, so that a raised
+	// error is also recorded) and record its statistics
+	llstat *st = &llstats[i];
+	uint64_t t0, dt;
+	int n, k, status;
+	lua_pushcfunction(L, lualinuxlib[i].func);
+	lua_insert(L, 1);
+	t0 = nsnow();
+	status = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+	dt = nsnow() - t0;
+	ADD(st->calls, 1);
+	ADD(st->time, dt);
+	k = dt ? 63 - __builtin_clzll(dt) : 0;
+	ADD(st->hist[k < NBUCKETS ? k : NBUCKETS - 1], 1);
+	if (status != LUA_OK) {
+		ADD(st->errors, 1);
+		return lua_error(L);
+	}
+	n = lua_gettop(L);
+	if (n > 1 && lua_isnil(L, 1)) ADD(st->errors, 1);
+	else if (n > 0 && isiofunc[i]) {
+		if (lua_type(L, 1) == LUA_TSTRING) 
+			ADD(st->bytes, lua_rawlen(L, 1));
+		else if (lua_isinteger(L, 1))
+			ADD(st->bytes, lua_tointeger(L, 1));
+	}
+	return n;
+}
+
+// one wrapper per function (each wrapper must be a distinct C 
+// function, so that its name can be found, eg. by slprof)
+#define W(i) static int w##i(lua_State *L) { return stats_call(L, i); }
+#define W10(i) W(i##0) W(i##1) W(i##2) W(i##3) W(i##4) \
+		W(i##5) W(i##6) W(i##7) W(i##8) W(i##9)
+W10() W10(1) W10(2) W10(3) W10(4) W10(5) W10(6) W10(7) W10(8) W10(9)
+#undef W
+#define W(i) w##i,
+static const lua_CFunction wrappers[] = {
+	W10() W10(1) W10(2) W10(3) W10(4) W10(5) W10(6) W10(7) W10(8) W10(9)
+};
+#undef W
+#undef W10
+
+#define STATS_MODULE "lualinux.module"  // registry key
+
+static int ll_stats_enable(lua_State *L) {
+	// lua api: stats_enable(flag)
+	// enable (flag is true) or disable the syscall statistics
+	int i, enable = lua_toboolean(L, 1);
+	if (NFUNCS > sizeof(wrappers) / sizeof(lua_CFunction))
+		LERR("too many functions");
+	if (lua_getfield(L, LUA_REGISTRYINDEX, STATS_MODULE) != LUA_TTABLE)
+		LERR("lualinux module not found");
+	for (i = 0; i < (int)NFUNCS; i++) {
+		if (lualinuxlib[i].func == ll_stats
+		    || lualinuxlib[i].func == ll_stats_enable) continue;
+		isiofunc[i] = isio(lualinuxlib[i].name);
+		lua_pushcfunction(L, 
+			enable ? wrappers[i] : lualinuxlib[i].func);
+		lua_setfield(L, -2, lualinuxlib[i].name);
+	}
+	__atomic_store_n(&stats_enabled, enable, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int ll_stats(lua_State *L) {
+	// lua api: stats([reset]) => {name = st}
+	// return the statistics of the functions which have been
+	// called. st is a table:
+	//	{calls=, errors=, bytes=, time=, hist=}
+	// time is the total duration in seconds. hist is a list:
+	// hist[k] is the number of calls whose duration d is
+	// 2^(k-1) <= d < 2^k nanoseconds. 
+	// enabled: (second return value) true if the statistics are
+	// enabled.
+	// if reset is true, the counters are reset after reading them.
+	int i, k, top;
+	int reset = lua_toboolean(L, 1);
+	llstat *st, copy;
+	lua_newtable(L);
+	for (i = 0; i < (int)NFUNCS; i++) {
+		// read (and reset) the counters with atomic operations
+		uint64_t *p = (uint64_t *)&llstats[i];
+		uint64_t *q = (uint64_t *)&copy;
+		for (k = 0; k < (int)(sizeof(llstat) / sizeof(uint64_t)); k++)
+			q[k] = reset ? __atomic_exchange_n(p + k, 0, 
+					__ATOMIC_RELAXED)
+				: __atomic_load_n(p + k, __ATOMIC_RELAXED);
+		st = &copy;
+		if (st->calls == 0) continue;
+		lua_createtable(L, 0, 5);
+		lua_pushinteger(L, st->calls); lua_setfield(L, -2, "calls");
+		lua_pushinteger(L, st->errors); lua_setfield(L, -2, "errors");
+		lua_pushinteger(L, st->bytes); lua_setfield(L, -2, "bytes");
+		lua_pushnumber(L, st->time / 1e9); lua_setfield(L, -2, "time");
+		for (top = NBUCKETS; top > 0 && st->hist[top-1] == 0; top--) {}
+		lua_createtable(L, top, 0);
+		for (k = 0; k < top; k++) {
+			lua_pushinteger(L, st->hist[k]);
+			lua_rawseti(L, -2, k + 1);
+		}
+		lua_setfield(L, -2, "hist");
+		lua_setfield(L, -2, lualinuxlib[i].name);
+	}
+	lua_pushboolean(L, __atomic_load_n(&stats_enabled, __ATOMIC_RELAXED));
+	return 2;
+}
+
 int luaopen_lualinux (lua_State *L) {
 	
 	// register main library functions
@@ -967,6 +1986,14 @@ int luaopen_lualinux (lua_State *L) {
 	lua_pushliteral (L, "VERSION");
 	lua_pushliteral (L, lualinux_VERSION); 
 	lua_settable (L, -3);
+	// keep the module table for stats_enable()
+	lua_pushvalue(L, -1);
+	lua_setfield(L, LUA_REGISTRYINDEX, STATS_MODULE);
+	if (getenv("LUALINUX_STATS") != NULL) {
+		lua_pushcfunction(L, ll_stats_enable);
+		lua_pushboolean(L, 1);
+		lua_call(L, 1, 0);
+	}
 	return 1;
 }
 
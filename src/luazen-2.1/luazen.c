@@ -14,6 +14,7 @@ luazen crypto, encoding and compression library
 #define VERSION "luazen-2.1"
 
 #include <assert.h>
+#include <pthread.h>
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -85,17 +86,26 @@ static void llib_init() {
 	//from lzma
 	APPEND(lzma)
 	APPEND(unlzma)
+	APPEND(lzma_encoder)
+	APPEND(lzma_decoder)
+	APPEND(lzma_blocks)
+	APPEND(lzma_blockindex)
+	APPEND(unlzma_range)
 	//
 	// from random, base64, md5
 	APPEND(randombytes)
 	APPEND(b64encode)
 	APPEND(b64decode)
 	APPEND(md5)
+	APPEND(md5_init)
 	//
 	// from mono
 	APPEND(encrypt)
 	APPEND(decrypt)
+	APPEND(encrypt_stream)
+	APPEND(decrypt_stream)
 	APPEND(blake2b)
+	APPEND(blake2b_init)
 	APPEND(argon2i)
 	APPEND(x25519_public_key)
 	APPEND(key_exchange)
@@ -104,6 +114,13 @@ static void llib_init() {
 	APPEND(ed25519_sign)
 	APPEND(ed25519_check)
 	APPEND(sha512)	
+	APPEND(sha512_init)
+	//
+	// from lzasync (run on the worker pool)
+	APPEND(lzma_async)
+	APPEND(argon2i_async)
+	APPEND(encrypt_async)
+	APPEND(blake2b_async)
 	//
 } //llib_init()
 
@@ -111,7 +128,10 @@ static void llib_init() {
 // library registration
 
 int luaopen_luazen (lua_State *L) {
-	llib_init(); // fill the library table
+	// fill the library table once (luaopen_luazen may be called
+	// concurrently by slthread states)
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, llib_init);
 	luaL_register (L, "luazen", llib);
     // 
     lua_pushliteral (L, "VERSION");
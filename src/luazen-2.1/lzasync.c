@@ -0,0 +1,486 @@
+// Copyright (c) 2023  Phil Leblanc  -- see LICENSE file
+// ---------------------------------------------------------------------
+/*
+lzasync - run the long luazen functions on a pool of worker threads
+
+lzma(), argon2i(), encrypt() and blake2b() run in the calling thread
+and block the interpreter until they return. The async variants
+queue the work to a pool of worker threads and immediately return a
+"future". The interpreter can go on (eg. serve other connections in
+a poll/epoll loop) and get the result when the work is done.
+
+The inputs are not copied: the strings or buffers passed to an async
+function are kept by the future (as uservalues) until the result is
+taken. A buffer must not be modified while the work is in progress,
+and it cannot be unmapped (lualinux.munmap fails with EBUSY) until the
+future is closed.
+
+The pool is created with the first async call. It has at most one
+worker thread per online CPU. The workers are started only as needed
+(when all the existing workers are busy) and never exit.
+
+Lua API:
+	lzma_async(s [, opts]) => future    (same arguments as lzma())
+	argon2i_async(pw, salt, nkb, niters) => future
+	encrypt_async(k, n, m [, ninc]) => future
+	blake2b_async(m [, diglen [, key]]) => future
+
+	fu:fd() => fd
+		an eventfd which becomes readable when the work is done.
+		It can be added to a poll or epoll set. (the fd belongs
+		to the future, it must not be closed)
+	fu:ready() => boolean  (the work is done, result() does not wait)
+	fu:result() => the results of the synchronous function
+		wait for the end of the work if needed. The future is
+		closed after result()
+	fu:close()
+		release the future resources. A queued work is cancelled,
+		a work in progress is waited for. A future which is
+		collected is closed.
+
+The worker threads do not survive a fork(). The pool is reset in a
+forked child (new async calls start new workers). The result() of a
+future created before the fork and not done raises an error in the
+child.
+
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "slbuf.h"
+#include "mono/monocypher.h"
+
+# define LERR(msg) return luaL_error(L, msg)
+
+// defined in lzma/lualzma.c
+void lzma_checkopts(lua_State *L, int idx,
+		int *level, int *dictsize, int *threads);
+int lzma_compressbuf(unsigned char *buf, size_t bufln,
+		const unsigned char *s, size_t sln,
+		int level, int dictsize, int threads, size_t *cln);
+
+#define FUTURE_MT "luazen.future"
+
+enum { OP_LZMA, OP_ARGON2I, OP_ENCRYPT, OP_BLAKE2B };
+enum { QUEUED, RUNNING, DONE };
+
+typedef struct job {
+	struct job *next;	// next job in the queue
+	int op;
+	int state;		// QUEUED, RUNNING or DONE (see below)
+	int efd;		// eventfd, or -1 when the future is closed
+	int r;			// lzma error code
+	pid_t pid;		// process which submitted the job
+	const unsigned char *m;	// input (pinned by the future)
+	size_t mln;
+	const unsigned char *salt;	// argon2i salt (pinned)
+	size_t saltln;
+	unsigned char *out;	// output buffer (malloc)
+	size_t outln;		// output length (max length before run)
+	void *work;		// argon2i work area (malloc)
+	int level, dictsize, threads;	// lzma options
+	int nkb, niters;		// argon2i parameters
+	unsigned char key[64];	// encrypt key or blake2b key
+	size_t keyln;
+	unsigned char nonce[24];
+} job;
+
+// the state is changed from QUEUED to RUNNING or DONE with the queue
+// lock held. It is set to DONE by the worker with a release store, so
+// that the output is visible to a thread which reads DONE.
+
+//----------------------------------------------------------------------
+// the worker pool
+
+static pthread_mutex_t qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qcond = PTHREAD_COND_INITIALIZER;
+static job *qhead, *qtail;	// the job queue
+static int nworkers, nidle, maxworkers;
+static pid_t poolpid;		// the process which owns the pool
+
+static void runjob(job *j) {
+	switch (j->op) {
+	case OP_LZMA:
+		j->r = lzma_compressbuf(j->out, j->outln, j->m, j->mln,
+			j->level, j->dictsize, j->threads, &j->outln);
+		break;
+	case OP_ARGON2I:
+		crypto_argon2i_general(j->out, 32, j->work, j->nkb,
+			j->niters, j->m, j->mln, j->salt, j->saltln,
+			"", 0, "", 0);
+		break;
+	case OP_ENCRYPT:
+		// the nonce increment has been added in encrypt_async()
+		crypto_lock(j->out + j->mln, j->out, j->key, j->nonce,
+			j->m, j->mln);
+		break;
+	case OP_BLAKE2B:
+		crypto_blake2b_general(j->out, j->outln, j->key, j->keyln,
+			j->m, j->mln);
+		break;
+	}
+}
+
+static void jobdone(job *j) {
+	// wake up the poll/epoll waiters and mark the job as done. 
+	// The job must not be used after it is done (the future may
+	// be closed), so the eventfd is written first.
+	uint64_t one = 1;
+	while (write(j->efd, &one, 8) < 0 && errno == EINTR) {}
+	__atomic_store_n(&j->state, DONE, __ATOMIC_RELEASE);
+}
+
+static void *worker(void *arg) {
+	job *j;
+	(void)arg;
+	pthread_mutex_lock(&qlock);
+	while (1) {
+		while (qhead == NULL) {
+			nidle++;
+			pthread_cond_wait(&qcond, &qlock);
+			nidle--;
+		}
+		j = qhead;
+		qhead = j->next;
+		if (qhead == NULL) qtail = NULL;
+		j->state = RUNNING;
+		pthread_mutex_unlock(&qlock);
+		runjob(j);
+		jobdone(j);
+		pthread_mutex_lock(&qlock);
+	}
+	return NULL;
+}
+
+static int startworker(void) {
+	// start a detached worker thread (with the qlock held). the
+	// signals are blocked in the worker so that they are handled
+	// by the interpreter thread. return 0, or -1 on error
+	pthread_t th;
+	pthread_attr_t attr;
+	sigset_t all, old;
+	int r;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	r = pthread_create(&th, &attr, worker, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+	if (r != 0) return -1;
+	nworkers++;
+	return 0;
+}
+
+// fork handlers: the queue is locked across the fork so that it is
+// consistent in the child. The child has no worker: the pool is reset,
+// and the jobs of the parent are lost (see lost())
+
+static void prefork(void) { pthread_mutex_lock(&qlock); }
+
+static void postfork_parent(void) { pthread_mutex_unlock(&qlock); }
+
+static void postfork_child(void) {
+	pthread_mutex_init(&qlock, NULL);
+	pthread_cond_init(&qcond, NULL);
+	qhead = qtail = NULL;
+	nworkers = nidle = 0;
+	poolpid = getpid();
+}
+
+static int lost(job *j) {
+	// true if the job was submitted by a parent process, and will
+	// never be done
+	return j->pid != poolpid 
+		&& __atomic_load_n(&j->state, __ATOMIC_ACQUIRE) != DONE;
+}
+
+static void submit(job *j) {
+	// queue the job. If no worker can be started, the job is run
+	// in the calling thread.
+	pthread_mutex_lock(&qlock);
+	if (maxworkers == 0) {
+		maxworkers = sysconf(_SC_NPROCESSORS_ONLN);
+		if (maxworkers < 1) maxworkers = 1;
+		poolpid = getpid();
+		pthread_atfork(prefork, postfork_parent, postfork_child);
+	}
+	j->state = QUEUED;
+	j->pid = poolpid;
+	if (nidle == 0 && nworkers < maxworkers) startworker();
+	if (nworkers == 0) {
+		j->state = RUNNING;
+		pthread_mutex_unlock(&qlock);
+		runjob(j);
+		jobdone(j);
+		return;
+	}
+	j->next = NULL;
+	if (qtail) qtail->next = j; else qhead = j;
+	qtail = j;
+	pthread_cond_signal(&qcond);
+	pthread_mutex_unlock(&qlock);
+}
+
+static void cancel(job *j) {
+	// remove the job from the queue if it has not been started
+	job **p;
+	pthread_mutex_lock(&qlock);
+	if (j->state == QUEUED && j->pid == poolpid) {
+		for (p = &qhead; *p != j; p = &(*p)->next) {}
+		*p = j->next;
+		if (qtail == j) {
+			qtail = NULL;
+			for (p = &qhead; *p; p = &(*p)->next) qtail = *p;
+		}
+		j->state = DONE;
+	}
+	pthread_mutex_unlock(&qlock);
+}
+
+static int waitjob(job *j) {
+	// return 0, or -1 if the job is lost
+	struct pollfd pfd;
+	while (__atomic_load_n(&j->state, __ATOMIC_ACQUIRE) != DONE) {
+		if (lost(j)) return -1;
+		pfd.fd = j->efd;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, -1);
+	}
+	return 0;
+}
+
+static void unpin(lua_State *L, int idx, int uv) {
+	// release the input pinned as user value uv of the future at
+	// stack index idx (see pin())
+	slbuf *b;
+	lua_getiuservalue(L, idx, uv);
+	if ((b = slbuf_test(L, -1)) != NULL) b->nrefs--;
+	lua_pop(L, 1);
+	lua_pushnil(L);
+	lua_setiuservalue(L, idx, uv);
+}
+
+static void closejob(lua_State *L, int idx, job *j) {
+	// wait for or cancel the job, free its resources and release
+	// the pinned inputs
+	if (j->efd < 0) return;
+	cancel(j);
+	waitjob(j);
+	close(j->efd);
+	j->efd = -1;
+	free(j->out);
+	free(j->work);
+	j->out = j->work = NULL;
+	unpin(L, idx, 1);
+	unpin(L, idx, 2);
+}
+
+//----------------------------------------------------------------------
+// future objects
+
+static job *newjob(lua_State *L, int op, size_t outln) {
+	// push a new future. the output buffer is allocated here so
+	// that an allocation failure is reported to the caller.
+	job *j = lua_newuserdatauv(L, sizeof(job), 2);
+	memset(j, 0, sizeof(job));
+	j->efd = -1;
+	luaL_setmetatable(L, FUTURE_MT);
+	j->op = op;
+	j->state = DONE;	// until it is submitted
+	j->outln = outln;
+	j->out = malloc(outln);
+	if (j->out == NULL) luaL_error(L, "not enough memory");
+	j->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (j->efd < 0) {
+		free(j->out);
+		j->out = NULL;
+		luaL_error(L, "eventfd: %s", strerror(errno));
+	}
+	return j;
+}
+
+static void pin(lua_State *L, int idx, int uv) {
+	// keep the input at index idx with the future (on the top).
+	// a buffer cannot be unmapped until the future is closed
+	slbuf *b = slbuf_test(L, idx);
+	if (b) b->nrefs++;
+	lua_pushvalue(L, idx);
+	lua_setiuservalue(L, -2, uv);
+}
+
+static job *checkfuture(lua_State *L) {
+	job *j = luaL_checkudata(L, 1, FUTURE_MT);
+	if (j->efd < 0) luaL_error(L, "future is closed");
+	return j;
+}
+
+static int ll_future_fd(lua_State *L) {
+	// lua api: fu:fd() => fd
+	job *j = checkfuture(L);
+	lua_pushinteger(L, j->efd);
+	return 1;
+}
+
+static int ll_future_ready(lua_State *L) {
+	// lua api: fu:ready() => boolean
+	// (as the fd, so that ready() is true when the fd is readable)
+	job *j = checkfuture(L);
+	struct pollfd pfd;
+	pfd.fd = j->efd;
+	pfd.events = POLLIN;
+	lua_pushboolean(L, poll(&pfd, 1, 0) == 1);
+	return 1;
+}
+
+static int ll_future_result(lua_State *L) {
+	// lua api: fu:result() => results of the synchronous function
+	job *j = checkfuture(L);
+	int n = 1;
+	if (waitjob(j) != 0) {
+		closejob(L, 1, j);
+		LERR("future of the parent process (forked)");
+	}
+	if (j->op == OP_LZMA && j->r != 0) {
+		lua_pushnil (L);
+		lua_pushliteral(L, "lzma error");
+		lua_pushinteger(L, j->r);
+		n = 3;
+	} else lua_pushlstring(L, j->out, j->outln);
+	closejob(L, 1, j);
+	return n;
+}
+
+static int ll_future_close(lua_State *L) {
+	// lua api: fu:close()
+	job *j = luaL_checkudata(L, 1, FUTURE_MT);
+	closejob(L, 1, j);
+	return 0;
+}
+
+static const struct luaL_Reg future_methods[] = {
+	{"fd", ll_future_fd},
+	{"ready", ll_future_ready},
+	{"result", ll_future_result},
+	{"close", ll_future_close},
+	{NULL, NULL},
+};
+
+static void newmetatable(lua_State *L) {
+	if (luaL_newmetatable(L, FUTURE_MT)) {
+		luaL_setfuncs(L, future_methods, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, ll_future_close);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_pop(L, 1);
+}
+
+//----------------------------------------------------------------------
+// async functions
+
+int ll_lzma_async(lua_State *L) {
+	// Lua API:  lzma_async(s [, opts]) => future
+	// the future result is the same as lzma(s, opts)
+	size_t sln;
+	int level = 5, dictsize = 0, threads = 1;
+	const char *s = slbuf_checkdata(L, 1, &sln);
+	job *j;
+	if (sln >= 0xffffffff) LERR("string too long");
+	lzma_checkopts(L, 2, &level, &dictsize, &threads);
+	newmetatable(L);
+	j = newjob(L, OP_LZMA, sln + (sln >> 3) + 16384); // as lzma()
+	pin(L, 1, 1);
+	j->m = s;
+	j->mln = sln;
+	j->level = level;
+	j->dictsize = dictsize;
+	j->threads = threads;
+	submit(j);
+	return 1;
+}
+
+int ll_argon2i_async(lua_State *L) {
+	// Lua API: argon2i_async(pw, salt, nkb, niters) => future
+	// the future result is the same as argon2i(pw, salt, nkb, niters)
+	size_t pwln, saltln;
+	const char *pw = luaL_checklstring(L, 1, &pwln);
+	const char *salt = luaL_checklstring(L, 2, &saltln);
+	int nkb = luaL_checkinteger(L, 3);
+	int niters = luaL_checkinteger(L, 4);
+	job *j;
+	if (nkb < 8 || niters < 1) LERR("bad argon2i parameters");
+	newmetatable(L);
+	j = newjob(L, OP_ARGON2I, 32);
+	j->work = malloc((size_t)nkb * 1024);
+	if (j->work == NULL) LERR("not enough memory");
+	pin(L, 1, 1);
+	pin(L, 2, 2);
+	j->m = pw;
+	j->mln = pwln;
+	j->salt = salt;
+	j->saltln = saltln;
+	j->nkb = nkb;
+	j->niters = niters;
+	submit(j);
+	return 1;
+}
+
+int ll_encrypt_async(lua_State *L) {
+	// Lua API: encrypt_async(k, n, m [, ninc]) => future
+	// the future result is the same as encrypt(k, n, m, ninc)
+	size_t kln, nln, mln;
+	const char *k = luaL_checklstring(L, 1, &kln);
+	const char *n = luaL_checklstring(L, 2, &nln);
+	const char *m = slbuf_checkdata(L, 3, &mln);
+	uint64_t ninc = luaL_optinteger(L, 4, 0), n8;
+	job *j;
+	if (nln != 24) LERR("bad nonce size");
+	if (kln != 32) LERR("bad key size");
+	newmetatable(L);
+	j = newjob(L, OP_ENCRYPT, mln + 16);
+	pin(L, 3, 1);
+	j->m = m;
+	j->mln = mln;
+	memcpy(j->key, k, 32);
+	// actual nonce = n + ninc (as encrypt())
+	memcpy(j->nonce, n, 24);
+	memcpy(&n8, j->nonce, 8);
+	n8 += ninc;
+	memcpy(j->nonce, &n8, 8);
+	submit(j);
+	return 1;
+}
+
+int ll_blake2b_async(lua_State *L) {
+	// Lua API: blake2b_async(m [, diglen [, key]]) => future
+	// the future result is the same as blake2b(m, diglen, key)
+	size_t mln, keyln = 0;
+	const char *m = slbuf_checkdata(L, 1, &mln);
+	int digln = luaL_optinteger(L, 2, 64);
+	const char *key = luaL_optlstring(L, 3, NULL, &keyln);
+	job *j;
+	if (keyln > 64) LERR("bad key size");
+	if ((digln < 1)||(digln > 64)) LERR("bad digest size");
+	newmetatable(L);
+	j = newjob(L, OP_BLAKE2B, digln);
+	pin(L, 1, 1);
+	j->m = m;
+	j->mln = mln;
+	if (keyln) memcpy(j->key, key, keyln);
+	j->keyln = keyln;
+	submit(j);
+	return 1;
+}
@@ -0,0 +1,247 @@
+/* LzFindMt.c -- multithreaded Match finder for LZ algorithms
+
+slua version - 2026-10-18 - Public domain
+
+See LzFindMt.h. The helper thread and the encoder thread share a ring
+of 32-bit words. For each input position, the helper thread writes a
+record: the number n of following words, then the n words returned by
+the match finder GetMatches() function (pairs of length, distance).
+
+The write and read positions are 64-bit word counters. They are
+exchanged under the mutex once per batch of kMtBatchSize words, so
+that the threads do not synchronize for each position.
+*/
+
+#include "Precomp.h"
+
+/* the module is empty in a single-thread build */
+#ifndef _7ZIP_ST
+
+#include "LzFindMt.h"
+
+#define kMtRingSize ((UInt32)1 << 20)
+#define kMtBatchSize ((UInt32)1 << 12)
+
+/* largest record: count + (LZMA_MATCH_LEN_MAX * 2 + 2) words */
+#define kMtMaxRecord (1 + 273 * 2 + 2)
+
+static void MtPublishRead(CMatchFinderMt *p)
+{
+  pthread_mutex_lock(&p->lock);
+  p->sharedReadPos = p->readPos;
+  if (p->writerWaits)
+    pthread_cond_signal(&p->canWrite);
+  pthread_mutex_unlock(&p->lock);
+  p->readPublished = p->readPos;
+}
+
+static void MtWaitData(CMatchFinderMt *p)
+{
+  pthread_mutex_lock(&p->lock);
+  p->sharedReadPos = p->readPos;
+  if (p->writerWaits)
+    pthread_cond_signal(&p->canWrite);
+  while (p->sharedWritePos == p->readPos && !p->finished)
+  {
+    p->readerWaits = 1;
+    pthread_cond_wait(&p->canRead, &p->lock);
+    p->readerWaits = 0;
+  }
+  p->readLimit = p->sharedWritePos;
+  pthread_mutex_unlock(&p->lock);
+  p->readPublished = p->readPos;
+}
+
+/* publish the write position, wait until a full record can be
+   written at wpos. return 1 if the thread must stop */
+static int MtPublishWrite(CMatchFinderMt *p, UInt64 wpos, UInt64 *wlimit)
+{
+  int stop;
+  pthread_mutex_lock(&p->lock);
+  p->sharedWritePos = wpos;
+  if (p->readerWaits)
+    pthread_cond_signal(&p->canRead);
+  while (!p->stop && wpos + kMtMaxRecord > p->sharedReadPos + kMtRingSize)
+  {
+    p->writerWaits = 1;
+    pthread_cond_wait(&p->canWrite, &p->lock);
+    p->writerWaits = 0;
+  }
+  *wlimit = p->sharedReadPos + kMtRingSize;
+  stop = p->stop;
+  pthread_mutex_unlock(&p->lock);
+  return stop;
+}
+
+static void *MtThreadFunc(void *arg)
+{
+  CMatchFinderMt *p = (CMatchFinderMt *)arg;
+  CMatchFinder *mf = p->MatchFinder;
+  UInt32 *ring = p->ring;
+  UInt32 mask = p->ringMask;
+  UInt32 d[kMtMaxRecord];
+  UInt64 wpos = 0, published = 0, wlimit = kMtRingSize;
+
+  while (p->mf.GetNumAvailableBytes(mf) != 0)
+  {
+    UInt32 n, i;
+    if (wpos + kMtMaxRecord > wlimit || wpos - published >= kMtBatchSize)
+    {
+      if (MtPublishWrite(p, wpos, &wlimit))
+        return NULL;
+      published = wpos;
+    }
+    n = p->mf.GetMatches(mf, d);
+    ring[(size_t)(wpos & mask)] = n;
+    for (i = 0; i < n; i++)
+      ring[(size_t)((wpos + 1 + i) & mask)] = d[i];
+    wpos += 1 + n;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  p->sharedWritePos = wpos;
+  p->finished = 1;
+  if (p->readerWaits)
+    pthread_cond_signal(&p->canRead);
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+static void MtStopThread(CMatchFinderMt *p)
+{
+  if (!p->threadCreated)
+    return;
+  pthread_mutex_lock(&p->lock);
+  p->stop = 1;
+  pthread_cond_signal(&p->canWrite);
+  pthread_mutex_unlock(&p->lock);
+  pthread_join(p->thread, NULL);
+  p->threadCreated = 0;
+}
+
+void MatchFinderMt_Construct(CMatchFinderMt *p)
+{
+  p->ring = NULL;
+  p->ringMask = kMtRingSize - 1;
+  p->threadCreated = 0;
+  p->MatchFinder = NULL;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->canRead, NULL);
+  pthread_cond_init(&p->canWrite, NULL);
+}
+
+void MatchFinderMt_Destruct(CMatchFinderMt *p, ISzAllocPtr alloc)
+{
+  MtStopThread(p);
+  ISzAlloc_Free(alloc, p->ring);
+  p->ring = NULL;
+  pthread_cond_destroy(&p->canWrite);
+  pthread_cond_destroy(&p->canRead);
+  pthread_mutex_destroy(&p->lock);
+}
+
+SRes MatchFinderMt_Create(CMatchFinderMt *p, UInt32 historySize, UInt32 keepAddBufferBefore,
+    UInt32 matchMaxLen, UInt32 keepAddBufferAfter, ISzAllocPtr alloc)
+{
+  if (!p->ring)
+  {
+    p->ring = (UInt32 *)ISzAlloc_Alloc(alloc, kMtRingSize * sizeof(UInt32));
+    if (!p->ring)
+      return SZ_ERROR_MEM;
+  }
+  if (!MatchFinder_Create(p->MatchFinder, historySize, keepAddBufferBefore,
+      matchMaxLen, keepAddBufferAfter, alloc))
+    return SZ_ERROR_MEM;
+  MatchFinder_CreateVTable(p->MatchFinder, &p->mf);
+  return SZ_OK;
+}
+
+void MatchFinderMt_ReleaseStream(CMatchFinderMt *p)
+{
+  MtStopThread(p);
+}
+
+static void MatchFinderMt_Init(CMatchFinderMt *p)
+{
+  CMatchFinder *mf = p->MatchFinder;
+  MtStopThread(p);
+  p->mf.Init(mf);
+  p->pointerToCurPos = Inline_MatchFinder_GetPointerToCurrentPos(mf);
+  p->numAvail = Inline_MatchFinder_GetNumAvailableBytes(mf);
+  p->readPos = p->readLimit = p->readPublished = 0;
+  p->sharedWritePos = p->sharedReadPos = 0;
+  p->readerWaits = p->writerWaits = 0;
+  p->finished = p->stop = 0;
+  /* if the thread cannot be created, the base match finder is
+     used directly from the encoder thread */
+  p->threadCreated = (pthread_create(&p->thread, NULL, MtThreadFunc, p) == 0);
+}
+
+static UInt32 MatchFinderMt_GetNumAvailableBytes(CMatchFinderMt *p)
+{
+  return p->numAvail;
+}
+
+static const Byte *MatchFinderMt_GetPointerToCurrentPos(CMatchFinderMt *p)
+{
+  return p->pointerToCurPos;
+}
+
+/* read the record for the current position. copy the matches to
+   'distances' if not NULL. return the number of words */
+static UInt32 MtReadRecord(CMatchFinderMt *p, UInt32 *distances)
+{
+  UInt32 n, i;
+  UInt32 mask = p->ringMask;
+  if (p->readPos == p->readLimit)
+  {
+    MtWaitData(p);
+    if (p->readPos == p->readLimit)
+      return 0;   /* no more data (not used by the encoder) */
+  }
+  n = p->ring[(size_t)(p->readPos & mask)];
+  if (distances)
+    for (i = 0; i < n; i++)
+      distances[i] = p->ring[(size_t)((p->readPos + 1 + i) & mask)];
+  p->readPos += 1 + n;
+  if (p->readPos - p->readPublished >= kMtBatchSize)
+    MtPublishRead(p);
+  p->pointerToCurPos++;
+  p->numAvail--;
+  return n;
+}
+
+static UInt32 MatchFinderMt_GetMatches(CMatchFinderMt *p, UInt32 *distances)
+{
+  UInt32 n;
+  if (p->threadCreated)
+    return MtReadRecord(p, distances);
+  n = p->mf.GetMatches(p->MatchFinder, distances);
+  p->pointerToCurPos++;
+  p->numAvail--;
+  return n;
+}
+
+static void MatchFinderMt_Skip(CMatchFinderMt *p, UInt32 num)
+{
+  if (p->threadCreated)
+  {
+    while (num-- != 0)
+      MtReadRecord(p, NULL);
+    return;
+  }
+  p->mf.Skip(p->MatchFinder, num);
+  p->pointerToCurPos += num;
+  p->numAvail -= num;
+}
+
+void MatchFinderMt_CreateVTable(CMatchFinderMt *p, IMatchFinder *vTable)
+{
+  vTable->Init = (Mf_Init_Func)MatchFinderMt_Init;
+  vTable->GetNumAvailableBytes = (Mf_GetNumAvailableBytes_Func)MatchFinderMt_GetNumAvailableBytes;
+  vTable->GetPointerToCurrentPos = (Mf_GetPointerToCurrentPos_Func)MatchFinderMt_GetPointerToCurrentPos;
+  vTable->GetMatches = (Mf_GetMatches_Func)MatchFinderMt_GetMatches;
+  vTable->Skip = (Mf_Skip_Func)MatchFinderMt_Skip;
+}
+
+#endif
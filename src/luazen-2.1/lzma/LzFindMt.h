@@ -0,0 +1,71 @@
+/* LzFindMt.h -- multithreaded Match finder for LZ algorithms
+
+slua version - 2026-10-18 - Public domain
+
+This is a simplified replacement for the LzFindMt module of the LZMA
+SDK, which is not included in this tree. It implements the interface
+used by LzmaEnc.c (MatchFinderMt_*) with a single helper thread:
+
+- the helper thread runs the regular binary tree match finder
+  (LzFind.c) ahead of the encoder, and stores the matches found at
+  each position in a ring buffer,
+- the encoder thread reads the matches from the ring buffer.
+
+The matches are exactly those the single-thread match finder would
+return, so the compressed output is identical.
+
+The helper thread reads the input buffer while the encoder also reads
+it, so the input data must not move: the encoder uses this match
+finder only for one-call (direct input) compression, ie. LzmaEncode()
+and LzmaCompress(). The incremental encoder stays single-thread.
+*/
+
+#ifndef __LZ_FIND_MT_H
+#define __LZ_FIND_MT_H
+
+#include <pthread.h>
+
+#include "LzFind.h"
+
+EXTERN_C_BEGIN
+
+typedef struct _CMatchFinderMt
+{
+  /* consumer (encoder thread) */
+  const Byte *pointerToCurPos;
+  UInt32 numAvail;
+  UInt64 readPos;      /* index of the next word to read in the ring */
+  UInt64 readLimit;    /* words available up to this index */
+  UInt64 readPublished;
+
+  UInt32 *ring;        /* match records: count, then (len, dist) pairs */
+  UInt32 ringMask;
+
+  /* shared state, protected by 'lock' */
+  pthread_mutex_t lock;
+  pthread_cond_t canRead;
+  pthread_cond_t canWrite;
+  UInt64 sharedWritePos;
+  UInt64 sharedReadPos;
+  int readerWaits;
+  int writerWaits;
+  int finished;        /* the helper thread has processed all data */
+  int stop;            /* the encoder asks the helper thread to stop */
+  int threadCreated;
+  pthread_t thread;
+
+  /* producer (helper thread) */
+  IMatchFinder mf;
+  CMatchFinder *MatchFinder;
+} CMatchFinderMt;
+
+void MatchFinderMt_Construct(CMatchFinderMt *p);
+void MatchFinderMt_Destruct(CMatchFinderMt *p, ISzAllocPtr alloc);
+SRes MatchFinderMt_Create(CMatchFinderMt *p, UInt32 historySize, UInt32 keepAddBufferBefore,
+    UInt32 matchMaxLen, UInt32 keepAddBufferAfter, ISzAllocPtr alloc);
+void MatchFinderMt_CreateVTable(CMatchFinderMt *p, IMatchFinder *vTable);
+void MatchFinderMt_ReleaseStream(CMatchFinderMt *p);
+
+EXTERN_C_END
+
+#endif
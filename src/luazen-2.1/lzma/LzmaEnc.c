@@ -2563,7 +2563,10 @@ static SRes LzmaEnc_Alloc(CLzmaEnc *p, UInt32 keepWindowSize, ISzAllocPtr alloc,
     return SZ_ERROR_MEM;
 
   #ifndef _7ZIP_ST
-  p->mtMode = (p->multiThread && !p->fastMode && (p->matchFinderBase.btMode != 0));
+  /* slua: the match finder thread reads the input buffer, so it is
+     used only when the whole input is in memory (direct input) */
+  p->mtMode = (p->multiThread && !p->fastMode && (p->matchFinderBase.btMode != 0)
+      && p->matchFinderBase.directInput);
   #endif
 
   {
@@ -2887,6 +2890,29 @@ SRes LzmaEnc_Encode(CLzmaEncHandle pp, ISeqOutStream *outStream, ISeqInStream *i
 }
 
 
+/* slua: incremental encoding. The caller drives the encoder one block
+   at a time, and must ensure that enough input is available to the
+   inStream (see LzmaEnc.h) */
+
+SRes LzmaEnc_StreamPrepare(CLzmaEncHandle pp, ISeqOutStream *outStream, ISeqInStream *inStream,
+    ISzAllocPtr alloc, ISzAllocPtr allocBig)
+{
+  return LzmaEnc_Prepare(pp, outStream, inStream, alloc, allocBig);
+}
+
+
+SRes LzmaEnc_StreamCodeStep(CLzmaEncHandle pp, UInt64 *inProcessed, BoolInt *finished)
+{
+  CLzmaEnc *p = (CLzmaEnc *)pp;
+  SRes res = LzmaEnc_CodeOneBlock(p, 0, 0);
+  *inProcessed = p->nowPos64;
+  *finished = p->finished;
+  if (res != SZ_OK || p->finished)
+    LzmaEnc_Finish(p);
+  return res;
+}
+
+
 SRes LzmaEnc_WriteProperties(CLzmaEncHandle pp, Byte *props, SizeT *size)
 {
   CLzmaEnc *p = (CLzmaEnc *)pp;
@@ -65,6 +65,23 @@ SRes LzmaEnc_MemEncode(CLzmaEncHandle p, Byte *dest, SizeT *destLen, const Byte
     int writeEndMark, ICompressProgress *progress, ISzAllocPtr alloc, ISzAllocPtr allocBig);
 
 
+/* ---------- Incremental Interface (slua) ---------- */
+
+/* LzmaEnc_StreamCodeStep encodes the next block (about 128 KB) of input.
+   The inStream Read callback must not return 0 bytes (end of stream)
+   before the real end of input: the caller must keep at least
+   LZMA_STREAM_LOOKAHEAD bytes not yet encoded available in inStream
+   before each call, except after the end of input.
+   *inProcessed is set to the total number of input bytes encoded.
+   *finished is set when the end of stream has been encoded. */
+
+#define LZMA_STREAM_LOOKAHEAD (1 << 18)
+
+SRes LzmaEnc_StreamPrepare(CLzmaEncHandle p, ISeqOutStream *outStream, ISeqInStream *inStream,
+    ISzAllocPtr alloc, ISzAllocPtr allocBig);
+SRes LzmaEnc_StreamCodeStep(CLzmaEncHandle p, UInt64 *inProcessed, BoolInt *finished);
+
+
 /* ---------- One Call Interface ---------- */
 
 SRes LzmaEncode(Byte *dest, SizeT *destLen, const Byte *src, SizeT srcLen,
@@ -23,11 +23,14 @@
 #include "lua.h"
 #include "lauxlib.h"
 
-// single thread (no multi-thread support)
-//~ #define _7ZIP_ST   --- defined in the makefile
+// single thread by default: _7ZIP_ST is defined in the makefile.
+// without it, the multi-thread match finder (LzFindMt.c) is used
+// when lzma() is called with the option threads=2
 
 #include "LzmaLib.h"
 
+#include "slbuf.h"
+
 
 //----------------------------------------------------------------------
 // compatibility with Lua 5.2  --and lua 5.3, added 150621
@@ -56,6 +59,7 @@
 //----------------------------------------------------------------------
 //-- lua binding
 
+#define LERR(msg) return luaL_error(L, msg)
 
 static uint32_t load32_le(const uint8_t s[4]) {
     return (uint32_t)s[0]
@@ -93,21 +97,37 @@ static void store64_le(uint8_t out[8], uint64_t in) {
     out[7] = (in >> 56) & 0xff;
 }
 
-int ll_lzma(lua_State *L) {
-	// Lua API:  compress(s) => c
-	// compress string s, return compressed string c
-	// or nil, error msg, lzma error number -- in case of error
-	//
-	size_t sln, cln, bufln, propssize;
-	int r;
-	const char *s = luaL_checklstring(L, 1, &sln);	
-	assert(sln < 0xffffffff); // fit a uint32
+static void getopt_int(lua_State *L, int idx, const char *name, 
+		int *val, int min, int max) {
+	// set *val to field 'name' of table at idx if it is present
+	lua_Integer i;
+	if (lua_getfield(L, idx, name) != LUA_TNIL) {
+		i = luaL_checkinteger(L, -1);
+		if (i < min || i > max) 
+			luaL_error(L, "lzma option %s out of range", name);
+		*val = (int)i;
+	}
+	lua_pop(L, 1);
+}
 
-	// allocate compression buffer:
-	// bufln is buffer length. suggested value is input size + 11% +16kb
-	// (we use 'sln + sln>>3', ie input length +12.5%)
-	bufln = sln + (sln >> 3) + 16384; 
-	unsigned char * buf = lua_newuserdata(L, bufln);
+void lzma_checkopts(lua_State *L, int idx, 
+		int *level, int *dictsize, int *threads) {
+	// read the lzma() options table at idx if it is present
+	if (lua_isnoneornil(L, idx)) return;
+	luaL_checktype(L, idx, LUA_TTABLE);
+	getopt_int(L, idx, "level", level, 0, 9);
+	getopt_int(L, idx, "dictsize", dictsize, 1<<12, 1<<30);
+	getopt_int(L, idx, "threads", threads, 1, 2);
+}
+
+int lzma_compressbuf(unsigned char *buf, size_t bufln, 
+		const unsigned char *s, size_t sln, 
+		int level, int dictsize, int threads, size_t *cln) {
+	// compress s in buf (bufln bytes). set *cln to the length of the
+	// result (including the header). return 0, or the LZMA error
+	// (also used by the luazen async functions, see lzasync.c)
+	size_t propssize;
+	int r;
 
 	// buffer format: 
 	// 2020-10-24 - use a format as can be uncompressed by the 
@@ -119,26 +139,74 @@ int ll_lzma(lua_State *L) {
 
 	// cln, propssize _MUST_ be initialized before calling LzmaCompress
 	propssize = LZMA_PROPS_SIZE; // = 5
-	cln = bufln - LZMA_PROPS_SIZE - 8; // max available space in buf
+	*cln = bufln - LZMA_PROPS_SIZE - 8; // max available space in buf
 	
 	r = LzmaCompress(
-		buf + LZMA_PROPS_SIZE + 8, &cln,  // dest, destlen
+		buf + LZMA_PROPS_SIZE + 8, cln,  // dest, destlen
 		s, sln, // src, srclen
 		buf, &propssize, // props, propslen
+		level,
+		dictsize, // 0 for the level default
 		
 		// !! DO NOT CHANGE THE FOLLOWING PARAMETERS !!
-		// (they are used to recognize lzma standard format
-		//  vs. the luazen lzma legacy format)
+		// (lc, lp, pb are used to recognize lzma standard 
+		//  format vs. the luazen lzma legacy format)
 		
-		5, // level 
-		(1<<24), // dict size
 		3, 	// lc
 		0, 	// lp
 		2,	// pb
-		32, 	// fb
-		1	// numthreads
+		-1, 	// fb (level default, 32 for level 5)
+		threads	// numthreads
 		);
+	if (r != 0) return r;
 	
+	// store  uncompressed string length (little endian)
+	store64_le(buf+LZMA_PROPS_SIZE, sln);
+	*cln += LZMA_PROPS_SIZE + 8;
+	return 0;
+}
+
+int ll_lzma(lua_State *L) {
+	// Lua API:  compress(s [, opts [, buf [, idx]]]) => c
+	// compress string s, return compressed string c
+	// or nil, error msg, lzma error number -- in case of error
+	// s may also be a buffer. If the optional buffer buf is 
+	// provided, c is written in buf at index idx (default 1) and 
+	// lzma() returns idx + #c instead of c.
+	// opts is an optional table with the following fields:
+	//	level: compression level, 0 to 9 (default 5)
+	//	dictsize: dictionary size, 4KB to 1GB (the default depends
+	//	  on the level, 16MB for level 5)
+	//	threads: 1 or 2 (default 1). With 2, the match finder
+	//	  runs in a separate thread. This requires a library 
+	//	  built without _7ZIP_ST (see the Makefile), else the 
+	//	  option is ignored. The result is the same.
+	//
+	size_t sln, cln, bufln, avail;
+	int r;
+	int level = 5, dictsize = 0, threads = 1;
+	luaL_Buffer b;
+	const char *s = slbuf_checkdata(L, 1, &sln);	
+	unsigned char *buf = slbuf_optout(L, 3, &avail);
+	assert(sln < 0xffffffff); // fit a uint32
+	lzma_checkopts(L, 2, &level, &dictsize, &threads);
+	lua_settop(L, 4);  // the result string buffer is above the args
+
+	// compression buffer: the output buffer, or the result string 
+	// buffer. 
+	// bufln is buffer length. suggested value is input size + 11% +16kb
+	// (we use 'sln + sln>>3', ie input length +12.5%)
+	// with an output buffer, LzmaCompress fails if the compressed
+	// output does not fit
+	bufln = sln + (sln >> 3) + 16384; 
+	if (buf) {
+		if (avail < LZMA_PROPS_SIZE + 8) LERR("buffer too small");
+		bufln = avail;
+	} else buf = luaL_buffinitsize(L, &b, bufln);
+
+	r = lzma_compressbuf(buf, bufln, s, sln, level, dictsize, threads,
+		&cln);
+
 	if (r != 0) {
 		lua_pushnil (L);
 		lua_pushliteral(L, "lzma error");
@@ -146,20 +214,26 @@ int ll_lzma(lua_State *L) {
 		return 3;         
 	}
 	
-	// store  uncompressed string length (little endian)
-	store64_le(buf+LZMA_PROPS_SIZE, sln);
-	lua_pushlstring (L, buf, LZMA_PROPS_SIZE + 8 + cln); 	
+	if (lua_isnoneornil(L, 3)) 
+		luaL_pushresultsize(&b, cln);
+	else 
+		lua_pushinteger(L, luaL_optinteger(L, 4, 1) + cln);
 	return 1;
 } //lzma()
 
 int ll_unlzma(lua_State *L) {
-	// Lua API:  uncompress(c) => s | nil, error msg
+	// Lua API:  uncompress(c [, buf [, idx]]) => s | nil, error msg
 	// decompress string c, return original string s
 	// or nil, error msg in case of decompression error
+	// c may also be a buffer. If the optional buffer buf is provided,
+	// s is written in buf at index idx (default 1) and unlzma() 
+	// returns idx + #s instead of s.
 	//
-	size_t sln, cln, bufln, dln;
+	size_t sln, cln, bufln, dln, avail;
 	int r;
-	const char *c = luaL_checklstring(L, 1, &cln);	
+	luaL_Buffer b;
+	const char *c = slbuf_checkdata(L, 1, &cln);	
+	unsigned char *out = slbuf_optout(L, 2, &avail);
 	uint64_t sln64;
 	
 	// LzmaUncompress parameters
@@ -171,8 +245,12 @@ int ll_unlzma(lua_State *L) {
 	size_t propsSize;
 	
 	// try to guess compressed string format (legacy or standard)
-	const char default_props[5] = {0x5d, 0, 0, 0, 1};
-	if (strncmp(c, default_props, 5) == 0) {
+	// both start with the props byte 0x5d (lc=3, lp=0, pb=2).
+	// legacy: 4-byte length, then props (0x5d at offset 4)
+	// standard: props, then dict size (its high byte at offset 4
+	// is never 0x5d for a valid dict size: 2^n or 3*2^n, <= 1GB)
+	if (cln >= LZMA_PROPS_SIZE + 8 
+		&& (uint8_t)c[0] == 0x5d && (uint8_t)c[4] != 0x5d) {
 		// standard format - set LzmaUncompress parameters
 		sln64 = load64_le(c + LZMA_PROPS_SIZE);
 		if (sln64 >= 1LL<<32) { 
@@ -197,7 +275,12 @@ int ll_unlzma(lua_State *L) {
 		props = c + 4;
 		propsSize = LZMA_PROPS_SIZE;
 	}
-	dest = lua_newuserdata(L, dln); // allocate buffer 
+	// decompress directly in the output buffer or the result string
+	lua_settop(L, 3);
+	if (out) {
+		if (avail < dln) LERR("buffer too small");
+		dest = out;
+	} else dest = luaL_buffinitsize(L, &b, dln);
 	r = LzmaUncompress(dest, destLen, src, srcLen, props, propsSize);
 	if (r != 0) {
 		lua_pushnil (L);
@@ -205,7 +288,640 @@ int ll_unlzma(lua_State *L) {
 		lua_pushinteger(L, r);
 		return 3;         
 	}
-	lua_pushlstring (L, dest, dln); 
+	if (out) lua_pushinteger(L, luaL_optinteger(L, 3, 1) + dln);
+	else luaL_pushresultsize(&b, dln);
 	return 1;
 } //unlzma()
 
+
+//----------------------------------------------------------------------
+// incremental (streaming) compression and decompression
+//
+// the encoder and decoder objects process the data chunk by chunk,
+// in constant memory. They use the standard .lzma format (the same
+// as lzma() above). When the uncompressed size is not known when
+// the encoder is created, it is stored as 0xffffffffffffffff and an
+// end marker is written at the end of the compressed stream 
+// (as the linux 'lzma' command does).
+// such a stream can be decompressed by the decoder object or the
+// 'unlzma' command, but not by unlzma() which requires a known size.
+
+#include <stddef.h>	// offsetof
+#include "Alloc.h"	// g_Alloc
+#include "LzmaEnc.h"
+#include "LzmaDec.h"
+
+#define LZENC_MT "luazen.lzma_encoder"
+#define LZDEC_MT "luazen.lzma_decoder"
+
+// decoder output is produced in chunks of this size
+#define LZDEC_CHUNK 65536
+
+typedef struct {
+	ISeqInStream vt_in;	// reads from the pending input
+	ISeqOutStream vt_out;	// appends to the output buffer
+	CLzmaEncHandle enc;
+	Byte *in;		// pending input is in[inpos .. inlen-1]
+	size_t inpos, inlen, incap;
+	Byte *out;		// compressed output not yet returned
+	size_t outlen, outcap;
+	uint64_t total;		// total input size so far
+	UInt64 done;		// number of input bytes encoded
+	uint64_t size;		// declared input size, or -1 (unknown)
+	int finished;
+	int error;		// an lzma error occurred: the encoder is unusable
+} lzenc;
+
+static SRes lzenc_read(const ISeqInStream *p, void *buf, size_t *size) {
+	lzenc *ze = (lzenc *)((char *)p - offsetof(lzenc, vt_in));
+	size_t n = ze->inlen - ze->inpos;
+	if (n > *size) n = *size;
+	if (n > 0) memcpy(buf, ze->in + ze->inpos, n);  // (in may be NULL)
+	ze->inpos += n;
+	*size = n;
+	return SZ_OK;
+}
+
+static int growbuf(Byte **buf, size_t *cap, size_t need) {
+	// ensure buf can contain need bytes. return 0 on failure
+	if (need <= *cap) return 1;
+	size_t newcap = *cap ? *cap : 65536;
+	while (newcap < need) newcap *= 2;
+	Byte *p = realloc(*buf, newcap);
+	if (p == NULL) return 0;
+	*buf = p;
+	*cap = newcap;
+	return 1;
+}
+
+static size_t lzenc_write(const ISeqOutStream *p, const void *buf, 
+		size_t size) {
+	lzenc *ze = (lzenc *)((char *)p - offsetof(lzenc, vt_out));
+	if (!growbuf(&ze->out, &ze->outcap, ze->outlen + size)) return 0;
+	memcpy(ze->out + ze->outlen, buf, size);
+	ze->outlen += size;
+	return size;
+}
+
+static int lzenc_append(lzenc *ze, const char *s, size_t sln) {
+	// append s to the pending input
+	if (ze->inpos > 0) {
+		memmove(ze->in, ze->in + ze->inpos, ze->inlen - ze->inpos);
+		ze->inlen -= ze->inpos;
+		ze->inpos = 0;
+	}
+	if (sln == 0) return 1;  // (in may still be NULL)
+	if (!growbuf(&ze->in, &ze->incap, ze->inlen + sln)) return 0;
+	memcpy(ze->in + ze->inlen, s, sln);
+	ze->inlen += sln;
+	ze->total += sln;
+	return 1;
+}
+
+static int lzenc_push(lua_State *L, lzenc *ze, int r) {
+	// push the available output, or nil, error msg, lzma error
+	if (r != SZ_OK) {
+		ze->error = 1;
+		lua_pushnil (L);
+		lua_pushliteral(L, "lzma error");
+		lua_pushinteger(L, r);
+		return 3;         
+	}
+	lua_pushlstring(L, (const char *)ze->out, ze->outlen);
+	ze->outlen = 0;
+	return 1;
+}
+
+static int lzenc_code(lua_State *L, int final) {
+	// common part of enc:update() and enc:finish()
+	size_t sln = 0;
+	int r = SZ_OK;
+	BoolInt finished = 0;
+	lzenc *ze = luaL_checkudata(L, 1, LZENC_MT);
+	const char *s = luaL_optlstring(L, 2, "", &sln);
+	if (ze->error) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "lzma encoder: previous error");
+		return 2;
+	}
+	if (ze->finished) LERR("lzma encoder: already finished");
+	if (!lzenc_append(ze, s, sln)) LERR("lzma encoder: not enough memory");
+	while (r == SZ_OK && !finished) {
+		if (!final && ze->total - ze->done < LZMA_STREAM_LOOKAHEAD)
+			break;
+		r = LzmaEnc_StreamCodeStep(ze->enc, &ze->done, &finished);
+	}
+	if (finished) ze->finished = 1;
+	if (final && r == SZ_OK && ze->size != (uint64_t)-1 
+			&& ze->size != ze->total) {
+		lua_pushnil (L);
+		lua_pushliteral(L, "lzma encoder: input size mismatch");
+		return 2;
+	}
+	return lzenc_push(L, ze, r);
+}
+
+static int ll_lzenc_update(lua_State *L) {
+	// Lua API: enc:update(s) => c | nil, error msg, lzma error number
+	// compress string s. return the compressed data available
+	// at this point (possibly an empty string)
+	return lzenc_code(L, 0);
+}
+
+static int ll_lzenc_finish(lua_State *L) {
+	// Lua API: enc:finish([s]) => c | nil, error msg [, lzma error]
+	// compress the optional last string s, and return the end of 
+	// the compressed stream. the encoder cannot be used after.
+	return lzenc_code(L, 1);
+}
+
+static int ll_lzenc_gc(lua_State *L) {
+	lzenc *ze = luaL_checkudata(L, 1, LZENC_MT);
+	if (ze->enc) LzmaEnc_Destroy(ze->enc, &g_Alloc, &g_Alloc);
+	free(ze->in);
+	free(ze->out);
+	ze->enc = NULL; ze->in = NULL; ze->out = NULL;
+	return 0;
+}
+
+static const struct luaL_Reg lzenc_methods[] = {
+	{"update", ll_lzenc_update},
+	{"finish", ll_lzenc_finish},
+	{"__gc", ll_lzenc_gc},
+	{NULL, NULL},
+};
+
+int ll_lzma_encoder(lua_State *L) {
+	// Lua API: lzma_encoder([size]) => enc
+	// return an lzma encoder object (see above)
+	// size is the total uncompressed size if it is known (then the
+	// output can also be decompressed with unlzma())
+	CLzmaEncProps props;
+	Byte header[LZMA_PROPS_SIZE + 8];
+	SizeT propssize = LZMA_PROPS_SIZE;
+	lua_Integer size = luaL_optinteger(L, 1, -1);
+	if (size < -1) LERR("lzma encoder: invalid size");
+	lzenc *ze = lua_newuserdatauv(L, sizeof(lzenc), 0);
+	memset(ze, 0, sizeof(lzenc));
+	if (luaL_newmetatable(L, LZENC_MT)) {
+		luaL_setfuncs(L, lzenc_methods, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	ze->vt_in.Read = lzenc_read;
+	ze->vt_out.Write = lzenc_write;
+	ze->size = (uint64_t) size;
+	ze->enc = LzmaEnc_Create(&g_Alloc);
+	if (ze->enc == NULL) LERR("lzma encoder: not enough memory");
+	// same parameters as lzma() (see the comments there)
+	LzmaEncProps_Init(&props);
+	props.level = 5;
+	props.dictSize = 1 << 24;
+	props.lc = 3; props.lp = 0; props.pb = 2; props.fb = 32;
+	props.numThreads = 1;
+	props.writeEndMark = (size == -1);
+	int r = LzmaEnc_SetProps(ze->enc, &props);
+	if (r == SZ_OK) r = LzmaEnc_WriteProperties(ze->enc, header, &propssize);
+	if (r == SZ_OK) {
+		if (size != -1) LzmaEnc_SetDataSize(ze->enc, size);
+		store64_le(header + LZMA_PROPS_SIZE, size);
+		lzenc_write(&ze->vt_out, header, sizeof(header));
+		r = LzmaEnc_StreamPrepare(ze->enc, &ze->vt_out, &ze->vt_in,
+			&g_Alloc, &g_Alloc);
+	}
+	if (r != SZ_OK) return lzenc_push(L, ze, r);
+	return 1;
+}
+
+typedef struct {
+	CLzmaDec dec;
+	Byte header[LZMA_PROPS_SIZE + 8];
+	int hdrlen;		// number of header bytes received
+	uint64_t size;		// uncompressed size or -1 (unknown)
+	uint64_t total;		// uncompressed bytes produced
+	int finished;
+	int error;		// invalid stream: the decoder is unusable
+} lzdec;
+
+static int lzdec_error(lua_State *L, lzdec *zd, const char *msg, int r) {
+	// put the decoder in the error state and return nil, msg [, r]
+	zd->error = 1;
+	zd->finished = 0;
+	lua_pushnil(L);
+	lua_pushstring(L, msg);
+	if (r == 0) return 2;
+	lua_pushinteger(L, r);
+	return 3;
+}
+
+static int ll_lzdec_update(lua_State *L) {
+	// Lua API: dec:update(c) => s, finished | nil, error msg
+	// decompress the compressed chunk c. return the decompressed
+	// data available at this point (possibly an empty string) and
+	// a boolean which is true when the end of the compressed stream 
+	// has been reached (any data after the end is ignored)
+	size_t cln;
+	luaL_Buffer b;
+	lzdec *zd = luaL_checkudata(L, 1, LZDEC_MT);
+	const Byte *c = (const Byte *) luaL_checklstring(L, 2, &cln);
+	if (zd->error) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "unlzma error: invalid stream");
+		return 2;
+	}
+	if (zd->hdrlen < (int)sizeof(zd->header)) {
+		size_t n = sizeof(zd->header) - zd->hdrlen;
+		if (n > cln) n = cln;
+		memcpy(zd->header + zd->hdrlen, c, n);
+		zd->hdrlen += n;
+		c += n;
+		cln -= n;
+		if (zd->hdrlen < (int)sizeof(zd->header)) {
+			lua_pushliteral(L, "");
+			lua_pushboolean(L, 0);
+			return 2;
+		}
+		if (LzmaDec_Allocate(&zd->dec, zd->header, LZMA_PROPS_SIZE, 
+				&g_Alloc) != SZ_OK) 
+			return lzdec_error(L, zd, 
+				"unlzma error: invalid header", 0);
+		LzmaDec_Init(&zd->dec);
+		zd->size = load64_le(zd->header + LZMA_PROPS_SIZE);
+		if (zd->size == 0) zd->finished = 1;
+	}
+	luaL_buffinit(L, &b);
+	while (!zd->finished) {
+		ELzmaStatus status;
+		ELzmaFinishMode fmode = LZMA_FINISH_ANY;
+		SizeT inln = cln;
+		SizeT outln = LZDEC_CHUNK;
+		if (zd->size != (uint64_t)-1 && zd->size - zd->total <= outln) {
+			outln = zd->size - zd->total;
+			fmode = LZMA_FINISH_END;
+		}
+		Byte *p = (Byte *) luaL_prepbuffsize(&b, outln);
+		int r = LzmaDec_DecodeToBuf(&zd->dec, p, &outln, c, &inln, 
+			fmode, &status);
+		c += inln;
+		cln -= inln;
+		zd->total += outln;
+		luaL_addsize(&b, outln);
+		if (r != SZ_OK) return lzdec_error(L, zd, "unlzma error", r);
+		if (status == LZMA_STATUS_FINISHED_WITH_MARK 
+				|| zd->total == zd->size)
+			zd->finished = 1;
+		else if (inln == 0 && outln == 0) 
+			break;	// need more input
+	}
+	luaL_pushresult(&b);
+	lua_pushboolean(L, zd->finished);
+	return 2;
+}
+
+static int ll_lzdec_finished(lua_State *L) {
+	// Lua API: dec:finished() => boolean | nil, error msg
+	// return true if the end of the compressed stream has been 
+	// reached (the stream is not truncated), or nil, error msg if
+	// the stream is invalid
+	lzdec *zd = luaL_checkudata(L, 1, LZDEC_MT);
+	if (zd->error) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "unlzma error: invalid stream");
+		return 2;
+	}
+	lua_pushboolean(L, zd->finished);
+	return 1;
+}
+
+static int ll_lzdec_gc(lua_State *L) {
+	lzdec *zd = luaL_checkudata(L, 1, LZDEC_MT);
+	LzmaDec_Free(&zd->dec, &g_Alloc);
+	return 0;
+}
+
+static const struct luaL_Reg lzdec_methods[] = {
+	{"update", ll_lzdec_update},
+	{"finished", ll_lzdec_finished},
+	{"__gc", ll_lzdec_gc},
+	{NULL, NULL},
+};
+
+int ll_lzma_decoder(lua_State *L) {
+	// Lua API: lzma_decoder() => dec
+	// return an lzma decoder object (see above)
+	lzdec *zd = lua_newuserdatauv(L, sizeof(lzdec), 0);
+	memset(zd, 0, sizeof(lzdec));
+	LzmaDec_Construct(&zd->dec);
+	if (luaL_newmetatable(L, LZDEC_MT)) {
+		luaL_setfuncs(L, lzdec_methods, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+
+//----------------------------------------------------------------------
+// block container
+//
+// lzma_blocks() splits its input in blocks of a fixed size (1MB by
+// default) and compresses each block independently, in parallel 
+// threads. A part of the data can then be decompressed without 
+// decompressing everything before it: unlzma_range() decompresses 
+// only the blocks covering the requested range.
+//
+// container format (all integers are little endian):
+//	- magic "LZB1" (4 bytes)
+//	- the compressed blocks. Each block is a standard .lzma stream
+//	  (props, uncompressed size, data), as produced by lzma()
+//	- index: n+1 block offsets (8 bytes each), counted from the 
+//	  beginning of the container. The last one is the offset of 
+//	  the index itself (ie. the end of the last block)
+//	- footer (20 bytes): uncompressed size (8), block size (4),
+//	  number of blocks n (4), magic "LZB1" (4)
+//
+// the functions reading a container accept either the container as
+// a string, or a reader function rd(pos, n) which must return the n 
+// bytes at offset pos in the container, or at offset 
+// (container size + pos) if pos is negative. eg. for a file f:
+//	function rd(pos, n) 
+//		f:seek(pos < 0 and "end" or "set", pos)
+//		return f:read(n)
+//	end
+
+#include <pthread.h>
+#include <unistd.h>	// sysconf
+
+#define LZB_MAGIC "LZB1"
+#define LZB_FOOTER 20
+#define LZB_BLOCKSIZE (1<<20)
+#define LZB_MAXTHREADS 64
+
+typedef struct {
+	const Byte *src;
+	size_t sln, bsize, nblocks;
+	int level;
+	size_t outcap;	// max compressed size of a block
+	Byte *out;	// block k is compressed at out + k * outcap
+	size_t *outln;	// compressed size of each block
+	int *res;	// lzma result code for each block
+	size_t next;	// next block to compress (shared by the threads)
+} lzbjob;
+
+static void lzb_compress(lzbjob *jb, size_t k) {
+	const Byte *in = jb->src + k * jb->bsize;
+	size_t inln = jb->sln - k * jb->bsize;
+	Byte *out = jb->out + k * jb->outcap;
+	SizeT cln = jb->outcap - LZMA_PROPS_SIZE - 8;
+	SizeT propssize = LZMA_PROPS_SIZE;
+	CLzmaEncProps props;
+	if (inln > jb->bsize) inln = jb->bsize;
+	// same lc, lp, pb as lzma(). The dict size is reduced to the 
+	// block size.
+	LzmaEncProps_Init(&props);
+	props.level = jb->level;
+	props.lc = 3; props.lp = 0; props.pb = 2;
+	props.numThreads = 1;
+	props.reduceSize = inln;
+	jb->res[k] = LzmaEncode(out + LZMA_PROPS_SIZE + 8, &cln, in, inln,
+		&props, out, &propssize, 0, NULL, &g_Alloc, &g_Alloc);
+	store64_le(out + LZMA_PROPS_SIZE, inln);
+	jb->outln[k] = LZMA_PROPS_SIZE + 8 + cln;
+}
+
+static void *lzb_worker(void *arg) {
+	// compress blocks until there is no more block to compress
+	lzbjob *jb = arg;
+	size_t k;
+	while ((k = __atomic_fetch_add(&jb->next, 1, __ATOMIC_RELAXED))
+			< jb->nblocks)
+		lzb_compress(jb, k);
+	return NULL;
+}
+
+int ll_lzma_blocks(lua_State *L) {
+	// Lua API:  lzma_blocks(s [, opts]) => c
+	// compress string s, return a block container c (see above)
+	// or nil, error msg, lzma error number -- in case of error
+	// opts is an optional table with the following fields:
+	//	level: compression level, 0 to 9 (default 5)
+	//	blocksize: block size, 4KB to 1GB (default 1MB)
+	//	threads: max number of threads, 1 to 64 (default:
+	//	  the number of online processors)
+	size_t sln, k, nt;
+	int level = 5, bsize = LZB_BLOCKSIZE, threads = 0;
+	uint64_t off;
+	uint8_t n8[8];
+	pthread_t th[LZB_MAXTHREADS];
+	lzbjob jb;
+	luaL_Buffer b;
+	const char *s = luaL_checklstring(L, 1, &sln);
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		getopt_int(L, 2, "level", &level, 0, 9);
+		getopt_int(L, 2, "blocksize", &bsize, 1<<12, 1<<30);
+		getopt_int(L, 2, "threads", &threads, 1, LZB_MAXTHREADS);
+	}
+	lua_settop(L, 1);
+	jb.src = (const Byte *)s;
+	jb.sln = sln;
+	jb.bsize = bsize;
+	jb.nblocks = (sln + bsize - 1) / bsize;
+	jb.level = level;
+	jb.outcap = bsize + (bsize >> 3) + 16384; // as in lzma()
+	jb.next = 0;
+	// all the work memory is in one userdata, so that it is 
+	// collected in case of error
+	jb.outln = lua_newuserdatauv(L, jb.nblocks * 
+		(sizeof(size_t) + sizeof(int) + jb.outcap), 0);
+	jb.res = (int *)(jb.outln + jb.nblocks);
+	jb.out = (Byte *)(jb.res + jb.nblocks);
+	
+	// the calling thread also compresses blocks. If a thread
+	// cannot be created, it just does more of the work.
+	if (threads == 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1) threads = 1;
+	if (threads > LZB_MAXTHREADS) threads = LZB_MAXTHREADS;
+	if ((size_t)threads > jb.nblocks) threads = jb.nblocks;
+	for (nt = 0; (int)nt < threads - 1; nt++) 
+		if (pthread_create(&th[nt], NULL, lzb_worker, &jb) != 0) break;
+	lzb_worker(&jb);
+	for (k = 0; k < nt; k++) pthread_join(th[k], NULL);
+	for (k = 0; k < jb.nblocks; k++) {
+		if (jb.res[k] != SZ_OK) {
+			lua_pushnil (L);
+			lua_pushliteral(L, "lzma error");
+			lua_pushinteger(L, jb.res[k]);
+			return 3;
+		}
+	}
+	
+	luaL_buffinit(L, &b);
+	luaL_addlstring(&b, LZB_MAGIC, 4);
+	for (k = 0; k < jb.nblocks; k++) 
+		luaL_addlstring(&b, jb.out + k * jb.outcap, jb.outln[k]);
+	off = 4;
+	for (k = 0; k <= jb.nblocks; k++) {
+		store64_le(n8, off);
+		luaL_addlstring(&b, n8, 8);
+		if (k < jb.nblocks) off += jb.outln[k];
+	}
+	store64_le(n8, sln);
+	luaL_addlstring(&b, n8, 8);
+	store32_le(n8, bsize);
+	store32_le(n8 + 4, jb.nblocks);
+	luaL_addlstring(&b, n8, 8);
+	luaL_addlstring(&b, LZB_MAGIC, 4);
+	luaL_pushresult(&b);
+	return 1;
+}
+
+static const Byte *lzb_read(lua_State *L, int src, lua_Integer pos, 
+		size_t n) {
+	// return the n bytes at offset pos in the container at stack
+	// index src (a string or a reader function - see above).
+	// one value is pushed on the stack (the caller must pop it when 
+	// the bytes are no longer used)
+	size_t ln;
+	const char *s;
+	if (lua_type(L, src) == LUA_TSTRING) {
+		s = lua_tolstring(L, src, &ln);
+		if (pos < 0) pos += ln;
+		if (pos < 0 || (size_t)pos > ln || n > ln - pos) 
+			luaL_error(L, "lzma container: truncated data");
+		lua_pushvalue(L, src);
+		return (const Byte *)s + pos;
+	}
+	lua_pushvalue(L, src);
+	lua_pushinteger(L, pos);
+	lua_pushinteger(L, n);
+	lua_call(L, 2, 1);
+	s = lua_tolstring(L, -1, &ln);
+	if (s == NULL || ln != n) luaL_error(L, "lzma container: read error");
+	return (const Byte *)s;
+}
+
+static void lzb_index(lua_State *L, int src) {
+	// read the container index and push it as a table (see
+	// lzma_blockindex() below)
+	const Byte *x = lzb_read(L, src, -LZB_FOOTER, LZB_FOOTER);
+	uint64_t size = load64_le(x);
+	uint32_t bsize = load32_le(x + 8), n = load32_le(x + 12);
+	uint32_t i;
+	if (memcmp(x + 16, LZB_MAGIC, 4) != 0 || bsize == 0 
+			|| n != (size + bsize - 1) / bsize)
+		luaL_error(L, "lzma container: invalid format");
+	lua_pop(L, 1);
+	x = lzb_read(L, src, -(LZB_FOOTER + 8 * ((lua_Integer)n + 1)), 
+		8 * ((size_t)n + 1));
+	lua_createtable(L, n + 1, 2);
+	for (i = 0; i <= n; i++) {
+		lua_pushinteger(L, load64_le(x + 8 * (size_t)i));
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_pushinteger(L, size);
+	lua_setfield(L, -2, "size");
+	lua_pushinteger(L, bsize);
+	lua_setfield(L, -2, "blocksize");
+	lua_remove(L, -2);
+}
+
+static void lzb_checksrc(lua_State *L) {
+	int t = lua_type(L, 1);
+	luaL_argexpected(L, t == LUA_TSTRING || t == LUA_TFUNCTION, 1, 
+		"string or function");
+}
+
+int ll_lzma_blockindex(lua_State *L) {
+	// Lua API:  lzma_blockindex(src) => idx
+	// read the index of the block container src (a string or a 
+	// reader function). idx is a table with fields 'size' (total 
+	// uncompressed size) and 'blocksize'. idx[1] .. idx[n+1] are 
+	// the block offsets in the container (block k is stored at 
+	// offsets idx[k] to idx[k+1]-1, 0-based)
+	lzb_checksrc(L);
+	lzb_index(L, 1);
+	return 1;
+}
+
+int ll_unlzma_range(lua_State *L) {
+	// Lua API:  unlzma_range(src, i [, j [, idx]]) => s
+	// decompress bytes i to j of the data stored in the block 
+	// container src (a string or a reader function). i, j are
+	// interpreted as for string.sub(). Only the blocks covering the 
+	// range are read and decompressed. idx is the table returned by
+	// lzma_blockindex(src). It is optional (it allows to read the
+	// index only once for many calls)
+	// return nil, error msg, lzma error number in case of 
+	// decompression error
+	lua_Integer i, j, size, bsize, k, k1, k2, off, end, a, e;
+	size_t ulen;
+	SizeT dln, cln;
+	int r;
+	Byte *d;
+	const Byte *c;
+	luaL_Buffer b;
+	lzb_checksrc(L);
+	i = luaL_checkinteger(L, 2);
+	j = luaL_optinteger(L, 3, -1);
+	if (lua_isnoneornil(L, 4)) {
+		lua_settop(L, 3);
+		lzb_index(L, 1);
+	} else {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		lua_settop(L, 4);
+	}
+	lua_getfield(L, 4, "size");
+	lua_getfield(L, 4, "blocksize");
+	size = lua_tointeger(L, -2);
+	bsize = lua_tointeger(L, -1);
+	lua_pop(L, 2);
+	if (bsize <= 0) LERR("lzma container: invalid index");
+	// same as string.sub index handling
+	if (i < 0) i = (-i > size) ? 1 : size + i + 1;
+	if (j < 0) j = (-j > size) ? 0 : size + j + 1;
+	if (i < 1) i = 1;
+	if (j > size) j = size;
+	if (i > j) {
+		lua_pushliteral(L, "");
+		return 1;
+	}
+	k1 = (i - 1) / bsize;
+	k2 = (j - 1) / bsize;
+	luaL_buffinit(L, &b);
+	for (k = k1; k <= k2; k++) {
+		ulen = (k == (size - 1) / bsize) ? size - k * bsize : bsize;
+		lua_rawgeti(L, 4, k + 1);
+		lua_rawgeti(L, 4, k + 2);
+		off = lua_tointeger(L, -2);
+		end = lua_tointeger(L, -1);
+		lua_pop(L, 2);
+		if (end - off < LZMA_PROPS_SIZE + 8 || off < 0) 
+			LERR("lzma container: invalid index");
+		// the block is decompressed in place in the buffer.
+		d = (Byte *)luaL_prepbuffsize(&b, ulen);
+		c = lzb_read(L, 1, off, end - off);
+		if (load64_le(c + LZMA_PROPS_SIZE) != ulen)
+			LERR("lzma container: invalid block");
+		dln = ulen;
+		cln = end - off - (LZMA_PROPS_SIZE + 8);
+		r = LzmaUncompress(d, &dln, c + LZMA_PROPS_SIZE + 8, &cln, 
+			c, LZMA_PROPS_SIZE);
+		lua_pop(L, 1);
+		if (r != 0 || dln != ulen) {
+			lua_pushnil (L);
+			lua_pushliteral(L, "unlzma error");
+			lua_pushinteger(L, r);
+			return 3;
+		}
+		// keep only the requested part of the block
+		a = (k == k1) ? i - 1 - k * bsize : 0;
+		e = (k == k2) ? j - k * bsize : (lua_Integer)ulen;
+		if (a > 0) memmove(d, d + a, e - a);
+		luaL_addsize(&b, e - a);
+	}
+	luaL_pushresult(&b);
+	return 1;
+}
@@ -323,6 +323,8 @@ static void Decode(uint32_t *output, const uint8_t *input, uint32_t len)
 #include "lua.h"
 #include "lauxlib.h"
 
+#include "slbuf.h"
+
 # define LERR(msg) return luaL_error(L, msg)
 
 //----------------------------------------------------------------------
@@ -338,3 +340,64 @@ int ll_md5(lua_State *L) {
     lua_pushlstring (L, digest, MD5_SIZE); 
     return 1;
 }
+
+//----------------------------------------------------------------------
+// incremental md5: md5_init() returns a context object. The data is
+// passed in any number of pieces with ctx:update(m) (m is a string 
+// or a buffer), then ctx:final() returns the digest.
+
+#define MD5CTX_MT "luazen.md5ctx"
+
+typedef struct {
+    MD5_CTX ctx;
+    int done;
+} md5ctx;
+
+static int ll_md5ctx_update(lua_State *L) {
+    // Lua API: ctx:update(m) => ctx
+    size_t sln, n; 
+    const char *src;
+    md5ctx *c = luaL_checkudata(L, 1, MD5CTX_MT);
+    src = slbuf_checkdata(L, 2, &sln);
+    if (c->done) LERR("md5 context already finalized");
+    // MD5_Update length is an int
+    while (sln > 0) {
+        n = sln > (1 << 30) ? (1 << 30) : sln;
+        MD5_Update(&c->ctx, src, n);
+        src += n;
+        sln -= n;
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int ll_md5ctx_final(lua_State *L) {
+    // Lua API: ctx:final() => digest
+    char digest[MD5_SIZE];
+    md5ctx *c = luaL_checkudata(L, 1, MD5CTX_MT);
+    if (c->done) LERR("md5 context already finalized");
+    c->done = 1;
+    MD5_Final(digest, &c->ctx);
+    lua_pushlstring (L, digest, MD5_SIZE); 
+    return 1;
+}
+
+static const struct luaL_Reg md5ctx_methods[] = {
+    {"update", ll_md5ctx_update},
+    {"final", ll_md5ctx_final},
+    {NULL, NULL},
+};
+
+int ll_md5_init(lua_State *L) {
+    // Lua API: md5_init() => ctx
+    md5ctx *c = lua_newuserdatauv(L, sizeof(md5ctx), 0);
+    c->done = 0;
+    MD5_Init(&c->ctx);
+    if (luaL_newmetatable(L, MD5CTX_MT)) {
+        luaL_setfuncs(L, md5ctx_methods, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+    return 1;
+}
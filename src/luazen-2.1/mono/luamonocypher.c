@@ -22,6 +22,8 @@ luamonocypher - a Lua wrapping for the Monocypher library
 #include "monocypher.h"
 #include "monocypher-ed25519.h"
 
+#include "slbuf.h"
+
 
 // compatibility with Lua 5.2  --and lua 5.3, added 150621
 // (from roberto's lpeg 0.10.1 dated 101203)
@@ -58,10 +60,10 @@ luamonocypher - a Lua wrapping for the Monocypher library
 
 int ll_encrypt(lua_State *L) {
 	// Authenticated encryption (XChacha20 + Poly1305)
-	// Lua API: encrypt(k, n, m [, ninc]) return c
+	// Lua API: encrypt(k, n, m [, ninc [, buf [, idx]]]) return c
 	// k: key string (32 bytes)
 	// n: nonce string (24 bytes)
-	// m: message (plain text) string 
+	// m: message (plain text) string (or buffer)
 	// ninc: optional nonce increment (useful when encrypting a long
 	//   message as a sequence of block). The same parameter n can 
 	//   be used for the sequence. ninc is added to n for each block, 
@@ -70,19 +72,27 @@ int ll_encrypt(lua_State *L) {
 	// return encrypted message as a binary string c
 	//   c includes the 16-byte MAC (or "tag"), so #c = #m + 16
 	//   (the MAC is stored at the end of c)
+	// buf, idx: optional output buffer and index (default 1). If buf
+	//   is provided, c is written in buf at index idx, and encrypt()
+	//   returns idx + #c instead of c. Nothing is allocated.
 
 	
 	int r;
-	size_t mln, nln, kln, bufln;
+	size_t mln, nln, kln, bufln, avail;
+	luaL_Buffer b;
 	const char *k = luaL_checklstring(L,1,&kln);
 	const char *n = luaL_checklstring(L,2,&nln);	
-	const char *m = luaL_checklstring(L,3,&mln);	
+	const char *m = slbuf_checkdata(L,3,&mln);	
 	uint64_t ninc = luaL_optinteger(L, 4, 0);	
+	unsigned char *buf = slbuf_optout(L, 5, &avail);
 	if (nln != 24) LERR("bad nonce size");
 	if (kln != 32) LERR("bad key size");
-	// allocate a buffer for the encrypted text
 	bufln = mln + 16; //make room for the MAC
-	unsigned char * buf = lua_newuserdata(L, bufln);
+	// the encrypted text is written directly in the output buffer,
+	// or in the result string buffer (above the args on the stack)
+	lua_settop(L, 6);
+	if (buf) { if (avail < bufln) LERR("buffer too small"); }
+	else buf = luaL_buffinitsize(L, &b, bufln);
 	// compute the actual nonce
 	char actn[24]; // "actual nonce = n + ninc"
 	memcpy(actn, n, 24); 
@@ -92,31 +102,40 @@ int ll_encrypt(lua_State *L) {
 	// encrypted text will be stored at buf, 
 	// MAC at end of encrypted text
 	crypto_lock(buf+mln, buf, k, actn, m, mln);
-	lua_pushlstring (L, buf, bufln); 
+	if (lua_isnoneornil(L, 5)) luaL_pushresultsize(&b, bufln);
+	else lua_pushinteger(L, luaL_optinteger(L, 6, 1) + bufln);
 	return 1;
 } // encrypt()
 
 int ll_decrypt(lua_State *L) {
 	// Authenticated decryption (XChacha20 + Poly1305)
-	// Lua API: decrypt(k, n, c [, ninc]) return m
+	// Lua API: decrypt(k, n, c [, ninc [, buf [, idx]]]) return m
 	//  k: key string (32 bytes)
 	//  n: nonce string (24 bytes)
-	//  c: encrypted message string. 
+	//  c: encrypted message string (or buffer)
 	//     (MAC has been stored by encrypt() at the end of c)
 	//  ninc: optional nonce increment (see above. defaults to 0)
+	//  buf, idx: optional output buffer (see encrypt). If buf is 
+	//     provided, m is written in buf at idx and decrypt() 
+	//     returns idx + #m
 	//  return plain text string or nil, errmsg if MAC is not valid
 	int r = 0;
-	size_t cln, nln, kln;
+	size_t cln, nln, kln, avail;
+	luaL_Buffer b;
 	const char *k = luaL_checklstring(L, 1, &kln);
 	const char *n = luaL_checklstring(L, 2, &nln);	
-	const char *c = luaL_checklstring(L, 3, &cln);	
+	const char *c = slbuf_checkdata(L, 3, &cln);	
 	uint64_t ninc = luaL_optinteger(L, 4, 0);	
+	unsigned char *buf = slbuf_optout(L, 5, &avail);
 	if (nln != 24) LERR("bad nonce size");
 	if (kln != 32) LERR("bad key size");
 	if (cln < 16) LERR("bad msg size");
 	
-	// allocate a buffer for the decrypted text
-	unsigned char * buf = lua_newuserdata(L, cln);
+	// the decrypted text is written directly in the output buffer,
+	// or in the result string buffer (above the args on the stack)
+	lua_settop(L, 6);
+	if (buf) { if (avail < cln - 16) LERR("buffer too small"); }
+	else buf = luaL_buffinitsize(L, &b, cln - 16);
 	// compute the actual nonce
 	char actn[24]; // "actual nonce = n + ninc"
 	memcpy(actn, n, 24); 
@@ -131,10 +150,244 @@ int ll_decrypt(lua_State *L) {
 		lua_pushliteral(L, "decrypt error");
 		return 2;         
 	} 
-	lua_pushlstring (L, buf, cln-16); 
+	if (lua_isnoneornil(L, 5)) luaL_pushresultsize(&b, cln - 16);
+	else lua_pushinteger(L, luaL_optinteger(L, 6, 1) + cln - 16);
 	return 1;
 } // ll_decrypt()
 
+//----------------------------------------------------------------------
+// stream encryption
+//
+// encrypt_stream(k, n) and decrypt_stream(k, n) return stream objects
+// which encrypt or decrypt a message of any size chunk by chunk, with
+// XChacha20 + Poly1305 (crypto_lock_aead). 
+//
+// the encrypted stream is a sequence of frames, one per chunk:
+//	- header (4 bytes, little endian): chunk length (bits 0-30),
+//	  final chunk flag (bit 31)
+//	- encrypted chunk
+//	- MAC (16 bytes)
+// the header is authenticated as additional data. The nonce of chunk 
+// i (starting at 0) is n + i (as for the ninc parameter of encrypt(),
+// added modulo 2^64 to the first 8 bytes of n, little endian).
+// So chunks cannot be modified, reordered, dropped or moved to another
+// stream. The last chunk is flagged as final. A truncated stream is 
+// detected with ds:finished().
+// as for encrypt(), a (k, n) pair must never be used for two streams.
+//
+// encryption:
+//	es = encrypt_stream(k, n)
+//	es:update(m) => c  -- encrypt chunk m, return the frame
+//	es:final([m]) => c  -- same for the final chunk (may be empty)
+//	es:update(m, buf [, idx]) => idx + #c  -- write the frame in 
+//	  buffer buf at idx (default 1) instead of returning a string.
+//	  es:final(m, buf [, idx]) is the same.
+// decryption:
+//	ds = decrypt_stream(k, n)
+//	ds:update(c) => m | nil, errmsg
+//	  c is any part of the encrypted stream (not necessarily whole
+//	  frames). Return the decrypted chunks of all the complete 
+//	  frames received so far ("" if none).
+//	ds:finished() => true if the final chunk has been decrypted
+//
+// each chunk is encrypted or decrypted in a work buffer kept in the 
+// stream object. Only the result string is allocated.
+
+#define SSTREAM_MT "luazen.secretstream"
+#define SSTREAM_HDR 4
+#define SSTREAM_MAC 16
+#define SSTREAM_MAXCHUNK 0x7fffffff
+#define SSTREAM_FINAL 0x80000000u
+
+typedef struct {
+	uint8_t key[32];
+	uint8_t nonce[24];
+	uint64_t ctr;	// number of chunks processed
+	int decrypt;	// 1 for a decryption stream
+	int state;	// 0: open, 1: final chunk done, 2: failed
+	uint8_t *in;	// pending input (partial frame, decryption only)
+	size_t inlen, incap;
+	uint8_t *out;	// work buffer
+	size_t outcap;
+} sstream;
+
+static int sstream_grow(uint8_t **buf, size_t *cap, size_t need) {
+	// ensure buf can contain need bytes. return 0 on failure
+	if (need <= *cap) return 1;
+	size_t newcap = *cap ? *cap : 4096;
+	while (newcap < need) newcap *= 2;
+	uint8_t *p = realloc(*buf, newcap);
+	if (p == NULL) return 0;
+	*buf = p;
+	*cap = newcap;
+	return 1;
+}
+
+static void sstream_nonce(sstream *ss, uint8_t actn[24]) {
+	// actual nonce for the current chunk: nonce + ctr
+	uint64_t x = 0;
+	int i;
+	memcpy(actn, ss->nonce, 24);
+	for (i = 7; i >= 0; i--) x = (x << 8) | actn[i];
+	x += ss->ctr;
+	for (i = 0; i < 8; i++) { actn[i] = x & 0xff; x >>= 8; }
+}
+
+static void sstream_lock(sstream *ss, uint8_t *frame, const uint8_t *m,
+		size_t mln, int final) {
+	// encrypt chunk m as a frame at address 'frame'
+	uint8_t actn[24];
+	uint32_t h = (uint32_t)mln | (final ? SSTREAM_FINAL : 0);
+	frame[0] = h; frame[1] = h >> 8; frame[2] = h >> 16; frame[3] = h >> 24;
+	sstream_nonce(ss, actn);
+	crypto_lock_aead(frame + SSTREAM_HDR + mln, frame + SSTREAM_HDR, 
+		ss->key, actn, frame, SSTREAM_HDR, m, mln);
+	ss->ctr++;
+	if (final) ss->state = 1;
+}
+
+static int sstream_encrypt(lua_State *L, int final) {
+	// common part of es:update() and es:final()
+	size_t mln, fln;
+	sstream *ss = luaL_checkudata(L, 1, SSTREAM_MT);
+	const char *m = luaL_optlstring(L, 2, "", &mln);
+	slbuf *b = slbuf_test(L, 3);
+	if (ss->decrypt) LERR("not an encryption stream");
+	if (ss->state != 0) LERR("stream already finalized");
+	if (mln > SSTREAM_MAXCHUNK) LERR("chunk too large");
+	fln = SSTREAM_HDR + mln + SSTREAM_MAC;
+	if (b) {
+		lua_Integer idx = luaL_optinteger(L, 4, 1);
+		slbuf_checkwrite(L, b);
+		if (idx < 1 || fln > b->len || (size_t)idx - 1 > b->len - fln)
+			LERR("out of range");
+		sstream_lock(ss, b->ptr + idx - 1, m, mln, final);
+		lua_pushinteger(L, idx + fln);
+		return 1;
+	}
+	if (!sstream_grow(&ss->out, &ss->outcap, fln)) LERR("not enough memory");
+	sstream_lock(ss, ss->out, m, mln, final);
+	lua_pushlstring(L, ss->out, fln);
+	return 1;
+}
+
+static int ll_sstream_update(lua_State *L) {
+	sstream *ss = luaL_checkudata(L, 1, SSTREAM_MT);
+	size_t cln, pln, outln = 0, ln;
+	const uint8_t *c, *p;
+	uint8_t actn[24];
+	uint32_t h;
+	if (!ss->decrypt) return sstream_encrypt(L, 0);
+	c = luaL_checklstring(L, 2, &cln);
+	if (ss->state == 2) goto error;
+	// process the frames directly in c if there is no pending input
+	if (ss->inlen > 0) {
+		if (!sstream_grow(&ss->in, &ss->incap, ss->inlen + cln))
+			LERR("not enough memory");
+		memcpy(ss->in + ss->inlen, c, cln);
+		ss->inlen += cln;
+		p = ss->in; pln = ss->inlen;
+	} else {
+		p = c; pln = cln;
+	}
+	while (pln >= SSTREAM_HDR) {
+		if (ss->state == 1) goto error; // data after the final chunk
+		h = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+		ln = h & SSTREAM_MAXCHUNK;
+		if (pln < SSTREAM_HDR + ln + SSTREAM_MAC) break;
+		if (!sstream_grow(&ss->out, &ss->outcap, outln + ln))
+			LERR("not enough memory");
+		sstream_nonce(ss, actn);
+		if (crypto_unlock_aead(ss->out + outln, ss->key, actn, 
+				p + SSTREAM_HDR + ln, p, SSTREAM_HDR, 
+				p + SSTREAM_HDR, ln) != 0) 
+			goto error;
+		outln += ln;
+		ss->ctr++;
+		if (h & SSTREAM_FINAL) ss->state = 1;
+		p += SSTREAM_HDR + ln + SSTREAM_MAC;
+		pln -= SSTREAM_HDR + ln + SSTREAM_MAC;
+	}
+	// keep the partial frame for the next update
+	if (pln > 0 && !sstream_grow(&ss->in, &ss->incap, pln))
+		LERR("not enough memory");
+	if (pln > 0) memmove(ss->in, p, pln);
+	ss->inlen = pln;
+	lua_pushlstring(L, ss->out, outln);
+	return 1;
+error:
+	ss->state = 2;
+	ss->inlen = 0;
+	lua_pushnil (L);
+	lua_pushliteral(L, "decrypt error");
+	return 2;
+}
+
+static int ll_sstream_final(lua_State *L) {
+	return sstream_encrypt(L, 1);
+}
+
+static int ll_sstream_finished(lua_State *L) {
+	sstream *ss = luaL_checkudata(L, 1, SSTREAM_MT);
+	lua_pushboolean(L, ss->state == 1);
+	return 1;
+}
+
+static int ll_sstream_gc(lua_State *L) {
+	sstream *ss = luaL_checkudata(L, 1, SSTREAM_MT);
+	crypto_wipe(ss->key, 32);
+	if (ss->in) crypto_wipe(ss->in, ss->incap);
+	if (ss->out) crypto_wipe(ss->out, ss->outcap);
+	free(ss->in);
+	free(ss->out);
+	ss->in = ss->out = NULL;
+	ss->incap = ss->outcap = ss->inlen = 0;
+	ss->state = 2;
+	return 0;
+}
+
+static const struct luaL_Reg sstream_methods[] = {
+	{"update", ll_sstream_update},
+	{"final", ll_sstream_final},
+	{"finished", ll_sstream_finished},
+	{"__gc", ll_sstream_gc},
+	{NULL, NULL},
+};
+
+static int newsstream(lua_State *L, int decrypt) {
+	size_t kln, nln;
+	const char *k = luaL_checklstring(L, 1, &kln);
+	const char *n = luaL_checklstring(L, 2, &nln);	
+	if (nln != 24) LERR("bad nonce size");
+	if (kln != 32) LERR("bad key size");
+	sstream *ss = lua_newuserdatauv(L, sizeof(sstream), 0);
+	memset(ss, 0, sizeof(sstream));
+	memcpy(ss->key, k, 32);
+	memcpy(ss->nonce, n, 24);
+	ss->decrypt = decrypt;
+	if (luaL_newmetatable(L, SSTREAM_MT)) {
+		luaL_setfuncs(L, sstream_methods, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+int ll_encrypt_stream(lua_State *L) {
+	// Lua API: encrypt_stream(k, n) => es
+	// k: key string (32 bytes)
+	// n: nonce string (24 bytes)
+	// return a stream encryption object (see above)
+	return newsstream(L, 0);
+}
+
+int ll_decrypt_stream(lua_State *L) {
+	// Lua API: decrypt_stream(k, n) => ds
+	// return a stream decryption object (see above)
+	return newsstream(L, 1);
+}
+
 //----------------------------------------------------------------------
 // blake2b hash and argon2i KDF
 
@@ -161,6 +414,93 @@ int ll_blake2b(lua_State *L) {
 	return 1;
 }// ll_blake2b
 
+//----------------------------------------------------------------------
+// incremental hash (blake2b, sha512)
+//
+// a hash context object is created by blake2b_init() or sha512_init().
+// the data to hash is passed in any number of pieces with ctx:update()
+// and ctx:final() returns the digest. So large data (eg. a file read 
+// block by block) can be hashed in constant memory.
+// the digest is the same as blake2b() or sha512() for the 
+// concatenation of all the pieces.
+
+#define HASHCTX_MT "luazen.hashctx"
+
+typedef struct {
+	int sha512;	// 1 for sha512, 0 for blake2b
+	int done;	// final() has been called
+	union {
+		crypto_blake2b_ctx b2;
+		crypto_sha512_ctx s5;
+	} u;
+} hashctx;
+
+static int ll_hashctx_update(lua_State *L) {
+	// Lua API: ctx:update(m) => ctx
+	// m: the next part of the data to hash (a string or a buffer)
+	size_t mln;
+	const char *m;
+	hashctx *h = luaL_checkudata(L, 1, HASHCTX_MT);
+	m = slbuf_checkdata(L, 2, &mln);
+	if (h->done) LERR("hash context already finalized");
+	if (h->sha512) crypto_sha512_update(&h->u.s5, m, mln);
+	else crypto_blake2b_update(&h->u.b2, m, mln);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int ll_hashctx_final(lua_State *L) {
+	// Lua API: ctx:final() => digest
+	// return the digest. the context cannot be used after this.
+	char digest[64];
+	size_t digln;
+	hashctx *h = luaL_checkudata(L, 1, HASHCTX_MT);
+	if (h->done) LERR("hash context already finalized");
+	h->done = 1;
+	if (h->sha512) {
+		digln = 64;
+		crypto_sha512_final(&h->u.s5, digest);
+	} else {
+		digln = h->u.b2.hash_size;
+		crypto_blake2b_final(&h->u.b2, digest);
+	}
+	lua_pushlstring (L, digest, digln); 
+	return 1;
+}
+
+static const struct luaL_Reg hashctx_methods[] = {
+	{"update", ll_hashctx_update},
+	{"final", ll_hashctx_final},
+	{NULL, NULL},
+};
+
+static hashctx *newhashctx(lua_State *L, int sha512) {
+	hashctx *h = lua_newuserdatauv(L, sizeof(hashctx), 0);
+	h->sha512 = sha512;
+	h->done = 0;
+	if (luaL_newmetatable(L, HASHCTX_MT)) {
+		luaL_setfuncs(L, hashctx_methods, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	return h;
+}
+
+int ll_blake2b_init(lua_State *L) {
+	// Lua API: blake2b_init(diglen, key) => ctx
+	// return a blake2b hash context (see above). diglen and key
+	// are optional, as for blake2b()
+	size_t keyln = 0; 
+	int digln = luaL_optinteger(L, 1, 64);
+	const char *key = luaL_optlstring(L, 2, NULL, &keyln);
+	if ((keyln < 0)||(keyln > 64)) LERR("bad key size");
+	if ((digln < 1)||(digln > 64)) LERR("bad digest size");
+	hashctx *h = newhashctx(L, 0);
+	crypto_blake2b_general_init(&h->u.b2, digln, key, keyln);
+	return 1;
+}
+
 int ll_argon2i(lua_State *L) {
 	// Lua API: argon2i(pw, salt, nkb, niters) => k
 	// pw: the password string
@@ -264,6 +604,14 @@ int ll_sha512(lua_State *L) {
 	return 1;
 }// ll_sha512
 
+int ll_sha512_init(lua_State *L) {
+	// Lua API: sha512_init() => ctx
+	// return a sha512 hash context (see blake2b_init() above)
+	hashctx *h = newhashctx(L, 1);
+	crypto_sha512_init(&h->u.s5);
+	return 1;
+}
+
 
 
 int ll_ed25519_public_key(lua_State *L) {
@@ -0,0 +1,934 @@
+// Copyright (c) 2023  Phil Leblanc  -- see LICENSE file
+// ---------------------------------------------------------------------
+/*
+
+slalloc - pool memory allocator for Lua states  (see slalloc.h)
+
+Slab layout: a 64-byte header, then blocks of the slab size class.
+Blocks are taken from the slab free list, else from the never used
+part of the slab (bump allocation), so a new slab does not need to
+be initialized.
+
+A pool keeps, for each size class, a list of the slabs that have
+free blocks. A full slab is in no list. It is put back in the list
+when one of its blocks is freed. An empty slab is moved to the pool
+list of empty slabs, except if it is the only slab of its class (to
+avoid moving the same slab back and forth). Only SLPOOL_KEEP empty
+slabs are kept as is. The memory of the other ones is returned to
+the OS (except the header page). They are reused before new slabs
+are taken from the reserved range.
+
+When a pool is freed, its slabs are returned to the OS and put in a
+global list of free slabs, used by the other pools.
+
+Memory accounting (SLALLOC_BUDGET) is a lua_Alloc wrapper around
+the pool or libc allocator. Lua gives the type of an object only when
+it is created, so each block has a small header with its category.
+
+An arena is a reserved address range used by one state only. The
+arena header (allocator state) is at the start of the range, so the
+arena content is the complete state. Blocks are allocated from free
+lists (16-byte classes up to 512 bytes, then powers of 2) or from the
+never used part of the arena. Lua gives the size of a block when it 
+is freed, so there are no block headers.
+A template is a copy of the arena content in a memfd file. To restore
+it, the file is mapped copy-on-write at the arena address: pointers
+remain valid, and only the pages written later are copied.
+The restore also puts back the C resources referenced by the template
+(FILE *, malloc'd memory, ...) as they were when the template was 
+saved, so a template cannot hold objects with a finalizer, except 
+the standard io files and the (empty) table of the loaded C 
+libraries, which are harmless. The objects with a finalizer created
+by a run are found in the Lua GC lists (finobj, tobefnz) and their 
+finalizers are called before the next restore.
+
+*/
+
+// _GNU_SOURCE needed in glibc to declare memfd_create() in sys/mman.h
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include "lstate.h"
+#include "lobject.h"
+#include "lgc.h"
+
+#include "slalloc.h"
+
+#define SLAB_SHIFT 16
+#define SLAB_SIZE ((size_t)1 << SLAB_SHIFT)
+#define SLAB_HDR 64
+#define NCLASSES 16
+
+// number of empty slabs kept by a pool without releasing their memory
+#define SLPOOL_KEEP 4
+
+enum { SLAB_PARTIAL, SLAB_FULL, SLAB_EMPTY };
+
+typedef struct slab {
+	struct slab *next, *prev;	// in a pool slab list
+	struct slab *allnext;		// all the slabs of the pool
+	void *free;			// list of free blocks
+	uint32_t bump;			// offset of the first never used block
+	uint32_t used;			// number of allocated blocks
+	uint16_t size;			// block size
+	uint8_t cls;			// size class
+	uint8_t state;
+} slab;
+
+struct slpool {
+	slab *partial[NCLASSES];	// slabs with free blocks, per class
+	slab *empty;			// empty slabs (memory kept)
+	slab *released;			// empty slabs (memory released)
+	int nempty;			// number of slabs in 'empty'
+	slab *all;			// all the slabs of the pool
+};
+
+static const uint16_t class_size[NCLASSES] = {
+	16, 32, 48, 64, 80, 96, 112, 128,
+	160, 192, 224, 256, 320, 384, 448, 512,
+};
+
+static int sizeclass(size_t n) {
+	// n is 1 to SLALLOC_SMALLMAX
+	if (n <= 128) return (n - 1) >> 4;
+	if (n <= 256) return 8 + ((n - 129) >> 5);
+	return 12 + ((n - 257) >> 6);
+}
+
+//----------------------------------------------------------------------
+// the reserved address range (shared by all the pools)
+
+static char *region;		// reserved range, aligned on SLAB_SIZE
+static size_t region_size;
+static size_t region_next;	// offset of the next never used slab
+static size_t pagesize;
+static slab *global_free;	// slabs released by freed pools
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t region_once = PTHREAD_ONCE_INIT;
+
+static void region_init(void) {
+	// reserve a large address range. Memory is committed only when
+	// it is used. Try smaller sizes if it fails (eg. with a strict
+	// overcommit policy or an address space limit)
+	size_t sz = (size_t)1 << (sizeof(void *) == 8 ? 36 : 28);
+	char *p = MAP_FAILED;
+	pagesize = sysconf(_SC_PAGESIZE);
+	for (; sz >= ((size_t)1 << 24); sz >>= 2) {
+		p = mmap(NULL, sz + SLAB_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (p != MAP_FAILED) break;
+	}
+	if (p == MAP_FAILED) return; // no slab: use malloc for all blocks
+	region = (char *)(((uintptr_t)p + SLAB_SIZE - 1) & ~(SLAB_SIZE - 1));
+	region_size = sz;
+}
+
+#define OWNED(ptr) ((size_t)((char *)(ptr) - region) < region_size)
+#define SLAB_OF(ptr) ((slab *)((uintptr_t)(ptr) & ~(SLAB_SIZE - 1)))
+
+static void slab_release(slab *s) {
+	// return the memory of an empty slab to the OS (except the
+	// page with the header)
+	if (pagesize < SLAB_SIZE)
+		madvise((char *)s + pagesize, SLAB_SIZE - pagesize,
+			MADV_DONTNEED);
+}
+
+static slab *slab_get(slpool *p) {
+	// return an empty slab for pool p, or NULL
+	slab *s;
+	size_t off;
+	if ((s = p->empty) != NULL) {
+		p->empty = s->next;
+		p->nempty--;
+		return s;
+	}
+	if ((s = p->released) != NULL) {
+		p->released = s->next;
+		return s;
+	}
+	if (global_free != NULL) {
+		pthread_mutex_lock(&global_lock);
+		if ((s = global_free) != NULL) global_free = s->next;
+		pthread_mutex_unlock(&global_lock);
+	}
+	if (s == NULL) {
+		off = __atomic_fetch_add(&region_next, SLAB_SIZE,
+			__ATOMIC_RELAXED);
+		if (off >= region_size) return NULL;
+		s = (slab *)(region + off);
+	}
+	s->allnext = p->all;
+	p->all = s;
+	return s;
+}
+
+//----------------------------------------------------------------------
+// slab lists
+
+static void list_remove(slpool *p, slab *s) {
+	// remove s from the partial list of its class
+	if (s->prev) s->prev->next = s->next;
+	else p->partial[s->cls] = s->next;
+	if (s->next) s->next->prev = s->prev;
+}
+
+static void list_push(slpool *p, slab *s) {
+	// push s at the head of the partial list of its class
+	s->prev = NULL;
+	s->next = p->partial[s->cls];
+	if (s->next) s->next->prev = s;
+	p->partial[s->cls] = s;
+	s->state = SLAB_PARTIAL;
+}
+
+//----------------------------------------------------------------------
+// small blocks
+
+static void *small_alloc(slpool *p, int cls) {
+	void *b;
+	slab *s = p->partial[cls];
+	if (s == NULL) {
+		s = slab_get(p);
+		if (s == NULL) return NULL;
+		s->free = NULL;
+		s->bump = SLAB_HDR;
+		s->used = 0;
+		s->size = class_size[cls];
+		s->cls = cls;
+		list_push(p, s);
+	}
+	if (s->free) {
+		b = s->free;
+		s->free = *(void **)b;
+	} else {
+		b = (char *)s + s->bump;
+		s->bump += s->size;
+	}
+	s->used++;
+	if (s->free == NULL && s->bump + s->size > SLAB_SIZE) {
+		list_remove(p, s);
+		s->state = SLAB_FULL;
+	}
+	return b;
+}
+
+static void small_free(slpool *p, void *b) {
+	slab *s = SLAB_OF(b);
+	*(void **)b = s->free;
+	s->free = b;
+	s->used--;
+	if (s->state == SLAB_FULL) list_push(p, s);
+	if (s->used == 0 && (s->prev != NULL || s->next != NULL)) {
+		list_remove(p, s);
+		s->state = SLAB_EMPTY;
+		if (p->nempty < SLPOOL_KEEP) {
+			s->next = p->empty;
+			p->empty = s;
+			p->nempty++;
+		} else {
+			slab_release(s);
+			s->next = p->released;
+			p->released = s;
+		}
+	}
+}
+
+//----------------------------------------------------------------------
+// pool allocator
+
+void *slalloc_pool(void *ud, void *ptr, size_t osize, size_t nsize) {
+	slpool *p = (slpool *)ud;
+	void *nptr = NULL;
+	if (nsize == 0) {
+		if (OWNED(ptr)) small_free(p, ptr);
+		else free(ptr);
+		return NULL;
+	}
+	if (ptr == NULL) {  // (osize is then the object type)
+		if (nsize <= SLALLOC_SMALLMAX)
+			nptr = small_alloc(p, sizeclass(nsize));
+		return nptr ? nptr : malloc(nsize);
+	}
+	if (OWNED(ptr)) {
+		slab *s = SLAB_OF(ptr);
+		if (nsize <= SLALLOC_SMALLMAX) {
+			int cls = sizeclass(nsize);
+			if (cls == s->cls) return ptr;
+			nptr = small_alloc(p, cls);
+		}
+		if (nptr == NULL) nptr = malloc(nsize);
+		// a block can always shrink in place
+		if (nptr == NULL) return (nsize <= s->size) ? ptr : NULL;
+		memcpy(nptr, ptr, osize < nsize ? osize : nsize);
+		small_free(p, ptr);
+		return nptr;
+	}
+	// block allocated by malloc (or by the standard allocator before
+	// the pool was installed)
+	if (nsize <= SLALLOC_SMALLMAX)
+		nptr = small_alloc(p, sizeclass(nsize));
+	if (nptr == NULL) return realloc(ptr, nsize);
+	memcpy(nptr, ptr, osize < nsize ? osize : nsize);
+	free(ptr);
+	return nptr;
+}
+
+slpool *slalloc_newpool(void) {
+	slpool *p;
+	pthread_once(&region_once, region_init);
+	p = calloc(1, sizeof(slpool));
+	return p;
+}
+
+void slalloc_freepool(slpool *p) {
+	slab *s, *next;
+	if (p == NULL) return;
+	for (s = p->all; s != NULL; s = next) {
+		next = s->allnext;
+		madvise(s, SLAB_SIZE, MADV_DONTNEED);
+		pthread_mutex_lock(&global_lock);
+		s->next = global_free;
+		global_free = s;
+		pthread_mutex_unlock(&global_lock);
+	}
+	free(p);
+}
+
+//----------------------------------------------------------------------
+// memory accounting and budget
+
+// allocation categories (from the type tag given by Lua when an
+// object is created)
+enum {
+	CAT_OTHER, CAT_STRING, CAT_TABLE, CAT_CLOSURE, CAT_USERDATA,
+	CAT_THREAD, CAT_UPVALUE, CAT_PROTO, NCATS
+};
+
+static const char *const cat_names[NCATS] = {
+	"other", "string", "table", "closure", "userdata",
+	"thread", "upvalue", "proto",
+};
+
+// each block is prefixed with a header holding its category. The
+// header size keeps the block alignment of the underlying allocator
+#define BHDR 16
+
+typedef struct slbudget {
+	lua_Alloc f;		// underlying allocator
+	void *ud;
+	size_t total;		// live bytes (without headers)
+	size_t peak;
+	size_t limit;		// 0 for no limit
+	size_t nfail;		// number of failed allocations
+	size_t cat[NCATS];	// live bytes per category
+} slbudget;
+
+static int tagcat(size_t tag) {
+	switch (tag) {
+		case LUA_TSTRING: return CAT_STRING;
+		case LUA_TTABLE: return CAT_TABLE;
+		case LUA_TFUNCTION: return CAT_CLOSURE;
+		case LUA_TUSERDATA: return CAT_USERDATA;
+		case LUA_TTHREAD: return CAT_THREAD;
+		case LUA_NUMTYPES: return CAT_UPVALUE;
+		case LUA_NUMTYPES + 1: return CAT_PROTO;
+		default: return CAT_OTHER; // arrays (table parts, stack, ...)
+	}
+}
+
+static void *budget_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	slbudget *b = (slbudget *)ud;
+	char *h = NULL;
+	int cat;
+	if (ptr == NULL) {  // (osize is the object type)
+		cat = tagcat(osize);
+		osize = 0;
+	} else {
+		h = (char *)ptr - BHDR;
+		cat = *(unsigned char *)h;
+	}
+	if (nsize == 0) {
+		b->f(b->ud, h, osize + BHDR, 0);
+		b->total -= osize;
+		b->cat[cat] -= osize;
+		return NULL;
+	}
+	// the limit is not checked when a block shrinks
+	if (b->limit != 0 && nsize > osize
+	    && b->total + (nsize - osize) > b->limit) {
+		b->nfail++;
+		return NULL;  // Lua collects garbage, then retries or
+			      // raises a memory error
+	}
+	h = b->f(b->ud, h, h ? osize + BHDR : 0, nsize + BHDR);
+	if (h == NULL) {
+		b->nfail++;
+		return NULL;
+	}
+	*(unsigned char *)h = cat;
+	b->total += nsize - osize;
+	b->cat[cat] += nsize - osize;
+	if (b->total > b->peak) b->peak = b->total;
+	return h + BHDR;
+}
+
+//----------------------------------------------------------------------
+// state creation
+
+static void *libc_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	// same as l_alloc in lauxlib.c
+	(void)ud; (void)osize;
+	if (nsize == 0) {
+		free(ptr);
+		return NULL;
+	}
+	return realloc(ptr, nsize);
+}
+
+lua_State *slalloc_newstate(int flags, size_t limit) {
+	lua_Alloc f = libc_alloc;
+	void *ud = NULL;
+	slbudget *b = NULL;
+	lua_State *L;
+	if (flags & SLALLOC_POOL) {
+		if ((ud = slalloc_newpool()) == NULL) return NULL;
+		f = slalloc_pool;
+	}
+	if (flags & SLALLOC_BUDGET) {
+		b = calloc(1, sizeof(slbudget));
+		if (b == NULL) {
+			slalloc_freepool(ud);
+			return NULL;
+		}
+		b->f = f;
+		b->ud = ud;
+		b->limit = limit;
+		f = budget_alloc;
+		ud = b;
+	}
+	L = luaL_newstatex(f, ud);
+	if (L == NULL) {
+		if (b != NULL) {
+			ud = b->ud;
+			free(b);
+		}
+		if (flags & SLALLOC_POOL) slalloc_freepool(ud);
+	}
+	return L;
+}
+
+void slalloc_close(lua_State *L) {
+	void *ud;
+	slbudget *b = NULL;
+	lua_Alloc f = lua_getallocf(L, &ud);
+	lua_close(L);
+	if (f == budget_alloc) {
+		b = (slbudget *)ud;
+		f = b->f;
+		ud = b->ud;
+		free(b);
+	}
+	if (f == slalloc_pool) slalloc_freepool((slpool *)ud);
+}
+
+//----------------------------------------------------------------------
+// arena states
+
+#define ARENA_SMALL 32			// 16-byte classes, up to 512
+#define ARENA_NCLASSES (ARENA_SMALL + 48)
+
+typedef struct slarena {
+	char *base;		// the arena (this header is at base)
+	size_t size;		// reserved size
+	size_t top;		// offset of the never used part
+	size_t hiwater;		// highest top since the template restore
+	void *free[ARENA_NCLASSES];	// free blocks per class
+	lua_State *L;		// the state (set by slarena_save)
+	int fd;			// template memfd, or -1
+	size_t tsize;		// template size (page multiple)
+} slarena;
+
+static int arena_class(size_t n, size_t *csize) {
+	int c = 0;
+	if (n <= SLALLOC_SMALLMAX) {
+		c = (n - 1) >> 4;
+		*csize = (size_t)(c + 1) << 4;
+		return c;
+	}
+	for (*csize = 1024, c = ARENA_SMALL; *csize < n; c++) *csize <<= 1;
+	return c;
+}
+
+static void *arena_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	slarena *a = (slarena *)ud;
+	size_t ocs, ncs;
+	int oc, nc;
+	void *nptr;
+	if (ptr == NULL) osize = 0;  // (osize is the object type)
+	oc = osize ? arena_class(osize, &ocs) : -1;
+	if (nsize == 0) {
+		if (ptr != NULL) {
+			*(void **)ptr = a->free[oc];
+			a->free[oc] = ptr;
+		}
+		return NULL;
+	}
+	nc = arena_class(nsize, &ncs);
+	if (nc == oc) return ptr;
+	if ((nptr = a->free[nc]) != NULL) {
+		a->free[nc] = *(void **)nptr;
+	} else {
+		if (ncs > a->size - a->top) 
+			// the arena is full. a block can shrink in place
+			return nsize <= osize ? ptr : NULL;
+		nptr = a->base + a->top;
+		a->top += ncs;
+		if (a->top > a->hiwater) a->hiwater = a->top;
+	}
+	if (ptr != NULL) {
+		memcpy(nptr, ptr, osize < nsize ? osize : nsize);
+		*(void **)ptr = a->free[oc];
+		a->free[oc] = ptr;
+	}
+	return nptr;
+}
+
+lua_State *slarena_newstate(size_t size) {
+	lua_State *L;
+	slarena *a;
+	char *base;
+	pthread_once(&region_once, region_init);  // (set pagesize)
+	size = (size + 4095) & ~(size_t)4095;
+	if (size < 65536) size = 65536;
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) return NULL;
+	a = (slarena *)base;
+	a->base = base;
+	a->size = size;
+	a->top = a->hiwater = (sizeof(slarena) + 15) & ~(size_t)15;
+	a->fd = -1;
+	L = luaL_newstatex(arena_alloc, a);
+	if (L == NULL) munmap(base, size);
+	return L;
+}
+
+static slarena *getarena(lua_State *L) {
+	void *ud;
+	if (lua_getallocf(L, &ud) != arena_alloc) return NULL;
+	return (slarena *)ud;
+}
+
+static void pushgco(lua_State *L, GCObject *o) {
+	// push an object of the finobj or tobefnz list (a table or a
+	// full userdata)
+	if (o->tt == LUA_VUSERDATA) {
+		setuvalue(L, s2v(L->top), gco2u(o));
+	} else {
+		sethvalue(L, s2v(L->top), gco2t(o));
+	}
+	L->top++;
+}
+
+static int harmlessfin(lua_State *L) {
+	// return true if the object with a finalizer at the top of the 
+	// stack can be kept in a template: a standard io file, or the 
+	// table of the loaded C libraries if it is empty
+	luaL_Stream *ls = luaL_testudata(L, -1, LUA_FILEHANDLE);
+	int r;
+	if (ls != NULL) 
+		return ls->f == stdin || ls->f == stdout || ls->f == stderr;
+	lua_getfield(L, LUA_REGISTRYINDEX, "_CLIBS");
+	r = lua_rawequal(L, -1, -2);
+	lua_pop(L, 1);
+	if (r) {
+		lua_pushnil(L);
+		r = (lua_next(L, -2) == 0);
+		if (!r) lua_pop(L, 2);
+	}
+	return r;
+}
+
+static int checkfin(lua_State *L) {
+	// return 0 if the objects with a finalizer of the state can be
+	// kept in a template, else -2. (this does not allocate, so no GC
+	// step modifies the lists)
+	GCObject *o;
+	int r = 0;
+	if (G(L)->tobefnz != NULL) return -2;
+	for (o = G(L)->finobj; o != NULL && r == 0; o = o->next) {
+		if (!lua_checkstack(L, 4)) return -2;
+		pushgco(L, o);
+		if (!harmlessfin(L)) r = -2;
+		lua_pop(L, 1);
+	}
+	return r;
+}
+
+static int callfin(lua_State *L) {
+	// call the finalizers of the objects on the stack
+	// (called in protected mode by runfin). errors are ignored, as
+	// in the Lua GC
+	int i, n = lua_gettop(L);
+	for (i = 1; i <= n; i++) {
+		if (luaL_getmetafield(L, i, "__gc") == LUA_TNIL) continue;
+		lua_pushvalue(L, i);
+		lua_pcall(L, 1, 0, 0);
+		lua_settop(L, n);
+	}
+	return 0;
+}
+
+static void runfin(lua_State *L) {
+	// call the finalizers of all the objects with a finalizer. The
+	// state is about to be discarded by a restore, so the objects 
+	// are not freed. The GC is stopped so that the lists are not 
+	// modified (and the template has the GC running, so the state 
+	// of the next run is not changed)
+	GCObject *o, *lists[2];
+	int i;
+	lua_gc(L, LUA_GCSTOP);
+	lua_settop(L, 0);
+	lua_pushcfunction(L, callfin);
+	lists[0] = G(L)->tobefnz;
+	lists[1] = G(L)->finobj;
+	for (i = 0; i < 2; i++) {
+		for (o = lists[i]; o != NULL; o = o->next) {
+			if (!lua_checkstack(L, 1)) break;
+			pushgco(L, o);
+		}
+	}
+	lua_pcall(L, lua_gettop(L) - 1, 0, 0);
+	lua_settop(L, 0);
+}
+
+int slarena_save(lua_State *L) {
+	slarena *a = getarena(L);
+	size_t n, done;
+	ssize_t r;
+	if (a == NULL) return -1;
+	// run the pending finalizers first, then check the others
+	lua_gc(L, LUA_GCCOLLECT);
+	if (checkfin(L) != 0) return -2;
+	if (a->fd >= 0) close(a->fd);
+	a->fd = memfd_create("slarena", MFD_CLOEXEC);
+	if (a->fd < 0) return -1;
+	a->L = L;
+	a->tsize = (a->top + pagesize - 1) & ~(pagesize - 1);
+	if (a->tsize > a->size) a->tsize = a->size;
+	a->hiwater = a->top;
+	// the header is written with the rest, so the template includes
+	// the current values of fd, tsize, ...
+	for (n = a->tsize, done = 0; done < n; done += r) {
+		r = pwrite(a->fd, a->base + done, n - done, done);
+		if (r <= 0) {
+			close(a->fd);
+			a->fd = -1;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+lua_State *slarena_restore(lua_State *L) {
+	slarena *a = getarena(L);
+	char *base;
+	size_t tsize, hiwater;
+	if (a == NULL || a->fd < 0) return NULL;
+	runfin(L);
+	// the header is replaced by the template one: keep the values 
+	// needed after the remap in local variables
+	base = a->base;
+	tsize = a->tsize;
+	hiwater = (a->hiwater + pagesize - 1) & ~(pagesize - 1);
+	if (mmap(base, tsize, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_FIXED, a->fd, 0) == MAP_FAILED)
+		return NULL;
+	// discard the pages used above the template
+	if (hiwater > tsize && mmap(base + tsize, hiwater - tsize, 
+		PROT_READ | PROT_WRITE, 
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, 
+		-1, 0) == MAP_FAILED)
+		return NULL;
+	return ((slarena *)base)->L;
+}
+
+void slarena_close(lua_State *L) {
+	slarena *a = getarena(L);
+	if (a == NULL) return;
+	runfin(L);
+	if (a->fd >= 0) close(a->fd);
+	munmap(a->base, a->size);
+}
+
+//----------------------------------------------------------------------
+// lua api
+
+static slbudget *getbudget(lua_State *L, lua_Alloc *inner) {
+	void *ud;
+	lua_Alloc f = lua_getallocf(L, &ud);
+	slbudget *b = NULL;
+	if (f == budget_alloc) {
+		b = (slbudget *)ud;
+		f = b->f;
+	}
+	if (inner) *inner = f;
+	return b;
+}
+
+static int ll_stats(lua_State *L) {
+	// lua api: stats() => table
+	// return the memory counters of the state:
+	//	allocator: "pool" or "libc"
+	//	total: live bytes
+	// with memory accounting (SLALLOC_BUDGET):
+	//	peak: peak live bytes, limit: hard limit (0 for no limit)
+	//	nfail: number of failed allocations
+	//	string, table, closure, userdata, thread, upvalue, proto, 
+	//	other: live bytes per category
+	lua_Alloc f;
+	slbudget *b = getbudget(L, &f);
+	int i;
+	lua_createtable(L, 0, 16);
+	lua_pushstring(L, f == slalloc_pool ? "pool" : "libc");
+	lua_setfield(L, -2, "allocator");
+	if (b == NULL) {
+		lua_pushinteger(L, 
+			(lua_Integer)lua_gc(L, LUA_GCCOUNT) * 1024
+			+ lua_gc(L, LUA_GCCOUNTB));
+		lua_setfield(L, -2, "total");
+		return 1;
+	}
+	lua_pushinteger(L, b->total); lua_setfield(L, -2, "total");
+	lua_pushinteger(L, b->peak); lua_setfield(L, -2, "peak");
+	lua_pushinteger(L, b->limit); lua_setfield(L, -2, "limit");
+	lua_pushinteger(L, b->nfail); lua_setfield(L, -2, "nfail");
+	for (i = 0; i < NCATS; i++) {
+		lua_pushinteger(L, b->cat[i]);
+		lua_setfield(L, -2, cat_names[i]);
+	}
+	return 1;
+}
+
+static int ll_setlimit(lua_State *L) {
+	// lua api: setlimit(n) => previous limit
+	// set the hard memory limit in bytes (0 for no limit). 
+	// allocations above the limit raise a memory error.
+	// return nil, msg if the state has no memory accounting.
+	slbudget *b = getbudget(L, NULL);
+	lua_Integer n = luaL_checkinteger(L, 1);
+	if (b == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "no memory accounting");
+		return 2;
+	}
+	if (n < 0) return luaL_argerror(L, 1, "negative limit");
+	lua_pushinteger(L, b->limit);
+	b->limit = n;
+	return 1;
+}
+
+static int ll_resetpeak(lua_State *L) {
+	// lua api: resetpeak() => previous peak
+	slbudget *b = getbudget(L, NULL);
+	if (b == NULL) return 0;
+	lua_pushinteger(L, b->peak);
+	b->peak = b->total;
+	return 1;
+}
+
+// arena objects
+
+#define ARENA_MT "slalloc.arena"
+#define ARENA_DEFAULT_SIZE ((size_t)256 << 20)
+
+typedef struct arenacall {
+	lua_State *L;		// the calling state
+	int first, nargs;	// arguments in L
+	const char *src;	// code to run in the arena state
+	size_t len;
+	int init;		// open the libraries first
+} arenacall;
+
+static void copyvalue(lua_State *from, int idx, lua_State *to) {
+	// push on 'to' a copy of the value at index idx in 'from'
+	size_t len;
+	const char *s;
+	switch (lua_type(from, idx)) {
+	case LUA_TNIL: lua_pushnil(to); break;
+	case LUA_TBOOLEAN: lua_pushboolean(to, lua_toboolean(from, idx)); break;
+	case LUA_TNUMBER:
+		if (lua_isinteger(from, idx))
+			lua_pushinteger(to, lua_tointeger(from, idx));
+		else lua_pushnumber(to, lua_tonumber(from, idx));
+		break;
+	case LUA_TSTRING:
+		s = lua_tolstring(from, idx, &len);
+		lua_pushlstring(to, s, len);
+		break;
+	default:
+		luaL_error(to, "cannot transfer a %s value",
+			luaL_typename(from, idx));
+	}
+}
+
+static int arena_pcall(lua_State *L) {
+	// run in the arena state L, in protected mode.
+	// (slualibs.h expects the state to be L)
+	arenacall *c = (arenacall *)lua_touserdata(L, 1);
+	int i;
+	lua_settop(L, 0);
+	if (c->init) {
+		luaL_openlibs(L);
+		#include "slualibs.h"
+	}
+	if (luaL_loadbuffer(L, c->src, c->len, "=arena") != LUA_OK)
+		return lua_error(L);
+	luaL_checkstack(L, c->nargs, "too many arguments");
+	for (i = 0; i < c->nargs; i++) copyvalue(c->L, c->first + i, L);
+	// the init results are not used (they may be any value)
+	lua_call(L, c->nargs, c->init ? 0 : LUA_MULTRET);
+	return lua_gettop(L);
+}
+
+static int arena_run(lua_State *L, lua_State *T, arenacall *c) {
+	// run c in T. push the results on L and return their number, or
+	// push nil, error msg and return -1
+	int n, i;
+	lua_pushcfunction(T, arena_pcall);
+	lua_pushlightuserdata(T, c);
+	if (lua_pcall(T, 1, LUA_MULTRET, 0) != LUA_OK) {
+		lua_pushnil(L);
+		if (lua_type(T, -1) == LUA_TSTRING) copyvalue(T, -1, L);
+		else lua_pushliteral(L, "error in arena state");
+		lua_settop(T, 0);
+		return -1;
+	}
+	n = lua_gettop(T);
+	for (i = 1; i <= n; i++) {
+		if (lua_type(T, i) > LUA_TSTRING 
+		    || lua_type(T, i) == LUA_TLIGHTUSERDATA) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "cannot transfer a %s value",
+				luaL_typename(T, i));
+			lua_settop(T, 0);
+			return -1;
+		}
+	}
+	luaL_checkstack(L, n, "too many results");
+	for (i = 1; i <= n; i++) copyvalue(T, i, L);
+	lua_settop(T, 0);
+	return n;
+}
+
+static lua_State **checkarena(lua_State *L) {
+	lua_State **pt = (lua_State **)luaL_checkudata(L, 1, ARENA_MT);
+	if (*pt == NULL) luaL_error(L, "arena is closed");
+	return pt;
+}
+
+static int ll_arena(lua_State *L) {
+	// lua api: arena(init [, size]) => arena object
+	// create an arena state with the standard and slua libraries. 
+	// run the Lua code 'init' in the state, then save the state as 
+	// the arena template (the values returned by init are ignored).
+	// size is the maximum memory of the state (defaults to 256MB).
+	// return nil, msg if init fails
+	arenacall c;
+	lua_State **pt;
+	lua_Integer size = luaL_optinteger(L, 2, ARENA_DEFAULT_SIZE);
+	luaL_argcheck(L, size > 0, 2, "invalid arena size");
+	lua_settop(L, 2);
+	c.src = luaL_checklstring(L, 1, &c.len);
+	c.L = L;
+	c.first = c.nargs = 0;
+	c.init = 1;
+	pt = (lua_State **)lua_newuserdatauv(L, sizeof(lua_State *), 0);
+	*pt = NULL;
+	luaL_setmetatable(L, ARENA_MT);
+	if ((*pt = slarena_newstate(size)) == NULL) 
+		luaL_error(L, "cannot create arena");
+	if (arena_run(L, *pt, &c) < 0) {
+		slarena_close(*pt);
+		*pt = NULL;
+		return 2;
+	}
+	lua_settop(L, 3);
+	switch (slarena_save(*pt)) {
+	case 0: return 1;
+	case -2:
+		slarena_close(*pt);
+		*pt = NULL;
+		lua_pushnil(L);
+		lua_pushliteral(L, "objects with a finalizer in the template");
+		return 2;
+	default: return luaL_error(L, "cannot save arena");
+	}
+}
+
+static int ll_arena_run(lua_State *L) {
+	// lua api: a:run(code, ...) => results
+	// restore the arena template, then run the Lua code with the 
+	// arguments. The state of the previous run is discarded.
+	// arguments and results are nil, booleans, numbers or strings.
+	// return nil, msg if the code fails
+	arenacall c;
+	lua_State **pt = checkarena(L);
+	lua_State *T;
+	int n;
+	c.src = luaL_checklstring(L, 2, &c.len);
+	c.L = L;
+	c.first = 3;
+	c.nargs = lua_gettop(L) - 2;
+	c.init = 0;
+	if ((T = slarena_restore(*pt)) == NULL) 
+		luaL_error(L, "cannot restore arena");
+	n = arena_run(L, T, &c);
+	return n < 0 ? 2 : n;
+}
+
+static int ll_arena_close(lua_State *L) {
+	// lua api: a:close()
+	// release the arena (the finalizers of the last run are called)
+	lua_State **pt = (lua_State **)luaL_checkudata(L, 1, ARENA_MT);
+	if (*pt != NULL) slarena_close(*pt);
+	*pt = NULL;
+	return 0;
+}
+
+static const struct luaL_Reg arena_methods[] = {
+	{"run", ll_arena_run},
+	{"close", ll_arena_close},
+	{"__gc", ll_arena_close},
+	{NULL, NULL},
+};
+
+static const struct luaL_Reg slalloclib[] = {
+	{"stats", ll_stats},
+	{"setlimit", ll_setlimit},
+	{"resetpeak", ll_resetpeak},
+	{"arena", ll_arena},
+	{NULL, NULL},
+};
+
+int luaopen_slalloc(lua_State *L) {
+	if (luaL_newmetatable(L, ARENA_MT)) {
+		luaL_setfuncs(L, arena_methods, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_pop(L, 1);
+	luaL_newlib(L, slalloclib);
+	return 1;
+}
@@ -0,0 +1,107 @@
+// Copyright (c) 2023  Phil Leblanc  -- see LICENSE file
+// ---------------------------------------------------------------------
+/*
+
+slalloc - pool memory allocator for Lua states
+
+The standard Lua allocator (l_alloc in lauxlib.c) uses realloc() and
+free() for every object. With the musl libc used for the static slua
+build, malloc is slow for the many small objects allocated by the Lua
+core (strings, tables, closures, upvalues, ...).
+
+The pool allocator serves blocks up to SLALLOC_SMALLMAX bytes from
+64KB slabs, one slab per size class. A pool belongs to one Lua state
+(so it is only used by one thread at a time, without locks). Empty
+slabs beyond a small number are returned to the OS (madvise), so the
+memory used after a peak is released. Larger blocks are allocated
+with malloc, which uses mmap for large sizes.
+
+The slabs are carved from an address range reserved once for the
+process (not committed until used). A block is known to be in a slab
+by its address, so a pool can be installed in a state that already
+has blocks allocated by the standard allocator.
+
+A state can also account its memory, per object category (strings,
+tables, closures, ...), and have a hard memory limit. The counters 
+and the limit are available from Lua with the slalloc library:
+	stats() => table of counters
+	setlimit(n) => previous limit
+	resetpeak() => previous peak
+	arena(init [, size]) => a  (an arena state cloned for each run)
+	a:run(code, ...) => results
+	a:close()
+
+*/
+
+#ifndef SLALLOC_H
+#define SLALLOC_H
+
+#include <stddef.h>
+
+#include "lua.h"
+
+// largest block size allocated in a slab
+#define SLALLOC_SMALLMAX 512
+
+typedef struct slpool slpool;
+
+// create a new pool. return NULL if there is not enough memory
+slpool *slalloc_newpool(void);
+
+// release the memory used by a pool. All the blocks allocated from
+// the pool must have been freed, or must no longer be used (eg. the
+// state using it has been closed)
+void slalloc_freepool(slpool *p);
+
+// the pool allocator function (a lua_Alloc). ud is the pool
+void *slalloc_pool(void *ud, void *ptr, size_t osize, size_t nsize);
+
+// flags for slalloc_newstate()
+#define SLALLOC_POOL 1		// use a pool allocator
+#define SLALLOC_BUDGET 2	// memory accounting and limit
+
+// create a new Lua state, as luaL_newstate(). 
+// flags: 0 for the standard allocator, else a combination of
+// SLALLOC_POOL and SLALLOC_BUDGET.
+// limit: with SLALLOC_BUDGET, the hard limit of the state memory in 
+// bytes (0 for no limit). Allocations above the limit fail, so they
+// raise a Lua memory error.
+lua_State *slalloc_newstate(int flags, size_t limit);
+
+// close a Lua state, and release its pool and counters
+void slalloc_close(lua_State *L);
+
+// arena states. The memory of an arena state is in a reserved address
+// range of 'size' bytes, allocated only by this state.
+// slarena_newstate(size) creates a new arena state (as luaL_newstate)
+lua_State *slarena_newstate(size_t size);
+
+// save the current content of the arena as its template. return 0, 
+// or -1 on error (not an arena state, or cannot create the memfd).
+// A restore puts back the memory of the template, but not the C 
+// resources its objects refer to (a FILE *, malloc'd memory, a 
+// mapping, a thread...): an object freed by a run would be used 
+// again, or freed again, by the next run. So the template cannot
+// hold objects with a finalizer (__gc), except the standard io
+// files. A full GC is done first, then if the state still holds such
+// objects, slarena_save() returns -2. (eg. a template can require 
+// luazen, but not create an lzma encoder, or open a file)
+int slarena_save(lua_State *L);
+
+// restore the template saved by slarena_save(), and return the 
+// template state. The current content of the arena is discarded. 
+// the finalizers of the objects of the discarded state are called
+// first (all of them, even if they are still reachable), so the C
+// resources of the previous run are released.
+// return NULL on error. 
+lua_State *slarena_restore(lua_State *L);
+
+// release an arena state. Objects are not freed one by one: the 
+// finalizers (__gc) are called as by slarena_restore(), then the 
+// arena is unmapped. (__close variables are not closed)
+void slarena_close(lua_State *L);
+
+// the slalloc Lua library (memory counters and limit)
+int luaopen_slalloc(lua_State *L);
+
+#endif
@@ -0,0 +1,343 @@
+// Copyright (c) 2023  Phil Leblanc  -- see LICENSE file
+// ---------------------------------------------------------------------
+/*
+
+slbuf - mutable byte buffers shared by the slua libraries
+
+The memory of a new buffer is allocated by Lua just after the slbuf 
+header, in the same userdata, so it is automatically collected.
+A view refers to a range of another buffer. The other buffer is 
+stored as the view user value, so it cannot be collected before the 
+view.
+
+All indices are 1-based, as for Lua strings. All accesses are
+bounds-checked.
+
+Lua methods:
+	#b => buffer size in bytes
+	b:get([i [, j]]) => string  (bytes i to j, as string.sub)
+	b:put(idx, s) => idx + #s  (s is a string or a buffer)
+	b:fill(byte [, idx, cnt]) => b
+	b:getuint(idx, isize) => i  (isize = 1, 2, 4 or 8)
+	b:getint(idx, isize) => i  (same for signed integers)
+	b:putuint(idx, i, isize) => b
+	b:view([i [, j]]) => v  (a buffer sharing bytes i to j of b)
+	b:find(s [, init]) => i, j | nil
+	b:addr([idx]) => address of byte idx, as an integer
+
+*/
+
+#define _GNU_SOURCE	// memmem
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "slbuf.h"
+
+
+#define LERR(msg) return luaL_error(L, msg)
+
+
+static lua_Integer posrelat(lua_Integer pos, size_t len) {
+	// same as string.sub index handling
+	if (pos >= 0) return pos;
+	else if (0u - (size_t)pos > len) return 0;
+	else return (lua_Integer)len + pos + 1;
+}
+
+static int ll_len(lua_State *L) {
+	slbuf *b = slbuf_check(L, 1);
+	lua_pushinteger(L, b->len);
+	return 1;
+}
+
+static int ll_get(lua_State *L) {
+	// lua api: b:get([i [, j]]) => string
+	// return bytes i to j as a string (i, j as in string.sub)
+	slbuf *b = slbuf_check(L, 1);
+	lua_Integer i = posrelat(luaL_optinteger(L, 2, 1), b->len);
+	lua_Integer j = posrelat(luaL_optinteger(L, 3, -1), b->len);
+	if (i < 1) i = 1;
+	if (j > (lua_Integer)b->len) j = b->len;
+	if (i > j) lua_pushliteral(L, "");
+	else lua_pushlstring(L, b->ptr + i - 1, j - i + 1);
+	return 1;
+}
+
+static int ll_put(lua_State *L) {
+	// lua api: b:put(idx, s) => idx + #s
+	// copy string or buffer s in b at index idx
+	size_t sln;
+	const char *s;
+	slbuf *b = slbuf_check(L, 1);
+	lua_Integer idx = luaL_checkinteger(L, 2);
+	slbuf *sb = slbuf_test(L, 3);
+	slbuf_checkwrite(L, b);
+	if (sb) { s = sb->ptr; sln = sb->len; }
+	else s = luaL_checklstring(L, 3, &sln);
+	if (idx < 1 || sln > b->len || (size_t)idx - 1 > b->len - sln)
+		LERR("out of range");
+	memmove(b->ptr + idx - 1, s, sln);
+	lua_pushinteger(L, idx + sln);
+	return 1;
+}
+
+static int ll_fill(lua_State *L) {
+	// lua api: b:fill(byte [, idx, cnt]) => b
+	// set cnt bytes at index idx to value byte
+	size_t cnt;
+	slbuf *b = slbuf_check(L, 1);
+	int c = luaL_checkinteger(L, 2);
+	char *p = slbuf_range(L, b, 3, &cnt);
+	slbuf_checkwrite(L, b);
+	memset(p, c, cnt);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static char *checkint(lua_State *L, slbuf *b, int argi, int *sz) {
+	// check arguments idx at argi, isize at argi+1 
+	// return the integer address
+	lua_Integer idx = luaL_checkinteger(L, argi);
+	*sz = luaL_checkinteger(L, argi + 1);
+	if (*sz != 1 && *sz != 2 && *sz != 4 && *sz != 8)
+		luaL_error(L, "invalid integer size");
+	if (idx < 1 || (size_t)*sz > b->len 
+		|| (size_t)idx - 1 > b->len - *sz)
+		luaL_error(L, "out of range");
+	return b->ptr + idx - 1;
+}
+
+static int getint(lua_State *L, int sign) {
+	// integers are stored with the native byte order.
+	// addresses may be unaligned, so use memcpy
+	int sz;
+	slbuf *b = slbuf_check(L, 1);
+	char *p = checkint(L, b, 2, &sz);
+	uint8_t i8; uint16_t i16; uint32_t i32; uint64_t i64;
+	lua_Integer i;
+	switch (sz) {
+		case 1: memcpy(&i8, p, 1); i = sign ? (int8_t)i8 : i8; break;
+		case 2: memcpy(&i16, p, 2); i = sign ? (int16_t)i16 : i16; break;
+		case 4: memcpy(&i32, p, 4);
+			i = sign ? (lua_Integer)(int32_t)i32 : i32; break;
+		default: memcpy(&i64, p, 8); i = i64; break;
+	}
+	lua_pushinteger(L, i);
+	return 1;
+}
+
+static int ll_getuint(lua_State *L) {
+	// lua api: b:getuint(idx, isize) => i
+	// get the unsigned integer of size isize at index idx
+	return getint(L, 0);
+}
+
+static int ll_getint(lua_State *L) {
+	// lua api: b:getint(idx, isize) => i
+	// get the signed integer of size isize at index idx
+	return getint(L, 1);
+}
+
+static int ll_putuint(lua_State *L) {
+	// lua api: b:putuint(idx, i, isize) => b
+	// put integer i at index idx. isize is the integer size in bytes
+	// (1, 2, 4 or 8). i is truncated to isize bytes.
+	int sz;
+	slbuf *b = slbuf_check(L, 1);
+	lua_Integer i = luaL_checkinteger(L, 3);
+	slbuf_checkwrite(L, b);
+	lua_rotate(L, 3, 1);  // checkint expects isize after idx
+	char *p = checkint(L, b, 2, &sz);
+	uint8_t i8 = i; uint16_t i16 = i; uint32_t i32 = i; uint64_t i64 = i;
+	switch (sz) {
+		case 1: memcpy(p, &i8, 1); break;
+		case 2: memcpy(p, &i16, 2); break;
+		case 4: memcpy(p, &i32, 4); break;
+		default: memcpy(p, &i64, 8); break;
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int ll_view(lua_State *L) {
+	// lua api: b:view([i [, j]]) => v
+	// return a buffer v sharing bytes i to j of b (i, j as in 
+	// string.sub). writing in v writes in b.
+	slbuf *b = slbuf_check(L, 1);
+	lua_Integer i = posrelat(luaL_optinteger(L, 2, 1), b->len);
+	lua_Integer j = posrelat(luaL_optinteger(L, 3, -1), b->len);
+	if (i < 1) i = 1;
+	if (j > (lua_Integer)b->len) j = b->len;
+	if (i > j) j = i - 1;  // empty view
+	slbuf_wrap(L, b->ptr + i - 1, j - i + 1, NULL, 1)->readonly = 
+		b->readonly;
+	return 1;
+}
+
+static int ll_find(lua_State *L) {
+	// lua api: b:find(s [, init]) => i, j | nil
+	// find s (a string, a buffer or a byte value) in b, starting at
+	// index init (as string.find(b, s, init, true)). return the 
+	// indices of the first and last bytes of s in b, or nil
+	slbuf *b = slbuf_check(L, 1);
+	lua_Integer init = posrelat(luaL_optinteger(L, 3, 1), b->len);
+	const char *s, *p;
+	char c;
+	size_t sln;
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		c = (char)luaL_checkinteger(L, 2);
+		s = &c;
+		sln = 1;
+	} else s = slbuf_checkdata(L, 2, &sln);
+	if (init < 1) init = 1;
+	if ((size_t)init > b->len + 1 || sln > b->len - init + 1) {
+		lua_pushnil(L);
+		return 1;
+	}
+	if (sln == 1) p = memchr(b->ptr + init - 1, s[0], b->len - init + 1);
+	else p = memmem(b->ptr + init - 1, b->len - init + 1, s, sln);
+	if (p == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushinteger(L, p - b->ptr + 1);
+	lua_pushinteger(L, p - b->ptr + sln);
+	return 2;
+}
+
+static int ll_addr(lua_State *L) {
+	// lua api: b:addr([idx]) => address
+	// return the address of byte idx as an integer (idx defaults 
+	// to 1). This is intended for the lsccore raw syscall interface.
+	slbuf *b = slbuf_check(L, 1);
+	lua_Integer idx = luaL_optinteger(L, 2, 1);
+	if (idx < 1 || (size_t)idx > b->len + 1) LERR("out of range");
+	lua_pushinteger(L, (lua_Integer)(long)(b->ptr + idx - 1));
+	return 1;
+}
+
+static int ll_gc(lua_State *L) {
+	slbuf *b = slbuf_check(L, 1);
+	if (b->release) b->release(b);
+	b->release = NULL;
+	b->len = 0;
+	// the owner is the view user value: it is not freed yet
+	if (b->owner) b->owner->nrefs--;
+	b->owner = NULL;
+	return 0;
+}
+
+static int ll_tostring(lua_State *L) {
+	slbuf *b = slbuf_check(L, 1);
+	lua_pushfstring(L, "slbuf: %p (%I bytes)",
+		(void *)b, (lua_Integer)b->len);
+	return 1;
+}
+
+static const struct luaL_Reg slbuf_methods[] = {
+	{"get", ll_get},
+	{"put", ll_put},
+	{"fill", ll_fill},
+	{"getuint", ll_getuint},
+	{"getint", ll_getint},
+	{"putuint", ll_putuint},
+	{"view", ll_view},
+	{"find", ll_find},
+	{"addr", ll_addr},
+	{"__len", ll_len},
+	{"__gc", ll_gc},
+	{"__tostring", ll_tostring},
+	{NULL, NULL},
+};
+
+static void slbuf_meta(lua_State *L) {
+	// push the buffer metatable. create it the first time.
+	if (luaL_newmetatable(L, SLBUF_MT)) {
+		luaL_setfuncs(L, slbuf_methods, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+}
+
+slbuf *slbuf_new(lua_State *L, size_t size) {
+	slbuf *b = lua_newuserdatauv(L, sizeof(slbuf) + size, 0);
+	b->ptr = (char *)(b + 1);
+	b->len = size;
+	b->release = NULL;
+	b->readonly = 0;
+	b->nrefs = 0;
+	b->owner = NULL;
+	memset(b->ptr, 0, size);
+	slbuf_meta(L);
+	lua_setmetatable(L, -2);
+	return b;
+}
+
+slbuf *slbuf_wrap(lua_State *L, char *ptr, size_t len,
+		void (*release)(slbuf *b), int owner) {
+	if (owner) owner = lua_absindex(L, owner);
+	slbuf *b = lua_newuserdatauv(L, sizeof(slbuf), 1);
+	b->ptr = ptr;
+	b->len = len;
+	b->release = release;
+	b->readonly = 0;
+	b->nrefs = 0;
+	b->owner = NULL;
+	if (owner) {
+		lua_pushvalue(L, owner);
+		lua_setiuservalue(L, -2, 1);
+		if ((b->owner = slbuf_test(L, owner)) != NULL)
+			b->owner->nrefs++;
+	}
+	slbuf_meta(L);
+	lua_setmetatable(L, -2);
+	return b;
+}
+
+slbuf *slbuf_check(lua_State *L, int idx) {
+	return (slbuf *) luaL_checkudata(L, idx, SLBUF_MT);
+}
+
+slbuf *slbuf_test(lua_State *L, int idx) {
+	return (slbuf *) luaL_testudata(L, idx, SLBUF_MT);
+}
+
+void slbuf_checkwrite(lua_State *L, slbuf *b) {
+	if (b->readonly) luaL_error(L, "read-only buffer");
+}
+
+char *slbuf_range(lua_State *L, slbuf *b, int argi, size_t *cnt) {
+	lua_Integer idx = luaL_optinteger(L, argi, 1);
+	lua_Integer n;
+	if (idx < 1 || (size_t)idx > b->len + 1)
+		luaL_error(L, "out of range");
+	n = luaL_optinteger(L, argi + 1, b->len - idx + 1);
+	if (n < 0 || (size_t)n > b->len - idx + 1)
+		luaL_error(L, "out of range");
+	*cnt = n;
+	return b->ptr + idx - 1;
+}
+
+const char *slbuf_checkdata(lua_State *L, int idx, size_t *len) {
+	slbuf *b = slbuf_test(L, idx);
+	if (b == NULL) return luaL_checklstring(L, idx, len);
+	*len = b->len;
+	return b->ptr;
+}
+
+char *slbuf_optout(lua_State *L, int argi, size_t *avail) {
+	slbuf *b;
+	lua_Integer idx;
+	if (lua_isnoneornil(L, argi)) return NULL;
+	b = slbuf_check(L, argi);
+	slbuf_checkwrite(L, b);
+	idx = luaL_optinteger(L, argi + 1, 1);
+	if (idx < 1 || (size_t)idx > b->len + 1) 
+		luaL_error(L, "out of range");
+	*avail = b->len - idx + 1;
+	return b->ptr + idx - 1;
+}
@@ -0,0 +1,85 @@
+// Copyright (c) 2023  Phil Leblanc  -- see LICENSE file
+// ---------------------------------------------------------------------
+/*
+
+slbuf - mutable byte buffers shared by the slua libraries
+
+A buffer is a full userdata with a fixed size. It is collected by
+the Lua GC like any other object. It can be used by the lualinux I/O
+functions to read or write data in place, without creating a new Lua
+string for each operation, and by lsccore as a safe replacement for
+raw memory addresses.
+
+A buffer either owns its memory (allocated by Lua in the userdata
+itself), or refers to memory owned by something else: another buffer
+(a view), or external memory released by the 'release' function
+when the buffer is collected.
+
+A buffer can be read-only (eg. a read-only file mapping): the
+functions which write in a buffer must call slbuf_checkwrite().
+
+'nrefs' counts the views of a buffer and the other objects which keep 
+a pointer in the buffer memory (eg. slshm rings). External memory 
+must not be released early (eg. lualinux.munmap) while nrefs > 0.
+
+*/
+
+#ifndef SLBUF_H
+#define SLBUF_H
+
+#include <stddef.h>
+
+#include "lua.h"
+
+// buffer metatable name (in the Lua registry)
+#define SLBUF_MT "slbuf"
+
+typedef struct slbuf {
+	char *ptr;	// address of the first byte of the buffer
+	size_t len;	// buffer size in bytes
+	// called when the buffer is collected or freed (may be NULL)
+	void (*release)(struct slbuf *b);
+	int readonly;	// writes raise an error
+	int nrefs;	// number of views and other users of the memory
+	struct slbuf *owner;	// for a view, the viewed buffer
+} slbuf;
+
+// create a new buffer of 'size' bytes (initialized with null bytes)
+// and push it on the stack
+slbuf *slbuf_new(lua_State *L, size_t size);
+
+// push a new buffer for the external memory block (ptr, len).
+// release(b) is called when the buffer is collected. If 'owner' is
+// not 0, the value at this stack index is kept alive as long as the
+// buffer is alive (used for views). If it is a buffer, its nrefs is
+// incremented until the new buffer is collected
+slbuf *slbuf_wrap(lua_State *L, char *ptr, size_t len,
+	void (*release)(slbuf *b), int owner);
+
+// return the buffer at stack index 'idx', or raise an error
+slbuf *slbuf_check(lua_State *L, int idx);
+
+// return the buffer at stack index 'idx', or NULL if not a buffer
+slbuf *slbuf_test(lua_State *L, int idx);
+
+// raise an error if buffer b is read-only
+void slbuf_checkwrite(lua_State *L, slbuf *b);
+
+// check the optional (idx, cnt) arguments at stack index 'argi' and
+// 'argi+1' describing a range in buffer b. idx is 1-based and
+// defaults to 1. cnt defaults to the rest of the buffer.
+// return the range address and set *cnt
+char *slbuf_range(lua_State *L, slbuf *b, int argi, size_t *cnt);
+
+// return the address and length of the string or buffer at stack 
+// index 'idx', or raise an error (for functions accepting both)
+const char *slbuf_checkdata(lua_State *L, int idx, size_t *len);
+
+// optional output buffer: if the value at stack index 'argi' is nil
+// or none, return NULL. Else it must be a writable buffer b, with an
+// optional 1-based index idx at 'argi+1' (default 1). Return the 
+// address of byte idx in b and set *avail to the number of bytes from
+// idx to the end of b
+char *slbuf_optout(lua_State *L, int argi, size_t *avail);
+
+#endif
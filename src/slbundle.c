@@ -0,0 +1,199 @@
+// Copyright (c) 2023  Phil Leblanc  -- see LICENSE file
+// ---------------------------------------------------------------------
+/*
+
+slbundle - files embedded in a srlua executable  (see slbundle.h)
+
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "slbuf.h"
+#include "slbundle.h"
+
+static const char *bundle;	// the bundle, or NULL
+static const slbundle_entry *entries;
+static const uint32_t *buckets;
+static uint32_t count, nbuckets;
+
+uint32_t slbundle_hash(const char *s, size_t n) {
+	uint32_t h = 2166136261u;
+	size_t i;
+	for (i = 0; i < n; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+	return h;
+}
+
+int slbundle_init(const char *p, size_t len) {
+	const slbundle_hdr *hdr = (const slbundle_hdr *)p;
+	const slbundle_entry *e;
+	const uint32_t *b;
+	size_t dir;
+	uint32_t i;
+	if (len < sizeof(slbundle_hdr)
+	    || memcmp(hdr->magic, SLBUNDLE_MAGIC, sizeof(hdr->magic)) != 0
+	    || hdr->nbuckets <= hdr->count
+	    || (hdr->nbuckets & (hdr->nbuckets - 1)) != 0)
+		return -1;
+	dir = sizeof(slbundle_hdr) + hdr->count * sizeof(slbundle_entry)
+		+ (size_t)hdr->nbuckets * sizeof(uint32_t);
+	if (dir > len) return -1;
+	e = (const slbundle_entry *)(p + sizeof(slbundle_hdr));
+	b = (const uint32_t *)(e + hdr->count);
+	// check all the offsets once, so lookups need no check
+	for (i = 0; i < hdr->count; i++) {
+		if (e[i].name < dir || e[i].name >= len
+		    || e[i].namelen >= len - e[i].name
+		    || p[e[i].name + e[i].namelen] != '\0'
+		    || e[i].data > len || e[i].len > len - e[i].data)
+			return -1;
+	}
+	for (i = 0; i < hdr->nbuckets; i++)
+		if (b[i] > hdr->count) return -1;
+	bundle = p;
+	entries = e;
+	buckets = b;
+	count = hdr->count;
+	nbuckets = hdr->nbuckets;
+	return 0;
+}
+
+static const slbundle_entry *find(const char *name, size_t namelen) {
+	uint32_t h, i, k;
+	if (bundle == NULL) return NULL;
+	h = slbundle_hash(name, namelen);
+	for (i = h & (nbuckets - 1); (k = buckets[i]) != 0;
+			i = (i + 1) & (nbuckets - 1)) {
+		const slbundle_entry *e = &entries[k - 1];
+		if (e->hash == h && e->namelen == namelen
+		    && memcmp(bundle + e->name, name, namelen) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+const char *slbundle_find(const char *name, size_t namelen, size_t *len) {
+	const slbundle_entry *e = find(name, namelen);
+	if (e == NULL) return NULL;
+	*len = e->len;
+	return bundle + e->data;
+}
+
+//----------------------------------------------------------------------
+// package.searchers entry
+
+static const slbundle_entry *findmodule(lua_State *L, const char *name) {
+	// push the entry name for module 'name' and return the entry,
+	// or push the "not found" message and return NULL
+	const char *path = luaL_gsub(L, name, ".", "/");
+	const char *fn = lua_pushfstring(L, "%s.lua", path);
+	const slbundle_entry *e = find(fn, strlen(fn));
+	if (e == NULL) {
+		lua_pop(L, 1);
+		fn = lua_pushfstring(L, "%s/init.lua", path);
+		e = find(fn, strlen(fn));
+	}
+	if (e == NULL) {
+		lua_pushfstring(L, "no bundle entry '%s.lua' or '%s'",
+			path, fn);
+		lua_remove(L, -2);  // entry name
+	}
+	lua_remove(L, -2);  // path
+	return e;
+}
+
+static int searcher(lua_State *L) {
+	// lua api: searcher(modname) => loader, entry name | errmsg
+	const char *name = luaL_checkstring(L, 1);
+	const slbundle_entry *e = findmodule(L, name);
+	const char *fn;
+	if (e == NULL) return 1;  // error message
+	fn = lua_tostring(L, -1);
+	lua_pushfstring(L, "@%s", fn);
+	if (luaL_loadbufferx(L, bundle + e->data, e->len,
+			lua_tostring(L, -1), NULL) != LUA_OK)
+		return luaL_error(L,
+			"error loading module '%s' from bundle entry '%s':\n\t%s",
+			name, fn, lua_tostring(L, -1));
+	lua_remove(L, -2);  // chunk name
+	lua_insert(L, -2);  // loader, entry name
+	return 2;
+}
+
+void slbundle_install(lua_State *L) {
+	// insert the searcher in package.searchers, after the preload
+	// searcher
+	lua_Integer i, n;
+	lua_getglobal(L, "package");
+	if (lua_getfield(L, -1, "searchers") == LUA_TTABLE) {
+		n = luaL_len(L, -1);
+		for (i = n; i >= 2; i--) {
+			lua_rawgeti(L, -1, i);
+			lua_rawseti(L, -2, i + 1);
+		}
+		lua_pushcfunction(L, searcher);
+		lua_rawseti(L, -2, 2);
+	}
+	lua_pop(L, 2);
+}
+
+//----------------------------------------------------------------------
+// lua api
+
+static int ll_list(lua_State *L) {
+	// lua api: list() => list of entry names
+	uint32_t i;
+	lua_createtable(L, count, 0);
+	for (i = 0; i < count; i++) {
+		lua_pushlstring(L, bundle + entries[i].name,
+			entries[i].namelen);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+static const slbundle_entry *checkentry(lua_State *L) {
+	// return the entry for the name at index 1, or push nil and
+	// the error message and return NULL
+	size_t namelen;
+	const char *name = luaL_checklstring(L, 1, &namelen);
+	const slbundle_entry *e = find(name, namelen);
+	if (e == NULL) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "no bundle entry '%s'", name);
+	}
+	return e;
+}
+
+static int ll_read(lua_State *L) {
+	// lua api: read(name) => string | nil, errmsg
+	const slbundle_entry *e = checkentry(L);
+	if (e == NULL) return 2;
+	lua_pushlstring(L, bundle + e->data, e->len);
+	return 1;
+}
+
+static int ll_slice(lua_State *L) {
+	// lua api: slice(name) => slbuf | nil, errmsg
+	const slbundle_entry *e = checkentry(L);
+	if (e == NULL) return 2;
+	// the mapping is read-only and never released
+	slbuf_wrap(L, (char *)bundle + e->data, e->len, NULL, 0)
+		->readonly = 1;
+	return 1;
+}
+
+static const struct luaL_Reg slbundlelib[] = {
+	{"list", ll_list},
+	{"read", ll_read},
+	{"slice", ll_slice},
+	{NULL, NULL},
+};
+
+int luaopen_slbundle(lua_State *L) {
+	luaL_newlib(L, slbundlelib);
+	return 1;
+}
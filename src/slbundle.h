@@ -0,0 +1,84 @@
+// Copyright (c) 2023  Phil Leblanc  -- see LICENSE file
+// ---------------------------------------------------------------------
+/*
+
+slbundle - files embedded in a srlua executable
+
+srglue can append a bundle of files (Lua modules and data files) after
+the main program:
+
+	srglue [-c|-s] srlua main.lua app  mod/a.lua mod/b.lua data.txt
+
+The files are stored under their name as given on the command line.
+With -c or -s, the .lua files are compiled (and stripped) as the main
+program.
+
+srlua maps the executable and keeps the bundle mapped for the life of
+the process (private read-only mapping). A package.searchers entry
+(after the preload searcher) loads the module "mod.a" from the bundle
+entry "mod/a.lua" or "mod/a/init.lua", without any file system
+access. The chunk name is "@" .. entry name.
+
+Bundle layout (all offsets from the bundle start, 8-byte aligned,
+the bundle start is 8-byte aligned in the executable):
+	header
+	entries[count], sorted by name
+	buckets[nbuckets] - hash table: entry index + 1, or 0 if empty.
+		nbuckets is a power of 2 larger than count, collisions
+		use the next bucket (linear probing)
+	names (null-terminated)
+	data
+
+Lua functions (library "slbundle"):
+	list() => list of the entry names (sorted)
+	read(name) => string | nil, errmsg
+	slice(name) => slbuf | nil, errmsg
+		the entry data as a buffer (see slbuf.h) referring to the
+		mapped executable (no copy). The buffer is read-only.
+
+In slua, or in a srlua program without bundle, the bundle is empty.
+
+*/
+
+#ifndef SLBUNDLE_H
+#define SLBUNDLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lua.h"
+
+#define SLBUNDLE_MAGIC "%%slbndl"
+
+typedef struct slbundle_hdr {
+	char magic[8];
+	uint32_t count;		// number of entries
+	uint32_t nbuckets;	// hash table size
+} slbundle_hdr;
+
+typedef struct slbundle_entry {
+	uint64_t name;		// offset of the entry name
+	uint64_t data;		// offset of the entry data
+	uint64_t len;		// data length
+	uint32_t namelen;	// name length (without the null byte)
+	uint32_t hash;		// slbundle_hash(name)
+} slbundle_entry;
+
+// hash of the name (s, n) - FNV-1a
+uint32_t slbundle_hash(const char *s, size_t n);
+
+// use the bundle at address p (len bytes, 8-byte aligned). the memory
+// must not be released. return 0, or -1 if the bundle is not valid
+int slbundle_init(const char *p, size_t len);
+
+// return the address of the data of the entry 'name' and set *len,
+// or return NULL if there is no such entry
+const char *slbundle_find(const char *name, size_t namelen, size_t *len);
+
+// add the bundle searcher to package.searchers
+void slbundle_install(lua_State *L);
+
+// the slbundle Lua library
+int luaopen_slbundle(lua_State *L);
+
+#endif
@@ -0,0 +1,246 @@
+// Copyright (c) 2023  Phil Leblanc  -- see LICENSE file
+// ---------------------------------------------------------------------
+/*
+
+slcache - compiled chunk cache for luaL_loadfilex  (see slcache.h)
+
+Entry file: a fixed size header (the key), the file name as given to
+the loader, then the lua_dump output. The entry file name is a hash
+of the absolute path and of the given file name.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "luazen-2.1/mono/monocypher.h"
+
+#include "slcache.h"
+
+#define MAGIC "slcache1"	// entry format version
+
+typedef struct {
+	char magic[8];
+	int64_t dev, ino, size;		// 0 with SLCACHE_HASH
+	int64_t mtime, mtimens;		// 0 with SLCACHE_HASH
+	uint8_t hash[32];		// content hash (SLCACHE_HASH)
+	int32_t flags;
+	int32_t namelen;		// length of the file name
+} Header;
+
+static char cachedir[PATH_MAX];
+static int cacheflags;
+
+static int readall(int fd, char *p, size_t n) {
+	// return 0, or -1 on error or early end of file
+	while (n > 0) {
+		ssize_t r = read(fd, p, n);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return -1;
+		p += r;
+		n -= r;
+	}
+	return 0;
+}
+
+static int writeall(int fd, const char *p, size_t n) {
+	while (n > 0) {
+		ssize_t r = write(fd, p, n);
+		if (r < 0 && errno == EINTR) continue;
+		if (r < 0) return -1;
+		p += r;
+		n -= r;
+	}
+	return 0;
+}
+
+static int hashfile(const char *filename, uint8_t *hash) {
+	crypto_blake2b_ctx ctx;
+	char buf[16384];
+	ssize_t r;
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return -1;
+	crypto_blake2b_general_init(&ctx, 32, NULL, 0);
+	while ((r = read(fd, buf, sizeof(buf))) != 0) {
+		if (r < 0 && errno == EINTR) continue;
+		if (r < 0) break;
+		crypto_blake2b_update(&ctx, (uint8_t *)buf, r);
+	}
+	close(fd);
+	crypto_blake2b_final(&ctx, hash);
+	return (r < 0) ? -1 : 0;
+}
+
+static int makekey(Header *h, const char *filename, struct stat *st) {
+	memset(h, 0, sizeof(Header));
+	memcpy(h->magic, MAGIC, sizeof(h->magic));
+	h->flags = cacheflags;
+	h->namelen = strlen(filename);
+	// with SLCACHE_HASH, the key is only the content hash (a copy
+	// of the file renamed over it is the same file)
+	if (cacheflags & SLCACHE_HASH) return hashfile(filename, h->hash);
+	h->dev = st->st_dev;
+	h->ino = st->st_ino;
+	h->size = st->st_size;
+	h->mtime = st->st_mtim.tv_sec;
+	h->mtimens = st->st_mtim.tv_nsec;
+	return 0;
+}
+
+static int samefile(Header *h, const char *filename) {
+	// true if the file has not changed since makekey()
+	struct stat st;
+	uint8_t hash[32];
+	if (cacheflags & SLCACHE_HASH)
+		return hashfile(filename, hash) == 0
+			&& memcmp(hash, h->hash, sizeof(hash)) == 0;
+	return stat(filename, &st) == 0 && h->size == st.st_size
+		&& h->dev == (int64_t)st.st_dev && h->ino == (int64_t)st.st_ino
+		&& h->mtime == st.st_mtim.tv_sec
+		&& h->mtimens == st.st_mtim.tv_nsec;
+}
+
+static int entryname(char *name, const char *filename) {
+	// return the path of the cache entry for filename in 'name'
+	// (PATH_MAX bytes). return 0, or -1 on error
+	char path[PATH_MAX];
+	uint8_t hash[16];
+	char hex[2 * sizeof(hash) + 1];
+	crypto_blake2b_ctx ctx;
+	size_t i;
+	int n;
+	if (realpath(filename, path) == NULL) return -1;
+	crypto_blake2b_general_init(&ctx, sizeof(hash), NULL, 0);
+	crypto_blake2b_update(&ctx, (uint8_t *)path, strlen(path) + 1);
+	crypto_blake2b_update(&ctx, (uint8_t *)filename, strlen(filename));
+	crypto_blake2b_final(&ctx, hash);
+	for (i = 0; i < sizeof(hash); i++)
+		sprintf(hex + 2 * i, "%02x", hash[i]);
+	n = snprintf(name, PATH_MAX, "%s/%s.luac", cachedir, hex);
+	return (n < 0 || n >= PATH_MAX) ? -1 : 0;
+}
+
+static int loadentry(lua_State *L, const char *name, Header *h,
+		const char *filename) {
+	// load the chunk from the cache entry. return LUA_OK, or -1
+	// if there is no valid entry (nothing is pushed)
+	size_t hlen = sizeof(Header) + h->namelen;
+	struct stat st;
+	char *buf;
+	int status = -1;
+	int fd;
+	lua_pushfstring(L, "@%s", filename);  // chunk name
+	if ((fd = open(name, O_RDONLY | O_CLOEXEC)) < 0) {
+		lua_pop(L, 1);
+		return -1;
+	}
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+	    && st.st_uid == geteuid() && (size_t)st.st_size > hlen
+	    && (buf = malloc(st.st_size)) != NULL) {
+		if (readall(fd, buf, st.st_size) == 0
+		    && memcmp(buf, h, sizeof(Header)) == 0
+		    && memcmp(buf + sizeof(Header), filename,
+				h->namelen) == 0) {
+			// lundump rejects another Lua version or format
+			status = luaL_loadbufferx(L, buf + hlen,
+				st.st_size - hlen, lua_tostring(L, -1), "b");
+			if (status != LUA_OK) {
+				lua_pop(L, 1);  // error message
+				status = -1;
+			}
+		}
+		free(buf);
+	}
+	close(fd);
+	lua_remove(L, (status == LUA_OK) ? -2 : -1);  // chunk name
+	return status;
+}
+
+typedef struct {
+	char *p;
+	size_t n, size;
+} Dump;
+
+static int writer(lua_State *L, const void *p, size_t sz, void *ud) {
+	Dump *d = (Dump *)ud;
+	(void)L;
+	if (d->n + sz > d->size) {
+		size_t size = 2 * d->size + sz;
+		char *q = realloc(d->p, size);
+		if (q == NULL) return 1;
+		d->p = q;
+		d->size = size;
+	}
+	memcpy(d->p + d->n, p, sz);
+	d->n += sz;
+	return 0;
+}
+
+static void saveentry(lua_State *L, const char *name, Header *h,
+		const char *filename) {
+	// write the function on the stack top to the cache entry
+	// (errors are ignored: the entry is just not written)
+	char tmp[PATH_MAX + 32];
+	Dump d = {NULL, 0, 0};
+	int fd, r = -1;
+	if (writer(L, h, sizeof(Header), &d) != 0
+	    || writer(L, filename, h->namelen, &d) != 0
+	    || lua_dump(L, writer, &d, cacheflags & SLCACHE_STRIP) != 0)
+		goto done;
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", name, (int)getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0 && errno == ENOENT && mkdir(cachedir, 0700) == 0)
+		fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0) goto done;
+	r = writeall(fd, d.p, d.n);
+	if (close(fd) != 0) r = -1;
+	if (r != 0 || rename(tmp, name) != 0) unlink(tmp);
+done:
+	free(d.p);
+}
+
+static int cacheload(lua_State *L, const char *filename, const char *mode) {
+	// the luaL_loadfilex loader
+	struct stat st;
+	Header h;
+	char name[PATH_MAX];
+	int status;
+	if (filename == NULL || (mode != NULL && strchr(mode, 'b') == NULL)
+	    || stat(filename, &st) != 0 || !S_ISREG(st.st_mode)
+	    || makekey(&h, filename, &st) != 0
+	    || entryname(name, filename) != 0)
+		return luaL_loadfilesrc(L, filename, mode);
+	if (loadentry(L, name, &h, filename) == LUA_OK) return LUA_OK;
+	status = luaL_loadfilesrc(L, filename, mode);
+	// do not cache a file modified while it was parsed
+	if (status == LUA_OK && samefile(&h, filename))
+		saveentry(L, name, &h, filename);
+	return status;
+}
+
+int slcache_init(const char *dir, int flags) {
+	if (dir == NULL) {
+		luaL_setloadfile(NULL);
+		return 0;
+	}
+	if (strlen(dir) >= sizeof(cachedir) - 64) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(cachedir, dir);
+	cacheflags = flags;
+	luaL_setloadfile(cacheload);
+	return 0;
+}
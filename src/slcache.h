@@ -0,0 +1,49 @@
+// Copyright (c) 2023  Phil Leblanc  -- see LICENSE file
+// ---------------------------------------------------------------------
+/*
+
+slcache - compiled chunk cache for luaL_loadfilex
+
+When the cache is enabled, luaL_loadfilex (used by loadfile, dofile,
+the slua script and the package.searchers Lua loader) looks for the
+file bytecode in a cache directory before parsing the source file.
+After a successful parse, the chunk is dumped (lua_dump) to the cache.
+
+A cache entry is keyed by the file device, inode, size and
+modification time (nanoseconds), and the file name as given to the
+loader (it is the chunk name in error messages and debug info).
+With SLCACHE_HASH, the device, inode, size and modification time are
+replaced by a blake2b hash of the file content, so an entry survives
+a 'touch' or a fresh checkout, at the cost of reading the file.
+
+The cache entries are written to a temporary file, then renamed, so
+concurrent slua processes can share a cache directory. Entries are
+never removed: delete the directory to clear the cache.
+
+An entry that does not match the file or the Lua version and format
+(checked by lundump) is ignored: the source is parsed and the entry
+replaced. Only entries owned by the effective user are used. The
+cache directory (created with mode 0700 if needed) should not be
+writable by other users.
+
+slua enables the cache if the environment variable SLUA_CACHE is the
+cache directory. With SLUA_CACHE_STRIP, the debug information is
+stripped (smaller entries, but no line numbers in error messages).
+With SLUA_CACHE_HASH, entries are keyed by the file content hash.
+
+*/
+
+#ifndef SLCACHE_H
+#define SLCACHE_H
+
+#include "lua.h"
+
+// slcache_init() flags
+#define SLCACHE_STRIP 1		// strip the debug information
+#define SLCACHE_HASH 2		// key by the content hash, not mtime
+
+// enable the cache in directory 'dir' for all the states
+// (dir NULL disables the cache). return 0, or -1 if 'dir' is too long
+int slcache_init(const char *dir, int flags);
+
+#endif
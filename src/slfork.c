@@ -0,0 +1,589 @@
+// Copyright (c) 2023  Phil Leblanc  -- see LICENSE file
+// ---------------------------------------------------------------------
+/*
+
+slfork - parallel map in forked worker processes  (see slfork.h)
+
+Worker w calls the function for the partitions first..last and writes
+one encoded value per partition on its pipe (the buffer is written
+each time it exceeds FLUSHSIZE bytes). If the function raises an
+error, the worker writes an error record and exits. The parent polls
+all the pipes until they are closed, then decodes the results of each
+worker in order.
+
+Encoding: a one-byte tag followed by its payload. Integers and lengths
+are LEB128 varints (integers are zigzag encoded, so small negative
+numbers are also short):
+	'n' nil, 't' true, 'f' false
+	'i' varint, 'd' 8-byte lua_Number
+	's' varint length, bytes
+	'T' varint array size, varint number of pairs, key/value pairs
+	'E' varint length, error message (instead of a value)
+
+The workers and their pipes are held in a "pool" userdata, so that
+they are killed and reaped, and the buffers freed, if an error is
+raised in the parent.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "slbuf.h"
+#include "slfork.h"
+
+#define POOL_MT "slfork.pool"
+
+#define MAXWORKERS 256
+#define MAXDEPTH 100		// max table nesting in a result
+#define FLUSHSIZE 65536		// worker write size
+#define PIPESIZE (1 << 20)	// pipe buffer size (if allowed)
+
+typedef struct Buf {
+	char *p;
+	size_t n;	// length used
+	size_t size;	// allocated size
+} Buf;
+
+typedef struct Worker {
+	pid_t pid;	// 0 when reaped
+	int fd;		// pipe read end, or -1 when closed
+	int status;	// waitpid status
+	lua_Integer first, last;	// partitions
+	Buf b;		// results read from the pipe
+} Worker;
+
+typedef struct Pool {
+	int k;
+	Worker w[];
+} Pool;
+
+//----------------------------------------------------------------------
+// encoding
+
+static char *reserve(lua_State *L, Buf *b, size_t n) {
+	// return the address where n bytes can be written
+	if (b->n + n > b->size) {
+		size_t size = 2 * b->size + n + 64;
+		char *p = realloc(b->p, size);
+		if (p == NULL) luaL_error(L, "not enough memory");
+		b->p = p;
+		b->size = size;
+	}
+	return b->p + b->n;
+}
+
+static void putvarint(lua_State *L, Buf *b, uint64_t v) {
+	char *p = reserve(L, b, 10);
+	size_t i = 0;
+	while (v >= 0x80) {
+		p[i++] = (char)(v | 0x80);
+		v >>= 7;
+	}
+	p[i++] = (char)v;
+	b->n += i;
+}
+
+static void putbytes(lua_State *L, Buf *b, int tag, const char *s,
+		size_t len) {
+	*reserve(L, b, 1) = tag;
+	b->n++;
+	putvarint(L, b, len);
+	memcpy(reserve(L, b, len), s, len);
+	b->n += len;
+}
+
+static void encode(lua_State *L, Buf *b, int idx, int depth) {
+	switch (lua_type(L, idx)) {
+	case LUA_TNIL: *reserve(L, b, 1) = 'n'; b->n++; break;
+	case LUA_TBOOLEAN:
+		*reserve(L, b, 1) = lua_toboolean(L, idx) ? 't' : 'f';
+		b->n++;
+		break;
+	case LUA_TNUMBER:
+		if (lua_isinteger(L, idx)) {
+			uint64_t i = (uint64_t)lua_tointeger(L, idx);
+			*reserve(L, b, 1) = 'i';
+			b->n++;
+			putvarint(L, b, (i << 1) ^ -(i >> 63));  // zigzag
+		} else {
+			lua_Number d = lua_tonumber(L, idx);
+			char *p = reserve(L, b, 1 + sizeof(d));
+			*p = 'd';
+			memcpy(p + 1, &d, sizeof(d));
+			b->n += 1 + sizeof(d);
+		}
+		break;
+	case LUA_TSTRING: {
+		size_t len;
+		const char *s = lua_tolstring(L, idx, &len);
+		putbytes(L, b, 's', s, len);
+		break;
+	}
+	case LUA_TTABLE: {
+		uint64_t npairs = 0;
+		if (depth > MAXDEPTH)
+			luaL_error(L, "table too deep (or cyclic) in result");
+		luaL_checkstack(L, 4, "table too deep in result");
+		lua_pushnil(L);
+		while (lua_next(L, idx)) {
+			lua_pop(L, 1);
+			npairs++;
+		}
+		*reserve(L, b, 1) = 'T';
+		b->n++;
+		putvarint(L, b, lua_rawlen(L, idx));
+		putvarint(L, b, npairs);
+		lua_pushnil(L);
+		while (lua_next(L, idx)) {
+			encode(L, b, lua_absindex(L, -2), depth + 1);
+			encode(L, b, lua_absindex(L, -1), depth + 1);
+			lua_pop(L, 1);
+		}
+		break;
+	}
+	case LUA_TUSERDATA:
+		if (slbuf_test(L, idx) != NULL) {
+			size_t len;
+			const char *s = slbuf_checkdata(L, idx, &len);
+			putbytes(L, b, 's', s, len);
+			break;
+		}
+		// FALLTHROUGH
+	default:
+		luaL_error(L, "cannot return a %s value from a worker",
+			luaL_typename(L, idx));
+	}
+}
+
+//----------------------------------------------------------------------
+// decoding (the data is checked: a worker may have been killed
+// while writing)
+
+typedef struct Rd {
+	const char *p;
+	size_t n, i;
+} Rd;
+
+static int getvarint(Rd *r, uint64_t *v) {
+	int shift = 0;
+	*v = 0;
+	while (r->i < r->n && shift < 64) {
+		unsigned char c = r->p[r->i++];
+		*v |= (uint64_t)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0) return 0;
+		shift += 7;
+	}
+	return -1;
+}
+
+static int decode(lua_State *L, Rd *r, int depth) {
+	// push the next value. return 0, or -1 if the data is invalid
+	uint64_t u, narr, npairs;
+	lua_Number d;
+	if (r->i >= r->n || depth > MAXDEPTH) return -1;
+	luaL_checkstack(L, 3, "table too deep in result");
+	switch (r->p[r->i++]) {
+	case 'n': lua_pushnil(L); break;
+	case 't': lua_pushboolean(L, 1); break;
+	case 'f': lua_pushboolean(L, 0); break;
+	case 'i':
+		if (getvarint(r, &u)) return -1;
+		lua_pushinteger(L, (lua_Integer)((u >> 1) ^ -(u & 1)));
+		break;
+	case 'd':
+		if (r->n - r->i < sizeof(d)) return -1;
+		memcpy(&d, r->p + r->i, sizeof(d));
+		r->i += sizeof(d);
+		lua_pushnumber(L, d);
+		break;
+	case 's':
+		if (getvarint(r, &u) || u > r->n - r->i) return -1;
+		lua_pushlstring(L, r->p + r->i, u);
+		r->i += u;
+		break;
+	case 'T':
+		// each pair is at least 2 bytes
+		if (getvarint(r, &narr) || getvarint(r, &npairs)
+		    || npairs > (r->n - r->i) / 2)
+			return -1;
+		if (narr > npairs) narr = npairs;  // (a size hint)
+		lua_createtable(L, narr, npairs - narr);
+		while (npairs-- > 0) {
+			if (decode(L, r, depth + 1)
+			    || decode(L, r, depth + 1)
+			    || lua_isnil(L, -2))
+				return -1;
+			lua_rawset(L, -3);
+		}
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+//----------------------------------------------------------------------
+// workers
+
+typedef struct Job {
+	int fd;		// pipe write end
+	lua_Integer first, last;
+	Buf b;
+	size_t mark;	// end of the last complete value in b
+} Job;
+
+static void writeall(int fd, const char *p, size_t n) {
+	ssize_t r;
+	while (n > 0) {
+		r = write(fd, p, n);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) _exit(3);  // the parent is gone
+		p += r;
+		n -= r;
+	}
+}
+
+static int workerrun(lua_State *L) {
+	// lua api: workerrun(f, parts | nil, job)
+	Job *j = (Job *)lua_touserdata(L, 3);
+	int parts = lua_istable(L, 2);
+	lua_Integer i;
+	for (i = j->first; i <= j->last; i++) {
+		lua_pushvalue(L, 1);
+		if (parts) lua_rawgeti(L, 2, i);
+		else lua_pushinteger(L, i);
+		lua_call(L, 1, 1);
+		encode(L, &j->b, lua_gettop(L), 0);
+		lua_pop(L, 1);
+		j->mark = j->b.n;
+		if (j->b.n >= FLUSHSIZE) {
+			writeall(j->fd, j->b.p, j->b.n);
+			j->b.n = j->mark = 0;
+		}
+	}
+	return 0;
+}
+
+static void workermain(lua_State *L, int f, int parts, Job *j) {
+	// run in the forked process. never returns
+	char hdr[11];
+	size_t len, v, n = 0;
+	const char *msg;
+	lua_pushcfunction(L, workerrun);
+	lua_pushvalue(L, f);
+	if (parts) lua_pushvalue(L, parts); else lua_pushnil(L);
+	lua_pushlightuserdata(L, j);
+	if (lua_pcall(L, 3, 0, 0) == LUA_OK) {
+		writeall(j->fd, j->b.p, j->b.n);
+		fflush(NULL);
+		_exit(0);
+	}
+	// the complete values, then an error record
+	writeall(j->fd, j->b.p, j->mark);
+	msg = lua_tolstring(L, -1, &len);
+	if (msg == NULL) {
+		msg = "(error object is not a string)";
+		len = strlen(msg);
+	}
+	hdr[n++] = 'E';
+	for (v = len; v >= 0x80; v >>= 7) hdr[n++] = (char)(v | 0x80);
+	hdr[n++] = (char)v;
+	writeall(j->fd, hdr, n);
+	writeall(j->fd, msg, len);
+	fflush(NULL);
+	_exit(1);
+}
+
+//----------------------------------------------------------------------
+// the calling process
+
+static int pool_gc(lua_State *L) {
+	// kill and reap the workers which are still running
+	Pool *pool = (Pool *)luaL_checkudata(L, 1, POOL_MT);
+	Worker *w;
+	int i;
+	for (i = 0; i < pool->k; i++) {
+		w = &pool->w[i];
+		if (w->fd >= 0) close(w->fd);
+		w->fd = -1;
+		if (w->pid > 0) {
+			kill(w->pid, SIGKILL);
+			while (waitpid(w->pid, &w->status, 0) < 0
+				&& errno == EINTR) {}
+			w->pid = 0;
+		}
+		free(w->b.p);
+		w->b.p = NULL;
+	}
+	return 0;
+}
+
+static void startworkers(lua_State *L, Pool *pool, int f, int parts) {
+	Worker *w;
+	Job j;
+	int i, k, fds[2];
+	fflush(NULL);  // (else the buffered output is written twice)
+	for (i = 0; i < pool->k; i++) {
+		w = &pool->w[i];
+		if (pipe2(fds, O_CLOEXEC) < 0)
+			luaL_error(L, "slfork: pipe2: %s", strerror(errno));
+		fcntl(fds[1], F_SETPIPE_SZ, PIPESIZE);  // (may fail)
+		w->pid = fork();
+		if (w->pid < 0) {
+			w->pid = 0;
+			close(fds[0]);
+			close(fds[1]);
+			luaL_error(L, "slfork: fork: %s", strerror(errno));
+		}
+		if (w->pid == 0) {
+			close(fds[0]);
+			for (k = 0; k < i; k++) close(pool->w[k].fd);
+			memset(&j, 0, sizeof(j));
+			j.fd = fds[1];
+			j.first = w->first;
+			j.last = w->last;
+			workermain(L, f, parts, &j);
+		}
+		close(fds[1]);
+		w->fd = fds[0];
+	}
+}
+
+static void collect(lua_State *L, Pool *pool) {
+	// read the pipes until they are all closed, and reap the workers
+	struct pollfd pfd[MAXWORKERS];
+	Worker *w;
+	int i, n, nopen = pool->k;
+	ssize_t r;
+	while (nopen > 0) {
+		for (i = 0; i < pool->k; i++) {
+			pfd[i].fd = pool->w[i].fd;  // (ignored if -1)
+			pfd[i].events = POLLIN;
+		}
+		n = poll(pfd, pool->k, -1);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) luaL_error(L, "slfork: poll: %s", strerror(errno));
+		for (i = 0; i < pool->k; i++) {
+			if (pfd[i].revents == 0) continue;
+			w = &pool->w[i];
+			reserve(L, &w->b, FLUSHSIZE);
+			r = read(w->fd, w->b.p + w->b.n, w->b.size - w->b.n);
+			if (r < 0 && (errno == EINTR || errno == EAGAIN))
+				continue;
+			if (r < 0) luaL_error(L, "slfork: read: %s",
+				strerror(errno));
+			if (r == 0) {
+				close(w->fd);
+				w->fd = -1;
+				nopen--;
+			}
+			w->b.n += r;
+		}
+	}
+	for (i = 0; i < pool->k; i++) {
+		w = &pool->w[i];
+		while (waitpid(w->pid, &w->status, 0) < 0 && errno == EINTR) {}
+		w->pid = 0;
+	}
+}
+
+static void results(lua_State *L, Pool *pool, int wi) {
+	// set the results of worker wi in the table on the top
+	Worker *w = &pool->w[wi];
+	Rd r;
+	lua_Integer p;
+	uint64_t len;
+	r.p = w->b.p;
+	r.n = w->b.n;
+	r.i = 0;
+	for (p = w->first; p <= w->last; p++) {
+		if (r.i < r.n && r.p[r.i] == 'E') {
+			r.i++;
+			if (getvarint(&r, &len) || len > r.n - r.i) break;
+			lua_pushlstring(L, r.p + r.i, len);
+			luaL_error(L, "slfork: worker %d: %s", wi + 1,
+				lua_tostring(L, -1));
+		}
+		if (decode(L, &r, 0)) break;
+		lua_rawseti(L, -2, p);
+	}
+	if (p > w->last && r.i == r.n) return;
+	if (WIFSIGNALED(w->status))
+		luaL_error(L, "slfork: worker %d killed by signal %d",
+			wi + 1, WTERMSIG(w->status));
+	if (WIFEXITED(w->status) && WEXITSTATUS(w->status) != 0)
+		luaL_error(L, "slfork: worker %d exited with status %d",
+			wi + 1, WEXITSTATUS(w->status));
+	luaL_error(L, "slfork: worker %d: invalid results", wi + 1);
+}
+
+static int pmap(lua_State *L, int parts, lua_Integer n, int kidx) {
+	// call f (at index 1) for the partitions 1..n in the workers.
+	// parts is the stack index of the partition list, or 0
+	lua_Integer k = luaL_optinteger(L, kidx, 
+		sysconf(_SC_NPROCESSORS_ONLN));
+	Pool *pool;
+	int i;
+	luaL_argcheck(L, k >= 1 && k <= MAXWORKERS, kidx,
+		"number of workers out of range");
+	if (k > n) k = n;
+	lua_createtable(L, n, 0);
+	if (n == 0) return 1;
+	pool = (Pool *)lua_newuserdatauv(L, 
+		sizeof(Pool) + k * sizeof(Worker), 0);
+	pool->k = 0;
+	luaL_setmetatable(L, POOL_MT);
+	for (i = 0; i < k; i++) {
+		pool->w[i].pid = 0;
+		pool->w[i].fd = -1;
+		pool->w[i].b.p = NULL;
+		pool->w[i].b.n = pool->w[i].b.size = 0;
+		pool->w[i].first = n * i / k + 1;
+		pool->w[i].last = n * (i + 1) / k;
+	}
+	pool->k = k;
+	startworkers(L, pool, 1, parts);
+	collect(L, pool);
+	lua_pushvalue(L, -2);  // result table
+	for (i = 0; i < k; i++) results(L, pool, i);
+	lua_pop(L, 1);
+	lua_pushcfunction(L, pool_gc);  // free the buffers now
+	lua_insert(L, -2);
+	lua_call(L, 1, 0);
+	return 1;
+}
+
+static int ll_map(lua_State *L) {
+	// lua api: map(f, n [, k]) => list
+	lua_Integer n = luaL_checkinteger(L, 2);
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	luaL_argcheck(L, n >= 0, 2, "negative count");
+	lua_settop(L, 3);
+	return pmap(L, 0, n, 3);
+}
+
+static int ll_run(lua_State *L) {
+	// lua api: run(f, parts [, k]) => list
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 3);
+	return pmap(L, 2, lua_rawlen(L, 2), 3);
+}
+
+static void pushrange(lua_State *L, lua_Integer i, lua_Integer j) {
+	// append {i, j} to the list on the top
+	lua_createtable(L, 2, 0);
+	lua_pushinteger(L, i);
+	lua_rawseti(L, -2, 1);
+	lua_pushinteger(L, j);
+	lua_rawseti(L, -2, 2);
+	lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+}
+
+static int ll_ranges(lua_State *L) {
+	// lua api: ranges(n, k) => list of {i, j}
+	lua_Integer n = luaL_checkinteger(L, 1);
+	lua_Integer k = luaL_checkinteger(L, 2);
+	lua_Integer i;
+	luaL_argcheck(L, k >= 1, 2, "number of ranges out of range");
+	if (k > n) k = n;
+	lua_createtable(L, k > 0 ? k : 0, 0);
+	for (i = 0; i < k; i++)
+		pushrange(L, n * i / k + 1, n * (i + 1) / k);
+	return 1;
+}
+
+static off_t nextsep(int fd, off_t pos, off_t size, int sep) {
+	// return the offset after the first sep byte at or after pos,
+	// or size if there is none, or -1 on error
+	char buf[4096], *q;
+	ssize_t r;
+	while (pos < size) {
+		r = pread(fd, buf, sizeof(buf), pos);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return r < 0 ? -1 : size;
+		q = memchr(buf, sep, r);
+		if (q != NULL) return pos + (q - buf) + 1;
+		pos += r;
+	}
+	return size;
+}
+
+static int ll_fileranges(lua_State *L) {
+	// lua api: fileranges(path, k [, sep]) => list of {offset, len}
+	//	| nil, errmsg
+	const char *path = luaL_checkstring(L, 1);
+	lua_Integer k = luaL_checkinteger(L, 2);
+	size_t seplen;
+	const char *sep = luaL_optlstring(L, 3, "\n", &seplen);
+	struct stat st;
+	off_t prev = 0, b;
+	lua_Integer i;
+	int fd, e;
+	luaL_argcheck(L, k >= 1, 2, "number of ranges out of range");
+	luaL_argcheck(L, seplen <= 1, 3, "separator must be one byte");
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) goto error;
+	lua_createtable(L, k, 0);
+	for (i = 1; i <= k; i++) {
+		b = (off_t)(st.st_size * (double)i / k);
+		if (i == k) b = st.st_size;
+		else if (seplen == 1 && b > prev)
+			b = nextsep(fd, b - 1, st.st_size, sep[0]);
+		if (b < 0) goto error;
+		if (b <= prev) continue;
+		pushrange(L, prev, b - prev);
+		prev = b;
+	}
+	close(fd);
+	return 1;
+error:
+	e = errno;
+	if (fd >= 0) close(fd);
+	lua_pushnil(L);
+	lua_pushfstring(L, "%s: %s", path, strerror(e));
+	return 2;
+}
+
+static int ll_ncpu(lua_State *L) {
+	// lua api: ncpu() => number of online CPUs
+	lua_pushinteger(L, sysconf(_SC_NPROCESSORS_ONLN));
+	return 1;
+}
+
+//----------------------------------------------------------------------
+// lua api
+
+static const struct luaL_Reg slforklib[] = {
+	{"map", ll_map},
+	{"run", ll_run},
+	{"ranges", ll_ranges},
+	{"fileranges", ll_fileranges},
+	{"ncpu", ll_ncpu},
+	{NULL, NULL},
+};
+
+int luaopen_slfork(lua_State *L) {
+	if (luaL_newmetatable(L, POOL_MT)) {
+		lua_pushcfunction(L, pool_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_pop(L, 1);
+	luaL_newlib(L, slforklib);
+	return 1;
+}
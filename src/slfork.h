@@ -0,0 +1,56 @@
+// Copyright (c) 2023  Phil Leblanc  -- see LICENSE file
+// ---------------------------------------------------------------------
+/*
+
+slfork - parallel map in forked worker processes
+
+The work is split in partitions, and k worker processes are forked.
+Each worker is a copy of the calling process: the loaded code and data
+are shared copy-on-write, nothing is sent to the workers. Each worker
+calls the function for a contiguous part of the partitions and writes
+the results on a pipe in a compact binary encoding. The calling
+process collects the results of all the workers and returns them in
+order.
+
+The results can be nil, booleans, numbers, strings, slbuf buffers
+(returned as strings) and tables of these values (no cycle, no
+metatable). Only the first result of the function is returned.
+
+Lua functions (library "slfork"):
+	map(f, n [, k]) => list
+		list[i] = f(i) for i = 1..n
+	run(f, parts [, k]) => list
+		list[p] = f(parts[p]) for each partition in the list
+		'parts' (eg. a list returned by ranges() or fileranges())
+	ranges(n, k) => list of {i, j}
+		split 1..n in at most k contiguous ranges i..j
+	fileranges(path, k [, sep]) => list of {offset, len} | nil, errmsg
+		split the file in at most k byte ranges (offset is
+		counted from 0, as for lualinux.lseek). Each range but
+		the last one ends with the separator byte 'sep' (defaults
+		to "\n", so that lines are not split). With sep = "",
+		ranges are split at any byte.
+	ncpu() => number of online CPUs
+
+	k is the number of workers. It defaults to the number of online
+	CPUs, and is at most the number of partitions.
+
+If a worker raises an error, or is killed, map() and run() raise an
+error. The workers write to the pipes as they go, so the results of a
+worker can be larger than a pipe buffer. stdout and the C stdio
+streams are flushed before the fork.
+
+A process which has started slthread threads must not use slfork
+(only the calling thread is forked).
+
+*/
+
+#ifndef SLFORK_H
+#define SLFORK_H
+
+#include "lua.h"
+
+// the slfork Lua library
+int luaopen_slfork(lua_State *L);
+
+#endif
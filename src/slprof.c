@@ -0,0 +1,433 @@
+// Copyright (c) 2023  Phil Leblanc  -- see LICENSE file
+// ---------------------------------------------------------------------
+/*
+
+slprof - sampling CPU profiler for slua  (see slprof.h)
+
+The signal handler must not call the Lua API (except lua_sethook and
+the lua_gethook functions, which only read or set the hook fields).
+It sets a count and return hook, and records the current CallInfo 
+(only the pointer: the stack may be in the middle of a reallocation).
+If a C function is running, the sample is recorded by the return
+hook of this CallInfo, with the C function at level 0 of the stack.
+(The functions it calls while returning, eg. a __close metamethod, 
+have another CallInfo.) This uses the Lua core headers (lstate.h).
+A hook set with debug.sethook() (or by the lua.c SIGINT handler) is
+saved by the signal handler, and set again by the profiler hook.
+
+The samples are kept in a hash table (folded stack => count),
+outside of the Lua state, so profiling does not allocate Lua objects
+(except when the names of the C functions are collected).
+
+*/
+
+#include <errno.h>
+#include <pthread.h>	// pthread_sigmask
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "lstate.h"
+
+#include "slprof.h"
+
+#define DEFAULT_PERIOD 1000	// microseconds
+#define MAXDEPTH 100		// max number of frames in a stack
+#define FRAMELEN 128		// max length of a frame name
+
+static lua_State *prof_L;	// the sampled thread
+static int prof_running;
+static struct sigaction prof_oldsa;
+static volatile sig_atomic_t prof_ticks;	// ticks not yet recorded
+static CallInfo * volatile prof_ci;	// CallInfo at the last tick
+// the hook replaced by the profiler hook
+static lua_Hook volatile prof_oldhook;
+static volatile int prof_oldmask, prof_oldcount;
+
+//----------------------------------------------------------------------
+// samples (folded stack => count)
+
+typedef struct sample {
+	char *stack;
+	size_t count;
+} sample;
+
+static sample *tab;
+static size_t tabcap, tabn;
+
+static size_t strhash(const char *s) {
+	// FNV-1a
+	size_t h = 2166136261u;
+	for (; *s; s++) h = (h ^ (unsigned char)*s) * 16777619u;
+	return h;
+}
+
+static sample *tab_find(sample *t, size_t cap, const char *stack) {
+	size_t i = strhash(stack) & (cap - 1);
+	while (t[i].stack != NULL && strcmp(t[i].stack, stack) != 0)
+		i = (i + 1) & (cap - 1);
+	return &t[i];
+}
+
+static void tab_add(const char *stack, size_t count) {
+	sample *e;
+	size_t i;
+	if (2 * (tabn + 1) > tabcap) {
+		size_t ncap = tabcap ? 2 * tabcap : 256;
+		sample *nt = calloc(ncap, sizeof(sample));
+		if (nt == NULL) return;  // the sample is lost
+		for (i = 0; i < tabcap; i++)
+			if (tab[i].stack != NULL)
+				*tab_find(nt, ncap, tab[i].stack) = tab[i];
+		free(tab);
+		tab = nt;
+		tabcap = ncap;
+	}
+	e = tab_find(tab, tabcap, stack);
+	if (e->stack == NULL) {
+		if ((e->stack = strdup(stack)) == NULL) return;
+		tabn++;
+	}
+	e->count += count;
+}
+
+static void tab_clear(void) {
+	size_t i;
+	for (i = 0; i < tabcap; i++) free(tab[i].stack);
+	free(tab);
+	tab = NULL;
+	tabcap = tabn = 0;
+}
+
+//----------------------------------------------------------------------
+// names of the C functions (from the loaded modules and the
+// metatables in the registry)
+
+typedef struct cname {
+	lua_CFunction f;
+	char *name;
+} cname;
+
+static cname *cnames;
+static size_t ncnames;
+static int cnames_nmods = -1;	// number of modules at the last scan
+
+static void cnames_add(lua_CFunction f, const char *prefix,
+		const char *sep, const char *name) {
+	cname *nc = realloc(cnames, (ncnames + 1) * sizeof(cname));
+	char buf[FRAMELEN];
+	if (nc == NULL) return;
+	cnames = nc;
+	snprintf(buf, FRAMELEN, "%s%s%s", prefix, sep, name);
+	if ((cnames[ncnames].name = strdup(buf)) == NULL) return;
+	cnames[ncnames++].f = f;
+}
+
+static void cnames_scan(lua_State *L, const char *prefix, const char *sep) {
+	// add the C functions in the table at the top of the stack
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		if (lua_type(L, -2) == LUA_TSTRING && lua_iscfunction(L, -1))
+			cnames_add(lua_tocfunction(L, -1), prefix, sep,
+				lua_tostring(L, -2));
+		lua_pop(L, 1);
+	}
+}
+
+static int count_modules(lua_State *L) {
+	int n = 0;
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+	lua_pushnil(L);
+	while (lua_next(L, -2)) { n++; lua_pop(L, 1); }
+	lua_pop(L, 1);
+	return n;
+}
+
+static void cnames_build(lua_State *L) {
+	size_t i;
+	for (i = 0; i < ncnames; i++) free(cnames[i].name);
+	ncnames = 0;
+	// module functions
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		if (lua_type(L, -2) == LUA_TSTRING && lua_istable(L, -1)) {
+			const char *mod = lua_tostring(L, -2);
+			if (strcmp(mod, "_G") == 0) cnames_scan(L, "", "");
+			else cnames_scan(L, mod, ".");
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	// methods (metatables created by luaL_newmetatable)
+	lua_pushnil(L);
+	while (lua_next(L, LUA_REGISTRYINDEX)) {
+		if (lua_type(L, -2) == LUA_TSTRING && lua_istable(L, -1)) {
+			int named = lua_getfield(L, -1, "__name") == LUA_TSTRING;
+			lua_pop(L, 1);
+			if (named) cnames_scan(L, lua_tostring(L, -2), ":");
+		}
+		lua_pop(L, 1);
+	}
+	cnames_nmods = count_modules(L);
+}
+
+static const char *cname_find(lua_State *L, lua_CFunction f) {
+	size_t i;
+	int pass;
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < ncnames; i++)
+			if (cnames[i].f == f) return cnames[i].name;
+		// new modules may have been loaded since the last scan
+		if (pass == 0 && count_modules(L) != cnames_nmods)
+			cnames_build(L);
+		else break;
+	}
+	return NULL;
+}
+
+//----------------------------------------------------------------------
+// sampling
+
+static void frame_name(lua_State *L, lua_Debug *ar, char *buf) {
+	// name of the function at the top of the stack, described by ar
+	const char *name = ar->name ? ar->name : "?";
+	char *p;
+	if (*ar->what == 'C') {
+		const char *cn = cname_find(L, lua_tocfunction(L, -1));
+		snprintf(buf, FRAMELEN, "%s [C]", cn ? cn : name);
+	} else if (*ar->what == 'm') {
+		snprintf(buf, FRAMELEN, "main (%s)", ar->short_src);
+	} else {
+		snprintf(buf, FRAMELEN, "%s (%s:%d)",
+			name, ar->short_src, ar->linedefined);
+	}
+	// ';' separates the frames in a folded stack
+	for (p = buf; (p = strchr(p, ';')) != NULL; ) *p = ':';
+}
+
+static void prof_hook(lua_State *L, lua_Debug *ar0);
+
+static void restore_hook(lua_State *L) {
+	// set the hook replaced by prof_hook again (if prof_hook is still
+	// the current hook: a signal handler may have set another one).
+	// signals are blocked so that this cannot happen between the
+	// test and lua_sethook
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (lua_gethook(L) == prof_hook)
+		lua_sethook(L, prof_oldhook, prof_oldmask, prof_oldcount);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void prof_hook(lua_State *L, lua_Debug *ar0) {
+	// called at the next instruction after a tick (count event), or
+	// when the running function returns (return event, eg. a C 
+	// function running at the tick: it is at level 0)
+	static char frames[MAXDEPTH + 1][FRAMELEN];
+	static char stack[(MAXDEPTH + 1) * (FRAMELEN + 1)];
+	lua_Debug ar;
+	int n = 0, level;
+	size_t ticks = prof_ticks;
+	lua_Hook oldhook = prof_oldhook;
+	int forward = oldhook != NULL && ar0->event == LUA_HOOKRET
+		&& (prof_oldmask & LUA_MASKRET);
+	char *p = stack;
+	if (ar0->event == LUA_HOOKRET && ar0->i_ci != prof_ci) {
+		// not the function running at the tick
+		if (forward) oldhook(L, ar0);
+		return;
+	}
+	prof_ticks = 0;
+	restore_hook(L);
+	// forward the event to the replaced hook if it expects it
+	if (forward) oldhook(L, ar0);
+	if (ticks == 0) return;
+	for (level = 0; n < MAXDEPTH && lua_getstack(L, level, &ar); level++) {
+		lua_getinfo(L, "Snf", &ar);
+		frame_name(L, &ar, frames[n++]);
+		lua_pop(L, 1);
+	}
+	if (n == MAXDEPTH && lua_getstack(L, level, &ar))
+		strcpy(frames[n++], "...");
+	if (n == 0) return;
+	// folded stack: root first
+	while (n-- > 0) {
+		size_t len = strlen(frames[n]);
+		memcpy(p, frames[n], len);
+		p += len;
+		*p++ = ';';
+	}
+	p[-1] = '\0';
+	tab_add(stack, ticks);
+}
+
+static void prof_handler(int sig) {
+	// do not call the Lua API here, except lua_sethook/gethook
+	lua_State *L = prof_L;
+	lua_Hook h = lua_gethook(L);
+	(void)sig;
+	if (h != prof_hook) {
+		prof_oldhook = h;
+		prof_oldmask = lua_gethookmask(L);
+		prof_oldcount = lua_gethookcount(L);
+	}
+	prof_ci = L->ci;
+	prof_ticks++;
+	lua_sethook(L, prof_hook, LUA_MASKCOUNT | LUA_MASKRET, 1);
+}
+
+#define SENTINEL "slprof.sentinel"	// registry key and metatable
+
+static int sentinel_gc(lua_State *L) {
+	// the sampled state is closed (or its arena is reset): stop
+	// sampling it before it is freed
+	lua_State **ud = (lua_State **)lua_touserdata(L, 1);
+	if (prof_running && prof_L == *ud) slprof_stop();
+	return 0;
+}
+
+static void setsentinel(lua_State *L, lua_State *main) {
+	// tie the profiler to the state: a registry value whose __gc
+	// stops the profiler when the state is closed
+	if (lua_getfield(L, LUA_REGISTRYINDEX, SENTINEL) == LUA_TNIL) {
+		lua_State **ud = lua_newuserdatauv(L, sizeof(lua_State *), 0);
+		*ud = main;
+		if (luaL_newmetatable(L, SENTINEL)) {
+			lua_pushcfunction(L, sentinel_gc);
+			lua_setfield(L, -2, "__gc");
+		}
+		lua_setmetatable(L, -2);
+		lua_setfield(L, LUA_REGISTRYINDEX, SENTINEL);
+	}
+	lua_pop(L, 1);
+}
+
+int slprof_start(lua_State *L, long period) {
+	struct sigaction sa;
+	struct itimerval it;
+	lua_State *main;
+	if (period <= 0) period = DEFAULT_PERIOD;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+	main = lua_tothread(L, -1);
+	lua_pop(L, 1);
+	setsentinel(L, main);
+	// another state is sampled: stop it first
+	if (prof_running && prof_L != main) slprof_stop();
+	prof_L = main;
+	if (!prof_running) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = prof_handler;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		if (sigaction(SIGPROF, &sa, &prof_oldsa) != 0) return -1;
+	}
+	it.it_interval.tv_sec = period / 1000000;
+	it.it_interval.tv_usec = period % 1000000;
+	it.it_value = it.it_interval;
+	if (setitimer(ITIMER_PROF, &it, NULL) != 0) {
+		if (!prof_running) sigaction(SIGPROF, &prof_oldsa, NULL);
+		return -1;
+	}
+	prof_running = 1;
+	return 0;
+}
+
+void slprof_stop(void) {
+	struct itimerval it;
+	if (!prof_running) return;
+	memset(&it, 0, sizeof(it));
+	setitimer(ITIMER_PROF, &it, NULL);
+	sigaction(SIGPROF, &prof_oldsa, NULL);
+	prof_running = 0;
+	restore_hook(prof_L);
+}
+
+int slprof_dump(const char *filename) {
+	FILE *f = stdout;
+	size_t i;
+	int r = 0;
+	if (filename != NULL && (f = fopen(filename, "w")) == NULL)
+		return -1;
+	for (i = 0; i < tabcap; i++)
+		if (tab[i].stack != NULL)
+			fprintf(f, "%s %zu\n", tab[i].stack, tab[i].count);
+	if (ferror(f)) r = -1;
+	if (f != stdout) {
+		if (fclose(f) != 0) r = -1;
+	} else fflush(f);
+	return r;
+}
+
+//----------------------------------------------------------------------
+// lua api
+
+static int ll_start(lua_State *L) {
+	// lua api: start([period]) => true | nil, errmsg
+	lua_Integer period = luaL_optinteger(L, 1, DEFAULT_PERIOD);
+	if (slprof_start(L, period) != 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int ll_stop(lua_State *L) {
+	// lua api: stop()
+	(void)L;
+	slprof_stop();
+	return 0;
+}
+
+static int ll_reset(lua_State *L) {
+	// lua api: reset()
+	(void)L;
+	tab_clear();
+	return 0;
+}
+
+static int ll_samples(lua_State *L) {
+	// lua api: samples() => {folded stack = count}
+	size_t i;
+	lua_createtable(L, 0, tabn);
+	for (i = 0; i < tabcap; i++) {
+		if (tab[i].stack == NULL) continue;
+		lua_pushinteger(L, tab[i].count);
+		lua_setfield(L, -2, tab[i].stack);
+	}
+	return 1;
+}
+
+static int ll_dump(lua_State *L) {
+	// lua api: dump([filename]) => number of stacks | nil, errmsg
+	const char *filename = luaL_optstring(L, 1, NULL);
+	if (slprof_dump(filename) != 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	lua_pushinteger(L, tabn);
+	return 1;
+}
+
+static const struct luaL_Reg slproflib[] = {
+	{"start", ll_start},
+	{"stop", ll_stop},
+	{"reset", ll_reset},
+	{"samples", ll_samples},
+	{"dump", ll_dump},
+	{NULL, NULL},
+};
+
+int luaopen_slprof(lua_State *L) {
+	luaL_newlib(L, slproflib);
+	return 1;
+}
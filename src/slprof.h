@@ -0,0 +1,57 @@
+// Copyright (c) 2023  Phil Leblanc  -- see LICENSE file
+// ---------------------------------------------------------------------
+/*
+
+slprof - sampling CPU profiler for slua
+
+A SIGPROF interval timer (process CPU time) interrupts the program
+periodically. The signal handler only sets a count and return hook. 
+At the next VM instruction, the hook records the Lua call stack as a
+"folded stack" (root first, frames separated by ';'), as used by the
+FlameGraph tools (flamegraph.pl, inferno, speedscope, ...)
+
+If a C function is running when the signal is received (eg. a luazen
+or lualinux function), the stack is recorded when it returns, with 
+the C function at the top. All the ticks received before the hook 
+runs are counted, so the time spent in long C calls is attributed to
+them.
+
+A hook set with debug.sethook() is kept: the profiler hook replaces
+it only until the next sample is recorded.
+
+Only the main thread is sampled (coroutines are not), and only one
+state at a time: starting the profiler in another state stops the
+sampling of the first one. The profiler is stopped when the sampled
+state is closed (or when its slalloc arena is reset).
+
+Lua functions (library "slprof"):
+	start([period]) - start sampling. period is the sampling period
+		in microseconds of CPU time (defaults to 1000)
+	stop()
+	reset() - clear the samples
+	samples() => table {folded stack = count}
+	dump([filename]) => number of stacks
+		write the folded stacks to a file (or stdout)
+
+*/
+
+#ifndef SLPROF_H
+#define SLPROF_H
+
+#include "lua.h"
+
+// start sampling the main thread of L. period is in microseconds
+// (0 for the default). return 0, or -1 on error (see errno)
+int slprof_start(lua_State *L, long period);
+
+// stop sampling
+void slprof_stop(void);
+
+// write the folded stacks to file 'filename' (stdout if NULL)
+// return 0, or -1 on error
+int slprof_dump(const char *filename);
+
+// the slprof Lua library
+int luaopen_slprof(lua_State *L);
+
+#endif
@@ -0,0 +1,397 @@
+// Copyright (c) 2023  Phil Leblanc  -- see LICENSE file
+// ---------------------------------------------------------------------
+/*
+
+slshm - shared memory regions, ring buffers and atomic counters
+(see slshm.h)
+
+Ring layout: a 256-byte header, then the message space (cap bytes, a
+power of 2). The producer and consumer positions are byte counts
+which only increase (the offset in the message space is the position
+modulo cap). They are in separate cache lines, and so is the futex
+word used by a waiting consumer.
+
+A message is an 8-byte header (the message length + 1), then the
+message bytes, padded to a multiple of 8 bytes (so a header never
+wraps around the end of the message space). A zero header means that
+the message is not written yet: a producer reserves space by moving
+the tail, writes the bytes, then stores the header (release). The
+consumer reads the message, clears its space (so that the headers are
+zero for the next turn), then moves the head (release).
+
+The positions and the header are accessed with the gcc __atomic
+builtins (the ring is in shared memory, not in C11 atomic objects).
+
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "slbuf.h"
+#include "slshm.h"
+
+#define RING_MT "slshm.ring"
+#define RING_MAGIC 0x31676e69726c73ULL	// "slring1"
+#define RING_SPSC 1
+
+typedef struct RingHdr {
+	uint64_t magic;
+	uint64_t cap;		// message space size (power of 2)
+	uint64_t flags;		// RING_SPSC
+	char pad0[40];
+	uint64_t tail;		// producer position (reserved)
+	char pad1[56];
+	uint64_t head;		// consumer position
+	char pad2[56];
+	uint32_t seq;		// futex word, incremented by each push
+	uint32_t nwait;		// number of waiting consumers
+	char pad3[56];
+} RingHdr;
+
+typedef struct Ring {
+	slbuf *b;		// the region (the ring user value)
+	RingHdr *h;
+	char *data;		// message space
+	uint64_t mask;		// cap - 1
+} Ring;
+
+//----------------------------------------------------------------------
+// regions
+
+static void unmap(slbuf *b) {
+	munmap(b->ptr, b->len);
+}
+
+static int pushregion(lua_State *L, int fd, size_t size, off_t off) {
+	// push a shared mapping of fd (or an anonymous mapping if fd is
+	// -1) as a buffer. return 1, or 2 (nil, errmsg) on error
+	int flags = MAP_SHARED | (fd < 0 ? MAP_ANONYMOUS : 0);
+	void *p = NULL;
+	if (size > 0) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, off);
+		if (p == MAP_FAILED) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "mmap: %s", strerror(errno));
+			return 2;
+		}
+	}
+	slbuf_wrap(L, p, size, size > 0 ? unmap : NULL, 0);
+	return 1;
+}
+
+static size_t checksize(lua_State *L, int idx) {
+	lua_Integer size = luaL_checkinteger(L, idx);
+	luaL_argcheck(L, size >= 0, idx, "invalid size");
+	return size;
+}
+
+static int ll_new(lua_State *L) {
+	// lua api: new(size) => region
+	size_t size = checksize(L, 1);
+	if (pushregion(L, -1, size, 0) == 2) return lua_error(L);
+	return 1;
+}
+
+static int ll_memfd(lua_State *L) {
+	// lua api: memfd(size [, name]) => region, fd | nil, errmsg
+	size_t size = checksize(L, 1);
+	const char *name = luaL_optstring(L, 2, "slshm");
+	int fd = memfd_create(name, MFD_CLOEXEC);
+	if (fd < 0 || ftruncate(fd, size) < 0) {
+		int e = errno;
+		if (fd >= 0) close(fd);
+		lua_pushnil(L);
+		lua_pushfstring(L, "memfd: %s", strerror(e));
+		return 2;
+	}
+	if (pushregion(L, fd, size, 0) == 2) {
+		close(fd);
+		return 2;
+	}
+	lua_pushinteger(L, fd);
+	return 2;
+}
+
+static int ll_map(lua_State *L) {
+	// lua api: map(fd [, size]) => region | nil, errmsg
+	int fd = luaL_checkinteger(L, 1);
+	struct stat st;
+	size_t size;
+	if (lua_isnoneornil(L, 2)) {
+		if (fstat(fd, &st) < 0) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "fstat: %s", strerror(errno));
+			return 2;
+		}
+		size = st.st_size;
+	} else size = checksize(L, 2);
+	return pushregion(L, fd, size, 0);
+}
+
+//----------------------------------------------------------------------
+// atomic counters
+
+static uint64_t *checkcounter(lua_State *L, int write) {
+	// return the address of the counter at (buffer, index) (the
+	// first two arguments)
+	slbuf *b = slbuf_check(L, 1);
+	lua_Integer i = luaL_checkinteger(L, 2);
+	char *p;
+	if (i < 1 || b->len < 8 || (size_t)i - 1 > b->len - 8)
+		luaL_error(L, "out of range");
+	p = b->ptr + i - 1;
+	if ((uintptr_t)p % 8 != 0) luaL_error(L, "counter not aligned");
+	if (write) slbuf_checkwrite(L, b);
+	return (uint64_t *)p;
+}
+
+static int ll_load(lua_State *L) {
+	// lua api: load(b, i) => n
+	uint64_t *p = checkcounter(L, 0);
+	lua_pushinteger(L, (lua_Integer)__atomic_load_n(p, __ATOMIC_SEQ_CST));
+	return 1;
+}
+
+static int ll_store(lua_State *L) {
+	// lua api: store(b, i, n)
+	uint64_t *p = checkcounter(L, 1);
+	uint64_t n = luaL_checkinteger(L, 3);
+	__atomic_store_n(p, n, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+static int ll_add(lua_State *L) {
+	// lua api: add(b, i, n) => previous value
+	uint64_t *p = checkcounter(L, 1);
+	uint64_t n = luaL_checkinteger(L, 3);
+	lua_pushinteger(L,
+		(lua_Integer)__atomic_fetch_add(p, n, __ATOMIC_SEQ_CST));
+	return 1;
+}
+
+static int ll_cas(lua_State *L) {
+	// lua api: cas(b, i, old, new) => true | false, current value
+	uint64_t *p = checkcounter(L, 1);
+	uint64_t old = luaL_checkinteger(L, 3);
+	uint64_t new = luaL_checkinteger(L, 4);
+	if (__atomic_compare_exchange_n(p, &old, new, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	lua_pushboolean(L, 0);
+	lua_pushinteger(L, (lua_Integer)old);
+	return 2;
+}
+
+//----------------------------------------------------------------------
+// rings
+
+static Ring *newring(lua_State *L, slbuf *b, int init, int flags) {
+	// push a ring object for the ring in buffer b (argument 1).
+	// If init, initialize the ring header
+	Ring *r;
+	RingHdr *h = (RingHdr *)b->ptr;
+	uint64_t cap;
+	slbuf_checkwrite(L, b);
+	if ((uintptr_t)b->ptr % 8 != 0) luaL_error(L, "ring not aligned");
+	if (b->len < sizeof(RingHdr) + 64) luaL_error(L, "ring too small");
+	if (init) {
+		for (cap = 64; cap * 2 <= b->len - sizeof(RingHdr); cap *= 2) {}
+		memset(b->ptr, 0, sizeof(RingHdr) + cap);
+		h->cap = cap;
+		h->flags = flags;
+		__atomic_store_n(&h->magic, RING_MAGIC, __ATOMIC_RELEASE);
+	} else if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != RING_MAGIC
+	    || h->cap > b->len - sizeof(RingHdr)
+	    || (h->cap & (h->cap - 1)) != 0)
+		luaL_error(L, "not a ring");
+	r = (Ring *)lua_newuserdatauv(L, sizeof(Ring), 1);
+	r->b = b;
+	b->nrefs++;	// the region cannot be unmapped (see slbuf.h)
+	r->h = h;
+	r->data = b->ptr + sizeof(RingHdr);
+	r->mask = h->cap - 1;
+	lua_pushvalue(L, 1);  // keep the region mapped
+	lua_setiuservalue(L, -2, 1);
+	luaL_setmetatable(L, RING_MT);
+	return r;
+}
+
+static int ll_ring(lua_State *L) {
+	// lua api: ring(b [, mode]) => ring
+	static const char *const modes[] = {"mpsc", "spsc", NULL};
+	slbuf *b = slbuf_check(L, 1);
+	int spsc = luaL_checkoption(L, 2, "mpsc", modes);
+	newring(L, b, 1, spsc ? RING_SPSC : 0);
+	return 1;
+}
+
+static int ll_attach(lua_State *L) {
+	// lua api: attach(b) => ring
+	newring(L, slbuf_check(L, 1), 0, 0);
+	return 1;
+}
+
+static void copyin(Ring *r, uint64_t pos, const char *s, size_t n) {
+	// copy n bytes at position pos (wrap around the end)
+	uint64_t off = pos & r->mask;
+	size_t n1 = r->mask + 1 - off;
+	if (n1 > n) n1 = n;
+	memcpy(r->data + off, s, n1);
+	memcpy(r->data, s + n1, n - n1);
+}
+
+static void copyout(Ring *r, uint64_t pos, char *s, size_t n) {
+	uint64_t off = pos & r->mask;
+	size_t n1 = r->mask + 1 - off;
+	if (n1 > n) n1 = n;
+	memcpy(s, r->data + off, n1);
+	memcpy(s + n1, r->data, n - n1);
+}
+
+static void clear(Ring *r, uint64_t pos, size_t n) {
+	uint64_t off = pos & r->mask;
+	size_t n1 = r->mask + 1 - off;
+	if (n1 > n) n1 = n;
+	memset(r->data + off, 0, n1);
+	memset(r->data, 0, n - n1);
+}
+
+static int ring_push(lua_State *L) {
+	// lua api: r:push(s) => true | false
+	Ring *r = (Ring *)luaL_checkudata(L, 1, RING_MT);
+	RingHdr *h = r->h;
+	size_t len;
+	const char *s = slbuf_checkdata(L, 2, &len);
+	uint64_t need = 8 + ((len + 7) & ~(uint64_t)7), t, hd;
+	if (need > h->cap) luaL_error(L, "message too large for the ring");
+	t = __atomic_load_n(&h->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		hd = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+		if (t + need - hd > h->cap) {
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+		if (h->flags & RING_SPSC) {
+			__atomic_store_n(&h->tail, t + need, __ATOMIC_RELAXED);
+			break;
+		}
+		if (__atomic_compare_exchange_n(&h->tail, &t, t + need, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+	copyin(r, t + 8, s, len);
+	__atomic_store_n((uint64_t *)(r->data + (t & r->mask)),
+		(uint64_t)len + 1, __ATOMIC_SEQ_CST);
+	__atomic_fetch_add(&h->seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&h->nwait, __ATOMIC_SEQ_CST) > 0)
+		syscall(SYS_futex, &h->seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int ring_pop(lua_State *L) {
+	// lua api: r:pop([timeout]) => s | nil
+	Ring *r = (Ring *)luaL_checkudata(L, 1, RING_MT);
+	RingHdr *h = r->h;
+	double timeout = luaL_optnumber(L, 2, 0);
+	double deadline = now() + timeout, t;
+	uint64_t hd = h->head;  // (only written by the consumer)
+	uint64_t *hdr = (uint64_t *)(r->data + (hd & r->mask));
+	uint64_t len;
+	uint32_t v;
+	struct timespec ts, *tsp;
+	luaL_Buffer b;
+	for (;;) {
+		v = __atomic_load_n(&h->seq, __ATOMIC_SEQ_CST);
+		len = __atomic_load_n(hdr, __ATOMIC_ACQUIRE);
+		if (len != 0) break;
+		tsp = NULL;
+		if (timeout >= 0) {
+			t = deadline - now();
+			if (t <= 0) {
+				lua_pushnil(L);
+				return 1;
+			}
+			ts.tv_sec = (time_t)t;
+			ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+			tsp = &ts;
+		}
+		__atomic_fetch_add(&h->nwait, 1, __ATOMIC_SEQ_CST);
+		syscall(SYS_futex, &h->seq, FUTEX_WAIT, v, tsp, NULL, 0);
+		__atomic_fetch_sub(&h->nwait, 1, __ATOMIC_SEQ_CST);
+	}
+	// the header is in shared memory: check it (the capacity used
+	// is the private copy in r, not h->cap)
+	if (len == 0 || len - 1 > r->mask + 1 - 8)
+		luaL_error(L, "corrupt ring");
+	len -= 1;
+	copyout(r, hd + 8, luaL_buffinitsize(L, &b, len), len);
+	luaL_pushresultsize(&b, len);
+	clear(r, hd, 8 + ((len + 7) & ~(uint64_t)7));
+	__atomic_store_n(&h->head, hd + 8 + ((len + 7) & ~(uint64_t)7),
+		__ATOMIC_RELEASE);
+	return 1;
+}
+
+static int ring_gc(lua_State *L) {
+	// release the region (the user value is not freed yet)
+	Ring *r = (Ring *)luaL_checkudata(L, 1, RING_MT);
+	if (r->b) r->b->nrefs--;
+	r->b = NULL;
+	return 0;
+}
+
+//----------------------------------------------------------------------
+// lua api
+
+static const struct luaL_Reg ring_methods[] = {
+	{"push", ring_push},
+	{"pop", ring_pop},
+	{"__gc", ring_gc},
+	{NULL, NULL},
+};
+
+static const struct luaL_Reg slshmlib[] = {
+	{"new", ll_new},
+	{"memfd", ll_memfd},
+	{"map", ll_map},
+	{"load", ll_load},
+	{"store", ll_store},
+	{"add", ll_add},
+	{"cas", ll_cas},
+	{"ring", ll_ring},
+	{"attach", ll_attach},
+	{NULL, NULL},
+};
+
+int luaopen_slshm(lua_State *L) {
+	if (luaL_newmetatable(L, RING_MT)) {
+		luaL_setfuncs(L, ring_methods, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_pop(L, 1);
+	luaL_newlib(L, slshmlib);
+	return 1;
+}
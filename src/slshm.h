@@ -0,0 +1,70 @@
+// Copyright (c) 2023  Phil Leblanc  -- see LICENSE file
+// ---------------------------------------------------------------------
+/*
+
+slshm - shared memory regions, ring buffers and atomic counters
+
+A region is a MAP_SHARED memory mapping, returned as a buffer (see
+slbuf.h) which unmaps the region when it is collected. A region
+created before a fork is shared by the parent and the children. A
+memfd region can also be mapped by another process from its fd.
+
+Atomic counters are 8-byte integers at an 8-byte aligned index in a
+region (or any buffer). The operations are lock-free and work across
+processes.
+
+A ring is a queue of messages (byte strings) stored in a region. It
+has one consumer, and one producer ("spsc") or any number of
+producers ("mpsc"). push and pop make no system call, except to wake
+up a consumer waiting in pop(timeout). The ring state is in the
+region, so a ring created before a fork can be used by the children.
+Another process which maps the same memfd can attach() to it.
+
+With "mpsc", the producers reserve space with a compare-and-swap,
+then write the message. A message is available to the consumer when
+it is completely written, and messages are received in reservation
+order: a producer which dies between the reservation and the end of
+the write blocks the ring.
+
+Lua functions (library "slshm"):
+	new(size) => region  (anonymous shared mapping)
+	memfd(size [, name]) => region, fd | nil, errmsg
+		the fd can be passed to another process (it is close
+		on exec, and must be closed with lualinux.close)
+	map(fd [, size]) => region | nil, errmsg
+		map a memfd or a file shared (size defaults to the
+		file size)
+
+	load(b, i) => n
+	store(b, i, n)
+	add(b, i, n) => previous value  (fetch and add)
+	cas(b, i, old, new) => true | false, current value
+		b is a buffer, i the 1-based index of an 8-byte aligned
+		integer in b. The operations are sequentially consistent.
+
+	ring(b [, mode]) => ring
+		initialize a ring in buffer b (a region or a view of a
+		region). mode is "mpsc" (default) or "spsc". The buffer
+		must be 8-byte aligned and at least 320 bytes. The
+		message space is the largest power of 2 which fits.
+	attach(b) => ring  (use the ring already initialized in b)
+
+	r:push(s) => true | false (the ring is full)
+		s is a string or a buffer. A message uses #s + 8 bytes
+		rounded up to a multiple of 8.
+	r:pop([timeout]) => s | nil
+		return the next message, or nil if the ring is empty.
+		With a timeout (in seconds, -1 for no limit), wait for a
+		message at most timeout seconds.
+
+*/
+
+#ifndef SLSHM_H
+#define SLSHM_H
+
+#include "lua.h"
+
+// the slshm Lua library
+int luaopen_slshm(lua_State *L);
+
+#endif
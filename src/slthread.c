@@ -0,0 +1,840 @@
+// Copyright (c) 2023  Phil Leblanc  -- see LICENSE file
+// ---------------------------------------------------------------------
+/*
+
+slthread - OS threads with their own Lua state  (see slthread.h)
+
+The channel queue is the bounded MPMC queue by Dmitry Vyukov: each
+cell has a sequence number which tells the producers and consumers
+whether the cell is free for the current turn. Producers and consumers
+only contend on their own position counter (compare and swap).
+
+Waiting threads sleep on a futex word ('nsent' or 'nrecv', incremented
+after each operation), and a wake up is only done when the count of
+waiting threads is not zero.
+
+Message format: a size_t length (the whole message), then the values.
+Each value is a one-byte tag followed by its payload:
+	'n' nil, 't' true, 'f' false
+	'i' lua_Integer, 'd' lua_Number
+	's' size_t length, bytes
+	'T' uint32 array size, uint32 record size, key/value pairs, 'e'
+	'B' Blob pointer, 'C' Channel pointer (a reference is counted)
+
+A message being built or decoded is held in a "box" userdata, so it is
+freed (and its references released) if a Lua error is raised.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include "slalloc.h"
+#include "slbuf.h"
+#include "slthread.h"
+
+#define BOX_MT "slthread.box"
+#define BLOB_MT "slthread.blob"
+#define CHANNEL_MT "slthread.channel"
+#define THREAD_MT "slthread.thread"
+
+#define MAXDEPTH 100			// max table nesting in a message
+#define STACKSIZE (4 * 1024 * 1024)	// thread stack size
+#define HDR sizeof(size_t)		// message header (length)
+
+//----------------------------------------------------------------------
+// blobs and channels
+
+typedef struct Blob {
+	atomic_int refcount;
+	size_t len;
+	char data[];
+} Blob;
+
+typedef struct Cell {
+	atomic_size_t seq;
+	char *msg;
+} Cell;
+
+typedef struct Channel {
+	atomic_int refcount;
+	atomic_int closed;
+	size_t mask;			// capacity - 1
+	atomic_uint nsent, nrecv;	// futex words
+	atomic_int sendwait, recvwait;	// number of waiting threads
+	char pad1[64];
+	atomic_size_t enq;		// producers position
+	char pad2[64];
+	atomic_size_t deq;		// consumers position
+	char pad3[64];
+	Cell cells[];
+} Channel;
+
+static void msgfree(char *msg, size_t n);
+
+static void blob_decref(Blob *b) {
+	if (atomic_fetch_sub(&b->refcount, 1) == 1) free(b);
+}
+
+static void channel_decref(Channel *c) {
+	size_t i;
+	if (atomic_fetch_sub(&c->refcount, 1) != 1) return;
+	for (i = atomic_load(&c->deq); i != atomic_load(&c->enq); i++) {
+		char *m = c->cells[i & c->mask].msg;
+		msgfree(m, *(size_t *)m);
+	}
+	free(c);
+}
+
+static int enqueue(Channel *c, char *msg) {
+	// return 1, or 0 if the channel is full
+	size_t pos = atomic_load_explicit(&c->enq, memory_order_relaxed);
+	Cell *cell;
+	for (;;) {
+		size_t seq;
+		intptr_t dif;
+		cell = &c->cells[pos & c->mask];
+		seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&c->enq,
+					&pos, pos + 1, memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		}
+		else if (dif < 0) return 0;
+		else pos = atomic_load_explicit(&c->enq,
+				memory_order_relaxed);
+	}
+	cell->msg = msg;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+	return 1;
+}
+
+static char *dequeue(Channel *c) {
+	// return a message, or NULL if the channel is empty
+	size_t pos = atomic_load_explicit(&c->deq, memory_order_relaxed);
+	Cell *cell;
+	char *msg;
+	for (;;) {
+		size_t seq;
+		intptr_t dif;
+		cell = &c->cells[pos & c->mask];
+		seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		dif = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&c->deq,
+					&pos, pos + 1, memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		}
+		else if (dif < 0) return NULL;
+		else pos = atomic_load_explicit(&c->deq,
+				memory_order_relaxed);
+	}
+	msg = cell->msg;
+	atomic_store_explicit(&cell->seq, pos + c->mask + 1,
+		memory_order_release);
+	return msg;
+}
+
+static void wake(atomic_uint *w, atomic_int *nwait, int all) {
+	atomic_fetch_add(w, 1);
+	if (atomic_load(nwait) > 0)
+		syscall(SYS_futex, w, FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1,
+			NULL, NULL, 0);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int waitfor(atomic_uint *w, atomic_int *nwait, unsigned v,
+		double deadline) {
+	// wait until *w is not v. deadline < 0 for no timeout.
+	// return 0, or -1 if the deadline is passed
+	struct timespec ts, *tsp = NULL;
+	if (deadline >= 0) {
+		double t = deadline - now();
+		if (t <= 0) return -1;
+		ts.tv_sec = (time_t)t;
+		ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+		tsp = &ts;
+	}
+	atomic_fetch_add(nwait, 1);
+	syscall(SYS_futex, w, FUTEX_WAIT_PRIVATE, v, tsp, NULL, 0);
+	atomic_fetch_sub(nwait, 1);
+	return 0;
+}
+
+//----------------------------------------------------------------------
+// messages
+
+typedef struct Box {
+	char *p;	// message, or NULL
+	size_t n;	// length used
+	size_t size;	// allocated size
+} Box;
+
+static void msgfree(char *msg, size_t n) {
+	// release the references in a (possibly incomplete) message
+	// and free it
+	size_t i = HDR;
+	void *ptr;
+	size_t len;
+	while (i < n) {
+		switch (msg[i++]) {
+		case 'i': case 'd': i += 8; break;
+		case 's':
+			memcpy(&len, msg + i, sizeof(size_t));
+			i += sizeof(size_t) + len;
+			break;
+		case 'T': i += 2 * sizeof(uint32_t); break;
+		case 'B':
+			memcpy(&ptr, msg + i, sizeof(ptr));
+			blob_decref(ptr);
+			i += sizeof(ptr);
+			break;
+		case 'C':
+			memcpy(&ptr, msg + i, sizeof(ptr));
+			channel_decref(ptr);
+			i += sizeof(ptr);
+			break;
+		}
+	}
+	free(msg);
+}
+
+static int box_gc(lua_State *L) {
+	Box *b = (Box *)luaL_checkudata(L, 1, BOX_MT);
+	if (b->p != NULL) msgfree(b->p, b->n);
+	b->p = NULL;
+	return 0;
+}
+
+static Box *newbox(lua_State *L) {
+	Box *b = (Box *)lua_newuserdatauv(L, sizeof(Box), 0);
+	b->p = NULL;
+	b->n = HDR;
+	b->size = 0;
+	luaL_setmetatable(L, BOX_MT);
+	return b;
+}
+
+static char *reserve(lua_State *L, Box *b, size_t n) {
+	// return the address where n bytes can be written
+	if (b->n + n > b->size) {
+		size_t size = 2 * b->size + n + 64;
+		char *p = realloc(b->p, size);
+		if (p == NULL) luaL_error(L, "not enough memory");
+		b->p = p;
+		b->size = size;
+	}
+	return b->p + b->n;
+}
+
+static void put(lua_State *L, Box *b, int tag, const void *v, size_t n) {
+	char *p = reserve(L, b, n + 1);
+	*p = tag;
+	if (n > 0) memcpy(p + 1, v, n);
+	b->n += n + 1;
+}
+
+static void encode(lua_State *L, Box *b, int idx, int depth) {
+	switch (lua_type(L, idx)) {
+	case LUA_TNIL: put(L, b, 'n', NULL, 0); break;
+	case LUA_TBOOLEAN:
+		put(L, b, lua_toboolean(L, idx) ? 't' : 'f', NULL, 0);
+		break;
+	case LUA_TNUMBER:
+		if (lua_isinteger(L, idx)) {
+			lua_Integer i = lua_tointeger(L, idx);
+			put(L, b, 'i', &i, 8);
+		} else {
+			lua_Number d = lua_tonumber(L, idx);
+			put(L, b, 'd', &d, 8);
+		}
+		break;
+	case LUA_TSTRING: {
+		size_t len;
+		const char *s = lua_tolstring(L, idx, &len);
+		char *p = reserve(L, b, 1 + sizeof(size_t) + len);
+		*p = 's';
+		memcpy(p + 1, &len, sizeof(size_t));
+		memcpy(p + 1 + sizeof(size_t), s, len);
+		b->n += 1 + sizeof(size_t) + len;
+		break;
+	}
+	case LUA_TTABLE: {
+		uint32_t narr = lua_rawlen(L, idx), nrec = 0;
+		size_t pos;
+		if (depth > MAXDEPTH)
+			luaL_error(L, "table too deep (or cyclic) in message");
+		luaL_checkstack(L, 4, "table too deep in message");
+		*reserve(L, b, 1 + 2 * sizeof(uint32_t)) = 'T';
+		pos = b->n + 1;  // (sizes written after the pairs)
+		b->n += 1 + 2 * sizeof(uint32_t);
+		lua_pushnil(L);
+		while (lua_next(L, idx)) {
+			encode(L, b, lua_absindex(L, -2), depth + 1);
+			encode(L, b, lua_absindex(L, -1), depth + 1);
+			lua_pop(L, 1);
+			nrec++;
+		}
+		nrec = nrec > narr ? nrec - narr : 0;
+		memcpy(b->p + pos, &narr, sizeof(uint32_t));
+		memcpy(b->p + pos + 4, &nrec, sizeof(uint32_t));
+		put(L, b, 'e', NULL, 0);
+		break;
+	}
+	case LUA_TUSERDATA: {
+		void **ud;
+		size_t len;
+		if ((ud = luaL_testudata(L, idx, BLOB_MT)) != NULL) {
+			reserve(L, b, 1 + sizeof(void *));
+			atomic_fetch_add(&((Blob *)*ud)->refcount, 1);
+			put(L, b, 'B', ud, sizeof(void *));
+			break;
+		}
+		if ((ud = luaL_testudata(L, idx, CHANNEL_MT)) != NULL) {
+			reserve(L, b, 1 + sizeof(void *));
+			atomic_fetch_add(&((Channel *)*ud)->refcount, 1);
+			put(L, b, 'C', ud, sizeof(void *));
+			break;
+		}
+		if (slbuf_test(L, idx) != NULL) {
+			lua_pushlstring(L, slbuf_checkdata(L, idx, &len), len);
+			encode(L, b, lua_gettop(L), depth);
+			lua_pop(L, 1);
+			break;
+		}
+	}	// FALLTHROUGH
+	default:
+		luaL_error(L, "cannot send a %s value", luaL_typename(L, idx));
+	}
+}
+
+static Box *encodevalues(lua_State *L, int first, int last) {
+	// encode the values at stack index first..last in a new box
+	// (pushed on the stack)
+	Box *b = newbox(L);
+	int i;
+	for (i = first; i <= last; i++) encode(L, b, i, 0);
+	reserve(L, b, 0);
+	*(size_t *)b->p = b->n;
+	return b;
+}
+
+static void pushref(lua_State *L, void *ptr, const char *mt) {
+	void **ud = (void **)lua_newuserdatauv(L, sizeof(void *), 0);
+	*ud = ptr;
+	luaL_setmetatable(L, mt);
+}
+
+static size_t decode(lua_State *L, const char *m, size_t i) {
+	// push the value at m + i. return the index of the next value
+	lua_Integer n;
+	lua_Number d;
+	size_t len;
+	void *ptr;
+	uint32_t narr, nrec;
+	luaL_checkstack(L, 3, "table too deep in message");
+	switch (m[i++]) {
+	case 'n': lua_pushnil(L); break;
+	case 't': lua_pushboolean(L, 1); break;
+	case 'f': lua_pushboolean(L, 0); break;
+	case 'i':
+		memcpy(&n, m + i, 8);
+		lua_pushinteger(L, n);
+		i += 8;
+		break;
+	case 'd':
+		memcpy(&d, m + i, 8);
+		lua_pushnumber(L, d);
+		i += 8;
+		break;
+	case 's':
+		memcpy(&len, m + i, sizeof(size_t));
+		i += sizeof(size_t);
+		lua_pushlstring(L, m + i, len);
+		i += len;
+		break;
+	case 'T':
+		memcpy(&narr, m + i, 4);
+		memcpy(&nrec, m + i + 4, 4);
+		i += 8;
+		lua_createtable(L, narr, nrec);
+		while (m[i] != 'e') {
+			i = decode(L, m, i);
+			i = decode(L, m, i);
+			lua_rawset(L, -3);
+		}
+		i++;
+		break;
+	case 'B':
+		memcpy(&ptr, m + i, sizeof(ptr));
+		i += sizeof(ptr);
+		pushref(L, ptr, BLOB_MT);
+		atomic_fetch_add(&((Blob *)ptr)->refcount, 1);
+		break;
+	case 'C':
+		memcpy(&ptr, m + i, sizeof(ptr));
+		i += sizeof(ptr);
+		pushref(L, ptr, CHANNEL_MT);
+		atomic_fetch_add(&((Channel *)ptr)->refcount, 1);
+		break;
+	}
+	return i;
+}
+
+static int decodevalues(lua_State *L, Box *b) {
+	// push the values of the message in box b, and free it.
+	// return the number of values
+	size_t i = HDR;
+	int n = 0;
+	while (i < b->n) {
+		i = decode(L, b->p, i);
+		n++;
+	}
+	msgfree(b->p, b->n);
+	b->p = NULL;
+	return n;
+}
+
+//----------------------------------------------------------------------
+// blob and channel objects
+
+static Blob *checkblob(lua_State *L, int idx) {
+	return *(Blob **)luaL_checkudata(L, idx, BLOB_MT);
+}
+
+static Channel *checkchannel(lua_State *L, int idx) {
+	return *(Channel **)luaL_checkudata(L, idx, CHANNEL_MT);
+}
+
+static int ll_blob(lua_State *L) {
+	// lua api: blob(s) => blob
+	size_t len;
+	const char *s = slbuf_checkdata(L, 1, &len);
+	Blob **ud = (Blob **)lua_newuserdatauv(L, sizeof(Blob *), 0);
+	*ud = NULL;
+	luaL_setmetatable(L, BLOB_MT);
+	if ((*ud = malloc(sizeof(Blob) + len)) == NULL)
+		return luaL_error(L, "not enough memory");
+	atomic_init(&(*ud)->refcount, 1);
+	(*ud)->len = len;
+	memcpy((*ud)->data, s, len);
+	return 1;
+}
+
+static int blob_get(lua_State *L) {
+	// lua api: blob:get([i [, j]]) => string
+	Blob *b = checkblob(L, 1);
+	lua_Integer len = b->len;
+	lua_Integer i = luaL_optinteger(L, 2, 1);
+	lua_Integer j = luaL_optinteger(L, 3, -1);
+	if (i < 0) i = (-i > len) ? 1 : len + i + 1;
+	else if (i == 0) i = 1;
+	if (j < 0) j = len + j + 1;
+	else if (j > len) j = len;
+	if (i > j) lua_pushliteral(L, "");
+	else lua_pushlstring(L, b->data + i - 1, j - i + 1);
+	return 1;
+}
+
+static int blob_len(lua_State *L) {
+	lua_pushinteger(L, checkblob(L, 1)->len);
+	return 1;
+}
+
+static int blob_tostring(lua_State *L) {
+	Blob *b = checkblob(L, 1);
+	lua_pushfstring(L, "slthread.blob: %p (%I bytes)",
+		(void *)b, (lua_Integer)b->len);
+	return 1;
+}
+
+static int blob_gc(lua_State *L) {
+	Blob **ud = (Blob **)luaL_checkudata(L, 1, BLOB_MT);
+	if (*ud != NULL) blob_decref(*ud);
+	*ud = NULL;
+	return 0;
+}
+
+static int ll_channel(lua_State *L) {
+	// lua api: channel([capacity]) => ch
+	lua_Integer cap = luaL_optinteger(L, 1, 64);
+	size_t n = 2, i;
+	Channel **ud;
+	luaL_argcheck(L, cap > 0 && cap <= (1 << 24), 1, "invalid capacity");
+	while (n < (size_t)cap) n *= 2;
+	ud = (Channel **)lua_newuserdatauv(L, sizeof(Channel *), 0);
+	*ud = NULL;
+	luaL_setmetatable(L, CHANNEL_MT);
+	if ((*ud = calloc(1, sizeof(Channel) + n * sizeof(Cell))) == NULL)
+		return luaL_error(L, "not enough memory");
+	atomic_init(&(*ud)->refcount, 1);
+	(*ud)->mask = n - 1;
+	for (i = 0; i < n; i++) atomic_init(&(*ud)->cells[i].seq, i);
+	return 1;
+}
+
+static int send(lua_State *L, int wait) {
+	Channel *c = checkchannel(L, 1);
+	Box *b = encodevalues(L, 2, lua_gettop(L));
+	for (;;) {
+		unsigned v = atomic_load(&c->nrecv);
+		if (atomic_load(&c->closed)) {
+			lua_pushnil(L);
+			lua_pushliteral(L, "closed");
+			return 2;
+		}
+		if (enqueue(c, b->p)) {
+			b->p = NULL;
+			wake(&c->nsent, &c->recvwait, 0);
+			lua_pushboolean(L, 1);
+			return 1;
+		}
+		if (!wait) {
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+		waitfor(&c->nrecv, &c->sendwait, v, -1);
+	}
+}
+
+static int ch_send(lua_State *L) {
+	// lua api: ch:send(...) => true | nil, "closed"
+	return send(L, 1);
+}
+
+static int ch_trysend(lua_State *L) {
+	// lua api: ch:trysend(...) => true | false | nil, "closed"
+	return send(L, 0);
+}
+
+static int ch_recv(lua_State *L) {
+	// lua api: ch:recv([timeout]) => values... | nil, errmsg
+	Channel *c = checkchannel(L, 1);
+	double timeout = luaL_optnumber(L, 2, -1);
+	double deadline = (timeout < 0) ? -1 : now() + timeout;
+	Box *b = newbox(L);
+	for (;;) {
+		unsigned v = atomic_load(&c->nsent);
+		char *m = dequeue(c);
+		if (m != NULL) {
+			b->p = m;
+			b->n = *(size_t *)m;
+			wake(&c->nrecv, &c->sendwait, 0);
+			return decodevalues(L, b);
+		}
+		lua_pushnil(L);
+		if (atomic_load(&c->closed)) {
+			lua_pushliteral(L, "closed");
+			return 2;
+		}
+		if (timeout == 0
+		    || waitfor(&c->nsent, &c->recvwait, v, deadline) != 0) {
+			lua_pushliteral(L, "timeout");
+			return 2;
+		}
+		lua_pop(L, 1);
+	}
+}
+
+static int ch_close(lua_State *L) {
+	// lua api: ch:close()
+	Channel *c = checkchannel(L, 1);
+	atomic_store(&c->closed, 1);
+	wake(&c->nsent, &c->recvwait, 1);
+	wake(&c->nrecv, &c->sendwait, 1);
+	return 0;
+}
+
+static int ch_len(lua_State *L) {
+	Channel *c = checkchannel(L, 1);
+	size_t deq = atomic_load(&c->deq);
+	size_t enq = atomic_load(&c->enq);
+	lua_pushinteger(L, (intptr_t)(enq - deq) > 0 ? enq - deq : 0);
+	return 1;
+}
+
+static int ch_tostring(lua_State *L) {
+	Channel *c = checkchannel(L, 1);
+	lua_pushfstring(L, "slthread.channel: %p", (void *)c);
+	return 1;
+}
+
+static int ch_gc(lua_State *L) {
+	Channel **ud = (Channel **)luaL_checkudata(L, 1, CHANNEL_MT);
+	if (*ud != NULL) channel_decref(*ud);
+	*ud = NULL;
+	return 0;
+}
+
+//----------------------------------------------------------------------
+// threads
+
+typedef struct Thread {
+	atomic_int refcount;	// the handle and the running thread
+	pthread_t tid;
+	int joined;
+	char *args;		// message: code, arguments
+	char *result;		// message: true, results | false, errmsg
+} Thread;
+
+static void thread_decref(Thread *t) {
+	if (atomic_fetch_sub(&t->refcount, 1) != 1) return;
+	if (t->args != NULL) msgfree(t->args, *(size_t *)t->args);
+	if (t->result != NULL) msgfree(t->result, *(size_t *)t->result);
+	free(t);
+}
+
+static char *errormsg(const char *s) {
+	// return the message (false, s), or NULL
+	size_t len = strlen(s);
+	size_t n = HDR + 1 + 1 + sizeof(size_t) + len;
+	char *m = malloc(n);
+	if (m == NULL) return NULL;
+	*(size_t *)m = n;
+	m[HDR] = 'f';
+	m[HDR + 1] = 's';
+	memcpy(m + HDR + 2, &len, sizeof(size_t));
+	memcpy(m + HDR + 2 + sizeof(size_t), s, len);
+	return m;
+}
+
+static void newmetatables(lua_State *L);
+
+static int msghandler(lua_State *L) {
+	const char *msg = lua_tostring(L, 1);
+	if (msg == NULL) msg = lua_pushfstring(L,
+		"(error object is a %s value)", luaL_typename(L, 1));
+	luaL_traceback(L, L, msg, 1);
+	return 1;
+}
+
+static int threadpmain(lua_State *L) {
+	Thread *t = (Thread *)lua_touserdata(L, 1);
+	const char *code;
+	size_t len;
+	Box *b;
+	int n;
+	luaL_openlibs(L);
+#include "slualibs.h"
+	newmetatables(L);
+	b = newbox(L);
+	b->p = t->args;
+	b->n = *(size_t *)t->args;
+	t->args = NULL;
+	n = decodevalues(L, b);  // code, args... (at index 3)
+	code = lua_tolstring(L, 3, &len);
+	if (luaL_loadbuffer(L, code, len, "=slthread") != LUA_OK)
+		return lua_error(L);
+	lua_replace(L, 3);
+	lua_call(L, n - 1, LUA_MULTRET);
+	lua_pushboolean(L, 1);
+	lua_insert(L, 3);
+	b = encodevalues(L, 3, lua_gettop(L));
+	t->result = b->p;
+	b->p = NULL;
+	return 0;
+}
+
+static void *threadmain(void *arg) {
+	Thread *t = (Thread *)arg;
+	lua_State *L = slalloc_newstate(SLALLOC_POOL, 0);
+	if (L == NULL) {
+		t->result = errormsg("not enough memory");
+	} else {
+		lua_pushcfunction(L, msghandler);
+		lua_pushcfunction(L, threadpmain);
+		lua_pushlightuserdata(L, t);
+		if (lua_pcall(L, 1, 0, 1) != LUA_OK) {
+			if (t->result != NULL)
+				msgfree(t->result, *(size_t *)t->result);
+			const char *msg = lua_tostring(L, -1);
+			t->result = errormsg(msg ? msg : "not enough memory");
+		}
+		slalloc_close(L);
+	}
+	thread_decref(t);
+	return NULL;
+}
+
+typedef struct Dump {
+	int init;
+	luaL_Buffer b;
+} Dump;
+
+static int dumpwriter(lua_State *L, const void *p, size_t sz, void *ud) {
+	// (as in lstrlib.c: the buffer is created after the function
+	// to dump, so that the buffer box is on top of the stack)
+	Dump *d = (Dump *)ud;
+	if (!d->init) {
+		d->init = 1;
+		luaL_buffinit(L, &d->b);
+	}
+	luaL_addlstring(&d->b, (const char *)p, sz);
+	return 0;
+}
+
+static int ll_start(lua_State *L) {
+	// lua api: start(f | code, ...) => thread | nil, errmsg
+	Thread **ud;
+	Thread *t;
+	Box *b;
+	pthread_attr_t attr;
+	int r;
+	if (lua_type(L, 1) == LUA_TFUNCTION) {
+		Dump d;
+		d.init = 0;
+		lua_pushvalue(L, 1);
+		if (lua_dump(L, dumpwriter, &d, 0) != 0 || !d.init)
+			return luaL_argerror(L, 1, "cannot dump function");
+		luaL_pushresult(&d.b);
+		lua_replace(L, 1);
+		lua_pop(L, 1);  // function
+	}
+	luaL_checktype(L, 1, LUA_TSTRING);
+	ud = (Thread **)lua_newuserdatauv(L, sizeof(Thread *), 0);
+	*ud = NULL;
+	luaL_setmetatable(L, THREAD_MT);
+	lua_insert(L, 1);
+	b = encodevalues(L, 2, lua_gettop(L));
+	if ((t = calloc(1, sizeof(Thread))) == NULL)
+		return luaL_error(L, "not enough memory");
+	atomic_init(&t->refcount, 2);
+	t->args = b->p;
+	b->p = NULL;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, STACKSIZE);
+	r = pthread_create(&t->tid, &attr, threadmain, t);
+	pthread_attr_destroy(&attr);
+	if (r != 0) {
+		msgfree(t->args, *(size_t *)t->args);
+		free(t);
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(r));
+		return 2;
+	}
+	*ud = t;
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int th_join(lua_State *L) {
+	// lua api: t:join() => true, results... | false, errmsg
+	Thread *t = *(Thread **)luaL_checkudata(L, 1, THREAD_MT);
+	Box *b;
+	if (t == NULL || t->joined)
+		return luaL_error(L, "thread already joined");
+	pthread_join(t->tid, NULL);
+	t->joined = 1;
+	if (t->result == NULL) {
+		lua_pushboolean(L, 0);
+		lua_pushliteral(L, "not enough memory");
+		return 2;
+	}
+	b = newbox(L);
+	b->p = t->result;
+	b->n = *(size_t *)t->result;
+	t->result = NULL;
+	return decodevalues(L, b);
+}
+
+static int th_gc(lua_State *L) {
+	Thread **ud = (Thread **)luaL_checkudata(L, 1, THREAD_MT);
+	if (*ud == NULL) return 0;
+	if (!(*ud)->joined) pthread_detach((*ud)->tid);
+	thread_decref(*ud);
+	*ud = NULL;
+	return 0;
+}
+
+static int ll_ncpu(lua_State *L) {
+	// lua api: ncpu() => number of online CPUs
+	lua_pushinteger(L, sysconf(_SC_NPROCESSORS_ONLN));
+	return 1;
+}
+
+//----------------------------------------------------------------------
+// lua api
+
+static const struct luaL_Reg blob_methods[] = {
+	{"get", blob_get},
+	{"__len", blob_len},
+	{"__tostring", blob_tostring},
+	{"__gc", blob_gc},
+	{NULL, NULL},
+};
+
+static const struct luaL_Reg channel_methods[] = {
+	{"send", ch_send},
+	{"trysend", ch_trysend},
+	{"recv", ch_recv},
+	{"close", ch_close},
+	{"__len", ch_len},
+	{"__tostring", ch_tostring},
+	{"__gc", ch_gc},
+	{NULL, NULL},
+};
+
+static const struct luaL_Reg thread_methods[] = {
+	{"join", th_join},
+	{"__gc", th_gc},
+	{NULL, NULL},
+};
+
+static void newmetatable(lua_State *L, const char *name,
+		const luaL_Reg *methods) {
+	if (luaL_newmetatable(L, name)) {
+		luaL_setfuncs(L, methods, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_pop(L, 1);
+}
+
+static void newmetatables(lua_State *L) {
+	// (also used by the thread states, to decode the arguments)
+	if (luaL_newmetatable(L, BOX_MT)) {
+		lua_pushcfunction(L, box_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_pop(L, 1);
+	newmetatable(L, BLOB_MT, blob_methods);
+	newmetatable(L, CHANNEL_MT, channel_methods);
+	newmetatable(L, THREAD_MT, thread_methods);
+}
+
+static const struct luaL_Reg slthreadlib[] = {
+	{"start", ll_start},
+	{"ncpu", ll_ncpu},
+	{"channel", ll_channel},
+	{"blob", ll_blob},
+	{NULL, NULL},
+};
+
+int luaopen_slthread(lua_State *L) {
+	newmetatables(L);
+	luaL_newlib(L, slthreadlib);
+	return 1;
+}
@@ -0,0 +1,68 @@
+// Copyright (c) 2023  Phil Leblanc  -- see LICENSE file
+// ---------------------------------------------------------------------
+/*
+
+slthread - OS threads with their own Lua state, and message channels
+
+A thread runs a Lua function or chunk in a new Lua state, with the
+standard and the slua preloaded libraries (slualibs.h). The states do
+not share any Lua value: the threads communicate with channels.
+
+A channel is a bounded lock-free multi-producer multi-consumer queue
+of messages. A message is a list of Lua values, serialized when sent
+and deserialized when received: nil, booleans, numbers, strings,
+slbuf buffers (received as strings), tables of these values (no
+cycle, no metatable), channels and blobs.
+
+A blob is an immutable byte string allocated outside of the Lua
+states. Sending a blob only sends a reference: the bytes are shared
+by all the states, not copied. A blob is freed when it is no longer
+used by any state or message.
+
+A thread which waits (send on a full channel, recv on an empty one)
+sleeps on a futex. A channel operation does not make any system call
+when no thread is waiting.
+
+Lua functions (library "slthread"):
+	start(f | code, ...) => thread | nil, errmsg
+		run the function f (a Lua function without upvalues, as
+		it is dumped and loaded in the new state) or the chunk
+		'code' (a string) with the arguments '...' in a new thread
+	ncpu() => number of online CPUs
+	channel([capacity]) => ch
+		capacity is rounded to a power of 2 (defaults to 64)
+	blob(s) => blob  (s is a string or a slbuf)
+
+	t:join() => true, results... | false, errmsg
+		wait for the end of the thread and return the results of
+		the function (as pcall). If the thread handle is collected
+		before join(), the thread is detached.
+
+	ch:send(...) => true | nil, "closed"
+		wait while the channel is full
+	ch:trysend(...) => true | false (channel full) | nil, "closed"
+	ch:recv([timeout]) => values... | nil, "timeout" | nil, "closed"
+		wait for a message at most timeout seconds (defaults to
+		no limit). "closed" is returned when the channel is
+		closed and empty
+	ch:close() - send and recv fail after close (recv only after
+		the channel is empty)
+	#ch => number of messages in the channel
+
+	#blob => length
+	blob:get([i [, j]]) => string  (as string.sub)
+
+The slprof and slvmstats libraries and the lualinux statistics use
+global counters and are not intended for multi-thread programs.
+
+*/
+
+#ifndef SLTHREAD_H
+#define SLTHREAD_H
+
+#include "lua.h"
+
+// the slthread Lua library
+int luaopen_slthread(lua_State *L);
+
+#endif
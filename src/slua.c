@@ -6,6 +6,14 @@
 ///   + preload slua libraries (after "luaL_openlibs(L);" 
 /// 230122 
 ///   + sluaversion.h, SLUA_VERSION
+/// 261018
+///   + pool allocator (slalloc.h) - SLUA_ALLOC=libc selects the
+///     standard allocator
+///   + SLUA_MEMLIMIT: memory accounting and limit
+///   + option -p file: sampling profiler (slprof.h)
+///   + instrumentation build (-DSLUA_VMSTATS): VM counters report
+///     at exit (slvmstats.h)
+///   + SLUA_CACHE: compiled chunk cache directory (slcache.h)
 ///---------------------------------------------------------------------
 
 
@@ -33,6 +41,13 @@
 #include "lauxlib.h"
 #include "lualib.h"
 
+#include "slalloc.h"
+#include "slcache.h"
+#include "slprof.h"
+#if defined(SLUA_VMSTATS)
+#include "slvmstats.h"
+#endif
+
 
 #if !defined(LUA_PROGNAME)
 #define LUA_PROGNAME		"lua"
@@ -95,7 +110,7 @@ static void laction (int i) {
 
 static void print_usage (const char *badoption) {
   lua_writestringerror("%s: ", progname);
-  if (badoption[1] == 'e' || badoption[1] == 'l')
+  if (badoption[1] == 'e' || badoption[1] == 'l' || badoption[1] == 'p')
     lua_writestringerror("'%s' needs argument\n", badoption);
   else
     lua_writestringerror("unrecognized option '%s'\n", badoption);
@@ -105,6 +120,7 @@ static void print_usage (const char *badoption) {
   "  -e stat  execute string 'stat'\n"
   "  -i       enter interactive mode after executing 'script'\n"
   "  -l name  require library 'name' into global 'name'\n"
+  "  -p file  write profile samples (folded stacks) to 'file'\n"
   "  -v       show version information\n"
   "  -E       ignore environment variables\n"
   "  -W       turn warnings on\n"
@@ -313,7 +329,8 @@ static int collectargs (char **argv, int *first) {
         break;
       case 'e':
         args |= has_e;  /* FALLTHROUGH */
-      case 'l':  /* both options need an argument */
+      case 'p':  /* FALLTHROUGH */
+      case 'l':  /* these options need an argument */
         if (argv[i][2] == '\0') {  /* no concatenated argument? */
           i++;  /* try next 'argv' */
           if (argv[i] == NULL || argv[i][0] == '-')
@@ -334,6 +351,9 @@ static int collectargs (char **argv, int *first) {
 ** 'W', which also affects the state.
 ** Returns 0 if some code raises an error.
 */
+/// slua: profile output file (option -p)
+static const char *profile_file = NULL;
+
 static int runargs (lua_State *L, char **argv, int n) {
   int i;
   for (i = 1; i < n; i++) {
@@ -354,6 +374,15 @@ static int runargs (lua_State *L, char **argv, int n) {
       case 'W':
         lua_warning(L, "@on", 0);  /* warnings on */
         break;
+      case 'p': {  /// slua: start the profiler
+        profile_file = argv[i] + 2;
+        if (*profile_file == '\0') profile_file = argv[++i];
+        if (slprof_start(L, 0) != 0) {
+          l_message(progname, "cannot start the profiler");
+          return 0;
+        }
+        break;
+      }
     }
   }
   return 1;
@@ -682,9 +711,46 @@ static int pmain (lua_State *L) {
 }
 
 
+/// slua: create the state with the pool allocator, unless the 
+/// environment variable SLUA_ALLOC is "libc". If SLUA_MEMLIMIT is
+/// defined, account the state memory, with a hard limit of 
+/// SLUA_MEMLIMIT bytes (suffix k, m or g allowed, 0 for no limit)
+static lua_State *newstate (void) {
+  const char *a = getenv("SLUA_ALLOC");
+  const char *m = getenv("SLUA_MEMLIMIT");
+  int flags = (a == NULL || strcmp(a, "libc") != 0) ? SLALLOC_POOL : 0;
+  size_t limit = 0;
+  if (m != NULL) {
+    char *end;
+    limit = strtoull(m, &end, 10);
+    switch (*end) {
+      case 'g': case 'G': limit <<= 10;  /* FALLTHROUGH */
+      case 'm': case 'M': limit <<= 10;  /* FALLTHROUGH */
+      case 'k': case 'K': limit <<= 10;
+    }
+    flags |= SLALLOC_BUDGET;
+  }
+  return slalloc_newstate(flags, limit);
+}
+
+
+/// slua: enable the compiled chunk cache if SLUA_CACHE is defined
+/// (the cache directory). See slcache.h
+static void initcache (void) {
+  const char *dir = getenv("SLUA_CACHE");
+  int flags = 0;
+  if (dir == NULL || *dir == '\0') return;
+  if (getenv("SLUA_CACHE_STRIP") != NULL) flags |= SLCACHE_STRIP;
+  if (getenv("SLUA_CACHE_HASH") != NULL) flags |= SLCACHE_HASH;
+  slcache_init(dir, flags);
+}
+
+
 int main (int argc, char **argv) {
   int status, result;
-  lua_State *L = luaL_newstate();  /* create state */
+  lua_State *L;
+  initcache();
+  L = newstate();  /* create state */
   if (L == NULL) {
     l_message(argv[0], "cannot create state: not enough memory");
     return EXIT_FAILURE;
@@ -695,7 +761,16 @@ int main (int argc, char **argv) {
   status = lua_pcall(L, 2, 1, 0);  /* do the call */
   result = lua_toboolean(L, -1);  /* get result */
   report(L, status);
-  lua_close(L);
+  slprof_stop();  /// slua: the state must not be sampled once closed
+  if (profile_file != NULL) {  /// slua: write the profile samples
+    if (slprof_dump(profile_file) != 0)
+      l_message(argv[0], "cannot write the profile file");
+  }
+#if defined(SLUA_VMSTATS)  /// slua: write the VM counters report
+  if (slvm_dump(getenv("SLUA_VMSTATS")) != 0)
+    l_message(argv[0], "cannot write the VM counters report");
+#endif
+  slalloc_close(L);
   return (result && status == LUA_OK) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
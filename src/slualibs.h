@@ -21,6 +21,36 @@
 	int luaopen_linenoise(lua_State *L); 
 	lua_pushcfunction(L, luaopen_linenoise);
 	lua_setfield(L, -2, "linenoise");
+	/// slalloc
+	int luaopen_slalloc(lua_State *L); 
+	lua_pushcfunction(L, luaopen_slalloc);
+	lua_setfield(L, -2, "slalloc");
+	/// slprof
+	int luaopen_slprof(lua_State *L); 
+	lua_pushcfunction(L, luaopen_slprof);
+	lua_setfield(L, -2, "slprof");
+	/// slbundle
+	int luaopen_slbundle(lua_State *L); 
+	lua_pushcfunction(L, luaopen_slbundle);
+	lua_setfield(L, -2, "slbundle");
+	/// slthread
+	int luaopen_slthread(lua_State *L); 
+	lua_pushcfunction(L, luaopen_slthread);
+	lua_setfield(L, -2, "slthread");
+	/// slfork
+	int luaopen_slfork(lua_State *L); 
+	lua_pushcfunction(L, luaopen_slfork);
+	lua_setfield(L, -2, "slfork");
+	/// slshm
+	int luaopen_slshm(lua_State *L); 
+	lua_pushcfunction(L, luaopen_slshm);
+	lua_setfield(L, -2, "slshm");
+#if defined(SLUA_VMSTATS)
+	/// slvmstats (instrumentation build only)
+	int luaopen_slvmstats(lua_State *L); 
+	lua_pushcfunction(L, luaopen_slvmstats);
+	lua_setfield(L, -2, "slvmstats");
+#endif
 	///
 	/// remove _PRELOAD table
 	lua_pop(L, 1);
@@ -0,0 +1,304 @@
+// Copyright (c) 2023  Phil Leblanc  -- see LICENSE file
+// ---------------------------------------------------------------------
+/*
+
+slvmstats - VM instruction counters  (see slvmstats.h)
+
+The module is empty if slua is not built with -DSLUA_VMSTATS.
+
+The time of a recursive function is counted for each active call, so
+the inclusive time of such a function may be larger than the run time.
+
+*/
+
+#if defined(SLUA_VMSTATS)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "ldebug.h"
+#include "lobject.h"
+#include "lopcodes.h"
+#include "lopnames.h"
+#include "lstate.h"
+
+#include "slvmstats.h"
+
+unsigned long long slvm_opcount[NUM_OPCODES];
+unsigned long long slvm_finishget, slvm_indextm;
+unsigned long long slvm_finishset, slvm_newindextm;
+
+static SlvmStats *allstats;	// all the function counters
+static int nstats;
+
+static unsigned long long now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+SlvmStats *slvm_newstats(Proto *p) {
+	SlvmStats *s = calloc(1, sizeof(SlvmStats));
+	const char *src = p->source ? getstr(p->source) : "=?";
+	int pc;
+	if (s == NULL
+	    || (s->source = strdup(src)) == NULL
+	    || (s->lines = malloc(p->sizecode * sizeof(int) + 1)) == NULL
+	    || (s->pccount = calloc(p->sizecode + 1,
+			sizeof(unsigned long long))) == NULL) {
+		// there is no way to report the error from the VM
+		fprintf(stderr, "slvmstats: not enough memory\n");
+		abort();
+	}
+	s->linedefined = p->linedefined;
+	s->sizecode = p->sizecode;
+	for (pc = 0; pc < p->sizecode; pc++)
+		s->lines[pc] = luaG_getfuncline(p, pc);
+	s->next = allstats;
+	allstats = s;
+	nstats++;
+	p->vmstats = s;
+	return s;
+}
+
+void slvm_call(SlvmStats *s, CallInfo *ci) {
+	s->calls++;
+	ci->vmt0 = now();
+}
+
+void slvm_return(SlvmStats *s, CallInfo *ci) {
+	s->time += now() - ci->vmt0;
+}
+
+static unsigned long long stats_count(SlvmStats *s) {
+	unsigned long long n = 0;
+	int pc;
+	for (pc = 0; pc < s->sizecode; pc++) n += s->pccount[pc];
+	return n;
+}
+
+static const char *stats_name(SlvmStats *s, char *buf, size_t len) {
+	char src[LUA_IDSIZE];
+	luaO_chunkid(src, s->source, strlen(s->source));
+	if (s->linedefined == 0) snprintf(buf, len, "main (%s)", src);
+	else snprintf(buf, len, "%s:%d", src, s->linedefined);
+	return buf;
+}
+
+static int cmp_stats(const void *a, const void *b) {
+	unsigned long long na = stats_count(*(SlvmStats **)a);
+	unsigned long long nb = stats_count(*(SlvmStats **)b);
+	return (na < nb) - (na > nb);
+}
+
+static SlvmStats **sorted_stats(void) {
+	// return an array of the counters, sorted by decreasing
+	// instruction count, or NULL
+	SlvmStats **v = malloc((nstats + 1) * sizeof(SlvmStats *));
+	SlvmStats *s;
+	int n = 0;
+	if (v == NULL) return NULL;
+	for (s = allstats; s != NULL; s = s->next) v[n++] = s;
+	qsort(v, n, sizeof(SlvmStats *), cmp_stats);
+	return v;
+}
+
+static int cmp_op(const void *a, const void *b) {
+	unsigned long long na = slvm_opcount[*(int *)a];
+	unsigned long long nb = slvm_opcount[*(int *)b];
+	return (na < nb) - (na > nb);
+}
+
+typedef struct linecount {
+	int line;
+	unsigned long long n;
+} linecount;
+
+static int cmp_line(const void *a, const void *b) {
+	int la = ((const linecount *)a)->line;
+	int lb = ((const linecount *)b)->line;
+	return (la > lb) - (la < lb);
+}
+
+static int dump_lines(FILE *f, SlvmStats *s) {
+	// print the instruction count of each line of s, sorted by line.
+	// (the instructions of a line are not always contiguous)
+	linecount *lc = malloc(s->sizecode * sizeof(linecount));
+	int pc, i, n = 0;
+	if (lc == NULL) return -1;
+	for (pc = 0; pc < s->sizecode; pc++) {
+		if (s->pccount[pc] == 0) continue;
+		lc[n].line = s->lines[pc];
+		lc[n++].n = s->pccount[pc];
+	}
+	qsort(lc, n, sizeof(linecount), cmp_line);
+	for (i = 0; i < n; i++) {
+		unsigned long long sum = lc[i].n;
+		while (i + 1 < n && lc[i + 1].line == lc[i].line) 
+			sum += lc[++i].n;
+		fprintf(f, "%8d %14llu\n", lc[i].line, sum);
+	}
+	free(lc);
+	return 0;
+}
+
+int slvm_dump(const char *filename) {
+	FILE *f = stderr;
+	SlvmStats **v;
+	int ops[NUM_OPCODES];
+	unsigned long long total = 0;
+	char name[LUA_IDSIZE + 32];
+	int i, r = 0;
+	if ((v = sorted_stats()) == NULL) return -1;
+	if (filename != NULL && (f = fopen(filename, "w")) == NULL) {
+		free(v);
+		return -1;
+	}
+	for (i = 0; i < NUM_OPCODES; i++) {
+		ops[i] = i;
+		total += slvm_opcount[i];
+	}
+	qsort(ops, NUM_OPCODES, sizeof(int), cmp_op);
+	fprintf(f, "== opcodes (%llu instructions)\n", total);
+	for (i = 0; i < NUM_OPCODES && slvm_opcount[ops[i]] != 0; i++)
+		fprintf(f, "%-12s %14llu %6.2f%%\n", opnames[ops[i]],
+			slvm_opcount[ops[i]],
+			100.0 * slvm_opcount[ops[i]] / total);
+	fprintf(f, "\n== table accesses (slow path)\n");
+	fprintf(f, "get %14llu  (__index %llu)\n",
+		slvm_finishget, slvm_indextm);
+	fprintf(f, "set %14llu  (__newindex %llu)\n",
+		slvm_finishset, slvm_newindextm);
+	fprintf(f, "\n== functions\n");
+	fprintf(f, "%14s %7s %12s %12s  %s\n",
+		"instructions", "%", "calls", "time (ms)", "function");
+	for (i = 0; i < nstats; i++) {
+		SlvmStats *s = v[i];
+		unsigned long long n = stats_count(s);
+		if (n == 0) break;
+		fprintf(f, "%14llu %6.2f%% %12llu %12.3f  %s\n", n,
+			100.0 * n / total, s->calls, s->time / 1e6,
+			stats_name(s, name, sizeof(name)));
+	}
+	fprintf(f, "\n== lines\n");
+	for (i = 0; i < nstats; i++) {
+		SlvmStats *s = v[i];
+		if (stats_count(s) == 0) break;
+		fprintf(f, "%s\n", stats_name(s, name, sizeof(name)));
+		if (dump_lines(f, s) != 0) r = -1;
+	}
+	if (ferror(f)) r = -1;
+	if (f != stderr && fclose(f) != 0) r = -1;
+	free(v);
+	return r;
+}
+
+//----------------------------------------------------------------------
+// lua api
+
+static int ll_opcodes(lua_State *L) {
+	// lua api: opcodes() => {opname = count}
+	int i;
+	lua_newtable(L);
+	for (i = 0; i < NUM_OPCODES; i++) {
+		if (slvm_opcount[i] == 0) continue;
+		lua_pushinteger(L, slvm_opcount[i]);
+		lua_setfield(L, -2, opnames[i]);
+	}
+	return 1;
+}
+
+static int ll_counters(lua_State *L) {
+	// lua api: counters() => {instructions=, finishget=, ...}
+	unsigned long long total = 0;
+	int i;
+	for (i = 0; i < NUM_OPCODES; i++) total += slvm_opcount[i];
+	lua_createtable(L, 0, 5);
+	lua_pushinteger(L, total); lua_setfield(L, -2, "instructions");
+	lua_pushinteger(L, slvm_finishget); lua_setfield(L, -2, "finishget");
+	lua_pushinteger(L, slvm_indextm); lua_setfield(L, -2, "indextm");
+	lua_pushinteger(L, slvm_finishset); lua_setfield(L, -2, "finishset");
+	lua_pushinteger(L, slvm_newindextm); lua_setfield(L, -2, "newindextm");
+	return 1;
+}
+
+static int ll_functions(lua_State *L) {
+	// lua api: functions() => list of {source=, line=, calls=,
+	//	count=, time=, lines={line=count}}
+	SlvmStats **v = sorted_stats();
+	int i, pc;
+	if (v == NULL) return luaL_error(L, "not enough memory");
+	lua_createtable(L, nstats, 0);
+	for (i = 0; i < nstats; i++) {
+		SlvmStats *s = v[i];
+		unsigned long long n = stats_count(s);
+		if (n == 0) break;
+		lua_createtable(L, 0, 6);
+		lua_pushstring(L, s->source); lua_setfield(L, -2, "source");
+		lua_pushinteger(L, s->linedefined); lua_setfield(L, -2, "line");
+		lua_pushinteger(L, s->calls); lua_setfield(L, -2, "calls");
+		lua_pushinteger(L, n); lua_setfield(L, -2, "count");
+		lua_pushnumber(L, s->time / 1e9); lua_setfield(L, -2, "time");
+		lua_newtable(L);
+		for (pc = 0; pc < s->sizecode; pc++) {
+			if (s->pccount[pc] == 0) continue;
+			lua_rawgeti(L, -1, s->lines[pc]);
+			lua_pushinteger(L,
+				lua_tointeger(L, -1) + s->pccount[pc]);
+			lua_rawseti(L, -3, s->lines[pc]);
+			lua_pop(L, 1);
+		}
+		lua_setfield(L, -2, "lines");
+		lua_rawseti(L, -2, i + 1);
+	}
+	free(v);
+	return 1;
+}
+
+static int ll_reset(lua_State *L) {
+	// lua api: reset()
+	SlvmStats *s;
+	(void)L;
+	memset(slvm_opcount, 0, sizeof(slvm_opcount));
+	slvm_finishget = slvm_indextm = 0;
+	slvm_finishset = slvm_newindextm = 0;
+	for (s = allstats; s != NULL; s = s->next) {
+		memset(s->pccount, 0,
+			s->sizecode * sizeof(unsigned long long));
+		s->calls = s->time = 0;
+	}
+	return 0;
+}
+
+static int ll_dump(lua_State *L) {
+	// lua api: dump([filename]) => true | nil, errmsg
+	const char *filename = luaL_optstring(L, 1, NULL);
+	if (slvm_dump(filename) != 0) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "cannot write the report");
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static const struct luaL_Reg slvmstatslib[] = {
+	{"opcodes", ll_opcodes},
+	{"counters", ll_counters},
+	{"functions", ll_functions},
+	{"reset", ll_reset},
+	{"dump", ll_dump},
+	{NULL, NULL},
+};
+
+int luaopen_slvmstats(lua_State *L) {
+	luaL_newlib(L, slvmstatslib);
+	return 1;
+}
+
+#endif
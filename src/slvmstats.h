@@ -0,0 +1,78 @@
+// Copyright (c) 2023  Phil Leblanc  -- see LICENSE file
+// ---------------------------------------------------------------------
+/*
+
+slvmstats - VM instruction counters (instrumentation build)
+
+When slua is built with -DSLUA_VMSTATS (make VMFLAGS=-DSLUA_VMSTATS),
+the VM (luaV_execute in lvm.c) counts:
+- the executed instructions per opcode (for all states),
+- the executed instructions per function prototype and per
+  instruction (so per source line),
+- the calls and the inclusive time (wall clock) per function,
+- the table accesses not done by the fast path (luaV_finishget,
+  luaV_finishset) and those that use a metamethod (__index,
+  __newindex)
+
+The counters of a function prototype are not freed with the
+prototype, so a report includes the functions already collected.
+The counters are global and not protected: the instrumentation build
+is intended for single-thread programs.
+
+Lua functions (library "slvmstats"):
+	opcodes() => {opname = count}
+	counters() => {instructions=, finishget=, indextm=,
+		finishset=, newindextm=}
+	functions() => list of {source=, line=, calls=, count=, time=,
+		lines={line=count}}, sorted by decreasing count
+	reset()
+	dump([filename]) - write a report (stderr if no filename)
+
+slua writes the report at exit to the file named by the environment
+variable SLUA_VMSTATS, or to stderr.
+
+*/
+
+#ifndef SLVMSTATS_H
+#define SLVMSTATS_H
+
+#include "lua.h"
+#include "lobject.h"
+#include "lopcodes.h"
+#include "lstate.h"
+
+typedef struct SlvmStats {
+	struct SlvmStats *next;		// list of all the counters
+	char *source;			// (copied: the proto may be freed)
+	int linedefined;
+	int sizecode;
+	int *lines;			// source line of each instruction
+	unsigned long long *pccount;	// count of each instruction
+	unsigned long long calls;
+	unsigned long long time;	// inclusive time (nanoseconds)
+} SlvmStats;
+
+extern unsigned long long slvm_opcount[NUM_OPCODES];
+extern unsigned long long slvm_finishget, slvm_indextm;
+extern unsigned long long slvm_finishset, slvm_newindextm;
+
+// return the counters of p (create them the first time)
+SlvmStats *slvm_newstats(Proto *p);
+#define slvm_stats(p) ((p)->vmstats ? (p)->vmstats : slvm_newstats(p))
+
+// count instruction i at pc (pc is after the instruction)
+#define slvm_count(s, p, pc, i) \
+	(slvm_opcount[GET_OPCODE(i)]++, (s)->pccount[(pc) - (p)->code - 1]++)
+
+// start and end of a call
+void slvm_call(SlvmStats *s, CallInfo *ci);
+void slvm_return(SlvmStats *s, CallInfo *ci);
+
+// write a report to file 'filename' (stderr if NULL). return 0, or
+// -1 on error
+int slvm_dump(const char *filename);
+
+// the slvmstats Lua library
+int luaopen_slvmstats(lua_State *L);
+
+#endif
@@ -6,11 +6,19 @@
 * This code is hereby placed in the public domain and also under the MIT license
 */
 
+//  slua:
+//	option -c: glue the compiled script (bytecode) instead of the source
+//	option -s: same, with the debug information stripped
+//	files after out.exe are appended as a bundle (see slbundle.h)
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "srglue.h"
+#include "lua.h"
+#include "lauxlib.h"
+#include "slbundle.h"
 
 static const char* progname="srglue";
 
@@ -53,12 +61,134 @@ static long copy(FILE* in, const char* name, FILE* out, const char* outname)
  return size;
 }
 
+typedef struct { FILE* f; long size; } Writer;
+
+static int writer(lua_State* L, const void* p, size_t size, void* u)
+{
+ Writer* w=u;
+ (void)L;
+ w->size+=size;
+ return size>0 && fwrite(p,size,1,w->f)!=1;
+}
+
+static long compile(const char* name, FILE* out, const char* outname, int strip)
+{
+ lua_State* L=luaL_newstate();
+ Writer w={out,0};
+ if (L==NULL)
+ {
+  fprintf(stderr,"%s: cannot create state: not enough memory\n",progname);
+  exit(EXIT_FAILURE);
+ }
+ if (luaL_loadfile(L,name)!=LUA_OK)
+ {
+  fprintf(stderr,"%s: %s\n",progname,lua_tostring(L,-1));
+  exit(EXIT_FAILURE);
+ }
+ if (lua_dump(L,writer,&w,strip)!=0) cannot("write",outname);
+ lua_close(L);
+ return w.size;
+}
+
+typedef struct { const char* name; char* data; size_t len; } File;
+
+#define ALIGN(n)	(((n)+7) & ~(size_t)7)
+
+static void readfile(File* f, const char* outname, int c, int strip)
+{
+ size_t n=strlen(f->name);
+ FILE* out=open_memstream(&f->data,&f->len);
+ if (out==NULL) cannot("read",f->name);
+ if (c && n>4 && strcmp(f->name+n-4,".lua")==0)
+  compile(f->name,out,outname,strip);
+ else
+  copy(open(f->name,"rb",outname),f->name,out,outname);
+ if (fclose(out)!=0) cannot("read",f->name);
+}
+
+static void zeros(FILE* out, size_t n, const char* outname)
+{
+ static const char z[8];
+ if (n>0 && fwrite(z,n,1,out)!=1) cannot("write",outname);
+}
+
+static int cmpfile(const void* a, const void* b)
+{
+ return strcmp(((const File*)a)->name,((const File*)b)->name);
+}
+
+static void bundle(File* files, int n, long offset, FILE* out, const char* outname)
+{
+ slbundle_hdr h;
+ slbundle_entry* e=calloc(n,sizeof(slbundle_entry));
+ uint32_t* b;
+ uint32_t nb=2;
+ size_t pos;
+ int i;
+ while (nb<=2*(uint32_t)n) nb*=2;
+ b=calloc(nb,sizeof(uint32_t));
+ if (e==NULL || b==NULL) cannot("write",outname);
+ qsort(files,n,sizeof(File),cmpfile);
+ pos=sizeof(h)+n*sizeof(slbundle_entry)+nb*sizeof(uint32_t);
+ for (i=0; i<n; i++)
+ {
+  uint32_t j;
+  if (i>0 && strcmp(files[i].name,files[i-1].name)==0)
+  {
+   errno=EEXIST;
+   cannot("bundle",files[i].name);
+  }
+  e[i].name=pos;
+  e[i].namelen=strlen(files[i].name);
+  e[i].hash=slbundle_hash(files[i].name,e[i].namelen);
+  pos+=e[i].namelen+1;
+  for (j=e[i].hash&(nb-1); b[j]!=0; j=(j+1)&(nb-1)) ;
+  b[j]=i+1;
+ }
+ for (i=0; i<n; i++)
+ {
+  pos=ALIGN(pos);
+  e[i].data=pos;
+  e[i].len=files[i].len;
+  pos+=files[i].len;
+ }
+ memcpy(h.magic,SLBUNDLE_MAGIC,sizeof(h.magic));
+ h.count=n;
+ h.nbuckets=nb;
+ zeros(out,ALIGN(offset)-offset,outname);
+ if (fwrite(&h,sizeof(h),1,out)!=1
+  || fwrite(e,sizeof(slbundle_entry),n,out)!=(size_t)n
+  || fwrite(b,sizeof(uint32_t),nb,out)!=nb) cannot("write",outname);
+ for (i=0; i<n; i++)
+  if (fwrite(files[i].name,e[i].namelen+1,1,out)!=1) cannot("write",outname);
+ pos=e[n-1].name+e[n-1].namelen+1;
+ for (i=0; i<n; i++)
+ {
+  zeros(out,e[i].data-pos,outname);
+  if (files[i].len>0 && fwrite(files[i].data,files[i].len,1,out)!=1)
+   cannot("write",outname);
+  pos=e[i].data+files[i].len;
+ }
+ free(e);
+ free(b);
+}
+
 int main(int argc, char* argv[])
 {
+ int c=0, strip=0;
  if (argv[0]!=NULL && *argv[0]!=0) progname=argv[0];
- if (argc!=4)
+ if (argc>=5 && (strcmp(argv[1],"-c")==0 || strcmp(argv[1],"-s")==0))
+ {
+  c=1;
+  strip=(argv[1][1]=='s');
+  argc--; argv++;
+ }
+ if (argc<4)
  {
-  fprintf(stderr,"usage: %s in.exe in.lua out.exe\n",progname);
+  fprintf(stderr,"usage: %s [-c|-s] in.exe in.lua out.exe [file ...]\n"
+   "  -c  glue the compiled script\n"
+   "  -s  glue the compiled script, without debug information\n"
+   "  files are embedded as a bundle (Lua modules and data files)\n",progname);
   return 1;
  }
  else
@@ -68,7 +198,26 @@ int main(int argc, char* argv[])
   FILE* out=open(argv[3],"wb",NULL);
   Glue t={GLUESIG,0,0};
   t.size1=copy(in1,argv[1],out,argv[3]);
-  t.size2=copy(in2,argv[2],out,argv[3]);
+  if (c)
+  {
+   fclose(in2);
+   t.size2=compile(argv[2],out,argv[3],strip);
+  }
+  else
+   t.size2=copy(in2,argv[2],out,argv[3]);
+  if (argc>4)
+  {
+   int i, n=argc-4;
+   File* files=calloc(n,sizeof(File));
+   if (files==NULL) cannot("write",argv[3]);
+   for (i=0; i<n; i++)
+   {
+    files[i].name=argv[4+i];
+    while (strncmp(files[i].name,"./",2)==0) files[i].name+=2;
+    readfile(&files[i],argv[3],c,strip);
+   }
+   bundle(files,n,t.size1+t.size2,out,argv[3]);
+  }
   if (fwrite(&t,sizeof(t),1,out)!=1) cannot("write",argv[3]);
   if (fclose(out)!=0) cannot("close",argv[3]);
   return 0;
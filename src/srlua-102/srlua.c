@@ -10,16 +10,26 @@
 //	added slua preloaded libraries
 //  	ignore argv[0] - use /proc/self/exe to find the exe pathname
 //	added SLUA_VERSION
+//	use the slalloc pool allocator (SLUA_ALLOC=libc: standard allocator)
+//	the glued program may be a source or a compiled chunk (srglue -c, -s)
+//	load the program from a read-only mapping of the executable
+//	bundled modules and data files (slbundle.h)
 
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "srglue.h"
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
+#include "slalloc.h"
+#include "slbundle.h"
 
 #if LUA_VERSION_NUM <= 501
 
@@ -54,42 +64,45 @@ static void cannot(lua_State *L, const char* what, const char* name)
  fatal(message);
 }
 
-typedef struct { FILE *f; size_t size; char buff[512]; } State;
-
-static const char *myget(lua_State *L, void *data, size_t *size)
-{
- State* s=data;
- size_t n;
- (void)L;
- n=(sizeof(s->buff)<=s->size)? sizeof(s->buff) : s->size;
- n=fread(s->buff,1,n,s->f);
- s->size-=n;
- *size=n;
- return (n>0) ? s->buff : NULL;
-}
-
 static void load(lua_State *L, const char *name)
 {
  Glue t;
- State S;
+ struct stat st;
+ const char *p, *s;
+ size_t n, b;
+ int fd;
 	/// 220317  ignore argv[0] - force exe name
 	/// it allows the executable to be located anywhere 
 	/// (in the PATH) and called by name  (Linux only!)
 	name = "/proc/self/exe";
- FILE *f=fopen(name,"rb");
- int c;
-	
- if (f==NULL) cannot(L,"open",name);
- if (fseek(f,-sizeof(t),SEEK_END)!=0) cannot(L,"seek",name);
- if (fread(&t,sizeof(t),1,f)!=1) cannot(L,"read",name);
- if (memcmp(t.sig,GLUESIG,GLUELEN)!=0) cannot(L,"find a Lua program in",name);
- if (fseek(f,t.size1,SEEK_SET)!=0) cannot(L,"seek",name);
- S.f=f; S.size=t.size2;
- c=getc(f);
- if (c=='#') while (--S.size>0 && c!='\n') c=getc(f);
- ungetc(c,f);
- if (lua_load(L,myget,&S,"=",NULL)!=0) fatal(lua_tostring(L,-1));
- fclose(f);
+	/// slua: the executable is mapped, and the program is loaded
+	/// from the mapping in one piece (no read and copy). If there is
+	/// a bundle after the program (slbundle.h), the mapping is kept
+	/// (bundle slices are read-only slbuf buffers)
+ fd=open(name,O_RDONLY|O_CLOEXEC);
+ if (fd<0) cannot(L,"open",name);
+ if (fstat(fd,&st)!=0) cannot(L,"stat",name);
+ if (st.st_size<(off_t)sizeof(t)) cannot(L,"find a Lua program in",name);
+ p=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+ if (p==MAP_FAILED) cannot(L,"map",name);
+ close(fd);
+ memcpy(&t,p+st.st_size-sizeof(t),sizeof(t));
+ if (memcmp(t.sig,GLUESIG,GLUELEN)!=0
+  || t.size1<0 || t.size2<0
+  || t.size2>st.st_size-(off_t)sizeof(t)-t.size1)
+  cannot(L,"find a Lua program in",name);
+ s=p+t.size1; n=t.size2;
+ if (n>0 && *s=='#') while (n>0 && *s!='\n') { s++; n--; }
+ if (luaL_loadbuffer(L,s,n,"=")!=0) fatal(lua_tostring(L,-1));
+ b=(t.size1+t.size2+7) & ~(size_t)7;
+ if (b<st.st_size-sizeof(t))
+ {
+  if (slbundle_init(p+b,st.st_size-sizeof(t)-b)!=0)
+   fatal("invalid bundle");
+  slbundle_install(L);
+ }
+ else
+  munmap((void *)p,st.st_size);
 }
 
 static int pmain(lua_State *L)
@@ -144,15 +157,17 @@ static int msghandler(lua_State *L)
 int main(int argc, char *argv[])
 {
  lua_State *L;
+ const char *s;
  if (argv[0]==NULL) fatal("cannot locate this executable");
  progname=argv[0];
- L=luaL_newstate();
+ s=getenv("SLUA_ALLOC");
+ L=slalloc_newstate((s==NULL || strcmp(s,"libc")!=0) ? SLALLOC_POOL : 0, 0);
  if (L==NULL) fatal("cannot create state: not enough memory");
  lua_pushcfunction(L,msghandler);
  lua_pushcfunction(L,&pmain);
  lua_pushinteger(L,argc);
  lua_pushlightuserdata(L,argv);
  if (lua_pcall(L,2,0,1)!=0) fatal(lua_tostring(L,-1));
- lua_close(L);
+ slalloc_close(L);
  return EXIT_SUCCESS;
 }
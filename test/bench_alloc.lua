@@ -0,0 +1,64 @@
+
+-- allocator benchmark: table, string and closure heavy workloads
+--
+-- compare the pool allocator (default) and the standard allocator:
+--	./slua test/bench_alloc.lua
+--	SLUA_ALLOC=libc ./slua test/bench_alloc.lua
+
+local strf = string.format
+
+local function bench(name, f, n)
+	collectgarbage()
+	local t0 = os.clock()
+	f(n)
+	local t = os.clock() - t0
+	print(strf("%-12s %8.3f s   %8d KB", name, t,
+		math.floor(collectgarbage("count"))))
+	return t
+end
+
+local function tables(n)
+	-- many small tables, some growing
+	local keep = {}
+	for i = 1, n do
+		local t = {i, i + 1, x = i, y = i * 2}
+		if i % 7 == 0 then for j = 1, 20 do t[j] = j end end
+		keep[i % 1000 + 1] = t
+	end
+end
+
+local function strings(n)
+	-- short strings (interned) and longer strings
+	local keep = {}
+	for i = 1, n do
+		local s = "key" .. i
+		keep[i % 1000 + 1] = s .. string.rep("x", i % 200)
+	end
+end
+
+local function closures(n)
+	-- closures with upvalues
+	local keep = {}
+	for i = 1, n do
+		local a, b = i, i * 2
+		keep[i % 1000 + 1] = function() return a + b end
+	end
+end
+
+local function tree(d)
+	if d == 0 then return {} end
+	return {tree(d - 1), tree(d - 1)}
+end
+
+local function trees(n)
+	-- binary trees (as the benchmarksgame binary-trees)
+	for i = 1, n do tree(14) end
+end
+
+print("allocator:", os.getenv("SLUA_ALLOC") or "pool")
+local total = 0
+total = total + bench("tables", tables, 2000000)
+total = total + bench("strings", strings, 2000000)
+total = total + bench("closures", closures, 3000000)
+total = total + bench("trees", trees, 40)
+print(strf("%-12s %8.3f s", "total", total))
@@ -0,0 +1,9 @@
+-- module used by test_slbundle.lua (embedded in a srlua bundle)
+
+local M = {}
+
+function M.add(a, b) return a + b end
+
+function M.fail() error("bundlemod error") end
+
+return M
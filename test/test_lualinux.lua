@@ -0,0 +1,321 @@
+-- test of the lualinux functions added in slua (buffers, mmap, ...)
+-- with real round-trips over files, pipes and unix sockets
+
+local ll = require"lualinux"
+
+local AF_UNIX, SOCK_STREAM, SOCK_DGRAM = 1, 1, 2
+local EAGAIN = 11
+
+local function unixaddr()
+	local path = os.tmpname()
+	os.remove(path)
+	return string.pack("<I2z", AF_UNIX, path), path
+end
+
+local function socketpair()
+	-- return two connected unix stream sockets
+	local sa, path = unixaddr()
+	local a = assert(ll.socket(AF_UNIX, SOCK_STREAM, 0))
+	local b = assert(ll.socket(AF_UNIX, SOCK_STREAM, 0))
+	assert(ll.bind(a, sa) and ll.listen(a, 1) and ll.connect(b, sa))
+	local c = assert(ll.accept(a))
+	ll.close(a)
+	os.remove(path)
+	return c, b
+end
+
+-- arbitrary-size reads (larger than the 4 kB default)
+local r, w = assert(ll.pipe2())
+local big = string.rep("0123456789abcdef", 3000)	-- 48 kB
+assert(ll.write(w, big) == #big)
+assert(ll.read(r, 100000) == big)
+assert(ll.write(w, "abc") == 3)
+assert(ll.read(r, 0) == "" and ll.read(r) == "abc")
+assert(not pcall(ll.read, r, -1))
+-- write with idx and count
+assert(ll.write(w, "hello world", 7) == 5 and ll.read(r) == "world")
+assert(ll.write(w, "hello world", 3, 2) == 2 and ll.read(r) == "ll")
+assert(ll.write(w, "hello", 6, 0) == 0)
+assert(not pcall(ll.write, w, "hello", 0))
+assert(not pcall(ll.write, w, "hello", 3, 4))
+assert(not pcall(ll.write, w, "hello", 7) and not pcall(ll.write, w, "hello", -1))
+assert(not pcall(ll.write, w, "hello", 3, -1))
+assert(not pcall(ll.readbuf, r, ll.newbuffer(4), 2, math.maxinteger))
+-- reads in a buffer
+local b = ll.newbuffer(16)
+assert(#b == 16 and b:get() == string.rep("\0", 16))
+assert(ll.write(w, "0123456789") == 10)
+assert(ll.readbuf(r, b, 3, 4) == 4 and b:get(3, 6) == "0123")
+assert(ll.readbuf(r, b) == 6 and b:get(1, 6) == "456789")
+assert(not pcall(ll.readbuf, r, b, 10, 8))	-- out of range
+ll.close(w)
+assert(ll.readbuf(r, b) == 0 and ll.read(r) == "")	-- end of file
+ll.close(r)
+-- read-only buffers cannot be read into
+r, w = assert(ll.pipe2())
+assert(not pcall(ll.readbuf, r, assert(ll.mmap(-1, 10, 1, 2))))
+ll.close(r); ll.close(w)
+
+-- sockets: recv, recvbuf, send with idx and count
+local s1, s2 = socketpair()
+assert(ll.send(s1, big, 0) == #big)
+local got = {}
+local n = 0
+while n < #big do
+	local s = assert(ll.recv(s2, 0, 100000))
+	got[#got + 1] = s
+	n = n + #s
+end
+assert(table.concat(got) == big)
+assert(ll.send(s1, "hello world", 0, 7, 5) == 5)
+assert(ll.recv(s2) == "world")
+b = ll.newbuffer(8)
+assert(ll.send(s1, b:view(1, 3):fill(65), 0) == 3)
+assert(ll.recvbuf(s2, b, 0, 5, 4) == 3 and b:get() == "AAA\0AAA\0")
+assert(not pcall(ll.send, s1, "hello", 0, 2, 5))
+assert(not pcall(ll.send, s1, "hello", 0, 10))
+assert(select(2, ll.recv(s2, 64)) == EAGAIN)	-- MSG_DONTWAIT
+ll.close(s1); ll.close(s2)
+-- datagrams: recvfrom, sendto
+local sa, path = unixaddr()
+s1 = assert(ll.socket(AF_UNIX, SOCK_DGRAM, 0))
+s2 = assert(ll.socket(AF_UNIX, SOCK_DGRAM, 0))
+assert(ll.bind(s1, sa))
+assert(ll.sendto(s2, "xxdatagram", 0, sa, 3) == 8)
+assert(not pcall(ll.sendto, s2, "xx", 0, sa, 4))
+local d, from = ll.recvfrom(s1, 0, 100000)
+assert(d == "datagram" and type(from) == "string")
+ll.close(s1); ll.close(s2)
+os.remove(path)
+
+-- buffer methods (see src/slbuf.c)
+b = ll.newbuffer(16)
+assert(b:put(1, "abc") == 4 and b:put(4, b:view(1, 3)) == 7)
+assert(b:get(1, 6) == "abcabc" and b:get(-10) == b:get(7))
+assert(b:get(5, 2) == "" and b:get(0, 100) == b:get())
+assert(not pcall(b.put, b, 15, "abc"))
+b:putuint(9, -2, 4):putuint(13, 0x0102, 2)
+assert(b:getuint(9, 4) == 0xfffffffe and b:getint(9, 4) == -2)
+assert(b:getuint(13, 2) == 0x0102 and b:getuint(13, 1) == 2)
+assert(not pcall(b.getuint, b, 14, 4) and not pcall(b.getuint, b, 1, 3))
+local v = b:view(4, 6)
+assert(#v == 3 and v:get() == "abc")
+v:fill(0x78)
+assert(b:get(1, 7) == "abcxxx\0" and #b:view(10, 2) == 0)
+assert(b:addr(4) == v:addr() and not pcall(b.addr, b, 18))
+
+-- lsccore: buffers in place of raw addresses
+local lsc = require"lsccore"
+b = lsc.newbuffer(32)
+assert(lsc.putstr(b, "hello") == b and lsc.getstr(b) == "hello")
+assert(lsc.putbin(b, "HE") and lsc.getstr(b, 5) == "HEllo")
+assert(lsc.putuint(b, 0x01020304, 4) and lsc.getuint(b, 4) == 0x01020304)
+assert(lsc.zero(b, 4) and lsc.getstr(b) == "")
+assert(not pcall(lsc.putstr, b, string.rep("x", 32)))	-- no room for \0
+assert(not pcall(lsc.getuint, b:view(1, 2), 4))
+assert(lsc.getstr(lsc.putbin(b, string.rep("y", 32))) == string.rep("y", 32))
+assert(lsc.freebuffer(b))
+if io.popen("uname -m"):read("l") == "x86_64" then
+	local SYS_read, SYS_write = 0, 1
+	r, w = assert(ll.pipe2())
+	lsc.putbin(b, "syscall")
+	assert(lsc.syscall(SYS_write, w, b, 7) == 7)
+	assert(lsc.syscall(SYS_read, r, b:view(8), 7) == 7)
+	assert(lsc.getstr(b:view(8), 7) == "syscall")
+	ll.close(r); ll.close(w)
+	assert(select(2, lsc.syscall(SYS_read, -1, b, 1)) == 9)	-- EBADF
+end
+
+-- epoll
+local EPOLLIN, EPOLLOUT = 1, 4
+local ADD, DEL, MOD = 1, 2, 3
+local ep = assert(ll.epoll_create())
+r, w = assert(ll.pipe2())
+assert(ll.epoll_ctl(ep, ADD, r) and ll.epoll_ctl(ep, ADD, w, EPOLLOUT))
+local evl = {}
+assert(ll.epoll_wait(ep, evl, nil, 0) == 1)	-- w is writable
+assert(evl[1] == w << 32 | EPOLLOUT)
+assert(ll.epoll_ctl(ep, DEL, w) and ll.epoll_wait(ep, evl, nil, 0) == 0)
+ll.write(w, "x")
+assert(ll.epoll_wait(ep, evl, 10, 1000) == 1 and evl[1] == r << 32 | EPOLLIN)
+assert(ll.epoll_ctl(ep, MOD, r, EPOLLOUT))
+assert(ll.epoll_wait(ep, evl, 10, 0) == 0)
+ll.close(ep); ll.close(r); ll.close(w)
+
+-- evloop: an echo server coroutine and a client coroutine
+local ev = assert(ll.evloop())
+s1, s2 = socketpair()
+local echoed = {}
+ev:add(s1, EPOLLIN, coroutine.create(function(fd, events)
+	while true do
+		assert(fd == s1 and events & EPOLLIN ~= 0)
+		local s = assert(ll.read(fd))
+		if s == "" or s == "quit" then return end
+		assert(ll.write(fd, s:upper()) == #s)
+		fd, events = coroutine.yield()
+	end
+end))
+ev:add(s2, EPOLLOUT, coroutine.create(function(fd, events)
+	for i = 1, 3 do
+		assert(events & EPOLLOUT ~= 0)
+		ll.write(fd, "msg" .. i)
+		fd, events = coroutine.yield(EPOLLIN)	-- wait for the echo
+		echoed[i] = ll.read(fd)
+		fd, events = coroutine.yield(EPOLLOUT)
+	end
+	ll.write(fd, "quit")
+end))
+local rounds = 0
+while #echoed < 3 do
+	assert(ev:wait(1000) > 0)
+	rounds = rounds + 1
+	assert(rounds < 100)
+end
+assert(echoed[1] == "MSG1" and echoed[3] == "MSG3")
+assert(ev:wait(1000) == 1)	-- the client sends "quit" and returns
+assert(ev:wait(1000) == 1)	-- the server gets "quit" and returns
+assert(ev:wait(0) == 0)	-- both coroutines are done: fds removed
+assert(select(2, ev:del(s1)) == 2)	-- ENOENT
+-- an error in a coroutine is propagated, and the fd is removed
+ev:add(s1, EPOLLOUT, coroutine.create(function() error("evboom") end))
+local ok, msg = pcall(ev.wait, ev, 1000)
+assert(not ok and msg:match"evboom" and ev:wait(0) == 0)
+assert(not pcall(ev.add, ev, s1, EPOLLIN))	-- no coroutine
+assert(type(ev:fd()) == "number")
+ev:close()
+assert(not pcall(ev.wait, ev))
+ll.close(s1); ll.close(s2)
+
+-- io_uring (skipped if not available: ENOSYS, EPERM)
+local u = ll.uring(8)
+if u then
+	local res = {}
+	r, w = assert(ll.pipe2())
+	b = ll.newbuffer(16)
+	-- two operations with the same udata
+	u:write(7, w, "hello world", 7):write(7, w, b:view(1, 3):fill(66))
+	assert(u:submit(2) == 2)
+	assert(u:reap(res) == 2)
+	assert(res[1] == 7 and res[2] == 5 and res[3] == 7 and res[4] == 3)
+	u:read(1, r, b, 1, 8)
+	assert(u:submit(1) == 1 and u:reap(res, 1) == 1)
+	assert(res[1] == 1 and res[2] == 8 and b:get(1, 8) == "worldBBB")
+	-- results are -errno
+	u:read(2, -1, b):submit(1)
+	assert(u:reap(res) == 1 and res[1] == 2 and res[2] == -9)  -- EBADF
+	-- counts are 32-bit: larger buffers are refused
+	local huge = ll.mmap(-1, 5 << 30, 3, 2 | 0x4000)  -- MAP_NORESERVE
+	if huge then
+		assert(select(2, pcall(u.read, u, 3, r, huge)):match"too large")
+		assert(select(2, pcall(u.write, u, 3, w, huge)):match"too large")
+		ll.munmap(huge)
+	end
+	assert(not pcall(u.read, u, 3, r, ll.mmap(-1, 10, 1, 2)))  -- read-only
+	assert(select(2, pcall(u.write, u, 3, w, "hello", 8)):match"out of range")
+	-- a mapping cannot be unmapped until the completion is reaped
+	local mp = assert(ll.mmap(-1, 4096, 3, 2))
+	u:read(8, r, mp):submit()
+	assert(select(2, ll.munmap(mp)) == 16)	-- EBUSY
+	assert(ll.write(w, "mapped") == 6 and u:submit(1))
+	assert(u:reap(res) == 1 and res[2] == 6 and mp:get(1, 6) == "mapped")
+	assert(ll.munmap(mp))
+	-- close() cancels the pending reads (nothing to read in the pipe)
+	mp = assert(ll.mmap(-1, 4096, 3, 2))
+	u:read(4, r, b):read(5, r, b:view(9)):read(6, r, mp)
+	assert(u:submit() == 3)
+	assert(select(2, ll.munmap(mp)) == 16)
+	u:close()
+	assert(ll.munmap(mp))
+	assert(not pcall(u.submit, u))
+	ll.close(r); ll.close(w)
+	-- the same for a collected ring
+	r, w = assert(ll.pipe2())
+	u = assert(ll.uring())
+	u:read(6, r, ll.newbuffer(8)):submit()
+	u = nil; collectgarbage()
+	assert(ll.write(w, "x") == 1 and ll.read(r) == "x")
+	ll.close(r); ll.close(w)
+end
+
+-- file mappings (lualinux.mmap) and b:find
+local fn = os.tmpname()
+local f = io.open(fn, "w")
+f:write("hello\n", string.pack("<I4i2", 0x01020304, -2), "\nworld\n")
+f:close()
+local fd = assert(ll.open(fn, 0, 0))	-- O_RDONLY
+local mp = assert(ll.mmap(fd))
+ll.close(fd)
+assert(#mp == 19 and mp:get(1, 5) == "hello")
+assert(mp:getuint(7, 4) == 0x01020304 and mp:getint(11, 2) == -2)
+assert(mp:find(10) == 6 and mp:find("\n", 7) == 13)
+local i, j = mp:find("world")
+assert(i == 14 and j == 18 and mp:find("world", 15) == nil)
+assert(mp:find("") == 1 and mp:find("x") == nil)
+assert(mp:find(10, -1) == 19)
+assert(not pcall(mp.put, mp, 1, "x"))	-- read-only mapping
+local v = mp:view(14, 18)
+assert(v:get() == "world" and not pcall(v.fill, v, 0))
+assert(not pcall(ll.munmap, ll.newbuffer(10)))
+-- a mapping cannot be unmapped while a view is alive
+local r, e = ll.munmap(mp)
+assert(r == nil and e == 16 and v:get() == "world")	-- EBUSY
+v = nil; collectgarbage()
+assert(ll.munmap(mp) and #mp == 0 and mp:get() == "")
+assert(not pcall(mp.getuint, mp, 1, 1) and ll.munmap(mp))
+fd = assert(ll.open(fn, 2, 0))	-- O_RDWR
+mp = assert(ll.mmap(fd, nil, 3))	-- PROT_READ|PROT_WRITE, MAP_SHARED
+mp:put(14, "WORLD")
+assert(ll.msync(mp) and ll.msync(mp, 14, 5, 1))	-- MS_ASYNC
+assert(ll.madvise(mp, 2) and ll.madvise(mp, 3, 10, 5))
+local nul = assert(ll.open("/dev/null", 1, 0))
+assert(ll.write(nul, mp, 14, 6) == 6)
+ll.close(nul)
+ll.close(fd)
+f = io.open(fn); assert(f:read("a"):sub(14) == "WORLD\n"); f:close()
+assert(#assert(ll.mmap(-1, 100, 3, 2)) == 100)	-- anonymous
+io.open(fn, "w"):close()
+fd = assert(ll.open(fn, 0, 0))
+mp = assert(ll.mmap(fd))
+ll.close(fd)
+assert(#mp == 0 and mp:find("x") == nil)
+os.remove(fn)
+assert(ll.mmap(-1, 100, 1, 0) == nil)	-- no MAP_SHARED or MAP_PRIVATE
+
+-- syscall statistics
+ll.stats_enable(true)
+ll.stats(true)	-- reset
+r, w = assert(ll.pipe2())
+assert(ll.write(w, "hello") == 5 and ll.read(r, 100) == "hello")
+assert(ll.write(w, "world") == 5 and ll.readbuf(r, ll.newbuffer(8)) == 5)
+ll.getcwd(); ll.environ()
+assert(ll.read(-1) == nil)	-- EBADF
+assert(not pcall(ll.read, "x"))	-- raised error
+ll.close(r); ll.close(w)
+local st, enabled = ll.stats(true)
+assert(enabled)
+assert(st.write.calls == 2 and st.write.bytes == 10)
+assert(st.read.calls == 3 and st.read.errors == 2 and st.read.bytes == 5)
+assert(st.readbuf.bytes == 5 and st.newbuffer.bytes == 0)
+assert(st.getcwd.calls == 1 and st.getcwd.bytes == 0 and st.environ.bytes == 0)
+local nh = 0
+for _, c in ipairs(st.read.hist) do nh = nh + c end
+assert(nh == 3 and st.read.time > 0)
+assert(next((ll.stats())) == nil)	-- reset
+-- the counters are shared by the states of all the threads
+local th = require"slthread"
+local ts = {}
+for i = 1, 4 do
+	ts[i] = th.start(function()
+		local ll = require"lualinux"
+		ll.stats_enable(true)
+		for j = 1, 20000 do ll.getpid() end
+	end)
+end
+for i = 1, 4 do assert(ts[i]:join()) end
+assert(ll.stats(true).getpid.calls == 80000)
+ll.stats_enable(false)
+ll.getpid()
+st, enabled = ll.stats()
+assert(not enabled and st.getpid == nil)
+
+print("test_lualinux", "ok")
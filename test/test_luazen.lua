@@ -80,6 +80,14 @@ print("------------------------------------------------------------")
 print("testing md5...")
 assert(stx(lz.md5('')) == 'd41d8cd98f00b204e9800998ecf8427e')
 assert(stx(lz.md5('abc')) == '900150983cd24fb0d6963f7d28e17f72')
+assert(lz.md5_init():final() == lz.md5(''))
+local function hashparts(ctx, s, n)
+	for i = 1, #s, n do ctx:update(s:sub(i, i+n-1)) end
+	return ctx:final()
+end
+x = ("abcdefghij"):rep(1000)
+assert(hashparts(lz.md5_init(), x, 7) == lz.md5(x))
+assert(hashparts(lz.md5_init(), x, 64) == lz.md5(x))
 
 ------------------------------------------------------------------------
 print("testing base64...")
@@ -123,6 +131,82 @@ x = ("\0"):rep(301); assert(lz.unlzma(lz.lzma(x)) == x)
 
 assert(#lz.lzma(("a"):rep(301)) < 30)
 
+-- streaming encoder and decoder
+local function lzstream(x, chunk, known)
+	local enc = lz.lzma_encoder(known and #x or nil)
+	local t = {}
+	for i = 1, #x, chunk do 
+		t[#t+1] = assert(enc:update(x:sub(i, i+chunk-1))) 
+	end
+	t[#t+1] = assert(enc:finish())
+	local c = concat(t)
+	if known then assert(lz.unlzma(c) == x) end
+	local dec = lz.lzma_decoder()
+	t = {}
+	for i = 1, #c, chunk do 
+		t[#t+1] = assert(dec:update(c:sub(i, i+chunk-1)))
+	end
+	assert(dec:finished())
+	assert(concat(t) == x)
+end
+x = ""; lzstream(x, 10); lzstream(x, 10, true)
+x = "Hello world"; lzstream(x, 3); lzstream(x, 3, true)
+x = {}; for i = 1, 100000 do x[i] = tostring(i * i) end
+x = concat(x, " ") 
+lzstream(x, 100000); lzstream(x, 4096, true)
+-- an invalid stream makes the decoder unusable
+local dec = lz.lzma_decoder()
+assert(not dec:update(("\255"):rep(13)))
+assert(not dec:update(lz.lzma("abc")) and not dec:finished())
+dec = lz.lzma_decoder()
+local c = lz.lzma(x)
+assert(not dec:update(c:sub(1, 13) .. ("\255"):rep(1000)))
+assert(not dec:update(c:sub(14)) and not dec:finished())
+assert(not pcall(lz.lzma_encoder, -2))
+
+-- compress / uncompress to a buffer
+local ok, ll = pcall(require, "lualinux")
+if ok then
+	local c = lz.lzma(x)
+	local b = ll.newbuffer(#c + 10)
+	assert(lz.lzma(x, nil, b, 3) == #c + 3)
+	assert(b:get(3, #c + 2) == c)
+	local b2 = ll.newbuffer(#x)
+	assert(lz.unlzma(b:view(3, #c + 2), b2) == #x + 1)
+	assert(b2:get() == x)
+	assert(not pcall(lz.unlzma, c, ll.newbuffer(#x - 1)))
+	assert(not lz.lzma(x, nil, ll.newbuffer(#c // 2)))
+end
+
+-- compression options
+assert(lz.lzma(x, {}) == lz.lzma(x))
+assert(lz.lzma(x, {threads=2}) == lz.lzma(x))
+assert(lz.lzma(x, {level=9, threads=2}) == lz.lzma(x, {level=9}))
+for _, o in ipairs{ {level=0}, {level=9}, {dictsize=1<<16} } do
+	assert(lz.unlzma(lz.lzma(x, o)) == x)
+end
+assert(not pcall(lz.lzma, x, {level=10}))
+
+-- block container
+local c = assert(lz.lzma_blocks(x, {blocksize=1<<16, threads=4}))
+assert(c == lz.lzma_blocks(x, {blocksize=1<<16, threads=1}))
+local idx = lz.lzma_blockindex(c)
+assert(idx.size == #x and idx.blocksize == 1<<16)
+assert(#idx == (#x + 0xffff) // 0x10000 + 1)
+assert(lz.unlzma(c:sub(idx[2]+1, idx[3])) == x:sub(65537, 131072))
+assert(lz.unlzma_range(c, 1) == x)
+for _, r in ipairs{ {1, 1}, {65536, 65537}, {100, 200000}, {-10, -1}, 
+		{5, 4}, {-1e9, 3} } do
+	assert(lz.unlzma_range(c, r[1], r[2], idx) == x:sub(r[1], r[2]))
+end
+local function rd(pos, n) 
+	if pos < 0 then pos = #c + pos end
+	return c:sub(pos + 1, pos + n) 
+end
+assert(lz.unlzma_range(rd, 300000, 300100) == x:sub(300000, 300100))
+assert(lz.unlzma_range(lz.lzma_blocks(""), 1) == "")
+assert(not pcall(lz.unlzma_range, c:sub(1, -2), 1))
+
 
 ------------------------------------------------------------------------
 print("testing blake2b...")
@@ -148,6 +232,13 @@ assert(e == dig)
 dig = lz.blake2b(t, 64, "aaa")
 assert(e ~= dig)
 
+-- incremental hash
+assert(hashparts(lz.blake2b_init(), t, 5) == e)
+assert(hashparts(lz.blake2b_init(32, "aaa"), x, 100) == lz.blake2b(x, 32, "aaa"))
+ctx = lz.blake2b_init()
+ctx:final()
+assert(not pcall(ctx.update, ctx, "a"))
+
 
 ------------------------------------------------------------------------
 print("testing authenticated encryption...")
@@ -220,6 +311,56 @@ c = lz.encrypt(k, n, m, 123)
 m2 = lz.decrypt(k, n, c, 123)
 assert(m2 == m)
 
+-- encrypt / decrypt to a buffer (buffers are created by lualinux)
+local ok, ll = pcall(require, "lualinux")
+if ok then
+	local b = ll.newbuffer(#m + 20)
+	assert(lz.encrypt(k, n, m, 123, b, 3) == #m + 19)
+	assert(b:get(3, #m + 18) == c)
+	local b2 = ll.newbuffer(#m)
+	assert(lz.decrypt(k, n, b:view(3, #m + 18), 123, b2) == #m + 1)
+	assert(b2:get() == m)
+	assert(not pcall(lz.encrypt, k, n, m, 0, ll.newbuffer(#m)))
+end
+
+-- stream encryption
+local es = lz.encrypt_stream(k, n)
+local t = { es:update("hello"), es:update(""), es:update(m), es:final(" end") }
+c = concat(t)
+assert(#c == 9 + #m + 4 * 20)
+-- chunk i is encrypted with nonce n + i
+assert(t[3]:sub(5) == lz.encrypt(k, n, m, 2):sub(1, #m) .. t[3]:sub(-16))
+local function sdecrypt(c, n1)
+	local ds = lz.decrypt_stream(k, n)
+	local r = {}
+	for i = 1, #c, n1 do 
+		local x, msg = ds:update(c:sub(i, i+n1-1))
+		if not x then return nil, msg end
+		r[#r+1] = x
+	end
+	return concat(r), ds:finished()
+end
+for _, n1 in ipairs{1, 7, #c} do
+	m2, fin = sdecrypt(c, n1)
+	assert(m2 == "hello" .. m .. " end" and fin)
+end
+-- reordered, truncated, modified streams
+assert(not sdecrypt(t[1] .. t[3] .. t[2] .. t[4], 10))
+m2, fin = sdecrypt(t[1] .. t[2] .. t[3], 10)
+assert(m2 == "hello" .. m and not fin)
+assert(not sdecrypt(c:sub(1, 10) .. "x" .. c:sub(12), 10))
+assert(not sdecrypt(c .. t[4], 10))
+assert(not pcall(es.update, es, "x"))
+-- frames written in a buffer (buffers are created by lualinux)
+local ok, ll = pcall(require, "lualinux")
+if ok then
+	local b = ll.newbuffer(100)
+	es = lz.encrypt_stream(k, n)
+	assert(es:update("hello", b, 1) == 26 and es:final("", b, 26) == 46)
+	m2, fin = sdecrypt(b:get(1, 45), 5)
+	assert(m2 == "hello" and fin)
+end
+
 ------------------------------------------------------------------------
 print("testing x25519 key exchange...")
 
@@ -253,6 +394,8 @@ e = hextos[[
 
 h = lz.sha512(t)
 assert(h == e)
+assert(hashparts(lz.sha512_init(), t, 3) == e)
+assert(hashparts(lz.sha512_init(), x, 129) == lz.sha512(x))
 --~ px(h)
 
 
@@ -298,4 +441,51 @@ assert(#k == 32)
 print("argon2i (100MB, 10 iter) Execution time (sec): ", os.clock()-c0)
 
 ------------------------------------------------------------------------
-print("\ntest_luazen", "ok\n")
\ No newline at end of file
+print("testing async functions...")
+
+local fs = {
+	lz.lzma_async(x), lz.argon2i_async(pw, salt, 1000, 3), 
+	lz.encrypt_async(k, n, m, 123), lz.blake2b_async(x, 32, "key"),
+	lz.lzma_async(x, {level=1}),
+}
+if ok then  -- lualinux: the future fd becomes readable
+	assert(ll.pollin(fs[4]:fd(), 10000) == 1)
+	assert(fs[4]:ready())
+end
+assert(fs[1]:result() == lz.lzma(x))
+assert(fs[2]:result() == lz.argon2i(pw, salt, 1000, 3))
+assert(fs[3]:result() == lz.encrypt(k, n, m, 123))
+assert(fs[4]:result() == lz.blake2b(x, 32, "key"))
+assert(lz.unlzma(fs[5]:result()) == x)
+assert(not pcall(fs[1].result, fs[1]))  -- closed after result()
+assert(lz.unlzma(lz.lzma_async(x, nil):result()) == x)
+assert(not pcall(lz.blake2b_async, x, 65))
+-- close() cancels or waits for the work
+for i = 1, 8 do lz.lzma_async(x):close() end
+for i = 1, 8 do lz.argon2i_async(pw, salt, 1000, 3) end
+collectgarbage()
+if ok then  -- a mapped input cannot be unmapped while in use
+	local mp = assert(ll.mmap(-1, 1 << 20, 3, 2))
+	mp:fill(65)
+	local fu = lz.blake2b_async(mp)
+	assert(select(2, ll.munmap(mp)) == 16)	-- EBUSY
+	assert(fu:result() == lz.blake2b(string.rep("A", 1 << 20)))
+	assert(ll.munmap(mp))
+end
+if ok then  -- the pool is reset in a forked child
+	local fu = lz.argon2i_async(pw, salt, 100000, 10)
+	io.stdout:flush()
+	local pid = assert(ll.fork())
+	if pid == 0 then
+		local r, msg = pcall(fu.result, fu)
+		local good = not r and msg:match"parent process"
+			and lz.blake2b_async(x):result() == lz.blake2b(x)
+		os.exit(good and 0 or 1)
+	end
+	local _, status = assert(ll.waitpid(pid))
+	assert(status == 0, "forked child failed")
+	assert(fu:result() == lz.argon2i(pw, salt, 100000, 10))
+end
+
+------------------------------------------------------------------------
+print("\ntest_luazen", "ok\n")
@@ -0,0 +1,135 @@
+
+-- test of the slalloc library (memory counters and limit)
+-- run with memory accounting enabled:
+--	SLUA_MEMLIMIT=0 ./slua test/test_slalloc.lua
+
+local sa = require"slalloc"
+
+local cats = {"string", "table", "closure", "userdata", "thread",
+	"upvalue", "proto", "other"}
+
+
+-- arena states
+local function arenatest()
+	local init = [[
+		lz = require"luazen"
+		count = 0
+		big = {}
+		for i = 1, 10000 do big[i] = "item" .. i end
+	]]
+	local a = assert(sa.arena(init, 16 << 20))
+	-- each run starts from the template state
+	for i = 1, 3 do
+		local c, n, h = a:run([[
+			count = count + 1
+			local x = ...
+			return count, #big, lz.b64encode(x)
+		]], "abc")
+		assert(c == 1 and n == 10000 and h == "YWJj")
+	end
+	-- arguments and results
+	local r = {a:run("return ...", nil, true, 1, 2.5, "s")}
+	assert(r[1] == nil and r[2] == true and r[3] == 1 and r[4] == 2.5
+		and r[5] == "s")
+	assert(math.type(r[3]) == "integer")
+	local ok, err = a:run("return {}")
+	assert(not ok and err:match"cannot transfer")
+	ok, err = a:run("error'boom'")
+	assert(not ok and err:match"boom")
+	ok, err = a:run("syntax error")
+	assert(not ok)
+	-- the arena size is a memory limit
+	ok, err = a:run("return string.rep('x', 32 << 20)")
+	assert(not ok and err == "not enough memory")
+	assert(a:run("return count") == 0)
+	a:close()
+	assert(not pcall(a.run, a, "return 1"))
+	a:close()
+	-- failed init
+	ok, err = sa.arena("error'init failed'")
+	assert(not ok and err:match"init failed")
+	-- the init results are ignored, the size must be positive
+	a = assert(sa.arena("M = {x = 1}; return M"))
+	assert(a:run("return M.x") == 1)
+	a:close()
+	assert(not pcall(sa.arena, "", 0) and not pcall(sa.arena, "", -1))
+	-- no objects with a finalizer in the template (except garbage)
+	ok, err = sa.arena("f = io.open('/dev/null')")
+	assert(not ok and err:match"finalizer")
+	ok, err = sa.arena("t = setmetatable({}, {__gc = print})")
+	assert(not ok and err:match"finalizer")
+	a = assert(sa.arena("io.open('/dev/null'); setmetatable({}, {})"))
+	-- the finalizers of a run are called before the next run
+	local fn = os.tmpname()
+	a:run("f = io.open(..., 'w'); f:write'data'", fn)
+	assert(a:run("return io.type(f)") == nil)
+	local f = io.open(fn); assert(f:read"a" == "data"); f:close()
+	a:run("f = io.open(..., 'w'); f:write'last'", fn)
+	a:close()
+	f = io.open(fn); assert(f:read"a" == "last"); f:close()
+	os.remove(fn)
+end
+arenatest()
+
+local st = sa.stats()
+print("allocator:", st.allocator)
+assert(st.allocator == "pool" or st.allocator == "libc")
+assert(st.total > 0)
+if not st.peak then
+	assert(sa.setlimit(0) == nil)
+	print("no memory accounting - run with SLUA_MEMLIMIT=0")
+	print("test_slalloc", "ok")
+	return
+end
+
+-- categories add up to the total
+local function sum(st)
+	local n = 0
+	for _, c in ipairs(cats) do n = n + st[c] end
+	return n
+end
+assert(sum(st) == st.total)
+assert(st.peak >= st.total)
+assert(st.limit == 0)
+
+-- strings and tables are accounted in their category
+collectgarbage(); collectgarbage("stop")
+st = sa.stats()
+local s = string.rep("a", 1000000)
+local st2 = sa.stats()
+assert(st2.string - st.string >= 1000000)
+local t = {}
+for i = 1, 1000 do t[i] = {} end
+local st3 = sa.stats()
+assert(st3.table - st2.table >= 1000 * 48)
+assert(sum(st3) == st3.total)
+s, t = nil, nil
+collectgarbage("restart"); collectgarbage()
+assert(sa.stats().total < st3.total - 1000000)
+
+-- hard limit
+collectgarbage()
+local base = sa.stats().total
+assert(sa.setlimit(base + 4000000) == 0)
+local ok, err = pcall(string.rep, "x", 8000000)
+assert(not ok and err == "not enough memory")
+ok, s = pcall(string.rep, "x", 1000000)
+assert(ok and #s == 1000000)
+local nfail = sa.stats().nfail
+assert(nfail > 0)
+-- many small allocations
+ok, err = pcall(function()
+	local t = {}
+	for i = 1, 1e7 do t[i] = {i} end
+end)
+assert(not ok and err == "not enough memory")
+assert(sa.stats().total <= base + 4000000)
+assert(sa.setlimit(0) == base + 4000000)
+s = string.rep("x", 8000000)
+assert(#s == 8000000)
+s = nil
+collectgarbage()
+assert(sa.resetpeak() >= base + 8000000)
+assert(sa.stats().peak < base + 8000000)
+
+print("test_slalloc", "ok")
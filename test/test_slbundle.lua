@@ -0,0 +1,41 @@
+-- test of the srlua bundle (see src/slbundle.h)
+-- this is the main program of a srlua application, built with:
+--	srglue srlua test/test_slbundle.lua app \
+--		test/bundlemod.lua Makefile
+-- (run from the slua directory)
+
+local bundle = require"slbundle"
+
+local names = bundle.list()
+if #names == 0 then
+	print("test_slbundle", "skipped (no bundle)")
+	return
+end
+assert(#names == 2)
+assert(names[1] == "Makefile")
+assert(names[2] == "test/bundlemod.lua")
+
+-- modules are loaded from the bundle, not from the file system
+package.path = ""
+local m, where = require"test.bundlemod"
+assert(m.add(1, 2) == 3)
+assert(where == "test/bundlemod.lua")
+assert(package.loaded["test.bundlemod"] == m)
+local ok, msg = pcall(m.fail)
+assert(not ok and msg:match"bundlemod error")
+local ok, msg = pcall(require, "test.nosuchmod")
+assert(not ok and msg:match"no bundle entry 'test/nosuchmod%.lua'")
+
+-- data files (with srglue -c or -s, .lua files are compiled)
+local f = assert(io.open("Makefile"))
+local s = f:read("a")
+f:close()
+assert(bundle.read("Makefile") == s)
+local b = assert(bundle.slice("Makefile"))
+assert(#b == #s and b:get() == s)
+assert(b:get(1, 2) == s:sub(1, 2))
+assert(not pcall(b.put, b, 1, "x"))	-- read-only
+assert(bundle.read("nosuchfile") == nil)
+assert(bundle.slice("nosuchfile") == nil)
+
+print("test_slbundle", "ok")
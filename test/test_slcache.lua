@@ -0,0 +1,111 @@
+-- test of the compiled chunk cache (SLUA_CACHE, see src/slcache.h)
+-- slua is run in child processes with the cache enabled
+
+local slua = arg[-1]
+local dir = os.tmpname()
+os.remove(dir)
+assert(os.execute("mkdir " .. dir))
+local cache = dir .. "/cache"
+local mod = dir .. "/cachedmod.lua"
+
+local function writemod(v)
+	-- rewrite the module in place (same inode, same size)
+	local f = assert(io.open(mod, "r+"))
+	f:write(string.format([[
+local v = %d
+local function f() error("boom") end
+return {v = v, f = f}
+]], v))
+	f:close()
+end
+
+local function run(env, code)
+	-- (SLUA_VMSTATS: no VM counters report in an instrumented build)
+	local cmd = string.format(
+		"%s SLUA_VMSTATS=/dev/null SLUA_CACHE=%s %s -e %q 2>&1",
+		env, cache, slua,
+		"package.path = '" .. dir .. "/?.lua;' .. package.path " ..
+		code)
+	local p = assert(io.popen(cmd))
+	local r = p:read("a")
+	p:close()
+	return r
+end
+
+local function entries()
+	local p = assert(io.popen("ls " .. cache .. " 2>/dev/null"))
+	local t = {}
+	for l in p:lines() do t[#t + 1] = cache .. "/" .. l end
+	p:close()
+	return t
+end
+
+local getv = "io.write(require'cachedmod'.v)"
+
+-- the cache directory is created by the first run
+assert(io.open(mod, "w")):close()
+writemod(1)
+assert(run("", getv) == "1")
+local e = entries()
+assert(#e == 1 and e[1]:match"%.luac$")
+
+-- same key (the file content is changed, but not its size, inode
+-- and modification time): the cached chunk is used
+assert(os.execute("touch -r " .. mod .. " " .. dir .. "/ref"))
+writemod(2)
+assert(os.execute("touch -r " .. dir .. "/ref " .. mod))
+assert(run("", getv) == "1")
+-- with content hash keys, the entry is replaced
+assert(run("SLUA_CACHE_HASH=1", getv) == "2")
+assert(run("SLUA_CACHE_HASH=1", getv) == "2")
+-- a copy renamed over the file (new inode) keeps the entry
+local function inode(fn)
+	local p = assert(io.popen("stat -c %i " .. fn))
+	local r = p:read("a")
+	p:close()
+	return r
+end
+local ino = inode(entries()[1])
+assert(os.execute("cp " .. mod .. " " .. mod .. ".new && mv "
+	.. mod .. ".new " .. mod))
+assert(run("SLUA_CACHE_HASH=1", getv) == "2")
+assert(inode(entries()[1]) == ino)
+
+-- a new modification time invalidates the entry
+writemod(3)
+assert(os.execute("touch -d '2001-01-01' " .. mod))
+assert(run("", getv) == "3")
+assert(run("", getv) == "3")
+assert(#entries() == 1)
+
+-- line numbers are kept, unless the bytecode is stripped
+assert(run("", "require'cachedmod'.f()"):match"cachedmod%.lua:2: boom")
+assert(run("SLUA_CACHE_STRIP=1", "require'cachedmod'.v = 0"))
+assert(not run("SLUA_CACHE_STRIP=1", "require'cachedmod'.f()")
+	:match"cachedmod%.lua:2:")
+
+-- an entry for another Lua version is ignored (and replaced)
+writemod(4)
+assert(run("", getv) == "4")
+local fn = entries()[1]
+local f = assert(io.open(fn, "rb"))
+local s = f:read("a")
+f:close()
+local i = assert(s:find("\27Lua", 1, true))
+s = s:sub(1, i + 3) .. "\x53" .. s:sub(i + 5)
+f = assert(io.open(fn, "wb"))
+f:write(s)
+f:close()
+assert(run("", getv) == "4")
+f = assert(io.open(fn, "rb"))
+assert(f:read("a"):sub(i + 4, i + 4) == "\x54")
+f:close()
+
+-- loadfile and dofile use the cache too. the file name is part of
+-- the key (it is the chunk name)
+local mod2 = dir .. "/./cachedmod.lua"
+assert(run("", "io.write(dofile'" .. mod2 .. "'.v)") == "4")
+assert(#entries() == 2)
+
+assert(os.execute("rm -rf " .. dir))
+print("test_slcache", "ok")
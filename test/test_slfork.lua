@@ -0,0 +1,92 @@
+-- test of the slfork library (parallel map in forked workers)
+
+local fk = require"slfork"
+
+assert(fk.ncpu() >= 1)
+
+-- map: results in order, shared upvalues and data
+local data = {}
+for i = 1, 1000 do data[i] = i * 3 end
+local r = fk.map(function(i) return data[i] + 1 end, 1000, 4)
+assert(#r == 1000)
+for i = 1, 1000 do assert(r[i] == i * 3 + 1) end
+assert(#fk.map(print, 0) == 0)
+r = fk.map(function(i) return i end, 3, 16)  -- at most n workers
+assert(r[1] == 1 and r[2] == 2 and r[3] == 3)
+
+-- result values
+local v = {1, 2.5, -3, "a\0b", true, false, x = {y = {z = "deep"}},
+	[100] = math.mininteger, [-1.5] = 1e300}
+r = fk.map(function(i)
+	if i == 1 then return v end
+	if i == 2 then return nil end
+	return string.rep("x", 300000)  -- larger than a pipe buffer
+end, 3, 2)
+local t = r[1]
+assert(t[1] == 1 and math.type(t[1]) == "integer" and t[2] == 2.5)
+assert(t[3] == -3 and t[4] == "a\0b" and t[5] == true and t[6] == false)
+assert(t.x.y.z == "deep" and t[100] == math.mininteger)
+assert(t[-1.5] == 1e300)
+assert(r[2] == nil and #r[3] == 300000)
+
+-- errors
+local ok, msg = pcall(fk.map, function(i)
+	if i == 5 then error("boom") end
+	return i
+end, 10, 3)
+assert(not ok and msg:match"worker 2: .*boom")
+ok, msg = pcall(fk.map, function(i) return print end, 4, 2)
+assert(not ok and msg:match"cannot return a function")
+ok, msg = pcall(fk.map, function(i)
+	if i == 4 then os.exit(5) end
+	return i
+end, 4, 2)
+assert(not ok and msg:match"worker 2 exited with status 5")
+local cyc = {}; cyc[1] = cyc
+assert(not pcall(fk.map, function(i) return cyc end, 1))
+
+-- index ranges
+local rg = fk.ranges(10, 3)
+assert(#rg == 3 and rg[1][1] == 1 and rg[3][2] == 10)
+assert(#fk.ranges(2, 5) == 2 and #fk.ranges(0, 5) == 0)
+r = fk.run(function(p)
+	local s = 0
+	for i = p[1], p[2] do s = s + data[i] end
+	return s
+end, fk.ranges(#data, 4))
+local sum = 0
+for _, s in ipairs(r) do sum = sum + s end
+assert(sum == 3 * 1000 * 1001 // 2)
+
+-- file byte ranges: lines are not split
+local fn = os.tmpname()
+local f = io.open(fn, "w")
+for i = 1, 5000 do f:write(i, "\n") end
+local fsize = f:seek("end")
+f:close()
+local fr = assert(fk.fileranges(fn, 4))
+assert(#fr == 4 and fr[1][1] == 0)
+r = fk.run(function(p)
+	local f = io.open(fn)
+	f:seek("set", p[1])
+	local s = f:read(p[2])
+	f:close()
+	assert(s:sub(-1) == "\n")
+	local n, sum = 0, 0
+	for l in s:gmatch"(%d+)\n" do n = n + 1; sum = sum + l end
+	return {n = n, sum = sum}
+end, fr)
+local n
+n, sum = 0, 0
+for _, x in ipairs(r) do n = n + x.n; sum = sum + x.sum end
+assert(n == 5000 and sum == 5000 * 5001 // 2)
+fr = fk.fileranges(fn, 7, "")
+local pos = 0
+for i, p in ipairs(fr) do assert(p[1] == pos); pos = pos + p[2] end
+assert(#fr == 7 and pos == fsize)
+io.open(fn, "w"):close()
+assert(#fk.fileranges(fn, 2) == 0)
+os.remove(fn)
+assert(fk.fileranges("/nonexistent", 2) == nil)
+
+print("test_slfork", "ok")
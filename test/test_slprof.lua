@@ -0,0 +1,83 @@
+
+-- test of the slprof sampling profiler
+
+local prof = require"slprof"
+local lz = require"luazen"
+
+local function fib(n)
+	if n < 2 then return n end
+	return fib(n - 1) + fib(n - 2)
+end
+
+local function compress()
+	local s = string.rep("abcdefgh", 200000)
+	for i = 1, 3 do lz.lzma(s) end
+end
+
+assert(prof.start(500))
+local t0 = os.clock()
+while os.clock() - t0 < 0.25 do fib(20) end
+t0 = os.clock()
+while os.clock() - t0 < 0.25 do compress() end
+prof.stop()
+
+local samples = prof.samples()
+local total, nfib, nlzma = 0, 0, 0
+for stack, n in pairs(samples) do
+	assert(math.type(n) == "integer" and n > 0)
+	assert(stack:match"main %(")
+	total = total + n
+	if stack:match"fib %(" then nfib = nfib + n end
+	if stack:match"compress %(.-;luazen%.lzma %[C%]$" then
+		nlzma = nlzma + n
+	end
+end
+-- 0.5 s at 500 us => up to 1000 samples (the timer resolution
+-- may be coarser: 4 ms with HZ=250)
+assert(total > 50, total)
+assert(nfib > 0 and nlzma > 0)
+
+-- dump to a file, in folded stack format
+local fn = os.tmpname()
+assert(prof.dump(fn) > 0)
+local n = 0
+for l in io.lines(fn) do
+	assert(l:match"^[^\n]+ %d+$")
+	n = n + 1
+end
+os.remove(fn)
+prof.reset()
+assert(next(prof.samples()) == nil)
+
+-- a hook set with debug.sethook is kept
+local nlines = 0
+local function hook() nlines = nlines + 1 end
+debug.sethook(hook, "l")
+assert(prof.start(500))
+t0 = os.clock()
+while os.clock() - t0 < 0.1 do fib(15) end
+prof.stop()
+assert(debug.gethook() == hook)
+local n0 = nlines
+fib(10)
+assert(nlines > n0)
+debug.sethook()
+assert(next(prof.samples()) ~= nil)
+prof.reset()
+
+-- the profiler is stopped when the sampled state is closed
+local a = assert(require"slalloc".arena("prof = require'slprof'"))
+a:run("prof.start(500)")
+a:close()
+prof.reset()
+t0 = os.clock()
+while os.clock() - t0 < 0.05 do fib(15) end
+assert(next(prof.samples()) == nil)
+local th = require"slthread"
+assert(th.start(function() require"slprof".start(500) end):join())
+prof.reset()
+t0 = os.clock()
+while os.clock() - t0 < 0.05 do fib(15) end
+assert(next(prof.samples()) == nil)
+
+print("test_slprof", "ok")
@@ -0,0 +1,127 @@
+-- test of the slshm library (shared memory, rings, atomic counters)
+
+local shm = require"slshm"
+local fk = require"slfork"
+local ll = require"lualinux"
+
+local function spawn(f, ...)
+	-- run f(...) in a child process
+	io.stdout:flush()
+	local pid = assert(ll.fork())
+	if pid == 0 then
+		f(...)
+		os.exit(0)
+	end
+	return pid
+end
+
+local function wait(pid)
+	local _, status = assert(ll.waitpid(pid))
+	assert(status == 0, "child failed")
+end
+
+-- regions are buffers, shared with the children
+local m = shm.new(4096)
+assert(#m == 4096 and m:getuint(1, 8) == 0)
+wait(spawn(function() m:put(1, "from child") end))
+assert(m:get(1, 10) == "from child")
+
+-- atomic counters
+shm.store(m, 9, 40)
+assert(shm.add(m, 9, 2) == 40 and shm.load(m, 9) == 42)
+assert(shm.cas(m, 9, 42, 100) == true)
+local ok, cur = shm.cas(m, 9, 42, 0)
+assert(ok == false and cur == 100)
+assert(not pcall(shm.add, m, 10, 1))	-- not aligned
+assert(not pcall(shm.load, m, 4090))	-- out of range
+shm.store(m, 17, 0)
+fk.map(function(i)
+	for j = 1, 1000 do shm.add(m, 17, 1) end
+end, 4, 4)
+assert(shm.load(m, 17) == 4000)
+
+-- memfd regions can be mapped again from the fd
+local m2, fd = assert(shm.memfd(8192, "test"))
+local m3 = assert(shm.map(fd))
+assert(#m3 == 8192)
+m2:put(100, "shared")
+assert(m3:get(100, 105) == "shared")
+ll.close(fd)
+
+-- rings
+assert(not pcall(shm.ring, shm.new(100)))
+local r = shm.ring(m:view(1025), "spsc")	-- 2048 bytes of messages
+assert(r:pop() == nil)
+assert(r:push("hello") and r:push("") and r:push(m:view(1, 3)))
+assert(r:pop() == "hello" and r:pop() == "" and r:pop() == "fro")
+assert(r:pop() == nil)
+local n = 0
+while r:push(string.rep("x", 100)) do n = n + 1 end
+assert(n == 2048 // 112)
+assert(not pcall(r.push, r, string.rep("x", 3000)))
+for i = 1, n do assert(#r:pop() == 100) end
+-- wrap around the end of the message space
+for i = 1, 100 do
+	local s = string.rep(string.char(65 + i % 26), i * 7 % 300)
+	assert(r:push(s) and r:pop() == s)
+end
+assert(r:pop(0.05) == nil)
+
+-- a corrupt message header is detected
+local rr = shm.ring(shm.new(1024))
+assert(rr:push("abc"))
+local region = debug.getuservalue(rr)
+region:putuint(257, 5000, 8)	-- first header, after the 256-byte ring header
+assert(select(2, pcall(rr.pop, rr)):match"corrupt ring")
+region:putuint(257, 4, 8)
+assert(rr:pop() == "abc")
+
+-- attach in another mapping of the same memfd
+m2, fd = assert(shm.memfd(65536))
+r = shm.ring(m2)
+local ra = shm.attach(assert(shm.map(fd)))
+ll.close(fd)
+r:push("via attach")
+assert(ra:pop() == "via attach")
+assert(not pcall(shm.attach, shm.new(4096)))
+
+-- mpsc ring with producers in child processes; the consumer waits
+r = shm.ring(shm.new(4096 + 256))
+local np, nm = 4, 2000
+local pids = {}
+for p = 1, np do
+	pids[p] = spawn(function()
+		for i = 1, nm do
+			local s = string.pack("<I4I4", p, i)
+			while not r:push(s) do end
+		end
+	end)
+end
+local last, count = {}, 0
+for p = 1, np do last[p] = 0 end
+while count < np * nm do
+	local s = assert(r:pop(10), "timeout")
+	local p, i = string.unpack("<I4I4", s)
+	assert(i == last[p] + 1)	-- in order for each producer
+	last[p] = i
+	count = count + 1
+end
+for p = 1, np do wait(pids[p]) end
+assert(r:pop() == nil)
+
+-- a region used by a ring or a view cannot be unmapped
+fd = assert(ll.open("/dev/zero", 2, 0))	-- O_RDWR
+local mr = assert(ll.mmap(fd, 4096, 3, 1))
+ll.close(fd)
+r = shm.ring(mr)
+local v = mr:view(1, 8)
+local _, e = ll.munmap(mr)
+assert(e == 16)	-- EBUSY
+v = nil; collectgarbage()
+assert(select(2, ll.munmap(mr)) == 16)	-- the ring
+r:push("still mapped")
+assert(r:pop() == "still mapped")
+r = nil; collectgarbage()
+assert(ll.munmap(mr) and #mr == 0)
+
+print("test_slshm", "ok")
@@ -0,0 +1,100 @@
+-- test of the slthread library (threads and channels)
+
+local th = require"slthread"
+
+assert(th.ncpu() >= 1)
+
+-- thread results, errors
+local t = assert(th.start(function(a, b) return a + b, "x" end, 1, 2))
+local ok, r1, r2 = t:join()
+assert(ok == true and r1 == 3 and r2 == "x")
+assert(not pcall(t.join, t))
+t = th.start("local a = ... ; return a * 2", 21)
+assert(select(2, t:join()) == 42)
+t = th.start(function() error("boom") end)
+local ok, msg = t:join()
+assert(ok == false and msg:match"boom")
+t = th.start(function() return function() end end)
+ok, msg = t:join()
+assert(ok == false and msg:match"cannot send a function value")
+
+-- the thread states have the preloaded libraries
+t = th.start(function() return require"luazen".b64encode"abc" end)
+assert(select(2, t:join()) == "YWJj")
+
+-- values in messages
+local ch = th.channel(4)
+local v = {1, 2, 3, x = {y = "z", [true] = 1.5}, [10] = -1}
+assert(ch:send(v, nil, 42, "s"))
+assert(#ch == 1)
+local a, b, c, d = ch:recv()
+assert(#a == 3 and a.x.y == "z" and a.x[true] == 1.5 and a[10] == -1)
+assert(b == nil and c == 42 and math.type(c) == "integer" and d == "s")
+assert(not pcall(ch.send, ch, print))
+assert(not pcall(ch.send, ch, io.stdout))
+local cyc = {}
+cyc[1] = cyc
+assert(not pcall(ch.send, ch, cyc))
+assert(#ch == 0)
+
+-- capacity, trysend, timeout
+for i = 1, 4 do assert(ch:trysend(i)) end
+assert(ch:trysend(5) == false)
+for i = 1, 4 do assert(ch:recv() == i) end
+local r, err = ch:recv(0.01)
+assert(r == nil and err == "timeout")
+assert(select(2, ch:recv(0)) == "timeout")
+
+-- blobs are shared, not copied
+local s = string.rep("0123456789", 1000)
+local blob = th.blob(s)
+assert(#blob == #s and blob:get() == s)
+assert(blob:get(2, 4) == "123" and blob:get(-3) == "789")
+assert(blob:get(5, 2) == "")
+ch:send(blob)
+local blob2 = ch:recv()
+assert(tostring(blob2) == tostring(blob))
+
+-- pipeline: producer -> N workers -> collector
+local n = 4
+local jobs, results = th.channel(16), th.channel(16)
+local workers = {}
+for i = 1, n do
+	workers[i] = assert(th.start(function(jobs, results, blob)
+		local count = 0
+		while true do
+			local j = jobs:recv()
+			if j == nil then break end
+			results:send(j, j * j, #blob)
+			count = count + 1
+		end
+		return count
+	end, jobs, results, blob))
+end
+local producer = th.start(function(jobs, nj)
+	for j = 1, nj do jobs:send(j) end
+	jobs:close()
+end, jobs, 1000)
+local sum = 0
+for i = 1, 1000 do
+	local j, sq, bl = results:recv()
+	assert(sq == j * j and bl == #s)
+	sum = sum + j
+end
+assert(sum == 1000 * 1001 // 2)
+assert(producer:join())
+local total = 0
+for i = 1, n do
+	local ok, count = workers[i]:join()
+	assert(ok)
+	total = total + count
+end
+assert(total == 1000)
+assert(select(2, jobs:recv()) == "closed")
+assert(select(2, jobs:send(1)) == "closed")
+
+-- a thread which is not joined is detached
+th.start(function() return 1 end)
+collectgarbage()
+
+print("test_slthread", "ok")
@@ -0,0 +1,58 @@
+
+-- test of the VM instruction counters (instrumentation build:
+-- make VMFLAGS=-DSLUA_VMSTATS)
+
+local ok, vm = pcall(require, "slvmstats")
+if not ok then
+	print("test_slvmstats", "skipped (not an instrumented build)")
+	return
+end
+
+local mt = {__index = function(t, k) return k end}
+
+local function hot(n)
+	local t = setmetatable({}, mt)
+	local s = 0
+	for i = 1, n do s = s + t[i] end
+	return s
+end
+
+vm.reset()
+assert(hot(1000) == 500500)
+for i = 1, 9 do hot(1000) end
+
+local ops = vm.opcodes()
+assert(ops.FORLOOP >= 10000 and ops.GETTABLE >= 10000)
+local c = vm.counters()
+assert(c.indextm >= 10000 and c.finishget >= c.indextm)
+assert(c.instructions >= ops.FORLOOP + ops.GETTABLE)
+
+local found
+for _, f in ipairs(vm.functions()) do
+	assert(f.count > 0 and f.time >= 0)
+	if f.line == 13 and f.source:match"test_slvmstats" then
+		found = f
+	end
+end
+assert(found and found.calls == 10)
+-- the loop body is line 16
+assert(found.lines[16] >= 10000 * 3)
+
+local fn = os.tmpname()
+assert(vm.dump(fn))
+local s = io.open(fn):read("a")
+os.remove(fn)
+assert(s:match"== opcodes" and s:match"FORLOOP")
+-- one row per line, sorted, in each function of the lines section
+local prev
+for l in s:match"== lines\n(.*)$":gmatch"[^\n]+" do
+	local line = l:match"^%s+(%d+)%s+%d+$"
+	if line then
+		assert(not prev or tonumber(line) > prev)
+		prev = tonumber(line)
+	else
+		prev = nil
+	end
+end
+
+print("test_slvmstats", "ok")